@@ -0,0 +1,65 @@
+#
+# - FindLZ4 module
+# Module to find the liblz4 package on Linux. pkg_config is used to provide a
+# starting point to look for the package. If the default method doesn't succeed,
+# one can either add the location of liblz4 in the CMAKE_PREFIX_PATH variable,
+# or set the LZ4_ROOTDIR.
+#
+# Usage of this module as follows:
+#   find_package(LZ4)
+#
+# After running the find, the variables below will be defined:
+#   LZ4_FOUND                System has liblz4 libs/headers
+#   LZ4_INCLUDE_DIRS         The location of liblz4 headers
+#   LZ4_LIBRARIES            The liblz4 libraries
+#
+
+message("\nLooking for liblz4 headers and libraries")
+
+if (LZ4_ROOTDIR)
+  message(STATUS "Root dir: ${LZ4_ROOTDIR}")
+endif()
+
+if (UNIX)
+  find_package(PkgConfig)
+  pkg_search_module( lz4_pkg liblz4)
+endif()
+
+find_path(LZ4_INCLUDE_DIRS
+  lz4.h
+  HINTS
+    ${LZ4_ROOTDIR}
+    ${lz4_pkg_INCLUDEDIR}
+  PATH_SUFFIXES
+    include
+  DOC
+    "Include Directory for liblz4"
+  )
+
+set(LZ4_ROOTDIR_LIB ${LZ4_ROOTDIR}/lib)
+
+find_library(LZ4_LIBRARIES
+  NAMES
+    lz4
+  PATH_SUFFIXES
+    ${LIB_PATH_SUFFIX}
+  HINTS
+    ${LZ4_ROOTDIR}
+    ${LZ4_ROOTDIR_LIB}
+    ${lz4_pkg_LIBDIR}
+  )
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(LZ4
+    DEFAULT_MSG
+    LZ4_LIBRARIES
+    LZ4_INCLUDE_DIRS
+)
+
+mark_as_advanced( LZ4_LIBRARIES LZ4_INCLUDE_DIRS)
+
+if (LZ4_FOUND)
+  message(STATUS "Include directories: ${LZ4_INCLUDE_DIRS}")
+  message(STATUS "Libraries: ${LZ4_LIBRARIES}")
+endif ()
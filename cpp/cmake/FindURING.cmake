@@ -0,0 +1,65 @@
+#
+# - FindURING module
+# Module to find the liburing package on Linux. pkg_config is used to provide a
+# starting point to look for the package. If the default method doesn't succeed,
+# one can either add the location of liburing in the CMAKE_PREFIX_PATH variable,
+# or set the URING_ROOTDIR.
+#
+# Usage of this module as follows:
+#   find_package(URING)
+#
+# After running the find, the variables below will be defined:
+#   URING_FOUND              System has liburing libs/headers
+#   URING_INCLUDE_DIRS       The location of liburing headers
+#   URING_LIBRARIES          The liburing libraries
+#
+
+message("\nLooking for liburing headers and libraries")
+
+if (URING_ROOTDIR)
+  message(STATUS "Root dir: ${URING_ROOTDIR}")
+endif()
+
+if (UNIX)
+  find_package(PkgConfig)
+  pkg_search_module( uring_pkg liburing)
+endif()
+
+find_path(URING_INCLUDE_DIRS
+  liburing.h
+  HINTS
+    ${URING_ROOTDIR}
+    ${uring_pkg_INCLUDEDIR}
+  PATH_SUFFIXES
+    include
+  DOC
+    "Include Directory for liburing"
+  )
+
+set(URING_ROOTDIR_LIB ${URING_ROOTDIR}/lib)
+
+find_library(URING_LIBRARIES
+  NAMES
+    uring
+  PATH_SUFFIXES
+    ${LIB_PATH_SUFFIX}
+  HINTS
+    ${URING_ROOTDIR}
+    ${URING_ROOTDIR_LIB}
+    ${uring_pkg_LIBDIR}
+  )
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(URING
+    DEFAULT_MSG
+    URING_LIBRARIES
+    URING_INCLUDE_DIRS
+)
+
+mark_as_advanced( URING_LIBRARIES URING_INCLUDE_DIRS)
+
+if (URING_FOUND)
+  message(STATUS "Include directories: ${URING_INCLUDE_DIRS}")
+  message(STATUS "Libraries: ${URING_LIBRARIES}")
+endif ()
@@ -0,0 +1,186 @@
+/*
+ * azimuthal_benchmark.cpp
+ *
+ * Measure the rate at which the EigerAzimuthalIntegrationPlugin can reduce
+ * images to 1D profiles, from bitshuffle/LZ4 compressed images as the
+ * detector sends them to the profile of each. Synthetic powder images are
+ * used, a falling background with Debye-Scherrer rings, and the module gaps
+ * flagged in the mask as the detector does.
+ *
+ * Build with CMAKE_BUILD_TYPE=Release for representative rates.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "zmq/zmq.hpp"
+#include "AzimuthalIntegrator.h"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "PixelKernels.h"
+#include "WorkerPool.h"
+
+namespace po = boost::program_options;
+using namespace FrameProcessor;
+
+// Module layout of an Eiger2, giving the gaps flagged in the mask
+static const size_t MODULE_WIDTH = 1028;
+static const size_t MODULE_HEIGHT = 512;
+static const size_t GAP_WIDTH = 12;
+static const size_t GAP_HEIGHT = 38;
+
+/**
+ * Make a powder image with rings every ring_spacing in q
+ */
+template <typename T>
+static void make_image(std::vector<T>& pixels, const std::vector<uint32_t>& mask, size_t width,
+                       const DetectorGeometry& geometry, double ring_spacing, std::mt19937& rng)
+{
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (mask[i]) {
+      pixels[i] = static_cast<T>(-1);
+      continue;
+    }
+    double q = geometry.q(i % width, i / width);
+    double ring = q / ring_spacing - floor(q / ring_spacing + 0.5);
+    double mean = 20 / (1 + q) + 200 * exp(-ring * ring / 0.002);
+    std::poisson_distribution<uint32_t> counts(mean);
+    pixels[i] = static_cast<T>(counts(rng));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t width;
+  size_t height;
+  int bit_depth;
+  size_t num_images;
+  size_t frames;
+  size_t bins;
+  double distance;
+  double ring_spacing;
+  double target_rate;
+  std::vector<unsigned int> thread_counts;
+
+  po::options_description options("Options");
+  options.add_options()
+    ("help,h", "Print this help message")
+    ("width,x", po::value<size_t>(&width)->default_value(4148), "Pixels in each row")
+    ("height,y", po::value<size_t>(&height)->default_value(4362), "Number of rows")
+    ("bit-depth,b", po::value<int>(&bit_depth)->default_value(32), "Bits per pixel, 16 or 32")
+    ("images,i", po::value<size_t>(&num_images)->default_value(4), "Number of distinct images to cycle through")
+    ("frames,n", po::value<size_t>(&frames)->default_value(200), "Number of frames to integrate in each run")
+    ("bins", po::value<size_t>(&bins)->default_value(1000), "Bins in each profile")
+    ("distance", po::value<double>(&distance)->default_value(0.2), "Sample to detector distance in metres")
+    ("ring-spacing", po::value<double>(&ring_spacing)->default_value(0.5), "Spacing of the powder rings in q")
+    ("threads,t", po::value<std::vector<unsigned int> >(&thread_counts)->multitoken(),
+        "Worker thread counts to run with (default 0 1 3 7)")
+    ("target-rate", po::value<double>(&target_rate)->default_value(500.0), "Rate in Hz the integration should keep up with")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+  if (bit_depth != 16 && bit_depth != 32) {
+    std::cerr << "Bit depth must be 16 or 32" << std::endl;
+    return 1;
+  }
+  if (!FrameDecompressor::supported() || !FrameCompressor::supported()) {
+    std::cerr << "Built without LZ4" << std::endl;
+    return 1;
+  }
+  if (thread_counts.empty()) {
+    thread_counts = {0, 1, 3, 7};
+  }
+
+  // Detector mask with the module gaps set
+  std::vector<uint32_t> mask(width * height, 0);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      bool gap = x % (MODULE_WIDTH + GAP_WIDTH) >= MODULE_WIDTH || y % (MODULE_HEIGHT + GAP_HEIGHT) >= MODULE_HEIGHT;
+      mask[y * width + x] = gap ? 1 : 0;
+    }
+  }
+
+  // Compress the images as the detector would
+  DetectorGeometry geometry = {width / 2.0, height / 2.0, distance, 75e-6, 75e-6, 1.0};
+  size_t elem_size = bit_depth / 8;
+  DataType data_type = bit_depth == 16 ? raw_16bit : raw_32bit;
+  std::vector<zmq::message_t> images(num_images);
+  std::vector<uint16_t> pixels16(bit_depth == 16 ? width * height : 0);
+  std::vector<uint32_t> pixels32(bit_depth == 32 ? width * height : 0);
+  std::mt19937 rng(2024);
+  FrameCompressor compressor(3);
+  size_t compressed_bytes = 0;
+  for (size_t i = 0; i < num_images; i++) {
+    zmq::message_t raw(width * height * elem_size);
+    if (bit_depth == 16) {
+      make_image(pixels16, mask, width, geometry, ring_spacing, rng);
+      memcpy(raw.data(), pixels16.data(), raw.size());
+    } else {
+      make_image(pixels32, mask, width, geometry, ring_spacing, rng);
+      memcpy(raw.data(), pixels32.data(), raw.size());
+    }
+    compressor.compress(raw, elem_size, images[i]);
+    compressed_bytes += images[i].size();
+  }
+
+  std::cout << width << "x" << height << " " << bit_depth << " bit images, " << compressed_bytes / num_images
+            << " bytes compressed on average, " << bins << " bins of q, kernel " << pixel_kernel_name() << std::endl;
+  std::cout << std::setw(10) << "threads" << std::setw(12) << "table ms" << std::setw(12) << "Hz"
+            << std::setw(16) << "decompress ms" << std::setw(16) << "integrate ms" << std::endl;
+
+  std::vector<uint8_t> output(width * height * elem_size);
+  std::vector<double> profile;
+  bool kept_up = false;
+  for (size_t t = 0; t < thread_counts.size(); t++) {
+    WorkerPool pool;
+    pool.resize(thread_counts[t]);
+    FrameDecompressor decompressor(pool);
+    AzimuthalIntegrator integrator(pool);
+    std::chrono::steady_clock::time_point table_start = std::chrono::steady_clock::now();
+    integrator.set_geometry(width, height, geometry, mask.data(), RADIAL_Q, bins, 0, 0);
+    double table_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - table_start).count();
+
+    double decompress_seconds = 0;
+    double integrate_seconds = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < frames; frame++) {
+      const zmq::message_t& image = images[frame % images.size()];
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+      if (!decompressor.decompress(image.data(), image.size(), bslz4, elem_size, width * height, output.data())) {
+        std::cerr << "Unable to decompress image" << std::endl;
+        return 1;
+      }
+      std::chrono::steady_clock::time_point decompressed = std::chrono::steady_clock::now();
+      integrator.integrate(output.data(), data_type, profile);
+      std::chrono::steady_clock::time_point integrated = std::chrono::steady_clock::now();
+      decompress_seconds += std::chrono::duration<double>(decompressed - begin).count();
+      integrate_seconds += std::chrono::duration<double>(integrated - decompressed).count();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = frames / seconds;
+    kept_up = kept_up || rate >= target_rate;
+
+    std::cout << std::setw(10) << thread_counts[t] + 1 << std::setw(12) << std::fixed << std::setprecision(1)
+              << table_seconds * 1000 << std::setw(12) << rate
+              << std::setw(16) << std::setprecision(3) << decompress_seconds * 1000 / frames
+              << std::setw(16) << integrate_seconds * 1000 / frames << std::endl;
+  }
+  std::cout << (kept_up ? "Keeps up with " : "Does not keep up with ") << target_rate << " Hz" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * direct_write_benchmark.cpp
+ *
+ * Compare the ways a writer can get image payloads out of FrameReceiver frame
+ * buffers and onto disk. With the payload straight after the FrameHeader it is
+ * either written through the page cache or copied to an aligned bounce buffer
+ * for O_DIRECT. With the decoder's payload_alignment set it is written with
+ * O_DIRECT from the frame buffer itself.
+ *
+ * O_DIRECT writes are a multiple of the alignment, so each payload is padded
+ * to the next boundary as a writer laying out aligned chunks would.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "EigerDefinitions.h"
+
+namespace po = boost::program_options;
+
+typedef struct
+{
+  std::string name;
+  bool direct;  // Open the file with O_DIRECT
+  bool aligned;  // Payload aligned in the frame buffer
+} WriteMode;
+
+static const WriteMode WRITE_MODES[] = {
+  {"buffered", false, false},
+  {"bounce+direct", true, false},
+  {"aligned+direct", true, true}
+};
+
+/**
+ * Write frames from a ring of frame buffers to a file
+ *
+ * \param[in] mode How the payload is laid out and written
+ * \param[in] path File to write to, which is removed afterwards
+ * \param[in] frame_size Size of each payload
+ * \param[in] frames Number of frames to write
+ * \param[in] alignment Alignment required for O_DIRECT
+ * \param[in] num_buffers Number of frame buffers to cycle through
+ * \return Bytes per second written, or a negative value if the file could not be written
+ */
+static double run(const WriteMode& mode, const std::string& path, size_t frame_size, size_t frames,
+                  size_t alignment, size_t num_buffers)
+{
+  size_t padded_size = (frame_size + alignment - 1) / alignment * alignment;
+  size_t offset = mode.aligned ? (sizeof(Eiger::FrameHeader) + alignment - 1) / alignment * alignment
+                               : sizeof(Eiger::FrameHeader);
+  size_t buffer_size = (offset + padded_size + alignment - 1) / alignment * alignment;
+
+  // Frame buffers, as in the FrameReceiver shared memory, with a payload in each
+  void* pool = NULL;
+  void* bounce = NULL;
+  if (posix_memalign(&pool, alignment, buffer_size * num_buffers) != 0 ||
+      posix_memalign(&bounce, alignment, padded_size) != 0) {
+    std::cerr << "Unable to allocate buffers" << std::endl;
+    free(pool);
+    return -1.0;
+  }
+  for (size_t i = 0; i < buffer_size * num_buffers; i++) {
+    static_cast<uint8_t*>(pool)[i] = static_cast<uint8_t>(i * 2654435761u >> 24);
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | (mode.direct ? O_DIRECT : 0);
+  int fd = open(path.c_str(), flags, 0600);
+  if (fd < 0) {
+    std::cerr << "Unable to open " << path << (mode.direct ? " with O_DIRECT" : "") << ": " << strerror(errno) << std::endl;
+    free(pool);
+    free(bounce);
+    return -1.0;
+  }
+
+  bool ok = true;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t frame = 0; frame < frames && ok; frame++) {
+    const char* payload = static_cast<const char*>(pool) + (frame % num_buffers) * buffer_size + offset;
+    off_t file_offset = frame * padded_size;
+    if (mode.direct && !mode.aligned) {
+      memcpy(bounce, payload, frame_size);
+      payload = static_cast<const char*>(bounce);
+    }
+    size_t length = mode.direct ? padded_size : frame_size;
+    ok = pwrite(fd, payload, length, file_offset) == static_cast<ssize_t>(length);
+  }
+  // Include the time to get buffered writes to disk
+  ok = ok && fdatasync(fd) == 0;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (!ok) {
+    std::cerr << "Unable to write to " << path << ": " << strerror(errno) << std::endl;
+  }
+
+  close(fd);
+  unlink(path.c_str());
+  free(pool);
+  free(bounce);
+  return ok ? frame_size * frames / seconds : -1.0;
+}
+
+int main(int argc, char** argv)
+{
+  std::string path;
+  size_t frame_size;
+  size_t frames;
+  size_t alignment;
+  size_t num_buffers;
+  int repeats;
+
+  po::options_description options("Options");
+  options.add_options()
+    ("help,h", "Print this help message")
+    ("file,f", po::value<std::string>(&path)->default_value("eiger-direct-write.bin"),
+        "File to write to, on the filesystem to test")
+    ("frame-size,i", po::value<size_t>(&frame_size)->default_value(4 * 1024 * 1024),
+        "Size in bytes of each payload")
+    ("frames,n", po::value<size_t>(&frames)->default_value(1000),
+        "Number of frames to write in each run")
+    ("alignment,a", po::value<size_t>(&alignment)->default_value(4096),
+        "Alignment required for O_DIRECT")
+    ("buffers,b", po::value<size_t>(&num_buffers)->default_value(16),
+        "Number of frame buffers to cycle through")
+    ("repeats,r", po::value<int>(&repeats)->default_value(3),
+        "Number of runs of each mode, reporting the best")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    std::cerr << "Alignment must be a power of 2" << std::endl;
+    return 1;
+  }
+
+  std::cout << "FrameHeader is " << sizeof(Eiger::FrameHeader) << " bytes, writing " << frames << " frames of "
+            << frame_size << " bytes to " << path << std::endl;
+  std::cout << std::setw(16) << "mode" << std::setw(14) << "GB/s" << std::endl;
+  for (size_t m = 0; m < sizeof(WRITE_MODES) / sizeof(WRITE_MODES[0]); m++) {
+    double best = -1.0;
+    for (int r = 0; r < repeats; r++) {
+      best = std::max(best, run(WRITE_MODES[m], path, frame_size, frames, alignment, num_buffers));
+    }
+    std::cout << std::setw(16) << WRITE_MODES[m].name;
+    if (best < 0) {
+      std::cout << std::setw(14) << "failed" << std::endl;
+    } else {
+      std::cout << std::setw(14) << std::fixed << std::setprecision(3) << best / 1e9 << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * hit_finder_benchmark.cpp
+ *
+ * Measure the rate at which the EigerHitFinderPlugin can score images, from
+ * bitshuffle/LZ4 compressed images as the detector sends them to the score
+ * of each. Synthetic serial crystallography images are used, mostly blank
+ * with a sparse background, with Bragg spots on a fraction of them and the
+ * module gaps flagged in the mask as the detector does.
+ *
+ * Build with CMAKE_BUILD_TYPE=Release for representative rates.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "zmq/zmq.hpp"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "HitScorer.h"
+#include "WorkerPool.h"
+
+namespace po = boost::program_options;
+using namespace FrameProcessor;
+
+// Module layout of an Eiger2, giving the gaps flagged in the mask
+static const size_t MODULE_WIDTH = 1028;
+static const size_t MODULE_HEIGHT = 512;
+static const size_t GAP_WIDTH = 12;
+static const size_t GAP_HEIGHT = 38;
+
+typedef struct
+{
+  zmq::message_t compressed;
+  bool hit;
+} TestImage;
+
+/**
+ * Make an image with a sparse background, and Bragg spots if it is a hit
+ */
+template <typename T>
+static void make_image(std::vector<T>& pixels, const std::vector<uint32_t>& mask, size_t width, double background,
+                       size_t spots, std::mt19937& rng)
+{
+  std::fill(pixels.begin(), pixels.end(), 0);
+  std::uniform_int_distribution<size_t> position(0, pixels.size() - 1);
+  size_t background_pixels = background * pixels.size();
+  for (size_t i = 0; i < background_pixels; i++) {
+    pixels[position(rng)] += 1 + rng() % 2;
+  }
+  for (size_t i = 0; i < spots; i++) {
+    size_t centre = position(rng);
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        size_t p = centre + dy * width + dx;
+        if (p < pixels.size()) {
+          pixels[p] += (dx == 0 && dy == 0) ? 50 : 10;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (mask[i]) {
+      pixels[i] = static_cast<T>(-1);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t width;
+  size_t height;
+  int bit_depth;
+  size_t num_images;
+  size_t frames;
+  double hit_fraction;
+  double background;
+  size_t spots;
+  uint32_t pixel_threshold;
+  uint64_t hit_threshold;
+  double low_resolution;
+  double high_resolution;
+  double target_rate;
+  std::vector<unsigned int> thread_counts;
+
+  po::options_description options("Options");
+  options.add_options()
+    ("help,h", "Print this help message")
+    ("width,x", po::value<size_t>(&width)->default_value(4148), "Pixels in each row")
+    ("height,y", po::value<size_t>(&height)->default_value(4362), "Number of rows")
+    ("bit-depth,b", po::value<int>(&bit_depth)->default_value(32), "Bits per pixel, 16 or 32")
+    ("images,i", po::value<size_t>(&num_images)->default_value(8), "Number of distinct images to cycle through")
+    ("frames,n", po::value<size_t>(&frames)->default_value(500), "Number of frames to score in each run")
+    ("hit-fraction", po::value<double>(&hit_fraction)->default_value(0.1), "Fraction of images with Bragg spots")
+    ("background", po::value<double>(&background)->default_value(0.01), "Fraction of pixels with background counts")
+    ("spots", po::value<size_t>(&spots)->default_value(200), "Bragg spots on each hit")
+    ("pixel-threshold", po::value<uint32_t>(&pixel_threshold)->default_value(5), "Count at or above which a pixel is bright")
+    ("hit-threshold", po::value<uint64_t>(&hit_threshold)->default_value(20), "Bright pixels that make an image a hit")
+    ("low-resolution", po::value<double>(&low_resolution)->default_value(20.0), "Low resolution limit of the ring, in Angstroms")
+    ("high-resolution", po::value<double>(&high_resolution)->default_value(2.0), "High resolution limit of the ring, in Angstroms")
+    ("threads,t", po::value<std::vector<unsigned int> >(&thread_counts)->multitoken(),
+        "Worker thread counts to run with (default 0 1 3 7)")
+    ("target-rate", po::value<double>(&target_rate)->default_value(500.0), "Rate in Hz the scoring should keep up with")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+  if (bit_depth != 16 && bit_depth != 32) {
+    std::cerr << "Bit depth must be 16 or 32" << std::endl;
+    return 1;
+  }
+  if (!FrameDecompressor::supported() || !FrameCompressor::supported()) {
+    std::cerr << "Built without LZ4" << std::endl;
+    return 1;
+  }
+  if (thread_counts.empty()) {
+    thread_counts = {0, 1, 3, 7};
+  }
+
+  // Detector mask with the module gaps set
+  std::vector<uint32_t> mask(width * height, 0);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      bool gap = x % (MODULE_WIDTH + GAP_WIDTH) >= MODULE_WIDTH || y % (MODULE_HEIGHT + GAP_HEIGHT) >= MODULE_HEIGHT;
+      mask[y * width + x] = gap ? 1 : 0;
+    }
+  }
+
+  // Compress the images as the detector would
+  size_t elem_size = bit_depth / 8;
+  DataType data_type = bit_depth == 16 ? raw_16bit : raw_32bit;
+  std::vector<TestImage> images(num_images);
+  std::vector<uint16_t> pixels16(bit_depth == 16 ? width * height : 0);
+  std::vector<uint32_t> pixels32(bit_depth == 32 ? width * height : 0);
+  std::mt19937 rng(2024);
+  FrameCompressor compressor(3);
+  size_t compressed_bytes = 0;
+  for (size_t i = 0; i < num_images; i++) {
+    images[i].hit = i < hit_fraction * num_images + 0.5;
+    size_t image_spots = images[i].hit ? spots : 0;
+    zmq::message_t raw(width * height * elem_size);
+    if (bit_depth == 16) {
+      make_image(pixels16, mask, width, background, image_spots, rng);
+      memcpy(raw.data(), pixels16.data(), raw.size());
+    } else {
+      make_image(pixels32, mask, width, background, image_spots, rng);
+      memcpy(raw.data(), pixels32.data(), raw.size());
+    }
+    compressor.compress(raw, elem_size, images[i].compressed);
+    compressed_bytes += images[i].compressed.size();
+  }
+
+  DetectorGeometry geometry = {width / 2.0, height / 2.0, 0.2, 75e-6, 75e-6, 1.0};
+  std::cout << width << "x" << height << " " << bit_depth << " bit images, " << compressed_bytes / num_images
+            << " bytes compressed on average, " << images.size() << " images of which "
+            << hit_fraction * 100 << "% hits, kernel " << pixel_kernel_name() << std::endl;
+  std::cout << std::setw(10) << "threads" << std::setw(12) << "Hz" << std::setw(16) << "decompress ms"
+            << std::setw(12) << "score ms" << std::setw(10) << "correct" << std::endl;
+
+  std::vector<uint8_t> output(width * height * elem_size);
+  bool kept_up = false;
+  for (size_t t = 0; t < thread_counts.size(); t++) {
+    WorkerPool pool;
+    pool.resize(thread_counts[t]);
+    FrameDecompressor decompressor(pool);
+    HitScorer scorer(pool);
+    scorer.set_region(width, height, &geometry, mask.data(), low_resolution, high_resolution);
+
+    double decompress_seconds = 0;
+    double score_seconds = 0;
+    size_t correct = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < frames; frame++) {
+      const TestImage& image = images[frame % images.size()];
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+      if (!decompressor.decompress(image.compressed.data(), image.compressed.size(), bslz4, elem_size,
+                                   width * height, output.data())) {
+        std::cerr << "Unable to decompress image" << std::endl;
+        return 1;
+      }
+      std::chrono::steady_clock::time_point decompressed = std::chrono::steady_clock::now();
+      bool hit = scorer.score(output.data(), data_type, pixel_threshold) >= hit_threshold;
+      std::chrono::steady_clock::time_point scored = std::chrono::steady_clock::now();
+      decompress_seconds += std::chrono::duration<double>(decompressed - begin).count();
+      score_seconds += std::chrono::duration<double>(scored - decompressed).count();
+      correct += hit == image.hit ? 1 : 0;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double rate = frames / seconds;
+    kept_up = kept_up || rate >= target_rate;
+
+    std::cout << std::setw(10) << thread_counts[t] + 1 << std::setw(12) << std::fixed << std::setprecision(1) << rate
+              << std::setw(16) << std::setprecision(3) << decompress_seconds * 1000 / frames
+              << std::setw(12) << score_seconds * 1000 / frames
+              << std::setw(9) << correct * 100 / frames << "%" << std::endl;
+  }
+  std::cout << (kept_up ? "Keeps up with " : "Does not keep up with ") << target_rate << " Hz" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,448 @@
+/*
+ * ingest_benchmark.cpp
+ *
+ * Compare the EigerFan ingest engines by pushing image-like multipart messages
+ * over loopback TCP at rates equivalent to 10, 25 and 100 GbE and measuring
+ * what each engine delivers to the fan's message queue.
+ *
+ * With --latency, instead time each message from just before it is sent to
+ * when it is popped from the queue, at a steady low rate, with the rx path
+ * blocking and then spinning, and report the latency percentiles of each.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/logger.h>
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+#include "boost/date_time/posix_time/posix_time.hpp"
+
+#include "zmq/zmq.hpp"
+
+#include "EigerDefinitions.h"
+#include "MultiPullBroker.h"
+#include "ThreadTuning.h"
+#include "UringZmtpIngest.h"
+
+namespace po = boost::program_options;
+
+typedef struct
+{
+  std::string name;
+  double bytes_per_second;
+} LinkRate;
+
+// Line rates expressed in bytes per second
+static const LinkRate LINK_RATES[] = {
+  {"10GbE", 1.25e9},
+  {"25GbE", 3.125e9},
+  {"100GbE", 12.5e9}
+};
+
+typedef struct
+{
+  uint64_t messages_sent;
+  uint64_t messages_received;
+  uint64_t bytes_received;
+  double seconds;
+  size_t max_queue_depth;
+} BenchmarkResult;
+
+/**
+ * Send image messages to the engine at a fixed rate
+ *
+ * \param[in] socket Bound PUSH socket to send on
+ * \param[in] image_size Size of the image part of each message
+ * \param[in] bytes_per_second Rate to send at
+ * \param[in] message_count Number of messages to send
+ * \param[out] messages_sent Number of messages sent
+ */
+static void send_images(
+  zmq::socket_t* socket,
+  size_t image_size,
+  double bytes_per_second,
+  uint64_t message_count,
+  uint64_t* messages_sent
+) {
+  const std::string image_header = "{\"htype\":\"dimage-1.0\",\"series\":1,\"frame\":0,\"hash\":\"\"}";
+  const std::string image_data_header =
+    "{\"htype\":\"dimage_d-1.0\",\"shape\":[4148,4362],\"type\":\"uint32\",\"encoding\":\"bs32-lz4<\",\"size\":0}";
+  const std::string image_config = "{\"htype\":\"dconfig-1.0\",\"start_time\":0,\"stop_time\":0,\"real_time\":0}";
+  std::vector<char> image(image_size, 0x5a);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  for (uint64_t i = 0; i < message_count; i++) {
+    boost::posix_time::ptime due = start + boost::posix_time::microseconds(
+      static_cast<int64_t>(i * image_size / bytes_per_second * 1e6)
+    );
+    boost::this_thread::sleep(due);
+
+    socket->send(image_header.c_str(), image_header.size(), ZMQ_SNDMORE);
+    socket->send(image_data_header.c_str(), image_data_header.size(), ZMQ_SNDMORE);
+    socket->send(&image[0], image.size(), ZMQ_SNDMORE);
+    socket->send(image_config.c_str(), image_config.size());
+    *messages_sent = i + 1;
+  }
+}
+
+/**
+ * Run one engine at one rate
+ *
+ * \param[in] engine Engine to run (zmq or io_uring)
+ * \param[in] connections Number of worker threads or connections
+ * \param[in] port Loopback port to stream on
+ * \param[in] image_size Size of the image part of each message
+ * \param[in] bytes_per_second Rate to send at
+ * \param[in] seconds Duration to send for
+ * \return The benchmark result
+ */
+static BenchmarkResult run(
+  const std::string& engine,
+  int connections,
+  int port,
+  size_t image_size,
+  double bytes_per_second,
+  double seconds
+) {
+  std::stringstream endpoint;
+  endpoint << "tcp://127.0.0.1:" << port;
+  std::string stream_endpoint = endpoint.str();
+
+  zmq::context_t stream_context(1);
+  zmq::socket_t stream_socket(stream_context, ZMQ_PUSH);
+  stream_socket.setsockopt(ZMQ_SNDHWM, &Eiger::WORKER_HWM, sizeof(Eiger::WORKER_HWM));
+  stream_socket.setsockopt(ZMQ_LINGER, &Eiger::LINGER_TIMEOUT, sizeof(Eiger::LINGER_TIMEOUT));
+  stream_socket.bind(stream_endpoint.c_str());
+
+  MessageQueue queue(Eiger::RX_QUEUE_CAPACITY);
+
+  boost::shared_ptr<StreamIngest> ingest;
+  if (engine == Eiger::INGEST_ENGINE_IO_URING) {
+    ingest.reset(new UringZmtpIngest(connections));
+  } else {
+    ingest.reset(new MultiPullBroker(connections));
+  }
+  ingest->connect(stream_endpoint, &queue);
+
+  // Give the engine time to connect so the PUSH socket spreads over all connections
+  boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+
+  BenchmarkResult result = {0, 0, 0, 0.0, 0};
+  uint64_t message_count = static_cast<uint64_t>(bytes_per_second * seconds / image_size);
+  boost::thread sender(
+    boost::bind(&send_images, &stream_socket, image_size, bytes_per_second, message_count, &result.messages_sent)
+  );
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  boost::posix_time::ptime last = start;
+  while (result.messages_received < message_count) {
+    // Stop if nothing arrives for a second - the remainder has been lost
+    MultipartMessage* message = queue.pop(1000);
+    if (message == NULL) {
+      break;
+    }
+    result.bytes_received += message->bytes();
+    ++result.messages_received;
+    last = boost::posix_time::microsec_clock::universal_time();
+    delete message;
+  }
+  result.seconds = (last - start).total_microseconds() / 1e6;
+  result.max_queue_depth = queue.max_depth();
+
+  sender.join();
+  ingest->shutdown();
+  stream_socket.close();
+  return result;
+}
+
+typedef struct
+{
+  uint64_t messages_received;
+  double p50_us;
+  double p99_us;
+  double p999_us;
+  double max_us;
+  uint64_t rx_spin_hits;
+  uint64_t rx_wakeups;
+  uint64_t ingest_spin_hits;
+  uint64_t ingest_wakeups;
+} LatencyResult;
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+/**
+ * Send image messages at a fixed message rate, each stamped with the time it was sent
+ *
+ * \param[in] socket Bound PUSH socket to send on
+ * \param[in] image_size Size of the image part of each message
+ * \param[in] messages_per_second Rate to send at
+ * \param[in] message_count Number of messages to send
+ */
+static void send_stamped_images(
+  zmq::socket_t* socket,
+  size_t image_size,
+  double messages_per_second,
+  uint64_t message_count
+) {
+  const std::string image_header = "{\"htype\":\"dimage-1.0\",\"series\":1,\"frame\":0,\"hash\":\"\"}";
+  const std::string image_data_header =
+    "{\"htype\":\"dimage_d-1.0\",\"shape\":[64,64],\"type\":\"uint16\",\"encoding\":\"<\",\"size\":0}";
+  const std::string image_config = "{\"htype\":\"dconfig-1.0\",\"start_time\":0,\"stop_time\":0,\"real_time\":0}";
+  std::vector<char> image(std::max(image_size, sizeof(int64_t)), 0x5a);
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  for (uint64_t i = 0; i < message_count; i++) {
+    boost::posix_time::ptime due = start + boost::posix_time::microseconds(
+      static_cast<int64_t>(i / messages_per_second * 1e6)
+    );
+    boost::this_thread::sleep(due);
+
+    int64_t sent_ns = now_ns();
+    memcpy(&image[0], &sent_ns, sizeof(sent_ns));
+    socket->send(image_header.c_str(), image_header.size(), ZMQ_SNDMORE);
+    socket->send(image_data_header.c_str(), image_data_header.size(), ZMQ_SNDMORE);
+    socket->send(&image[0], image.size(), ZMQ_SNDMORE);
+    socket->send(image_config.c_str(), image_config.size());
+  }
+}
+
+/**
+ * Return a percentile of sorted latencies
+ *
+ * \param[in] sorted Latencies in ns, in ascending order
+ * \param[in] fraction Percentile as a fraction
+ */
+static double percentile_us(const std::vector<int64_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+  return sorted[index] / 1e3;
+}
+
+/**
+ * Measure the latency through the zmq engine and message queue at one spin count
+ *
+ * \param[in] connections Number of worker threads
+ * \param[in] port Loopback port to stream on
+ * \param[in] image_size Size of the image part of each message
+ * \param[in] messages_per_second Rate to send at
+ * \param[in] seconds Duration to send for
+ * \param[in] spin_count Non-blocking receives to try before blocking (0 to block straight away)
+ * \param[in] cpus CPUs to pin the receiving thread and then the workers to (empty for none)
+ * \return The latency result
+ */
+static LatencyResult run_latency(
+  int connections,
+  int port,
+  size_t image_size,
+  double messages_per_second,
+  double seconds,
+  unsigned spin_count,
+  const std::vector<int>& cpus
+) {
+  std::stringstream endpoint;
+  endpoint << "tcp://127.0.0.1:" << port;
+  std::string stream_endpoint = endpoint.str();
+
+  zmq::context_t stream_context(1);
+  zmq::socket_t stream_socket(stream_context, ZMQ_PUSH);
+  stream_socket.setsockopt(ZMQ_LINGER, &Eiger::LINGER_TIMEOUT, sizeof(Eiger::LINGER_TIMEOUT));
+  stream_socket.bind(stream_endpoint.c_str());
+
+  MessageQueue queue(Eiger::RX_QUEUE_CAPACITY);
+  queue.set_spin(spin_count);
+
+  // The first CPU is for this thread, which plays the part of the rx thread
+  std::vector<int> worker_cpus;
+  if (!cpus.empty()) {
+    PinCurrentThread(cpus[0]);
+    worker_cpus.assign(cpus.begin() + 1, cpus.end());
+  }
+  MultiPullBroker broker(connections);
+  broker.set_cpus(worker_cpus);
+  broker.set_spin(spin_count);
+  broker.connect(stream_endpoint, &queue);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+
+  uint64_t message_count = static_cast<uint64_t>(messages_per_second * seconds);
+  boost::thread sender(
+    boost::bind(&send_stamped_images, &stream_socket, image_size, messages_per_second, message_count)
+  );
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(message_count);
+  while (latencies.size() < message_count) {
+    MultipartMessage* message = queue.pop(1000);
+    if (message == NULL) {
+      break;
+    }
+    int64_t received_ns = now_ns();
+    zmq::message_t part;
+    message->recv(&part);
+    message->recv(&part);
+    message->recv(&part);
+    int64_t sent_ns = 0;
+    if (part.size() >= sizeof(sent_ns)) {
+      memcpy(&sent_ns, part.data(), sizeof(sent_ns));
+      latencies.push_back(received_ns - sent_ns);
+    }
+    delete message;
+  }
+
+  sender.join();
+  LatencyResult result;
+  result.messages_received = latencies.size();
+  result.rx_spin_hits = queue.spin_hits();
+  result.rx_wakeups = queue.wakeups();
+  result.ingest_spin_hits = broker.spin_hits();
+  result.ingest_wakeups = broker.wakeups();
+  broker.shutdown();
+  stream_socket.close();
+
+  std::sort(latencies.begin(), latencies.end());
+  result.p50_us = percentile_us(latencies, 0.5);
+  result.p99_us = percentile_us(latencies, 0.99);
+  result.p999_us = percentile_us(latencies, 0.999);
+  result.max_us = latencies.empty() ? 0.0 : latencies.back() / 1e3;
+  return result;
+}
+
+/**
+ * Compare the latency of the rx path blocking straight away and spinning first
+ */
+static void run_latency_comparison(
+  int connections,
+  int port,
+  size_t image_size,
+  double messages_per_second,
+  double seconds,
+  unsigned spin_count,
+  const std::vector<int>& cpus
+) {
+  std::vector<unsigned> spin_counts;
+  spin_counts.push_back(0);
+  spin_counts.push_back(spin_count);
+
+  std::cout << std::setw(12) << "spin count" << std::setw(10) << "received" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p99 us" << std::setw(10) << "p99.9 us" << std::setw(10) << "max us"
+            << std::setw(14) << "rx spin hits" << std::setw(12) << "rx wakeups"
+            << std::setw(14) << "ingest spins" << std::setw(16) << "ingest wakeups" << std::endl;
+  for (size_t i = 0; i < spin_counts.size(); i++) {
+    LatencyResult result = run_latency(
+      connections, port, image_size, messages_per_second, seconds, spin_counts[i], cpus
+    );
+    std::cout << std::setw(12) << spin_counts[i] << std::setw(10) << result.messages_received
+              << std::fixed << std::setprecision(1)
+              << std::setw(10) << result.p50_us << std::setw(10) << result.p99_us
+              << std::setw(10) << result.p999_us << std::setw(10) << result.max_us
+              << std::setw(14) << result.rx_spin_hits << std::setw(12) << result.rx_wakeups
+              << std::setw(14) << result.ingest_spin_hits << std::setw(16) << result.ingest_wakeups << std::endl;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::string engines;
+  int connections;
+  int port;
+  size_t image_size;
+  double seconds;
+  size_t latency_image_size;
+  double rate;
+  unsigned spin_count;
+  std::string cpu_list;
+
+  po::options_description options("Options");
+  options.add_options()
+    ("help,h", "Print this help message")
+    ("engine", po::value<std::string>(&engines)->default_value("both"),
+        "Ingest engine to benchmark (zmq, io_uring or both)")
+    ("connections,t", po::value<int>(&connections)->default_value(2),
+        "Number of worker threads (zmq) or connections (io_uring)")
+    ("port,p", po::value<int>(&port)->default_value(31700),
+        "Loopback port to stream on")
+    ("image-size,i", po::value<size_t>(&image_size)->default_value(4 * 1024 * 1024),
+        "Size in bytes of the image part of each message")
+    ("seconds,s", po::value<double>(&seconds)->default_value(5.0),
+        "Duration to stream for at each rate")
+    ("latency", "Measure the latency of the zmq engine blocking and spinning instead of throughput")
+    ("latency-image-size", po::value<size_t>(&latency_image_size)->default_value(8192),
+        "Size in bytes of the image part of each message when measuring latency")
+    ("rate", po::value<double>(&rate)->default_value(1000.0),
+        "Messages per second to send when measuring latency")
+    ("spin-count", po::value<unsigned>(&spin_count)->default_value(100000),
+        "Non-blocking receives to try before blocking when measuring latency while spinning")
+    ("cpus", po::value<std::string>(&cpu_list)->default_value(""),
+        "Comma separated CPUs to pin the receiving thread and then the workers to when measuring latency")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+
+  log4cxx::BasicConfigurator::configure();
+  log4cxx::Logger::getRootLogger()->setLevel(log4cxx::Level::getWarn());
+
+  if (vm.count("latency")) {
+    std::vector<int> cpus;
+    std::stringstream cpu_stream(cpu_list);
+    std::string cpu;
+    while (std::getline(cpu_stream, cpu, ',')) {
+      if (!cpu.empty()) {
+        cpus.push_back(atoi(cpu.c_str()));
+      }
+    }
+    run_latency_comparison(connections, port, latency_image_size, rate, seconds, spin_count, cpus);
+    return 0;
+  }
+
+  std::vector<std::string> engine_list;
+  if (engines == "both" || engines == Eiger::INGEST_ENGINE_ZMQ) {
+    engine_list.push_back(Eiger::INGEST_ENGINE_ZMQ);
+  }
+  if (engines == "both" || engines == Eiger::INGEST_ENGINE_IO_URING) {
+    if (UringZmtpIngest::supported()) {
+      engine_list.push_back(Eiger::INGEST_ENGINE_IO_URING);
+    } else {
+      std::cout << "io_uring ingest engine is not available - skipping" << std::endl;
+    }
+  }
+
+  std::cout << std::setw(10) << "engine" << std::setw(10) << "link" << std::setw(12) << "sent"
+            << std::setw(12) << "received" << std::setw(14) << "GB/s" << std::setw(14) << "msgs/s"
+            << std::setw(12) << "max queue" << std::endl;
+  for (size_t e = 0; e < engine_list.size(); e++) {
+    for (size_t r = 0; r < sizeof(LINK_RATES) / sizeof(LINK_RATES[0]); r++) {
+      BenchmarkResult result = run(
+        engine_list[e], connections, port, image_size, LINK_RATES[r].bytes_per_second, seconds
+      );
+      double seconds_taken = result.seconds > 0 ? result.seconds : 1.0;
+      std::cout << std::setw(10) << engine_list[e] << std::setw(10) << LINK_RATES[r].name
+                << std::setw(12) << result.messages_sent << std::setw(12) << result.messages_received
+                << std::setw(14) << std::fixed << std::setprecision(3) << result.bytes_received / seconds_taken / 1e9
+                << std::setw(14) << std::setprecision(1) << result.messages_received / seconds_taken
+                << std::setw(12) << result.max_queue_depth << std::endl;
+    }
+  }
+
+  return 0;
+}
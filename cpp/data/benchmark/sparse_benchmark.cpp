@@ -0,0 +1,189 @@
+/*
+ * sparse_benchmark.cpp
+ *
+ * Compare the bytes written per frame by the EigerSparsePlugin with the
+ * bitshuffle/LZ4 images the detector sends, and measure the rate at which
+ * images are decompressed, encoded and their records compressed. Synthetic
+ * low dose images are used at a range of occupancies, with isolated counts
+ * of one or two photons and the module gaps flagged in the mask as the
+ * detector does.
+ *
+ * Build with CMAKE_BUILD_TYPE=Release for representative rates.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "zmq/zmq.hpp"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "PixelKernels.h"
+#include "SparseEncoder.h"
+#include "WorkerPool.h"
+
+namespace po = boost::program_options;
+using namespace FrameProcessor;
+
+// Module layout of an Eiger2, giving the gaps flagged in the mask
+static const size_t MODULE_WIDTH = 1028;
+static const size_t MODULE_HEIGHT = 512;
+static const size_t GAP_WIDTH = 12;
+static const size_t GAP_HEIGHT = 38;
+
+/**
+ * Make a low dose image with a fraction of the pixels counting
+ */
+template <typename T>
+static void make_image(std::vector<T>& pixels, const std::vector<uint32_t>& mask, double occupancy, std::mt19937& rng)
+{
+  std::fill(pixels.begin(), pixels.end(), 0);
+  std::uniform_int_distribution<size_t> position(0, pixels.size() - 1);
+  size_t counting = occupancy * pixels.size();
+  for (size_t i = 0; i < counting; i++) {
+    pixels[position(rng)] += 1 + rng() % 2;
+  }
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (mask[i]) {
+      pixels[i] = static_cast<T>(-1);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t width;
+  size_t height;
+  int bit_depth;
+  size_t frames;
+  double occupancy_threshold;
+  unsigned int threads;
+  std::vector<double> occupancies;
+
+  po::options_description options("Options");
+  options.add_options()
+    ("help,h", "Print this help message")
+    ("width,x", po::value<size_t>(&width)->default_value(4148), "Pixels in each row")
+    ("height,y", po::value<size_t>(&height)->default_value(4362), "Number of rows")
+    ("bit-depth,b", po::value<int>(&bit_depth)->default_value(32), "Bits per pixel, 16 or 32")
+    ("frames,n", po::value<size_t>(&frames)->default_value(50), "Number of frames to encode at each occupancy")
+    ("occupancy-threshold", po::value<double>(&occupancy_threshold)->default_value(0.01),
+        "Largest fraction of pixels counting in an image written sparse")
+    ("threads,t", po::value<unsigned int>(&threads)->default_value(2), "Worker threads, as well as the main thread")
+    ("occupancy,o", po::value<std::vector<double> >(&occupancies)->multitoken(),
+        "Fractions of pixels counting to test (default 0.0001 0.001 0.005 0.01 0.05)")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+  if (bit_depth != 16 && bit_depth != 32) {
+    std::cerr << "Bit depth must be 16 or 32" << std::endl;
+    return 1;
+  }
+  if (!FrameDecompressor::supported() || !FrameCompressor::supported()) {
+    std::cerr << "Built without LZ4" << std::endl;
+    return 1;
+  }
+  if (occupancies.empty()) {
+    occupancies = {0.0001, 0.001, 0.005, 0.01, 0.05};
+  }
+
+  // Detector mask with the module gaps set
+  size_t num_pixels = width * height;
+  std::vector<uint32_t> mask(num_pixels, 0);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      bool gap = x % (MODULE_WIDTH + GAP_WIDTH) >= MODULE_WIDTH || y % (MODULE_HEIGHT + GAP_HEIGHT) >= MODULE_HEIGHT;
+      mask[y * width + x] = gap ? 1 : 0;
+    }
+  }
+
+  WorkerPool pool;
+  pool.resize(threads);
+  FrameDecompressor decompressor(pool);
+  SparseEncoder encoder(pool);
+  encoder.set_mask(num_pixels, mask.data());
+  FrameCompressor compressor(threads);
+  size_t capacity = static_cast<size_t>(floor(occupancy_threshold * num_pixels));
+  size_t length = SparseEncoder::record_length(capacity);
+
+  std::cout << width << "x" << height << " " << bit_depth << " bit images, " << threads + 1 << " threads, "
+            << "records of " << length << " elements, kernel " << pixel_kernel_name() << std::endl;
+  std::cout << std::setw(11) << "occupancy" << std::setw(14) << "bslz4 bytes" << std::setw(14) << "written bytes"
+            << std::setw(9) << "ratio" << std::setw(9) << "sparse" << std::setw(10) << "Hz"
+            << std::setw(16) << "decompress ms" << std::setw(13) << "encode ms" << std::setw(15) << "compress ms"
+            << std::endl;
+
+  size_t elem_size = bit_depth / 8;
+  DataType data_type = bit_depth == 16 ? raw_16bit : raw_32bit;
+  std::vector<uint16_t> pixels16(bit_depth == 16 ? num_pixels : 0);
+  std::vector<uint32_t> pixels32(bit_depth == 32 ? num_pixels : 0);
+  std::vector<uint8_t> output(num_pixels * elem_size);
+  zmq::message_t record(length * sizeof(uint32_t));
+  zmq::message_t compressed_record;
+  std::mt19937 rng(2024);
+  for (size_t o = 0; o < occupancies.size(); o++) {
+    zmq::message_t raw(num_pixels * elem_size);
+    if (bit_depth == 16) {
+      make_image(pixels16, mask, occupancies[o], rng);
+      memcpy(raw.data(), pixels16.data(), raw.size());
+    } else {
+      make_image(pixels32, mask, occupancies[o], rng);
+      memcpy(raw.data(), pixels32.data(), raw.size());
+    }
+    zmq::message_t image;
+    compressor.compress(raw, elem_size, image);
+
+    double decompress_seconds = 0;
+    double encode_seconds = 0;
+    double compress_seconds = 0;
+    size_t written_bytes = 0;
+    bool sparse = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < frames; frame++) {
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+      if (!decompressor.decompress(image.data(), image.size(), bslz4, elem_size, num_pixels, output.data())) {
+        std::cerr << "Unable to decompress image" << std::endl;
+        return 1;
+      }
+      std::chrono::steady_clock::time_point decompressed = std::chrono::steady_clock::now();
+      sparse = encoder.encode(output.data(), data_type, capacity, static_cast<uint32_t*>(record.data()));
+      std::chrono::steady_clock::time_point encoded = std::chrono::steady_clock::now();
+      if (sparse) {
+        compressor.compress(record, sizeof(uint32_t), compressed_record);
+        written_bytes = compressed_record.size();
+      } else {
+        written_bytes = image.size();
+      }
+      std::chrono::steady_clock::time_point compressed = std::chrono::steady_clock::now();
+      decompress_seconds += std::chrono::duration<double>(decompressed - begin).count();
+      encode_seconds += std::chrono::duration<double>(encoded - decompressed).count();
+      compress_seconds += std::chrono::duration<double>(compressed - encoded).count();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::setw(11) << occupancies[o] << std::setw(14) << image.size() << std::setw(14) << written_bytes
+              << std::setw(9) << std::fixed << std::setprecision(2) << static_cast<double>(image.size()) / written_bytes
+              << std::setw(9) << (sparse ? "yes" : "no")
+              << std::setw(10) << std::setprecision(1) << frames / seconds
+              << std::setw(16) << std::setprecision(3) << decompress_seconds * 1000 / frames
+              << std::setw(13) << encode_seconds * 1000 / frames
+              << std::setw(15) << compress_seconds * 1000 / frames << std::endl;
+    std::cout.unsetf(std::ios::fixed);
+  }
+
+  return 0;
+}
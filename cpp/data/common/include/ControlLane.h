@@ -0,0 +1,165 @@
+/*
+ * ControlLane.h
+ *
+ * Sequencing of the messages the EigerFan sends to a FrameReceiver through
+ * its control lane. Each message is sent on the lane behind a fence, and the
+ * fence is sent on the image stream in the message's place, so the decoder
+ * applies the message when it reaches the fence, in order with the images.
+ */
+
+#ifndef INCLUDE_CONTROLLANE_H_
+#define INCLUDE_CONTROLLANE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "zmq/zmq.hpp"
+#include "EigerDefinitions.h"
+
+namespace Eiger {
+
+  /**
+   * Check whether a received part is a fence and read its sequence number
+   *
+   * \param[in] data The received part
+   * \param[in] size The size of the part
+   * \param[out] sequence The sequence number of the fence
+   * \return true if the part is a fence
+   */
+  inline bool ParseFence(const void* data, size_t size, uint64_t& sequence)
+  {
+    if (size <= FENCE_MESSAGE_PREFIX.size() || memcmp(data, FENCE_MESSAGE_PREFIX.data(), FENCE_MESSAGE_PREFIX.size()) != 0) {
+      return false;
+    }
+    std::string fence(static_cast<const char*>(data), size);
+    sequence = strtoull(fence.c_str() + FENCE_MESSAGE_PREFIX.size(), NULL, 10);
+    return true;
+  }
+
+  /**
+   * Messages received through the control lane, held until their fence is reached
+   *
+   * Fences are reached in sequence order, so a message for a fence that has
+   * already been passed can no longer be applied in order and is discarded.
+   * A fence whose message has not arrived is skipped once the decoder has
+   * waited for it. After a fence is missed the lane is taken to be stalled,
+   * and the decoder does not wait at later fences until a message arrives
+   * again, so the rx thread waits once for a lane that has gone away rather
+   * than once for every fence behind it.
+   */
+  class ControlLaneInbox
+  {
+  public:
+    typedef std::vector<boost::shared_ptr<zmq::message_t> > Message;
+
+    ControlLaneInbox() :
+      reached_(false),
+      last_reached_(0),
+      stalled_(false),
+      applied_(0),
+      missed_(0),
+      discarded_(0)
+    {}
+
+    /**
+     * Keep a message received through the lane until its fence is reached
+     *
+     * \param[in] sequence The sequence number of the fence sent in its place
+     * \param[in] message The parts of the message
+     * \return false if its fence has already been passed and it was discarded
+     */
+    bool add(uint64_t sequence, const Message& message)
+    {
+      stalled_ = false;
+      if (reached_ && sequence <= last_reached_) {
+        discarded_++;
+        return false;
+      }
+      messages_[sequence] = message;
+      return true;
+    }
+
+    /**
+     * Check whether the decoder should wait at a fence for its message
+     *
+     * \param[in] sequence The sequence number of the fence
+     */
+    bool should_wait(uint64_t sequence) const
+    {
+      return !stalled_ && messages_.count(sequence) == 0;
+    }
+
+    /**
+     * Take the message for a fence that has been reached
+     *
+     * Messages for earlier fences are discarded, and the fence is counted as
+     * missed if its message has not arrived.
+     *
+     * \param[in] sequence The sequence number of the fence
+     * \param[out] message The parts of the message
+     * \return false if the message has not arrived
+     */
+    bool take(uint64_t sequence, Message& message)
+    {
+      if (!reached_ || sequence > last_reached_) {
+        last_reached_ = sequence;
+      }
+      reached_ = true;
+      while (!messages_.empty() && messages_.begin()->first < sequence) {
+        messages_.erase(messages_.begin());
+        discarded_++;
+      }
+      std::map<uint64_t, Message>::iterator it = messages_.find(sequence);
+      if (it == messages_.end()) {
+        stalled_ = true;
+        missed_++;
+        return false;
+      }
+      message = it->second;
+      messages_.erase(it);
+      stalled_ = false;
+      applied_++;
+      return true;
+    }
+
+    /**
+     * Discard every message held and forget the fences reached, for a new connection
+     */
+    void clear()
+    {
+      messages_.clear();
+      reached_ = false;
+      last_reached_ = 0;
+      stalled_ = false;
+    }
+
+    /** Return the number of messages waiting for their fence */
+    size_t pending() const { return messages_.size(); }
+    /** Return whether fences are currently being skipped without waiting */
+    bool stalled() const { return stalled_; }
+    /** Return the number of fences whose message was applied */
+    uint64_t applied() const { return applied_; }
+    /** Return the number of fences whose message had not arrived */
+    uint64_t missed() const { return missed_; }
+    /** Return the number of messages that arrived after their fence had been passed */
+    uint64_t discarded() const { return discarded_; }
+
+  private:
+    std::map<uint64_t, Message> messages_;  // By sequence number of their fence
+    bool reached_;  // Whether any fence has been reached
+    uint64_t last_reached_;  // Highest sequence number of a fence reached
+    bool stalled_;  // A fence was missed and no message has arrived since
+    uint64_t applied_;
+    uint64_t missed_;
+    uint64_t discarded_;
+  };
+
+}
+
+#endif /* INCLUDE_CONTROLLANE_H_ */
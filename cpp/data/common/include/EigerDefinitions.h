@@ -9,6 +9,8 @@
 #define INCLUDE_EIGERDEFINITIONS_H_
 
 #include <stdint.h>
+#include <algorithm>
+#include <string>
 #include "version.h"
 
 namespace Eiger {
@@ -19,6 +21,7 @@ namespace Eiger {
   const std::string GLOBAL_HEADER_TYPE = "dheader-1.0";
   const std::string IMAGE_HEADER_TYPE = "dimage-1.0";
   const std::string END_HEADER_TYPE = "dseries_end-1.0";
+  const std::string FENCE_HEADER_TYPE = "dfence-1.0";
 
   const std::string HEADER_DETAIL_ALL = "all";
   const std::string HEADER_DETAIL_BASIC = "basic";
@@ -41,9 +44,42 @@ namespace Eiger {
 
   const std::string END_STREAM_MESSAGE = "{\"htype\": \"dseries_end-1.0\", \"series\": 1}";
 
+  // Sent by the EigerFan in place of a header or end message that is sent through
+  // the control lane, followed by the sequence number of the message and "}"
+  const std::string FENCE_MESSAGE_PREFIX = "{\"htype\":\"dfence-1.0\",\"seq\":";
+
+  // Sent by the EigerFan ahead of a stream2 start message, followed by the size of
+  // the CBOR part and "}", so it can be received into a buffer large enough to hold it
+  const std::string SIZE_NOTICE_PREFIX = "{\"htype\":\"dsize-1.0\",\"size\":";
+
+  // Stream protocols. Legacy is the multipart JSON stream (dheader-1.0 etc.),
+  // stream2 is the DECTRIS SIMPLON 1.8+ single part CBOR stream.
+  const std::string STREAM_PROTOCOL_LEGACY = "legacy";
+  const std::string STREAM_PROTOCOL_STREAM2 = "stream2";
+
+  // Engines used to receive the detector stream
+  const std::string INGEST_ENGINE_ZMQ = "zmq";
+  const std::string INGEST_ENGINE_IO_URING = "io_uring";
+
+  const std::string STREAM2_TYPE_KEY = "type";
+  const std::string STREAM2_START_TYPE = "start";
+  const std::string STREAM2_IMAGE_TYPE = "image";
+  const std::string STREAM2_END_TYPE = "end";
+  const std::string STREAM2_SERIES_ID_KEY = "series_id";
+  const std::string STREAM2_SERIES_UNIQUE_ID_KEY = "series_unique_id";
+  const std::string STREAM2_IMAGE_ID_KEY = "image_id";
+  const std::string STREAM2_DATA_KEY = "data";
+  const std::string STREAM2_FLATFIELD_KEY = "flatfield";
+  const std::string STREAM2_PIXEL_MASK_KEY = "pixel_mask";
+  const std::string STREAM2_COUNTRATE_KEY = "countrate_correction_lookup_table";
+  const std::string STREAM2_DETECTOR_TRANSLATION_KEY = "detector_translation";
+  const std::string STREAM2_COMPRESSION_BSLZ4 = "bslz4";
+  const std::string STREAM2_COMPRESSION_LZ4 = "lz4";
+
   // EigerFan related constants
   const int MORE_MESSAGES = 1;
   const int RECEIVE_HWM = 100000;  // High water marks for the main receiver thread
+  const int RX_QUEUE_CAPACITY = 32768;  // Messages buffered between the ingest engine and the fan
   const int SEND_HWM = 100000;
   const int WORKER_HWM = 10000;  // A lower high water mark for the worker threads
   const int LINGER_TIMEOUT = 100;  // Socket linger timeout in milliseconds
@@ -61,9 +97,58 @@ namespace Eiger {
   const std::string CONTROL_CLOSE = "close";
   const std::string CONTROL_OFFSET = "offset";
   const std::string CONTROL_ACQ_ID = "acqid";
+  const std::string CONTROL_ACQ_ID_QUEUE = "acqid_queue";  // Replace the queue of acquisition IDs for the next series
+  const std::string CONTROL_QUEUE_ACQ_ID = "queue_acqid";  // Add to the end of the queue
   const std::string CONTROL_FWD_STREAM = "forward_stream";
   const std::string CONTROL_DEV_SHM_CACHE = "dev_shm_cache";
   const std::string CONTROL_BLOCK_SIZE = "block_size";
+  const std::string CONTROL_STREAM_PROTOCOL = "stream_protocol";
+  const std::string CONTROL_INGEST_ENGINE = "ingest_engine";
+  const std::string CONTROL_MIN_THREADS = "min_threads";
+  const std::string CONTROL_MAX_THREADS = "max_threads";
+  const std::string CONTROL_UPSTREAM_CONSUMERS = "upstream_consumers";
+  const std::string CONTROL_UPSTREAM_BLOCK_SIZE = "upstream_block_size";
+  const std::string CONTROL_SHARED_TRANSPORT = "shared_transport";
+  const std::string CONTROL_COORDINATOR = "coordinator";
+  const std::string CONTROL_INSTANCE_NAME = "instance_name";
+  const std::string CONTROL_MEMORY_BUDGET = "memory_budget";
+  const std::string CONTROL_BUDGET_POLICY = "budget_policy";
+  const std::string CONTROL_NONBLOCKING_SEND = "nonblocking_send";
+  const std::string CONTROL_OVERFLOW_RAM = "overflow_ram";
+  const std::string CONTROL_SPILL_DIR = "spill_dir";
+  const std::string CONTROL_CONTROL_LANE_PORT = "control_lane_port";
+  const std::string CONTROL_COMPRESSION = "compression";
+  const std::string CONTROL_COMPRESSION_THREADS = "compression_threads";
+  const std::string CONTROL_STALL_TIMEOUT = "stall_timeout";
+  const std::string CONTROL_STALL_INTERVALS = "stall_intervals";
+  const std::string CONTROL_SPIN_COUNT = "spin_count";
+  const std::string CONTROL_RX_CPU = "rx_cpu";
+  const std::string CONTROL_INGEST_CPUS = "ingest_cpus";
+  const std::string CONTROL_PHASE_PERIOD = "phase_period";
+
+  // Compression the fan applies to uncompressed images
+  const std::string COMPRESSION_NONE = "none";
+  const std::string COMPRESSION_BSLZ4 = "bslz4";
+
+  // What the fan does with an image when its destination is over its share of the memory budget
+  const std::string BUDGET_POLICY_BLOCK = "block";  // Wait, pushing back on the detector stream
+  const std::string BUDGET_POLICY_DROP = "drop";  // Drop the image and count it
+
+  // Messages between EigerFan instances sharing one detector stream and their coordinator
+  const std::string COORDINATOR_MSG_TYPE_KEY = "msg_type";
+  const std::string COORDINATOR_REGISTER = "register";
+  const std::string COORDINATOR_REGISTERED = "registered";
+  const std::string COORDINATOR_START = "start";
+  const std::string COORDINATOR_END = "end";
+  const std::string COORDINATOR_DRAINED = "drained";
+  const std::string COORDINATOR_RELEASE_END = "release_end";
+  const std::string COORDINATOR_INSTANCE_KEY = "instance";
+  const std::string COORDINATOR_NUM_CONSUMERS_KEY = "num_consumers";
+  const std::string COORDINATOR_BLOCK_SIZE_KEY = "block_size";
+  const std::string COORDINATOR_SERIES_KEY = "series";
+  const std::string COORDINATOR_ACQ_ID_KEY = "acqid";
+  const std::string COORDINATOR_OFFSET_KEY = "offset";
+  const std::string COORDINATOR_FRAMES_KEY = "frames";
 
   const std::string CONTROL_RESPONSE_OK = "{\"msg_type\":\"ack\",\"msg_val\":\"configure\", \"params\": {}}";
   const std::string CONTROL_RESPONSE_UNABLE = "{\"msg_type\":\"nack\",\"msg_val\":\"configure\", \"params\": {\"error:\":\"Unable to process control command\"}}";
@@ -104,8 +189,47 @@ namespace Eiger {
     char encoding[11];  // String of the form "[bs<BIT>][[-]lz4][<|>]"
     char dataType[8];	// "uint16" or "uint32" or "float32"
     char acquisitionID[256];	// acquisitionID
+    uint32_t data_offset;	// Offset of the image data after the FrameHeader (non-zero for stream2)
+    uint32_t payload_offset;	// Offset of the received message part from the start of the frame buffer
   } FrameHeader;
 
+  /**
+   * Return the offset of the message part from the start of a frame buffer
+   *
+   * The part follows the FrameHeader, padded to the next alignment boundary if
+   * an alignment is set. The decoder records the offset in the FrameHeader as
+   * payload_offset, where the processors read it to find the part.
+   *
+   * \param[in] buffer The frame buffer
+   * \param[in] alignment Alignment of the part, a power of 2, or 0 for none
+   */
+  inline size_t AlignedPayloadOffset(const void* buffer, size_t alignment)
+  {
+    if (alignment == 0) {
+      return sizeof(FrameHeader);
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(buffer);
+    uintptr_t payload = (start + sizeof(FrameHeader) + alignment - 1) & ~(alignment - 1);
+    return payload - start;
+  }
+
+  /**
+   * Return the frame buffer size needed to hold a frame with its part aligned
+   *
+   * The size allows for the padding, and is a multiple of the alignment so
+   * the part is at the same offset in every buffer of a pool.
+   *
+   * \param[in] size The frame buffer size without alignment
+   * \param[in] alignment Alignment of the part, a power of 2, or 0 for none
+   */
+  inline size_t AlignedFrameBufferSize(size_t size, size_t alignment)
+  {
+    if (alignment == 0) {
+      return size;
+    }
+    return (size + alignment + alignment - 1) / alignment * alignment;
+  }
+
   static const size_t frame_size_500K    =  2117680 + sizeof(FrameHeader); // 529,420 pixels at 32 bit pixel depth
   static const size_t frame_size_1M      = 4387800 + sizeof(FrameHeader); // 1,096,950 pixels at 32 bit pixel depth
   static const size_t frame_size_4M      = 17942760 + sizeof(FrameHeader); // 4,485,690 pixels at 32 bit pixel depth
@@ -129,6 +253,24 @@ namespace Eiger {
   static const int global_countrate_data_part = 8; // Global header 8th part contains countrate data
   static const int global_appendix_part = 9; // Appendix is on the 9th global header part
 
+  static const int stream2_acquisition_id_part = 1; // stream2 messages from the EigerFan start with the acquisition ID
+  static const int stream2_cbor_part = 2; // followed by the unmodified CBOR message from the detector
+  static const size_t stream2_message_overhead = 4096; // Allowance for the CBOR fields around a stream2 image
+
+  /**
+   * Return the size of the decoder's scratch buffers
+   *
+   * Payloads are received into a scratch buffer before being copied into a
+   * frame buffer, so it takes the biggest frame possible, or a whole frame
+   * buffer if that is larger.
+   *
+   * \param[in] buffer_size The frame buffer size
+   */
+  inline size_t ScratchBufferSize(size_t buffer_size)
+  {
+    return std::max(frame_size_16M + stream2_message_overhead, buffer_size);
+  }
+
 }
 
 #endif /* INCLUDE_EIGERDEFINITIONS_H_ */
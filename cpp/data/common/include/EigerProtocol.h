@@ -0,0 +1,182 @@
+/*
+ * EigerProtocol.h
+ *
+ * Description of the legacy multipart stream (dheader-1.0, dimage-1.0 and
+ * dseries_end-1.0 messages), shared by the EigerFan, the frame decoder and the
+ * simulator. Each part of each message type has an entry in a table indexed by
+ * message type and part number, so handling a part is a single lookup, and the
+ * header_detail variants are listed in one table giving how many header parts
+ * each one sends.
+ */
+
+#ifndef INCLUDE_EIGERPROTOCOL_H_
+#define INCLUDE_EIGERPROTOCOL_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include "EigerDefinitions.h"
+
+namespace Eiger {
+
+  // What a message part holds, which decides how it is handled
+  enum PartContent {
+    PART_CONTENT_NONE,  // No such part
+    PART_CONTENT_MESSAGE_HEADER,  // JSON identifying the message by its htype
+    PART_CONTENT_DATA_HEADER,  // JSON giving the shape and type of the global header data part after it
+    PART_CONTENT_DATA,  // Global header data, passed downstream as it is
+    PART_CONTENT_IMAGE_HEADER,  // JSON giving the shape, type and encoding of the image
+    PART_CONTENT_IMAGE_BLOB,  // The image
+    PART_CONTENT_IMAGE_TIMES,  // JSON giving the image times, the last part of an image
+    PART_CONTENT_APPENDIX  // The optional user appendix, the last part of any message
+  };
+
+  typedef struct
+  {
+    int part;  // Part number, from 1
+    PartContent content;
+    EigerMessageType message_type;  // Type the part is sent downstream as
+    bool frame_buffer;  // Received straight into a frame buffer by the decoder
+    const char* name;
+  } PartSpec;
+
+  static const int MAX_MESSAGE_PARTS = 10;  // Including the unused part 0
+  static const int NUM_MESSAGE_TYPES = PARENT_MESSAGE_TYPE_END + 1;
+
+  static constexpr PartSpec NO_PART = {0, PART_CONTENT_NONE, GLOBAL_HEADER_NONE, false, "none"};
+
+  // Parts of each message type, indexed by EigerMessageParentType and part number
+  static constexpr PartSpec MESSAGE_PARTS[NUM_MESSAGE_TYPES][MAX_MESSAGE_PARTS] = {
+    {
+      NO_PART,
+      {global_detector_none_part, PART_CONTENT_MESSAGE_HEADER, GLOBAL_HEADER_NONE, false, "header"},
+      {global_detector_config_part, PART_CONTENT_DATA, GLOBAL_HEADER_CONFIG, true, "config"},
+      {global_flatfield_header_part, PART_CONTENT_DATA_HEADER, GLOBAL_HEADER_FLATFIELD, false, "flatfield_header"},
+      {global_flatfield_data_part, PART_CONTENT_DATA, GLOBAL_HEADER_FLATFIELD, true, "flatfield"},
+      {global_mask_header_part, PART_CONTENT_DATA_HEADER, GLOBAL_HEADER_MASK, false, "mask_header"},
+      {global_mask_data_part, PART_CONTENT_DATA, GLOBAL_HEADER_MASK, true, "mask"},
+      {global_countrate_header_part, PART_CONTENT_DATA_HEADER, GLOBAL_HEADER_COUNTRATE, false, "countrate_header"},
+      {global_countrate_data_part, PART_CONTENT_DATA, GLOBAL_HEADER_COUNTRATE, true, "countrate"},
+      {global_appendix_part, PART_CONTENT_APPENDIX, GLOBAL_HEADER_APPENDIX, true, "appendix"}
+    },
+    {
+      NO_PART,
+      {1, PART_CONTENT_MESSAGE_HEADER, IMAGE_DATA, false, "header"},
+      {image_data_imaged_part, PART_CONTENT_IMAGE_HEADER, IMAGE_DATA, false, "image_header"},
+      {image_data_blob_part, PART_CONTENT_IMAGE_BLOB, IMAGE_DATA, true, "blob"},
+      {image_data_time_part, PART_CONTENT_IMAGE_TIMES, IMAGE_DATA, false, "times"},
+      {image_data_appendix_part, PART_CONTENT_APPENDIX, IMAGE_APPENDIX, true, "appendix"},
+      NO_PART, NO_PART, NO_PART, NO_PART
+    },
+    {
+      NO_PART,
+      {1, PART_CONTENT_MESSAGE_HEADER, END_OF_STREAM, false, "header"},
+      NO_PART, NO_PART, NO_PART, NO_PART, NO_PART, NO_PART, NO_PART, NO_PART
+    }
+  };
+
+  /**
+   * Check every part of a message type is at the index of its part number
+   */
+  constexpr bool PartsInOrder(int type, int part = 0) {
+    return part == MAX_MESSAGE_PARTS ||
+        ((MESSAGE_PARTS[type][part].content == PART_CONTENT_NONE || MESSAGE_PARTS[type][part].part == part) &&
+         PartsInOrder(type, part + 1));
+  }
+  static_assert(PartsInOrder(PARENT_MESSAGE_TYPE_GLOBAL), "Global header parts out of order");
+  static_assert(PartsInOrder(PARENT_MESSAGE_TYPE_IMAGE_DATA), "Image parts out of order");
+  static_assert(PartsInOrder(PARENT_MESSAGE_TYPE_END), "End parts out of order");
+
+  /**
+   * Look up a part of a message
+   *
+   * \param[in] type The message type
+   * \param[in] part The part number, from 1
+   * \return The part, or NO_PART if the message has no such part
+   */
+  constexpr const PartSpec& GetPartSpec(EigerMessageParentType type, int part) {
+    return part > 0 && part < MAX_MESSAGE_PARTS ? MESSAGE_PARTS[type][part] : NO_PART;
+  }
+
+  /**
+   * Number of parts of a message before any appendix
+   */
+  constexpr int NumMessageParts(EigerMessageParentType type, int part = 1) {
+    return part == MAX_MESSAGE_PARTS || GetPartSpec(type, part).content == PART_CONTENT_NONE ||
+        GetPartSpec(type, part).content == PART_CONTENT_APPENDIX ? part - 1 : NumMessageParts(type, part + 1);
+  }
+  static_assert(NumMessageParts(PARENT_MESSAGE_TYPE_IMAGE_DATA) == image_data_time_part, "Image parts miscounted");
+
+  typedef struct
+  {
+    const char* name;  // Value of header_detail
+    int last_part;  // Last global header part sent, before any appendix
+    EigerMessageType message_type;  // Type of the header before its data parts
+  } HeaderDetailSpec;
+
+  // The header_detail variants, each sending the global header parts up to last_part
+  static constexpr HeaderDetailSpec HEADER_DETAILS[] = {
+    {"none", global_detector_none_part, GLOBAL_HEADER_NONE},
+    {"basic", global_detector_config_part, GLOBAL_HEADER_CONFIG},
+    {"all", global_countrate_data_part, GLOBAL_HEADER_CONFIG}
+  };
+  static const size_t NUM_HEADER_DETAILS = sizeof(HEADER_DETAILS) / sizeof(HEADER_DETAILS[0]);
+
+  /**
+   * Look up a header_detail variant, once per acquisition
+   *
+   * \param[in] name Value of header_detail
+   * \return The variant, or NULL if it is not known
+   */
+  inline const HeaderDetailSpec* FindHeaderDetail(const char* name) {
+    for (size_t i = 0; i < NUM_HEADER_DETAILS; i++) {
+      if (strcmp(HEADER_DETAILS[i].name, name) == 0) {
+        return &HEADER_DETAILS[i];
+      }
+    }
+    return NULL;
+  }
+
+  typedef struct
+  {
+    const char* htype;
+    size_t length;
+    EigerMessageParentType type;
+  } MessageTypeSpec;
+
+  // The message types, each with an htype of a different length so they are told apart by length
+  static constexpr MessageTypeSpec MESSAGE_TYPES[] = {
+    {"dheader-1.0", sizeof("dheader-1.0") - 1, PARENT_MESSAGE_TYPE_GLOBAL},
+    {"dimage-1.0", sizeof("dimage-1.0") - 1, PARENT_MESSAGE_TYPE_IMAGE_DATA},
+    {"dseries_end-1.0", sizeof("dseries_end-1.0") - 1, PARENT_MESSAGE_TYPE_END}
+  };
+  static const size_t NUM_MESSAGE_TYPE_SPECS = sizeof(MESSAGE_TYPES) / sizeof(MESSAGE_TYPES[0]);
+
+  constexpr bool MessageTypeLengthsUnique(size_t i = 0, size_t j = 1) {
+    return i == NUM_MESSAGE_TYPE_SPECS ? true :
+        j == NUM_MESSAGE_TYPE_SPECS ? MessageTypeLengthsUnique(i + 1, i + 2) :
+        MESSAGE_TYPES[i].length != MESSAGE_TYPES[j].length && MessageTypeLengthsUnique(i, j + 1);
+  }
+  static_assert(MessageTypeLengthsUnique(), "Message htypes must differ in length");
+
+  /**
+   * Identify a message by its htype
+   *
+   * \param[in] htype The htype, which need not be null terminated
+   * \param[in] length Length of the htype
+   * \param[out] type The message type
+   * \return false if the htype is not a known message type
+   */
+  inline bool ClassifyMessageType(const char* htype, size_t length, EigerMessageParentType& type) {
+    for (size_t i = 0; i < NUM_MESSAGE_TYPE_SPECS; i++) {
+      if (MESSAGE_TYPES[i].length == length) {
+        type = MESSAGE_TYPES[i].type;
+        return memcmp(MESSAGE_TYPES[i].htype, htype, length) == 0;
+      }
+    }
+    return false;
+  }
+
+}
+
+#endif /* INCLUDE_EIGERPROTOCOL_H_ */
@@ -0,0 +1,151 @@
+/*
+ * SharedFrameTransport.h
+ *
+ * Same-host transport between the EigerFan and a FrameReceiver. The decoder
+ * lends empty frame buffers from its shared memory frame pool to the fan
+ * through a ring in a small control segment. The fan copies the image payload
+ * straight into a lent buffer and sends a SharedFrameDescriptor in place of
+ * the payload part, so the message order on the rank socket is unchanged and
+ * only the payload bypasses TCP.
+ */
+
+#ifndef INCLUDE_SHAREDFRAMETRANSPORT_H_
+#define INCLUDE_SHAREDFRAMETRANSPORT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+namespace Eiger {
+
+  static const uint64_t SHARED_TRANSPORT_MAGIC = 0x45494745525348ULL;  // "EIGERSH"
+  static const uint32_t SHARED_TRANSPORT_VERSION = 1;
+  static const uint64_t SHARED_DESCRIPTOR_MAGIC = 0x45494745524653ULL;  // "EIGERFS"
+  static const size_t SHARED_TRANSPORT_RING_SIZE = 64;  // Buffers lent to the fan at once
+  static const size_t SHARED_BUFFER_NAME_LENGTH = 128;
+
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared transport ring needs lock-free 64 bit atomics");
+
+  // Control segment states
+  static const uint32_t SHARED_TRANSPORT_INITIALISING = 0;
+  static const uint32_t SHARED_TRANSPORT_READY = 1;
+
+  /**
+   * A frame buffer lent to the fan, located by its byte offset in the frame pool
+   */
+  typedef struct
+  {
+    int64_t buffer_id;
+    uint64_t offset;
+  } SharedFrameSlot;
+
+  /**
+   * Control segment created by the decoder, one per FrameReceiver
+   *
+   * The lent buffer ring is single producer (decoder) single consumer (fan),
+   * with head and tail on separate cache lines.
+   */
+  typedef struct
+  {
+    uint64_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> state;
+    char buffer_name[SHARED_BUFFER_NAME_LENGTH];  // Name of the frame pool segment
+    uint64_t buffer_size;  // Size of each frame buffer
+    uint64_t payload_offset;  // Offset of the payload in a frame buffer, after the FrameHeader
+    alignas(64) std::atomic<uint64_t> head;  // Written by the decoder
+    alignas(64) std::atomic<uint64_t> tail;  // Written by the fan
+    alignas(64) SharedFrameSlot slots[SHARED_TRANSPORT_RING_SIZE];
+  } SharedTransportControl;
+
+  /**
+   * Sent in place of a payload part to say which lent buffer the payload was written to
+   */
+  typedef struct
+  {
+    uint64_t magic;
+    int64_t buffer_id;
+    uint64_t size;
+  } SharedFrameDescriptor;
+
+  /**
+   * Lend a buffer to the fan
+   *
+   * \param[in] control The control segment
+   * \param[in] slot The buffer to lend
+   * \return false if the ring is full
+   */
+  inline bool SharedTransportPush(SharedTransportControl* control, const SharedFrameSlot& slot)
+  {
+    uint64_t head = control->head.load(std::memory_order_relaxed);
+    if (head - control->tail.load(std::memory_order_acquire) >= SHARED_TRANSPORT_RING_SIZE) {
+      return false;
+    }
+    control->slots[head % SHARED_TRANSPORT_RING_SIZE] = slot;
+    control->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Look at the next lent buffer without taking it
+   *
+   * \param[in] control The control segment
+   * \param[out] slot The next buffer
+   * \return false if no buffers are lent
+   */
+  inline bool SharedTransportPeek(const SharedTransportControl* control, SharedFrameSlot& slot)
+  {
+    uint64_t tail = control->tail.load(std::memory_order_relaxed);
+    if (tail == control->head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    slot = control->slots[tail % SHARED_TRANSPORT_RING_SIZE];
+    return true;
+  }
+
+  /**
+   * Take the next lent buffer
+   *
+   * \param[in] control The control segment
+   * \param[out] slot The buffer taken
+   * \return false if no buffers are lent
+   */
+  inline bool SharedTransportPop(SharedTransportControl* control, SharedFrameSlot& slot)
+  {
+    if (!SharedTransportPeek(control, slot)) {
+      return false;
+    }
+    control->tail.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Return the number of buffers currently lent and not yet taken
+   *
+   * \param[in] control The control segment
+   */
+  inline size_t SharedTransportAvailable(const SharedTransportControl* control)
+  {
+    return control->head.load(std::memory_order_acquire) - control->tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Check whether a received part is a SharedFrameDescriptor
+   *
+   * \param[in] data The received part
+   * \param[in] size Size of the received part
+   * \param[out] descriptor The descriptor, if it is one
+   * \return true if the part is a descriptor
+   */
+  inline bool ParseSharedFrameDescriptor(const void* data, size_t size, SharedFrameDescriptor& descriptor)
+  {
+    if (size != sizeof(SharedFrameDescriptor)) {
+      return false;
+    }
+    memcpy(&descriptor, data, sizeof(descriptor));
+    return descriptor.magic == SHARED_DESCRIPTOR_MAGIC;
+  }
+
+}
+
+#endif /* INCLUDE_SHAREDFRAMETRANSPORT_H_ */
@@ -0,0 +1,840 @@
+/*
+ * Stream2Cbor.h
+ *
+ * Lightweight CBOR reader and writer for the DECTRIS SIMPLON stream2
+ * protocol. The reader works directly on the received buffer and never
+ * copies or allocates, so large image payloads can be located in place.
+ */
+
+#ifndef INCLUDE_STREAM2CBOR_H_
+#define INCLUDE_STREAM2CBOR_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "EigerDefinitions.h"
+
+namespace Eiger {
+
+  // CBOR major types (RFC 8949 section 3.1)
+  enum CborMajorType {
+    CBOR_UNSIGNED = 0,
+    CBOR_NEGATIVE = 1,
+    CBOR_BYTES = 2,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+    CBOR_TAG = 6,
+    CBOR_SIMPLE = 7
+  };
+
+  // CBOR tags used by stream2
+  static const uint64_t CBOR_TAG_SELF_DESCRIBE = 55799;
+  static const uint64_t CBOR_TAG_MULTI_DIM_ARRAY = 40;
+  static const uint64_t CBOR_TAG_UINT8 = 64;
+  static const uint64_t CBOR_TAG_UINT16_LE = 69;
+  static const uint64_t CBOR_TAG_UINT32_LE = 70;
+  static const uint64_t CBOR_TAG_UINT64_LE = 71;
+  static const uint64_t CBOR_TAG_FLOAT32_LE = 85;
+  static const uint64_t CBOR_TAG_DECTRIS_COMPRESSION = 56500;
+
+  /**
+   * A single decoded CBOR data item head.
+   *
+   * For byte and text strings data/length describe the string content, which
+   * is left in place in the source buffer. For arrays and maps value holds the
+   * number of entries, for tags the tag number and for integers the value.
+   */
+  typedef struct
+  {
+    int major;
+    int info;
+    uint64_t value;
+    const uint8_t* data;
+    size_t length;
+  } CborItem;
+
+  /**
+   * Forward-only, zero-copy CBOR reader.
+   *
+   * Only definite length items are supported, which is all stream2 produces.
+   */
+  class CborReader
+  {
+  public:
+    CborReader(const void* data, size_t size) :
+      start_(static_cast<const uint8_t*>(data)),
+      ptr_(static_cast<const uint8_t*>(data)),
+      end_(static_cast<const uint8_t*>(data) + size)
+    {
+    }
+
+    /** Offset of the read position from the start of the buffer */
+    size_t position() const { return ptr_ - start_; }
+
+    /** Whether the whole buffer has been consumed */
+    bool at_end() const { return ptr_ >= end_; }
+
+    /**
+     * Read the next data item head.
+     *
+     * Byte and text string contents are consumed and returned by pointer.
+     *
+     * \param[out] item The decoded item
+     * \return false if the buffer is truncated or the item is unsupported
+     */
+    bool next(CborItem& item)
+    {
+      if (ptr_ >= end_) {
+        return false;
+      }
+      uint8_t initial = *ptr_++;
+      item.major = initial >> 5;
+      uint8_t info = initial & 0x1f;
+      item.info = info;
+      item.data = 0;
+      item.length = 0;
+      if (info < 24) {
+        item.value = info;
+      } else if (info <= 27) {
+        size_t bytes = static_cast<size_t>(1) << (info - 24);
+        if (static_cast<size_t>(end_ - ptr_) < bytes) {
+          return false;
+        }
+        item.value = 0;
+        for (size_t i = 0; i < bytes; i++) {
+          item.value = (item.value << 8) | *ptr_++;
+        }
+      } else {
+        // Indefinite lengths and reserved values are not used by stream2
+        return false;
+      }
+      if (item.major == CBOR_BYTES || item.major == CBOR_TEXT) {
+        if (static_cast<uint64_t>(end_ - ptr_) < item.value) {
+          return false;
+        }
+        item.data = ptr_;
+        item.length = item.value;
+        ptr_ += item.value;
+      }
+      return true;
+    }
+
+    /**
+     * Skip over the next complete data item, including any nested items.
+     *
+     * \return false if the buffer is truncated or malformed
+     */
+    bool skip()
+    {
+      CborItem item;
+      if (!next(item)) {
+        return false;
+      }
+      return skip_children(item);
+    }
+
+    /**
+     * Skip the nested items of an item head that has already been read.
+     *
+     * \param[in] item The item head returned by next()
+     * \return false if the buffer is truncated or malformed
+     */
+    bool skip_children(const CborItem& item)
+    {
+      uint64_t children = 0;
+      if (item.major == CBOR_ARRAY) {
+        children = item.value;
+      } else if (item.major == CBOR_MAP) {
+        children = item.value * 2;
+      } else if (item.major == CBOR_TAG) {
+        children = 1;
+      }
+      for (uint64_t i = 0; i < children; i++) {
+        if (!skip()) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /**
+     * Read any tags preceding the next item and return the innermost one.
+     *
+     * \param[out] item The first non-tag item head
+     * \param[out] tag The tag directly applied to the item, or 0 if untagged
+     * \return false if the buffer is truncated or malformed
+     */
+    bool next_untagged(CborItem& item, uint64_t& tag)
+    {
+      tag = 0;
+      while (next(item)) {
+        if (item.major != CBOR_TAG) {
+          return true;
+        }
+        tag = item.value;
+      }
+      return false;
+    }
+
+    /** Read an unsigned integer */
+    bool read_uint(uint64_t& value)
+    {
+      CborItem item;
+      if (!next(item) || item.major != CBOR_UNSIGNED) {
+        return false;
+      }
+      value = item.value;
+      return true;
+    }
+
+    /** Read a text string without copying it */
+    bool read_text(const char*& text, size_t& length)
+    {
+      CborItem item;
+      if (!next(item) || item.major != CBOR_TEXT) {
+        return false;
+      }
+      text = reinterpret_cast<const char*>(item.data);
+      length = item.length;
+      return true;
+    }
+
+    /**
+     * Read a number of any numeric CBOR type as a double
+     *
+     * \param[out] value The decoded value
+     * \return false if the next item is not numeric
+     */
+    bool read_double(double& value)
+    {
+      CborItem item;
+      if (!next(item)) {
+        return false;
+      }
+      if (item.major == CBOR_UNSIGNED) {
+        value = static_cast<double>(item.value);
+      } else if (item.major == CBOR_NEGATIVE) {
+        value = -1.0 - static_cast<double>(item.value);
+      } else if (item.major == CBOR_SIMPLE && item.info == 26) {
+        uint32_t bits = static_cast<uint32_t>(item.value);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        value = f;
+      } else if (item.major == CBOR_SIMPLE && item.info == 27) {
+        uint64_t bits = item.value;
+        memcpy(&value, &bits, sizeof(value));
+      } else {
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    const uint8_t* start_;
+    const uint8_t* ptr_;
+    const uint8_t* end_;
+  };
+
+  /**
+   * Minimal CBOR encoder writing into a std::string.
+   *
+   * Used to fabricate stream2 messages (simulator, fabricated end of series).
+   */
+  class CborWriter
+  {
+  public:
+    void write_head(int major, uint64_t value)
+    {
+      uint8_t type = static_cast<uint8_t>(major << 5);
+      if (value < 24) {
+        buffer_.push_back(static_cast<char>(type | value));
+      } else if (value <= 0xff) {
+        buffer_.push_back(static_cast<char>(type | 24));
+        put_be(value, 1);
+      } else if (value <= 0xffff) {
+        buffer_.push_back(static_cast<char>(type | 25));
+        put_be(value, 2);
+      } else if (value <= 0xffffffffULL) {
+        buffer_.push_back(static_cast<char>(type | 26));
+        put_be(value, 4);
+      } else {
+        buffer_.push_back(static_cast<char>(type | 27));
+        put_be(value, 8);
+      }
+    }
+
+    void write_uint(uint64_t value) { write_head(CBOR_UNSIGNED, value); }
+    void write_map(uint64_t entries) { write_head(CBOR_MAP, entries); }
+    void write_array(uint64_t entries) { write_head(CBOR_ARRAY, entries); }
+    void write_tag(uint64_t tag) { write_head(CBOR_TAG, tag); }
+
+    void write_text(const std::string& text)
+    {
+      write_head(CBOR_TEXT, text.size());
+      buffer_.append(text);
+    }
+
+    void write_bytes(const void* data, size_t size)
+    {
+      write_head(CBOR_BYTES, size);
+      buffer_.append(static_cast<const char*>(data), size);
+    }
+
+    /** Write a double precision float */
+    void write_double(double value)
+    {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      buffer_.push_back(static_cast<char>((CBOR_SIMPLE << 5) | 27));
+      put_be(bits, 8);
+    }
+
+    /** Write a boolean */
+    void write_bool(bool value)
+    {
+      buffer_.push_back(static_cast<char>((CBOR_SIMPLE << 5) | (value ? 21 : 20)));
+    }
+
+    /** Write only the head of a byte string so the caller can append the content */
+    void write_bytes_head(size_t size) { write_head(CBOR_BYTES, size); }
+
+    /** Write a rational time value as used by stream2 ([numerator, denominator]) */
+    void write_rational(uint64_t numerator, uint64_t denominator)
+    {
+      write_array(2);
+      write_uint(numerator);
+      write_uint(denominator);
+    }
+
+    const std::string& str() const { return buffer_; }
+
+  private:
+    void put_be(uint64_t value, int bytes)
+    {
+      for (int i = bytes - 1; i >= 0; i--) {
+        buffer_.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+      }
+    }
+
+    std::string buffer_;
+  };
+
+  enum Stream2MessageType { STREAM2_UNKNOWN, STREAM2_START, STREAM2_IMAGE, STREAM2_END };
+
+  /**
+   * Summary of a stream2 message, pointing into the original buffer.
+   *
+   * Times are converted from stream2 rationals to nanoseconds to match the
+   * legacy dimage header.
+   */
+  typedef struct
+  {
+    Stream2MessageType type;
+    uint64_t series_id;
+    uint64_t image_id;
+    const char* series_unique_id;
+    size_t series_unique_id_length;
+    uint64_t start_time;
+    uint64_t stop_time;
+    uint64_t real_time;
+    uint32_t shape[3];       // x, y, z as in the legacy FrameHeader
+    const uint8_t* data;     // Image payload (possibly compressed), zero-copy
+    size_t data_size;
+    uint32_t element_size;   // Bytes per pixel
+    const char* data_type;   // "uint16", "uint32", ...
+    const char* compression; // "", "bslz4" or "lz4"
+  } Stream2Message;
+
+  /**
+   * Map a stream2 typed array tag to an Eiger data type string and element size
+   *
+   * \return false if the tag is not a supported typed array
+   */
+  inline bool Stream2TypedArray(uint64_t tag, const char*& data_type, uint32_t& element_size)
+  {
+    switch (tag) {
+      case CBOR_TAG_UINT8:      data_type = "uint8";   element_size = 1; return true;
+      case CBOR_TAG_UINT16_LE:  data_type = "uint16";  element_size = 2; return true;
+      case CBOR_TAG_UINT32_LE:  data_type = "uint32";  element_size = 4; return true;
+      case CBOR_TAG_UINT64_LE:  data_type = "uint64";  element_size = 8; return true;
+      case CBOR_TAG_FLOAT32_LE: data_type = "float32"; element_size = 4; return true;
+    }
+    return false;
+  }
+
+  /**
+   * Compare a CBOR text string against a constant key
+   */
+  inline bool Stream2KeyIs(const char* text, size_t length, const std::string& key)
+  {
+    return length == key.size() && memcmp(text, key.c_str(), length) == 0;
+  }
+
+  /**
+   * Read a stream2 rational time [numerator, denominator] as nanoseconds
+   */
+  inline bool Stream2ReadTime(CborReader& reader, uint64_t& nanoseconds)
+  {
+    CborItem item;
+    uint64_t numerator, denominator;
+    if (!reader.next(item) || item.major != CBOR_ARRAY || item.value != 2 ||
+        !reader.read_uint(numerator) || !reader.read_uint(denominator) || denominator == 0) {
+      return false;
+    }
+    nanoseconds = static_cast<uint64_t>(
+      static_cast<double>(numerator) * 1000000000.0 / static_cast<double>(denominator)
+    );
+    return true;
+  }
+
+  /**
+   * Parse the image of the first channel in the "data" map of an image message.
+   *
+   * Expected layout: 40([[dims...], typed_array]) where typed_array is either a
+   * tagged byte string or a tagged DECTRIS compression array
+   * 56500(["bslz4", element_size, bytes]).
+   */
+  inline bool Stream2ReadChannel(CborReader& reader, Stream2Message& msg)
+  {
+    CborItem item;
+    uint64_t tag;
+    if (!reader.next_untagged(item, tag) || tag != CBOR_TAG_MULTI_DIM_ARRAY ||
+        item.major != CBOR_ARRAY || item.value != 2) {
+      return false;
+    }
+
+    // Dimensions are row major, so the last entry is the fastest varying (x)
+    CborItem dims;
+    if (!reader.next(dims) || dims.major != CBOR_ARRAY || dims.value < 1 || dims.value > 3) {
+      return false;
+    }
+    uint64_t dim_values[3] = {0, 0, 0};
+    for (uint64_t i = 0; i < dims.value; i++) {
+      if (!reader.read_uint(dim_values[i])) {
+        return false;
+      }
+    }
+    msg.shape[0] = static_cast<uint32_t>(dim_values[dims.value - 1]);
+    msg.shape[1] = dims.value > 1 ? static_cast<uint32_t>(dim_values[dims.value - 2]) : 1;
+    msg.shape[2] = dims.value > 2 ? static_cast<uint32_t>(dim_values[0]) : 0;
+
+    // Typed array, optionally wrapping a compressed array. Both nestings are accepted.
+    uint64_t typed_tag = 0;
+    while (reader.next(item)) {
+      if (item.major == CBOR_TAG) {
+        if (item.value != CBOR_TAG_DECTRIS_COMPRESSION) {
+          typed_tag = item.value;
+        }
+        continue;
+      }
+      if (item.major == CBOR_ARRAY && item.value == 3) {
+        const char* algorithm;
+        size_t algorithm_length;
+        uint64_t element_size;
+        if (!reader.read_text(algorithm, algorithm_length) || !reader.read_uint(element_size)) {
+          return false;
+        }
+        if (Stream2KeyIs(algorithm, algorithm_length, STREAM2_COMPRESSION_BSLZ4)) {
+          msg.compression = STREAM2_COMPRESSION_BSLZ4.c_str();
+        } else if (Stream2KeyIs(algorithm, algorithm_length, STREAM2_COMPRESSION_LZ4)) {
+          msg.compression = STREAM2_COMPRESSION_LZ4.c_str();
+        } else {
+          return false;
+        }
+        continue;
+      }
+      if (item.major != CBOR_BYTES) {
+        return false;
+      }
+      msg.data = item.data;
+      msg.data_size = item.length;
+      return Stream2TypedArray(typed_tag, msg.data_type, msg.element_size);
+    }
+    return false;
+  }
+
+  /**
+   * Decode the header fields of a stream2 message in place.
+   *
+   * Only the fields needed to route and describe an image are decoded; all
+   * other entries are skipped without being interpreted.
+   *
+   * \param[in] data The CBOR message
+   * \param[in] size Size of the message in bytes
+   * \param[out] msg The decoded summary
+   * \return false if the message could not be decoded
+   */
+  inline bool ParseStream2Message(const void* data, size_t size, Stream2Message& msg)
+  {
+    memset(&msg, 0, sizeof(msg));
+    msg.type = STREAM2_UNKNOWN;
+    msg.compression = "";
+    msg.data_type = "";
+
+    CborReader reader(data, size);
+    CborItem item;
+    uint64_t tag;
+    if (!reader.next_untagged(item, tag) || item.major != CBOR_MAP) {
+      return false;
+    }
+
+    uint64_t entries = item.value;
+    for (uint64_t i = 0; i < entries; i++) {
+      const char* key;
+      size_t key_length;
+      if (!reader.read_text(key, key_length)) {
+        return false;
+      }
+      bool ok = true;
+      if (Stream2KeyIs(key, key_length, STREAM2_TYPE_KEY)) {
+        const char* type;
+        size_t type_length;
+        ok = reader.read_text(type, type_length);
+        if (ok) {
+          if (Stream2KeyIs(type, type_length, STREAM2_IMAGE_TYPE)) {
+            msg.type = STREAM2_IMAGE;
+          } else if (Stream2KeyIs(type, type_length, STREAM2_START_TYPE)) {
+            msg.type = STREAM2_START;
+          } else if (Stream2KeyIs(type, type_length, STREAM2_END_TYPE)) {
+            msg.type = STREAM2_END;
+          }
+        }
+      } else if (Stream2KeyIs(key, key_length, STREAM2_SERIES_ID_KEY)) {
+        ok = reader.read_uint(msg.series_id);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_SERIES_UNIQUE_ID_KEY)) {
+        ok = reader.read_text(msg.series_unique_id, msg.series_unique_id_length);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_IMAGE_ID_KEY)) {
+        ok = reader.read_uint(msg.image_id);
+      } else if (Stream2KeyIs(key, key_length, START_TIME_KEY)) {
+        ok = Stream2ReadTime(reader, msg.start_time);
+      } else if (Stream2KeyIs(key, key_length, STOP_TIME_KEY)) {
+        ok = Stream2ReadTime(reader, msg.stop_time);
+      } else if (Stream2KeyIs(key, key_length, REAL_TIME_KEY)) {
+        ok = Stream2ReadTime(reader, msg.real_time);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_DATA_KEY)) {
+        // Map of channel name to image; only the first channel is decoded
+        CborItem channels;
+        ok = reader.next(channels) && channels.major == CBOR_MAP;
+        for (uint64_t c = 0; ok && c < channels.value; c++) {
+          ok = reader.skip();  // Channel name
+          if (ok && c == 0) {
+            ok = Stream2ReadChannel(reader, msg);
+          } else if (ok) {
+            ok = reader.skip();
+          }
+        }
+      } else {
+        ok = reader.skip();
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    return msg.type != STREAM2_UNKNOWN;
+  }
+
+  /**
+   * Names of stream2 start entries that have a different name in the legacy
+   * global header config, which is what the processors and meta writer read.
+   */
+  typedef struct
+  {
+    const char* stream2;
+    const char* legacy;
+  } Stream2ConfigRename;
+
+  static const Stream2ConfigRename STREAM2_CONFIG_NAMES[] = {
+    {"incident_wavelength", "wavelength"},
+    {"incident_energy", "photon_energy"},
+    {"pixel_size_x", "x_pixel_size"},
+    {"pixel_size_y", "y_pixel_size"},
+    {"image_size_x", "x_pixels_in_detector"},
+    {"image_size_y", "y_pixels_in_detector"},
+    {"saturation_value", "countrate_correction_count_cutoff"},
+    {"detector_description", "description"},
+    {"detector_serial_number", "detector_number"},
+    {"number_of_images", "nimages"},
+    {"number_of_triggers", "ntrigger"},
+    {"countrate_correction_enabled", "countrate_correction_applied"},
+    {"flatfield_enabled", "flatfield_correction_applied"},
+    {"pixel_mask_enabled", "pixel_mask_applied"},
+    {"virtual_pixel_interpolation_enabled", "virtual_pixel_correction_applied"}
+  };
+
+  enum Stream2ValueType { STREAM2_VALUE_NUMBER, STREAM2_VALUE_BOOL, STREAM2_VALUE_TEXT, STREAM2_VALUE_ARRAY };
+
+  /**
+   * A scalar, text or array of numbers entry of a stream2 start message,
+   * under its legacy global header config name
+   */
+  typedef struct
+  {
+    std::string key;
+    Stream2ValueType type;
+    bool integer;                 // All the numbers are integers
+    std::vector<double> numbers;  // One value unless the entry is an array
+    std::string text;
+    bool flag;
+  } Stream2ConfigEntry;
+
+  /**
+   * Summary of a stream2 start message.
+   *
+   * The arrays point into the original buffer and have no data if they were
+   * not sent; only the first channel of each is kept, as for images.
+   */
+  typedef struct
+  {
+    uint64_t series_id;
+    std::vector<Stream2ConfigEntry> config;
+    Stream2Message flatfield;
+    Stream2Message pixel_mask;
+    Stream2Message countrate;
+  } Stream2Start;
+
+  /**
+   * Give the legacy global header config name for a stream2 start entry
+   */
+  inline std::string Stream2ConfigName(const char* key, size_t length)
+  {
+    for (size_t i = 0; i < sizeof(STREAM2_CONFIG_NAMES) / sizeof(STREAM2_CONFIG_NAMES[0]); i++) {
+      if (Stream2KeyIs(key, length, STREAM2_CONFIG_NAMES[i].stream2)) {
+        return STREAM2_CONFIG_NAMES[i].legacy;
+      }
+    }
+    return std::string(key, length);
+  }
+
+  /**
+   * Read a scalar, text or array of numbers as a config entry.
+   *
+   * A map (e.g. threshold_energy, by threshold) gives the value of its first
+   * entry, as the legacy config holds a single value. Other values are skipped.
+   *
+   * \param[in,out] reader Positioned at the value
+   * \param[out] entry The entry, with the key left unset
+   * \param[out] kept Whether the value could be held in a config entry
+   * \return false if the buffer is truncated or malformed
+   */
+  inline bool Stream2ReadConfigValue(CborReader& reader, Stream2ConfigEntry& entry, bool& kept)
+  {
+    kept = false;
+    entry.integer = false;
+    entry.flag = false;
+    CborReader peek = reader;
+    CborItem item;
+    if (!peek.next(item)) {
+      return false;
+    }
+    if (item.major == CBOR_TEXT) {
+      reader.next(item);
+      entry.type = STREAM2_VALUE_TEXT;
+      entry.text.assign(reinterpret_cast<const char*>(item.data), item.length);
+      kept = true;
+      return true;
+    }
+    if (item.major == CBOR_SIMPLE && (item.info == 20 || item.info == 21)) {
+      reader.next(item);
+      entry.type = STREAM2_VALUE_BOOL;
+      entry.flag = item.info == 21;
+      kept = true;
+      return true;
+    }
+    if (item.major == CBOR_MAP && item.value > 0) {
+      reader.next(item);
+      bool ok = reader.skip() && Stream2ReadConfigValue(reader, entry, kept);
+      for (uint64_t i = 1; ok && i < item.value; i++) {
+        ok = reader.skip() && reader.skip();
+      }
+      kept = kept && entry.type != STREAM2_VALUE_ARRAY;
+      return ok;
+    }
+    entry.integer = true;
+    entry.numbers.clear();
+    uint64_t count = 1;
+    if (item.major == CBOR_ARRAY) {
+      reader.next(item);
+      entry.type = STREAM2_VALUE_ARRAY;
+      count = item.value;
+    } else {
+      entry.type = STREAM2_VALUE_NUMBER;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      peek = reader;
+      double value;
+      if (peek.read_double(value)) {
+        reader.next(item);
+        entry.integer = entry.integer && item.major != CBOR_SIMPLE;
+        entry.numbers.push_back(value);
+      } else if (!reader.skip()) {
+        return false;
+      } else {
+        // Not an array of numbers, so not kept, but the rest of the entries are still read
+        entry.numbers.clear();
+        for (i++; i < count; i++) {
+          if (!reader.skip()) {
+            return false;
+          }
+        }
+        return true;
+      }
+    }
+    kept = true;
+    return true;
+  }
+
+  /**
+   * Read a flatfield, pixel mask or countrate table from a stream2 start message.
+   *
+   * These are a map of channel to multi-dimensional array, of which the first
+   * channel is kept, or a bare typed array, which is given the shape [n, 1].
+   *
+   * \param[in,out] reader Positioned at the value
+   * \param[out] array The first array found
+   * \return false if the buffer is truncated or malformed
+   */
+  inline bool Stream2ReadStartArray(CborReader& reader, Stream2Message& array)
+  {
+    CborReader peek = reader;
+    CborItem item;
+    uint64_t tag;
+    if (!peek.next_untagged(item, tag)) {
+      return false;
+    }
+    if (item.major == CBOR_MAP) {
+      reader.next(item);
+      bool ok = true;
+      for (uint64_t c = 0; ok && c < item.value; c++) {
+        ok = reader.skip();  // Channel name
+        if (ok && c == 0) {
+          ok = Stream2ReadStartArray(reader, array);
+        } else if (ok) {
+          ok = reader.skip();
+        }
+      }
+      return ok;
+    }
+    if (tag == CBOR_TAG_MULTI_DIM_ARRAY) {
+      return Stream2ReadChannel(reader, array);
+    }
+    if (item.major == CBOR_BYTES && Stream2TypedArray(tag, array.data_type, array.element_size)) {
+      reader = peek;
+      array.data = item.data;
+      array.data_size = item.length;
+      array.shape[0] = static_cast<uint32_t>(item.length / array.element_size);
+      array.shape[1] = 1;
+      return true;
+    }
+    return reader.skip();
+  }
+
+  /**
+   * Decode a stream2 start message in place.
+   *
+   * Scalar, text and numeric array entries are kept as config under their
+   * legacy names, the detector distance is taken from the detector
+   * translation if not given, and the flatfield, pixel mask and countrate
+   * table are located. Other entries are skipped.
+   *
+   * \param[in] data The CBOR message
+   * \param[in] size Size of the message in bytes
+   * \param[out] start The decoded start message
+   * \return false if the message is not a start message or could not be decoded
+   */
+  inline bool ParseStream2Start(const void* data, size_t size, Stream2Start& start)
+  {
+    Stream2Message* arrays[] = {&start.flatfield, &start.pixel_mask, &start.countrate};
+    for (size_t i = 0; i < 3; i++) {
+      memset(arrays[i], 0, sizeof(Stream2Message));
+      arrays[i]->compression = "";
+      arrays[i]->data_type = "";
+    }
+    start.series_id = 0;
+    start.config.clear();
+
+    CborReader reader(data, size);
+    CborItem item;
+    uint64_t tag;
+    if (!reader.next_untagged(item, tag) || item.major != CBOR_MAP) {
+      return false;
+    }
+
+    bool is_start = false;
+    bool have_distance = false;
+    const Stream2ConfigEntry* translation = NULL;
+    uint64_t entries = item.value;
+    for (uint64_t i = 0; i < entries; i++) {
+      const char* key;
+      size_t key_length;
+      if (!reader.read_text(key, key_length)) {
+        return false;
+      }
+      bool ok = true;
+      if (Stream2KeyIs(key, key_length, STREAM2_TYPE_KEY)) {
+        const char* type;
+        size_t type_length;
+        ok = reader.read_text(type, type_length);
+        is_start = ok && Stream2KeyIs(type, type_length, STREAM2_START_TYPE);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_SERIES_ID_KEY)) {
+        ok = reader.read_uint(start.series_id);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_FLATFIELD_KEY)) {
+        ok = Stream2ReadStartArray(reader, start.flatfield);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_PIXEL_MASK_KEY)) {
+        ok = Stream2ReadStartArray(reader, start.pixel_mask);
+      } else if (Stream2KeyIs(key, key_length, STREAM2_COUNTRATE_KEY)) {
+        ok = Stream2ReadStartArray(reader, start.countrate);
+      } else {
+        Stream2ConfigEntry entry;
+        bool kept;
+        ok = Stream2ReadConfigValue(reader, entry, kept);
+        if (ok && kept) {
+          entry.key = Stream2ConfigName(key, key_length);
+          have_distance = have_distance || entry.key == "detector_distance";
+          start.config.push_back(entry);
+        }
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+
+    for (size_t i = 0; i < start.config.size(); i++) {
+      if (start.config[i].key == STREAM2_DETECTOR_TRANSLATION_KEY) {
+        translation = &start.config[i];
+      }
+    }
+    if (!have_distance && translation && translation->type == STREAM2_VALUE_ARRAY && translation->numbers.size() == 3) {
+      Stream2ConfigEntry distance = *translation;
+      distance.key = "detector_distance";
+      distance.type = STREAM2_VALUE_NUMBER;
+      distance.numbers.assign(1, translation->numbers[2]);
+      start.config.push_back(distance);
+    }
+    return is_start;
+  }
+
+  /**
+   * Build the legacy style encoding string for a stream2 image
+   *
+   * \param[in] msg The decoded message
+   * \return Encoding of the form "[bs<BIT>][[-]lz4][<|>]"
+   */
+  inline std::string Stream2Encoding(const Stream2Message& msg)
+  {
+    std::string encoding;
+    if (STREAM2_COMPRESSION_BSLZ4.compare(msg.compression) == 0) {
+      encoding = "bs" + std::to_string(msg.element_size * 8) + "-lz4<";
+    } else if (STREAM2_COMPRESSION_LZ4.compare(msg.compression) == 0) {
+      encoding = "lz4<";
+    } else {
+      encoding = "<";
+    }
+    return encoding;
+  }
+
+}
+
+#endif /* INCLUDE_STREAM2CBOR_H_ */
@@ -5,8 +5,12 @@
 #ifndef EIGERDAQ_EIGERFAN_H
 #define EIGERDAQ_EIGERFAN_H
 
+#ifndef RAPIDJSON_HAS_STDSTRING
 #define RAPIDJSON_HAS_STDSTRING 1
+#endif
 
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <log4cxx/logger.h>
@@ -17,43 +21,120 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include "boost/date_time/posix_time/posix_time.hpp"
 
 #include "EigerFanConfig.h"
 #include "EigerDefinitions.h"
+#include "FanCoordinator.h"
+#include "FrameCompressor.h"
 #include "MultiPullBroker.h"
+#include "OverflowStore.h"
+#include "SendBudget.h"
+#include "SharedFrameWriter.h"
+#include "ThreadTuning.h"
+#include "UringZmtpIngest.h"
 
 
+int GetConsumerIndexForFrame(
+  uint64_t frame,
+  int offset,
+  int block_size,
+  int num_consumers,
+  int upstream_block_size = 1,
+  int upstream_consumers = 0
+);
+
+int GetConsumerIndexForPhase(
+  uint64_t frame,
+  int offset,
+  int block_size,
+  int num_consumers,
+  int phase_period
+);
+
 class EigerFan {
 
   typedef struct
   {
     int connected;
     boost::shared_ptr<zmq::socket_t> sendSocket;
+    boost::shared_ptr<zmq::socket_t> laneSocket;  // Set if headers and ends are sent through a control lane
+    boost::shared_ptr<SharedFrameWriter> sharedWriter;  // Set if the consumer is on this host
+    boost::shared_ptr<OverflowStore> overflow;  // Set if sending without blocking
+    bool overflowing;  // True if the message being sent is going to the overflow store
+    bool midMessage;  // True if more parts of the message being sent are to come
   } EigerConsumer;
 
+  typedef struct
+  {
+    boost::shared_ptr<zmq::message_t> message;
+    boost::shared_ptr<MultipartMessage> parts;
+  } HeldMessage;
+
+  typedef struct
+  {
+    std::string acquisitionID;
+    bool hasOffset;
+    int offset;
+    int blockSize;  // 0 to keep the current block size
+  } QueuedAcquisition;
+
 public:
   EigerFan();
   EigerFan(EigerFanConfig config_);
   virtual ~EigerFan();
   void run();
-  void HandleRxSocket(std::string& endpoint, int num_zmq_context_threads);
+  void HandleRxSocket(std::string& endpoint);
   void Stop();
   void SetNumberOfConsumers(int number);
 
 protected:
-  void HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<zmq::socket_t> socket);
-  void HandleGlobalHeaderMessage(boost::shared_ptr<zmq::socket_t> socket);
-  void HandleImageDataMessage(boost::shared_ptr<zmq::socket_t> socket, uint64_t frame_number);
-  void HandleEndOfSeriesMessage(boost::shared_ptr<zmq::socket_t> socket);
+  void DispatchStreamMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts);
+  void HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts);
+  void HandleStream2Message(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts);
+  void DiscardRemainingMessageParts(boost::shared_ptr<MultipartMessage> parts);
+  void StartAcquisition();
+  void EndAcquisition();
+  bool ParseQueuedAcquisitions(rapidjson::Value &value, std::vector<QueuedAcquisition> &entries);
+  int GetConsumerIndex(uint64_t frame);
+  int GetBlockSize();
+  void SetBlockSize(int blockSize);
+  void RecordFrameSent(uint64_t frame);
+  void LogSeriesSummary();
+  void HandleGlobalHeaderMessage(boost::shared_ptr<MultipartMessage> parts);
+  bool HandleImageDataMessage(boost::shared_ptr<MultipartMessage> parts, uint64_t frame_number);
+  bool CompressImage(zmq::message_t &messagePart2, zmq::message_t &messagePart3);
+  void HandleEndOfSeriesMessage(boost::shared_ptr<MultipartMessage> parts);
   void WriteMessageToFile(zmq::message_t &message, std::string filename);
   void HandleMonitorMessage(zmq::message_t &message, boost::shared_ptr<zmq::socket_t> socket, int rank);
   void HandleForwardMonitorMessage(zmq::message_t &message, zmq::socket_t &socket);
   void HandleControlMessage(zmq::message_t &message, zmq::message_t &idMessage);
+  void HandleCoordinatorMessages(bool rxIdle);
+  bool CoordinatedSeriesStarted(int series);
+  void HoldMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts);
+  void HoldEndMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts);
+  void ReleaseHeldMessages();
+  void StartCoordinatedSeries();
+  void AdoptCoordinatedSeries(int series, const std::string& acquisitionID, int offset, int blockSize);
+  void SendDrained();
 
   void SendMessageToAllConsumers(zmq::message_t &message, int flags = 0);
   void SendMessagesToAllConsumers(std::vector<zmq::message_t*> &messageLista);
   void SendMessageToSingleConsumer(zmq::message_t &message, int flags = 0);
+  void SendPayloadToSingleConsumer(zmq::message_t &message, int flags = 0);
+  void SendThroughControlLane(std::vector<zmq::message_t*> &messageList);
+  void SendSizeNotice(size_t size);
+  bool SendTracked(zmq::socket_t &socket, size_t destination, zmq::message_t &message, int flags = 0);
+  bool SendToConsumer(int rank, zmq::message_t &message, int flags = 0);
+  void DrainOverflow(int rank);
+  void DrainOverflows();
+  bool ConsumerWritable(int rank);
+  bool OverflowPending();
+  bool AdmitImage(uint64_t bytes);
+  void AttachSharedTransports();
   void SendFabricatedEndMessage();
+  void CheckForStall();
+  void SetSpinCount(unsigned int spinCount);
   std::string AddAcquisitionIDToPart1();
   int GetNumberOfConnectedConsumers();
   bool ExpectedConsumersConnected();
@@ -62,27 +143,59 @@ private:
   log4cxx::LoggerPtr log;
   rapidjson::Document jsonDocument;
   EigerFanConfig config;
+  boost::shared_ptr<SendBudget> sendBudget;  // Outlives the context, which releases messages still queued
   zmq::context_t ctx_;
   zmq::socket_t controlSocket;
   zmq::socket_t forwardSocket;
-  MultiPullBroker broker;
+  MessageQueue rx_queue_;
+  boost::shared_ptr<StreamIngest> broker;
   boost::shared_ptr<boost::thread> rx_thread_;
   std::vector<EigerConsumer> consumers;
+  boost::shared_ptr<FanCoordinatorClient> coordinator;
+  boost::shared_ptr<FrameCompressor> compressor;  // Set if the fan was built with LZ4
+  std::deque<HeldMessage> heldMessages;  // Images received before their series was started
+  std::atomic<size_t> heldMessageCount;  // Size of heldMessages, for the control thread to report
+  HeldMessage heldEndMessage;  // End of series waiting for every instance to drain
+  bool seriesStarted;
+  int drainSeries;  // Series to drain before reporting to the coordinator, -1 if none
+  bool releasingEnd;
 
   bool killRequested;
   Eiger::EigerFanState state;
   int currentSeries;
   int currentConsumerIndexToSendTo;
   std::string configuredAcquisitionID;
+  std::deque<QueuedAcquisition> acquisitionQueue;  // Applied to successive series ahead of the configured acquisition ID
+  boost::mutex acquisitionQueueMutex;
+  boost::mutex blockSizeMutex;  // Guards config.block_size, which the control and rx threads both set
   std::string currentAcquisitionID;
+  std::string upstreamAcquisitionID;
   uint64_t lastFrameSent;
   uint64_t num_frames_sent;
   std::vector<uint64_t> num_frames_consumed;
+  std::vector<uint64_t> phaseFramesSent;  // Frames sent for each phase of the trigger cycle this series
+  boost::mutex phaseMutex;  // Guards phaseFramesSent and config.phase_period, which the status and configure commands use
+  int seriesPhasePeriod;  // Phase period applied to the current series
   int configuredOffset;
   int currentOffset;
+  int seriesBlockSize;  // Block size applied to the current series, 0 between series
   int numConnectedForwardingSockets;
   bool forwardStream;
+  bool forwardCurrentImage;  // False while an image is not forwarded for lack of budget
   bool devShmCache;
+  std::atomic<bool> compressRequested;  // Compression chosen by the control thread, taken up by the rx thread at each series start
+  bool compressImages;  // Compression of the series the rx thread is handling
+  std::atomic<bool> stream2Requested;  // Protocol chosen by the control thread, taken up by the rx thread between series
+  bool stream2Protocol;  // Protocol of the stream the rx thread is handling
+  uint64_t controlLaneSequence;  // Sequence number of the last message sent through the control lane
+  boost::posix_time::ptime seriesStartTime;
+  boost::posix_time::ptime lastStreamMessageTime;
+  bool seriesStalled;  // True once the current series has been ended by the stall watchdog
+  std::atomic<int> stallTimeoutMs;  // Stall watchdog settings, configured by the control thread and read by the rx thread
+  std::atomic<int> stallIntervals;
+  uint64_t stallsDetected;
+  uint64_t lastStallFrame;  // Last frame sent before the most recent stall
+  uint64_t lateMessagesDiscarded;  // Messages of stalled series received after their fabricated end
 };
 
 #endif //EIGERDAQ_EIGERFAN_H
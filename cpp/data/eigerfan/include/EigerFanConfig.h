@@ -8,6 +8,10 @@
 #ifndef EIGERFAN_INCLUDE_EIGERFANCONFIG_H_
 #define EIGERFAN_INCLUDE_EIGERFANCONFIG_H_
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 #include "EigerDefinitions.h"
 
 namespace EigerFanDefaults {
@@ -20,6 +24,14 @@ namespace EigerFanDefaults {
   const int DEFAULT_NUM_CONTEXT_THREADS = 1;
   const int DEFAULT_BLOCK_SIZE = 1;
   const std::string DEFAULT_FORWARD_PORT_NUMBER = "9009";
+  const std::string DEFAULT_STREAM_PROTOCOL = Eiger::STREAM_PROTOCOL_LEGACY;
+  const std::string DEFAULT_INGEST_ENGINE = Eiger::INGEST_ENGINE_ZMQ;
+  const std::string DEFAULT_BUDGET_POLICY = Eiger::BUDGET_POLICY_BLOCK;
+  const int DEFAULT_OVERFLOW_RAM_MB = 1024;
+  const std::string DEFAULT_SPILL_DIR = "/tmp";
+  const std::string DEFAULT_COMPRESSION = Eiger::COMPRESSION_NONE;
+  const int DEFAULT_COMPRESSION_THREADS = 4;
+  const int DEFAULT_STALL_INTERVALS = 100;
 }
 
 class EigerFanConfig
@@ -28,6 +40,8 @@ public:
 
   EigerFanConfig() :
     num_threads(EigerFanDefaults::DEFAULT_NUM_THREADS),
+    min_threads(0),
+    max_threads(0),
     num_consumers(EigerFanDefaults::DEFAULT_NUM_CONSUMERS),
     ctrl_channel_port(EigerFanDefaults::DEFAULT_CONTROL_PORT_NUMBER),
     eiger_channel_address(EigerFanDefaults::DEFAULT_STREAM_ADDRESS),
@@ -35,7 +49,24 @@ public:
     forward_channel_port(EigerFanDefaults::DEFAULT_FORWARD_PORT_NUMBER),
     fan_channel_port_start(EigerFanDefaults::DEFAULT_FAN_PORT_NUMBER_START),
     num_zmq_context_threads(EigerFanDefaults::DEFAULT_NUM_CONTEXT_THREADS),
-    block_size(EigerFanDefaults::DEFAULT_BLOCK_SIZE)
+    block_size(EigerFanDefaults::DEFAULT_BLOCK_SIZE),
+    upstream_consumers(0),
+    upstream_block_size(EigerFanDefaults::DEFAULT_BLOCK_SIZE),
+    stream_protocol(EigerFanDefaults::DEFAULT_STREAM_PROTOCOL),
+    ingest_engine(EigerFanDefaults::DEFAULT_INGEST_ENGINE),
+    memory_budget(0),
+    budget_policy(EigerFanDefaults::DEFAULT_BUDGET_POLICY),
+    nonblocking_send(false),
+    overflow_ram(static_cast<uint64_t>(EigerFanDefaults::DEFAULT_OVERFLOW_RAM_MB) * 1024 * 1024),
+    spill_dir(EigerFanDefaults::DEFAULT_SPILL_DIR),
+    control_lane_port_start(0),
+    compression(EigerFanDefaults::DEFAULT_COMPRESSION),
+    compression_threads(EigerFanDefaults::DEFAULT_COMPRESSION_THREADS),
+    stall_timeout_ms(0),
+    stall_intervals(EigerFanDefaults::DEFAULT_STALL_INTERVALS),
+    spin_count(0),
+    rx_cpu(-1),
+    phase_period(0)
     {
     };
 
@@ -55,6 +86,14 @@ public:
     num_threads = numThreads;
   }
 
+  void setMinThreads(int minThreads) {
+    min_threads = minThreads;
+  }
+
+  void setMaxThreads(int maxThreads) {
+    max_threads = maxThreads;
+  }
+
   void setFanChannelPortStart(int fanChannelPortStart) {
     fan_channel_port_start = fanChannelPortStart;
   }
@@ -67,10 +106,98 @@ public:
     block_size = blockSize;
   }
 
+  void setUpstreamConsumers(int upstreamConsumers) {
+    upstream_consumers = upstreamConsumers;
+  }
+
+  void setUpstreamBlockSize(int upstreamBlockSize) {
+    upstream_block_size = upstreamBlockSize;
+  }
+
   void setEigerChannelPort(const std::string& eigerPort) {
     eiger_channel_port = eigerPort;
   }
 
+  void setStreamProtocol(const std::string& streamProtocol) {
+    stream_protocol = streamProtocol;
+  }
+
+  void setIngestEngine(const std::string& ingestEngine) {
+    ingest_engine = ingestEngine;
+  }
+
+  void setSharedTransports(const std::vector<std::string>& sharedTransports) {
+    shared_transports = sharedTransports;
+  }
+
+  void setCoordinatorEndpoint(const std::string& coordinatorEndpoint) {
+    coordinator_endpoint = coordinatorEndpoint;
+  }
+
+  void setCoordinatorBind(const std::string& coordinatorBind) {
+    coordinator_bind = coordinatorBind;
+  }
+
+  void setInstanceName(const std::string& instanceName) {
+    instance_name = instanceName;
+  }
+
+  void setMemoryBudget(uint64_t memoryBudget) {
+    memory_budget = memoryBudget;
+  }
+
+  void setBudgetPolicy(const std::string& budgetPolicy) {
+    budget_policy = budgetPolicy;
+  }
+
+  void setNonblockingSend(bool nonblockingSend) {
+    nonblocking_send = nonblockingSend;
+  }
+
+  void setOverflowRam(uint64_t overflowRam) {
+    overflow_ram = overflowRam;
+  }
+
+  void setSpillDir(const std::string& spillDir) {
+    spill_dir = spillDir;
+  }
+
+  void setControlLanePortStart(int controlLanePortStart) {
+    control_lane_port_start = controlLanePortStart;
+  }
+
+  void setCompression(const std::string& compression_) {
+    compression = compression_;
+  }
+
+  void setCompressionThreads(int compressionThreads) {
+    compression_threads = compressionThreads;
+  }
+
+  void setStallTimeout(int stallTimeoutMs) {
+    stall_timeout_ms = stallTimeoutMs;
+  }
+
+  void setStallIntervals(int stallIntervals) {
+    stall_intervals = stallIntervals;
+  }
+
+  void setSpinCount(unsigned int spinCount) {
+    spin_count = spinCount;
+  }
+
+  void setRxCpu(int rxCpu) {
+    rx_cpu = rxCpu;
+  }
+
+  void setIngestCpus(const std::vector<int>& ingestCpus) {
+    ingest_cpus = ingestCpus;
+  }
+
+  void setPhasePeriod(int phasePeriod) {
+    phase_period = phasePeriod;
+  }
+
   const std::string& getCtrlChannelPort() const {
     return ctrl_channel_port;
   }
@@ -87,6 +214,14 @@ public:
     return num_threads;
   }
 
+  int getMinThreads() const {
+    return min_threads;
+  }
+
+  int getMaxThreads() const {
+    return max_threads;
+  }
+
   int getFanChannelPortStart() const {
     return fan_channel_port_start;
   }
@@ -99,13 +234,103 @@ public:
     return block_size;
   }
 
+  int getUpstreamConsumers() const {
+    return upstream_consumers;
+  }
+
+  int getUpstreamBlockSize() const {
+    return upstream_block_size;
+  }
+
   const std::string& getEigerChannelPort() const {
     return eiger_channel_port;
   }
 
+  const std::string& getStreamProtocol() const {
+    return stream_protocol;
+  }
+
+  const std::string& getIngestEngine() const {
+    return ingest_engine;
+  }
+
+  const std::vector<std::string>& getSharedTransports() const {
+    return shared_transports;
+  }
+
+  const std::string& getCoordinatorEndpoint() const {
+    return coordinator_endpoint;
+  }
+
+  const std::string& getCoordinatorBind() const {
+    return coordinator_bind;
+  }
+
+  const std::string& getInstanceName() const {
+    return instance_name;
+  }
+
+  uint64_t getMemoryBudget() const {
+    return memory_budget;
+  }
+
+  const std::string& getBudgetPolicy() const {
+    return budget_policy;
+  }
+
+  bool getNonblockingSend() const {
+    return nonblocking_send;
+  }
+
+  uint64_t getOverflowRam() const {
+    return overflow_ram;
+  }
+
+  const std::string& getSpillDir() const {
+    return spill_dir;
+  }
+
+  int getControlLanePortStart() const {
+    return control_lane_port_start;
+  }
+
+  const std::string& getCompression() const {
+    return compression;
+  }
+
+  int getCompressionThreads() const {
+    return compression_threads;
+  }
+
+  int getStallTimeout() const {
+    return stall_timeout_ms;
+  }
+
+  int getStallIntervals() const {
+    return stall_intervals;
+  }
+
+  unsigned int getSpinCount() const {
+    return spin_count;
+  }
+
+  int getRxCpu() const {
+    return rx_cpu;
+  }
+
+  const std::vector<int>& getIngestCpus() const {
+    return ingest_cpus;
+  }
+
+  int getPhasePeriod() const {
+    return phase_period;
+  }
+
 private:
 
   int                   num_threads;    // Number of 0MQ threads
+  int                   min_threads;    // Minimum number of 0MQ threads when resizing (0 for num_threads)
+  int                   max_threads;    // Maximum number of 0MQ threads when resizing (0 for num_threads)
   int                   num_consumers;    // Expected number of consumers
   std::string           ctrl_channel_port;  // Port to bind to for the control channel
   std::string           eiger_channel_address;  // Address to connect to for the Eiger Stream
@@ -114,6 +339,28 @@ private:
   int                   fan_channel_port_start;  // Port to bind to for the fan channel
   int                   num_zmq_context_threads;    // Number of 0MQ context threads
   int                   block_size;    // Block Size being used by the downstream data file writers
+  int                   upstream_consumers;    // Number of consumers of the upstream EigerFan (0 if connected to the detector)
+  int                   upstream_block_size;    // Block size used by the upstream EigerFan
+  std::string           stream_protocol;  // Detector stream protocol (legacy or stream2)
+  std::string           ingest_engine;  // Engine receiving the detector stream (zmq or io_uring)
+  std::vector<std::string> shared_transports;  // Shared transport per rank for co-located consumers (empty for TCP)
+  std::string           coordinator_endpoint;  // Coordinator of instances sharing the detector stream (empty for none)
+  std::string           coordinator_bind;  // Endpoint to run a stand-in coordinator on in this process (empty for none)
+  std::string           instance_name;  // Name of this instance when coordinated
+  uint64_t              memory_budget;  // Bytes the send queues may hold, shared between consumers and forwarding (0 for no limit)
+  std::string           budget_policy;  // What to do with an image over budget (block or drop)
+  bool                  nonblocking_send;  // Store messages for a congested consumer instead of blocking every rank
+  uint64_t              overflow_ram;  // Bytes stored in memory per consumer before spilling to file
+  std::string           spill_dir;  // Directory for the overflow spill files
+  int                   control_lane_port_start;  // Port to bind to for the control lane of the first consumer (0 for no control lane)
+  std::string           compression;  // Compression applied to uncompressed legacy stream images (none or bslz4)
+  int                   compression_threads;  // Number of threads compressing each image
+  int                   stall_timeout_ms;  // Minimum time without messages before a series is treated as stalled (0 to disable)
+  int                   stall_intervals;  // Mean frame intervals without messages before a series is treated as stalled
+  unsigned int          spin_count;  // Non-blocking receives the rx path tries before blocking (0 to block straight away)
+  int                   rx_cpu;  // CPU to pin the rx thread to (-1 for none)
+  std::vector<int>      ingest_cpus;  // CPUs to pin the ingest workers to in turn (empty for none)
+  int                   phase_period;  // Frames in each trigger cycle, each phase going to its own group of consumers (0 for no phase routing)
 
   friend class EigerFan;
 };
@@ -0,0 +1,119 @@
+/*
+ * FanCoordinator.h
+ *
+ * Coordination of several EigerFan instances, on different hosts, pulling
+ * from the same detector stream. The detector's PUSH socket spreads messages
+ * over every connected instance, so the global header and end of series
+ * messages each arrive at only one of them. The coordinator shares the
+ * routing table and series details from the header with every instance, and
+ * holds back the end of series until every instance has sent its frames.
+ */
+
+#ifndef FANCOORDINATOR_H
+#define FANCOORDINATOR_H
+
+#ifndef RAPIDJSON_HAS_STDSTRING
+#define RAPIDJSON_HAS_STDSTRING 1
+#endif
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <log4cxx/logger.h>
+#include "rapidjson/document.h"
+#include "zmq/zmq.hpp"
+
+/**
+ * A JSON message between an EigerFan instance and the coordinator
+ */
+class CoordinatorMessage {
+
+public:
+  CoordinatorMessage(const std::string& type);
+
+  void set(const std::string& key, int value);
+  void set(const std::string& key, uint64_t value);
+  void set(const std::string& key, const std::string& value);
+  std::string encode() const;
+
+  static bool parse(zmq::message_t& message, rapidjson::Document& document);
+
+private:
+  rapidjson::Document document_;
+};
+
+/**
+ * Stand-in coordinator, run in one EigerFan process or a test
+ *
+ * Instances connect DEALER sockets to its ROUTER. The first instance to
+ * register sets the routing table every other instance must use.
+ */
+class FanCoordinator {
+
+public:
+  FanCoordinator(const std::string& endpoint);
+  ~FanCoordinator();
+
+  void start();
+  void stop();
+
+private:
+  typedef struct
+  {
+    std::string name;
+    bool drained;
+    uint64_t frames_sent;
+  } Instance;
+
+  log4cxx::LoggerPtr logger_;
+  std::string endpoint_;
+  zmq::context_t ctx_;
+  boost::shared_ptr<boost::thread> thread_;
+  bool stop_requested_;
+
+  std::map<std::string, Instance> instances_;  // By socket identity
+  int num_consumers_;  // Routing table, -1 until the first instance registers
+  int block_size_;
+  bool series_active_;
+  int series_;
+  std::string acquisition_id_;
+  int offset_;
+  int end_series_;  // Series waiting for instances to drain, -1 if none
+  std::string end_holder_;  // Identity of the instance holding the end message
+  boost::posix_time::ptime end_received_;
+
+  void run();
+  void handle_message(zmq::socket_t& socket, const std::string& identity, rapidjson::Document& document);
+  void send(zmq::socket_t& socket, const std::string& identity, const CoordinatorMessage& message);
+  void check_drained(zmq::socket_t& socket);
+};
+
+/**
+ * Connection from an EigerFan instance to the coordinator
+ *
+ * Only used from the EigerFan rx thread.
+ */
+class FanCoordinatorClient {
+
+public:
+  FanCoordinatorClient(zmq::context_t& ctx, const std::string& endpoint, const std::string& name);
+
+  void register_instance(int num_consumers, int block_size);
+  void send_start(int series, const std::string& acquisition_id, int offset, int block_size);
+  void send_end(int series);
+  void send_drained(int series, uint64_t frames_sent);
+  bool receive(rapidjson::Document& document);
+
+private:
+  log4cxx::LoggerPtr logger_;
+  std::string name_;
+  zmq::socket_t socket_;
+
+  void send(const CoordinatorMessage& message);
+};
+
+#endif // FANCOORDINATOR_H
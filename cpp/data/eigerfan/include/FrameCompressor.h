@@ -0,0 +1,87 @@
+/*
+ * FrameCompressor.h
+ *
+ * Bitshuffle/LZ4 compression of uncompressed image blobs in the EigerFan, for
+ * detector modes with compression switched off. The output is the same as the
+ * detector produces for bs<BIT>-lz4 encoding, which is the chunk format of the
+ * HDF5 bitshuffle filter, so the writers handle it as they would a compressed
+ * stream.
+ */
+
+#ifndef FRAMECOMPRESSOR_H
+#define FRAMECOMPRESSOR_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <log4cxx/logger.h>
+#include "zmq/zmq.hpp"
+
+/**
+ * Pool of worker threads compressing one frame at a time
+ *
+ * The bitshuffle blocks of a frame are independent, so each frame is split
+ * into ranges of blocks that are compressed in parallel and joined in order.
+ * Frames are compressed one after another on the calling thread's behalf, so
+ * they are sent in the order they were received.
+ */
+class FrameCompressor {
+
+public:
+  FrameCompressor(size_t num_workers);
+  ~FrameCompressor();
+
+  static bool supported();
+  static size_t block_size(size_t elem_size);
+  static void bitshuffle(const uint8_t* in, uint8_t* out, size_t elements, size_t elem_size);
+
+  bool compress(const zmq::message_t& in, size_t elem_size, zmq::message_t& out);
+
+  uint64_t frames_compressed() const;
+  uint64_t bytes_in() const;
+  uint64_t bytes_out() const;
+
+private:
+  typedef struct
+  {
+    size_t first_element;
+    size_t num_blocks;
+    size_t block_elements;  // Elements in each block of the range
+    std::vector<uint8_t> shuffled;  // One block after bitshuffling
+    std::vector<uint8_t> output;
+    size_t output_size;
+    bool ok;
+  } Range;
+
+  log4cxx::LoggerPtr logger_;
+  boost::thread_group workers_;
+  boost::mutex mutex_;
+  boost::condition_variable work_ready_;
+  boost::condition_variable work_done_;
+  bool stop_;
+  size_t num_workers_;
+  size_t next_range_;
+  size_t ranges_done_;
+
+  // The frame being compressed
+  const uint8_t* input_;
+  size_t elem_size_;
+  std::vector<Range> ranges_;
+  size_t num_ranges_;  // Ranges of the frame being compressed, ranges_ is kept to reuse its buffers
+
+  std::atomic<uint64_t> frames_compressed_;
+  std::atomic<uint64_t> bytes_in_;
+  std::atomic<uint64_t> bytes_out_;
+
+  void worker_loop();
+  void compress_range(Range& range);
+
+  FrameCompressor(const FrameCompressor&);
+  FrameCompressor& operator=(const FrameCompressor&);
+};
+
+#endif // FRAMECOMPRESSOR_H
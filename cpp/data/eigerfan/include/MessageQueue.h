@@ -0,0 +1,120 @@
+/*
+ * MessageQueue.h
+ *
+ * Handoff of complete multipart messages from the ingest engines to the
+ * EigerFan rx thread.
+ */
+
+#ifndef MESSAGEQUEUE_H
+#define MESSAGEQUEUE_H
+
+#include <atomic>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "zmq/zmq.hpp"
+
+/**
+ * A complete multipart message received from the detector
+ *
+ * Parts are read back in order with the same recv / more pattern used on a
+ * zmq socket, so the stream handlers can consume either.
+ */
+class MultipartMessage {
+
+public:
+  MultipartMessage() : next_(0), bytes_(0) {}
+
+  void add(boost::shared_ptr<zmq::message_t> part) {
+    bytes_ += part->size();
+    parts_.push_back(part);
+  }
+
+  /**
+   * Move the next part of the message into part
+   *
+   * \param[out] part Message to move the next part into
+   * \return false if there are no more parts
+   */
+  bool recv(zmq::message_t* part) {
+    if (next_ >= parts_.size()) {
+      return false;
+    }
+    part->move(parts_[next_].get());
+    parts_[next_++].reset();
+    return true;
+  }
+
+  /** Return 1 if there are more parts to receive, as for ZMQ_RCVMORE */
+  int more() const {
+    return next_ < parts_.size() ? 1 : 0;
+  }
+
+  size_t size() const {
+    return parts_.size();
+  }
+
+  uint64_t bytes() const {
+    return bytes_;
+  }
+
+private:
+  std::vector<boost::shared_ptr<zmq::message_t> > parts_;
+  size_t next_;
+  uint64_t bytes_;
+};
+
+/**
+ * Bounded lock-free multi-producer single-consumer queue of multipart messages
+ *
+ * Each ingest thread pushes complete messages and the rx thread pops them, so
+ * the parts never go back through a zmq pipe. The consumer blocks on an
+ * eventfd when the queue is empty, which producers only signal when the
+ * consumer is actually waiting. The consumer can be set to spin for a bounded
+ * number of attempts first, trading a CPU for the latency of the wakeup.
+ */
+class MessageQueue {
+
+public:
+  MessageQueue(size_t capacity);
+  ~MessageQueue();
+
+  bool try_push(MultipartMessage* message);
+  bool push(MultipartMessage* message, int timeout_ms);
+  MultipartMessage* try_pop();
+  MultipartMessage* pop(int timeout_ms);
+  void set_spin(unsigned spin_count);
+
+  size_t capacity() const;
+  size_t depth() const;
+  size_t max_depth() const;
+  void reset_max_depth();
+  uint64_t spin_hits() const;
+  uint64_t wakeups() const;
+
+private:
+  typedef struct
+  {
+    std::atomic<size_t> sequence;
+    MultipartMessage* message;
+  } Cell;
+
+  Cell* cells_;
+  size_t mask_;
+  int event_fd_;
+
+  // Keep producer and consumer positions on separate cache lines
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+  std::atomic<bool> consumer_waiting_;
+  std::atomic<size_t> max_depth_;
+  std::atomic<unsigned> spin_count_;  // Attempts to pop before blocking on the eventfd
+  std::atomic<uint64_t> spin_hits_;  // Messages popped while spinning
+  std::atomic<uint64_t> wakeups_;  // Messages popped after blocking on the eventfd
+
+  MessageQueue(const MessageQueue&);
+  MessageQueue& operator=(const MessageQueue&);
+};
+
+#endif // MESSAGEQUEUE_H
@@ -16,34 +16,70 @@
 #include <log4cxx/logger.h>
 #include "zmq/zmq.hpp"
 
-class MultiPullBroker {
+#include "StreamIngest.h"
+
+class MultiPullBroker : public StreamIngest {
 
 public:
-  MultiPullBroker(
-    std::string& sink_endpoint,
-    int thread_count
-  );
+  MultiPullBroker(int thread_count);
   ~MultiPullBroker();
 
-  void connect(std::string& endpoint, void* inproc_context);
+  void connect(std::string& endpoint, MessageQueue* queue);
   void start_message_counter();
   uint64_t messages_received();
+  uint64_t bytes_received();
+  int worker_count();
+  bool set_thread_bounds(int min_threads, int max_threads);
+  bool set_spin(unsigned spin_count);
+  bool set_cpus(const std::vector<int>& cpus);
+  uint64_t spin_hits();
+  uint64_t wakeups();
   void shutdown();
 
 protected:
 
 private:
+  typedef struct
+  {
+    boost::shared_ptr<boost::thread> thread;
+    std::atomic<bool> stop_requested;
+    std::atomic<bool> finished;
+    std::atomic<std::uint64_t> bytes_received;
+    std::atomic<std::uint64_t> poll_us;  // Time spent waiting for messages
+    std::atomic<std::uint64_t> spin_hits;  // Parts received while spinning
+    std::atomic<std::uint64_t> wakeups;  // Parts received after blocking in poll
+    int cpu;  // CPU the worker is pinned to, -1 for none
+    uint64_t last_bytes_received;
+    uint64_t last_poll_us;
+  } Worker;
+
   log4cxx::LoggerPtr logger_;
 
-  std::vector<boost::shared_ptr<boost::thread> > worker_threads_;
+  std::vector<boost::shared_ptr<Worker> > workers_;
+  std::vector<boost::shared_ptr<Worker> > retired_workers_;
+  boost::shared_ptr<boost::thread> supervisor_thread_;
+  boost::mutex workers_mutex_;
   std::string source_endpoint_;
-  std::string sink_endpoint_;
-  zmq::context_t* inproc_context_;
+  MessageQueue* queue_;
   int thread_count_;
+  std::atomic<int> min_threads_;
+  std::atomic<int> max_threads_;
+  std::atomic<int> active_workers_;
   std::atomic<std::uint64_t> messages_received_;
+  std::atomic<std::uint64_t> retired_bytes_received_;
+  std::atomic<std::uint64_t> retired_spin_hits_;
+  std::atomic<std::uint64_t> retired_wakeups_;
+  std::atomic<unsigned> spin_count_;
+  std::vector<int> cpus_;
+  size_t next_cpu_;
+  int shrink_intervals_;
   bool shutdown_requested_;
 
-  void worker_loop(std::string& endpoint);
+  void worker_loop(std::string& endpoint, boost::shared_ptr<Worker> worker);
+  void supervisor_loop();
+  void adapt_workers(double interval_s);
+  void start_worker();
+  void retire_worker();
 
 };
 
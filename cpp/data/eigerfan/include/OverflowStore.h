@@ -0,0 +1,70 @@
+/*
+ * OverflowStore.h
+ *
+ * Per consumer store for messages that could not be sent without blocking.
+ * Messages are kept in memory up to a limit and then spilled to a local file,
+ * and are taken back out in the order they were stored.
+ */
+
+#ifndef OVERFLOWSTORE_H
+#define OVERFLOWSTORE_H
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <log4cxx/logger.h>
+
+#include "zmq/zmq.hpp"
+
+typedef std::vector<boost::shared_ptr<zmq::message_t> > OverflowMessage;
+
+/**
+ * FIFO of multipart messages, in memory first and then in a spill file
+ *
+ * Once anything has been spilled, later messages are spilled too until the
+ * spill file has been read back, so every message in memory is older than
+ * every message in the file.
+ */
+class OverflowStore {
+
+public:
+  OverflowStore(const std::string& spill_path, uint64_t ram_limit);
+  ~OverflowStore();
+
+  void append(zmq::message_t& part, bool more);
+  bool empty() const;
+  OverflowMessage& front();
+  void pop_front();
+
+  size_t depth() const;
+  uint64_t ram_bytes() const;
+  size_t spill_depth() const;
+  uint64_t spilled_messages() const;
+  uint64_t spilled_bytes() const;
+
+private:
+  log4cxx::LoggerPtr logger_;
+  std::string spill_path_;
+  uint64_t ram_limit_;
+  OverflowMessage current_;  // Message being appended, until its last part
+  std::deque<OverflowMessage> ram_;
+  uint64_t ram_bytes_;
+  int spill_fd_;
+  off_t spill_write_offset_;
+  off_t spill_read_offset_;
+  size_t spill_depth_;  // Messages in the spill file not yet read back
+  OverflowMessage spill_front_;  // Message read back from the spill file
+  uint64_t spilled_messages_;
+  uint64_t spilled_bytes_;
+
+  bool spill(const OverflowMessage& message);
+  bool read_spilled(OverflowMessage& message);
+
+  OverflowStore(const OverflowStore&);
+  OverflowStore& operator=(const OverflowStore&);
+};
+
+#endif // OVERFLOWSTORE_H
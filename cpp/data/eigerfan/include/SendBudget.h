@@ -0,0 +1,72 @@
+/*
+ * SendBudget.h
+ *
+ * Accounting of the bytes held in 0MQ send queues by the EigerFan. The send
+ * high water marks are counted in messages, so with large frames they do not
+ * bound memory. Each message sent is handed to 0MQ without copying, with a
+ * free function that gives its bytes back when 0MQ has finished with it.
+ */
+
+#ifndef SENDBUDGET_H
+#define SENDBUDGET_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+#include <boost/thread.hpp>
+
+#include "zmq/zmq.hpp"
+
+/**
+ * Memory budget shared equally between a number of send destinations
+ *
+ * Each destination (a consumer rank or the forwarding socket) may hold up to
+ * its share of the budget, so one stalled consumer cannot use the budget of
+ * the others.
+ */
+class SendBudget {
+
+public:
+  SendBudget(uint64_t budget_bytes, size_t num_destinations);
+
+  void track(zmq::message_t& message, size_t destination);
+  bool send(zmq::socket_t& socket, zmq::message_t& message, size_t destination, int flags = 0);
+  bool has_space(size_t destination, uint64_t bytes) const;
+  bool wait_for_space(size_t destination, uint64_t bytes, int timeout_ms);
+  void record_drop(size_t destination, uint64_t bytes);
+  void reset_peaks();
+
+  uint64_t budget() const;
+  uint64_t share() const;
+  uint64_t queued_bytes(size_t destination) const;
+  uint64_t peak_queued_bytes(size_t destination) const;
+  uint64_t dropped_frames(size_t destination) const;
+  uint64_t dropped_bytes(size_t destination) const;
+
+private:
+  typedef struct
+  {
+    std::atomic<uint64_t> queued;  // Released by the 0MQ I/O threads
+    std::atomic<uint64_t> peak;
+    uint64_t dropped_frames;
+    uint64_t dropped_bytes;
+  } Destination;
+
+  uint64_t budget_;
+  uint64_t share_;
+  size_t num_destinations_;
+  std::unique_ptr<Destination[]> destinations_;
+  boost::mutex mutex_;
+  boost::condition_variable released_;
+
+  struct TrackedMessage;
+
+  TrackedMessage* track_message(zmq::message_t& message, size_t destination);
+  static void release(void* data, void* hint);
+
+  SendBudget(const SendBudget&);
+  SendBudget& operator=(const SendBudget&);
+};
+
+#endif // SENDBUDGET_H
@@ -0,0 +1,55 @@
+/*
+ * SharedFrameWriter.h
+ *
+ * Fan side of the same-host shared memory transport to a FrameReceiver.
+ */
+
+#ifndef SHAREDFRAMEWRITER_H
+#define SHAREDFRAMEWRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+#include <log4cxx/logger.h>
+
+#include "SharedFrameTransport.h"
+
+/**
+ * Writes image payloads into buffers lent by a co-located FrameReceiver
+ *
+ * The control segment is created by the EigerFrameDecoder, so attaching is
+ * retried until the decoder has created it and located its frame pool.
+ */
+class SharedFrameWriter {
+
+public:
+  SharedFrameWriter(const std::string& transport_name);
+  ~SharedFrameWriter();
+
+  bool attach();
+  void detach();
+  bool attached() const;
+  bool write(const void* data, size_t size, Eiger::SharedFrameDescriptor& descriptor);
+
+  const std::string& name() const;
+  uint64_t frames_written() const;
+  uint64_t frames_unavailable() const;
+  uint64_t buffers_rejected() const;
+
+private:
+  log4cxx::LoggerPtr logger_;
+  std::string transport_name_;
+  Eiger::SharedTransportControl* control_;
+  ino_t attached_ino_;  // Identifies the control segment currently mapped
+  char* pool_;
+  size_t pool_size_;
+  uint64_t frames_written_;
+  uint64_t frames_unavailable_;  // Payloads sent over TCP because no buffer was lent
+  uint64_t buffers_rejected_;  // Lent buffers left in the ring as they lie outside the mapped pool
+
+  SharedFrameWriter(const SharedFrameWriter&);
+  SharedFrameWriter& operator=(const SharedFrameWriter&);
+};
+
+#endif // SHAREDFRAMEWRITER_H
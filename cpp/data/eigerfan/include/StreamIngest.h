@@ -0,0 +1,66 @@
+/*
+ * StreamIngest.h
+ *
+ * Interface for the engines that receive the detector stream and pass
+ * complete multipart messages on to the EigerFan.
+ */
+
+#ifndef STREAMINGEST_H
+#define STREAMINGEST_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "MessageQueue.h"
+
+class StreamIngest {
+
+public:
+  virtual ~StreamIngest() {}
+
+  /**
+   * Connect to the detector stream and start pushing complete messages onto the queue
+   *
+   * \param[in] endpoint Endpoint of the detector stream
+   * \param[in] queue Queue to hand complete multipart messages to the fan through
+   */
+  virtual void connect(std::string& endpoint, MessageQueue* queue) = 0;
+  virtual void start_message_counter() = 0;
+  virtual uint64_t messages_received() = 0;
+  virtual uint64_t bytes_received() = 0;
+  virtual int worker_count() = 0;
+
+  /**
+   * Set the bounds the engine may resize its worker pool within
+   *
+   * \param[in] min_threads Minimum number of workers
+   * \param[in] max_threads Maximum number of workers
+   * \return false if the engine cannot resize or the bounds are invalid
+   */
+  virtual bool set_thread_bounds(int /* min_threads */, int /* max_threads */) { return false; }
+
+  /**
+   * Set the number of non-blocking receives to try before blocking
+   *
+   * \param[in] spin_count Receives to try before blocking (0 to block straight away)
+   * \return false if the engine does not busy-poll
+   */
+  virtual bool set_spin(unsigned /* spin_count */) { return false; }
+
+  /**
+   * Set the CPUs to pin workers to, in turn
+   *
+   * \param[in] cpus The CPUs (empty to leave workers unpinned)
+   * \return false if the engine cannot pin its workers
+   */
+  virtual bool set_cpus(const std::vector<int>& /* cpus */) { return false; }
+
+  /** Return the number of messages received while spinning */
+  virtual uint64_t spin_hits() { return 0; }
+  /** Return the number of messages received after blocking */
+  virtual uint64_t wakeups() { return 0; }
+  virtual void shutdown() = 0;
+};
+
+#endif // STREAMINGEST_H
@@ -0,0 +1,41 @@
+/*
+ * ThreadTuning.h
+ *
+ * Helpers for the low latency rx path: pinning threads to CPUs and pausing
+ * inside busy-poll loops.
+ */
+
+#ifndef THREADTUNING_H
+#define THREADTUNING_H
+
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * Pin the calling thread to a single CPU
+ *
+ * \param[in] cpu The CPU to run on
+ * \return false if the affinity could not be set
+ */
+inline bool PinCurrentThread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+/**
+ * Tell the CPU the thread is spinning, so it yields to a sibling hyperthread
+ */
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+#endif // THREADTUNING_H
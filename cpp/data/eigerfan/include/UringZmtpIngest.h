@@ -0,0 +1,90 @@
+/*
+ * UringZmtpIngest.h
+ *
+ * Detector stream ingest that speaks ZMTP 3.x over plain TCP using io_uring
+ * instead of libzmq PULL sockets.
+ */
+
+#ifndef URINGZMTPINGEST_H
+#define URINGZMTPINGEST_H
+
+#include <atomic>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <log4cxx/logger.h>
+#include "zmq/zmq.hpp"
+
+#include "StreamIngest.h"
+#include "ZmtpFrameParser.h"
+
+struct io_uring;
+struct io_uring_buf_ring;
+
+/**
+ * Receives the detector stream on a number of TCP connections driven from a
+ * single io_uring.
+ *
+ * Frame headers and small frames are received with multishot receives into a
+ * ring of preallocated provided buffers. When a large frame (the image blob)
+ * starts, the multishot receive is cancelled and the remainder of the frame
+ * is received directly into the zmq::message_t that is passed to the fan, so
+ * the image data is never copied in user space. Complete multipart messages
+ * are pushed onto the fan's MessageQueue.
+ */
+class UringZmtpIngest : public StreamIngest {
+
+public:
+  UringZmtpIngest(int connection_count);
+  ~UringZmtpIngest();
+
+  static bool supported();
+
+  void connect(std::string& endpoint, MessageQueue* queue);
+  void start_message_counter();
+  uint64_t messages_received();
+  uint64_t bytes_received();
+  int worker_count();
+  void shutdown();
+
+private:
+
+  typedef struct
+  {
+    int fd;
+    uint64_t last_attempt_ms;
+    bool multishot_armed;
+    bool direct_receive;
+    ZmtpFrameParser parser;
+    std::vector<boost::shared_ptr<zmq::message_t> > parts;
+  } Connection;
+
+  log4cxx::LoggerPtr logger_;
+
+  boost::shared_ptr<boost::thread> ingest_thread_;
+  MessageQueue* queue_;
+  int connection_count_;
+  std::atomic<std::uint64_t> messages_received_;
+  std::atomic<std::uint64_t> bytes_received_;
+  std::atomic<bool> shutdown_requested_;
+
+  std::vector<Connection> connections_;
+  struct io_uring* ring_;
+  struct io_uring_buf_ring* buffer_ring_;
+  uint8_t* buffers_;
+
+  void ingest_loop(std::string endpoint);
+  bool open_connection(Connection& connection, const std::string& host, const std::string& port);
+  void close_connection(Connection& connection);
+  void arm_multishot(int index);
+  void cancel_multishot(int index);
+  void receive_direct(int index);
+  void handle_completion(uint64_t user_data, int result, uint32_t cqe_flags);
+  void consume(int index, const uint8_t* data, size_t length);
+  void complete_frame(Connection& connection);
+  void reset_frame(Connection& connection);
+};
+
+#endif // URINGZMTPINGEST_H
@@ -0,0 +1,67 @@
+/*
+ * ZmtpFrameParser.h
+ *
+ * Incremental parser for the frames of a ZMTP 3.x connection, used by the
+ * io_uring ingest to turn the bytes received on each connection into frames.
+ */
+
+#ifndef ZMTPFRAMEPARSER_H
+#define ZMTPFRAMEPARSER_H
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "zmq/zmq.hpp"
+
+// ZMTP frame flags
+static const uint8_t ZMTP_MORE = 0x01;
+static const uint8_t ZMTP_LONG = 0x02;
+static const uint8_t ZMTP_COMMAND = 0x04;
+
+/**
+ * Parses ZMTP frames from bytes received in chunks of any size
+ *
+ * The body of a data frame is received into a zmq::message_t of the frame
+ * size, either by the parser or, for large frames, directly by the caller
+ * once the parser has reported the start of the frame.
+ */
+class ZmtpFrameParser {
+
+public:
+  enum Event {
+    PARSE_MORE,            // All the data was consumed without completing a frame
+    PARSE_FRAME_STARTED,   // The size of a frame with a body is known and its body allocated
+    PARSE_FRAME_COMPLETE   // A frame is complete
+  };
+
+  ZmtpFrameParser();
+
+  Event parse(const uint8_t*& data, size_t& length);
+  bool body_received(size_t count);
+  void reset();
+
+  bool idle() const;
+  bool in_body() const;
+  bool command() const;
+  bool more() const;
+  uint64_t size() const;
+  uint64_t remaining() const;
+  uint8_t* body_position() const;
+  boost::shared_ptr<zmq::message_t> body() const;
+  const std::string& command_body() const;
+
+private:
+  enum State { FRAME_FLAGS, FRAME_SIZE, FRAME_BODY };
+
+  State state_;
+  uint8_t flags_;
+  int size_bytes_remaining_;
+  uint64_t size_;
+  uint64_t body_received_;
+  boost::shared_ptr<zmq::message_t> body_;
+  std::string command_;
+};
+
+#endif // ZMTPFRAMEPARSER_H
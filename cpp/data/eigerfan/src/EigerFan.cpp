@@ -5,16 +5,20 @@
  *      Author: Ulrik Pedersen
  */
 
+#include <algorithm>
 #include <fcntl.h> // open, O_CREAT, O_RDWR
 #include <iomanip> // std::setw, std::setfill
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <unistd.h>
 
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include <boost/filesystem.hpp>
 
 #include "EigerFan.h"
+#include "EigerProtocol.h"
+#include "Stream2Cbor.h"
 
 // Utility variables
 int more;
@@ -22,6 +26,9 @@ size_t more_size = sizeof (more);
 
 using namespace Eiger;
 
+static const int RX_QUEUE_TIMEOUT_MS = 100;
+static const size_t MAX_HELD_MESSAGES = 1000;  // Images held waiting for a coordinated series to start
+static const int OVERFLOW_DRAIN_INTERVAL_MS = 1;  // rx queue wait while messages are waiting in overflow stores
 
 /** Log an error with the given message and the current errno
  *
@@ -52,7 +59,6 @@ std::string GetStateString(EigerFanState state) {
   return "UNKNOWN STATE";
 }
 
-static std::string BROKER_INPROC_ENDPOINT = "inproc://broker";
 
 /**
  * Create a string of value padded with zeroes.
@@ -67,6 +73,70 @@ std::string PadInt(int value) {
   return ss.str();
 }
 
+/**
+ * Get the rank of the consumer a frame should be sent to
+ *
+ * Frames are distributed to consumers in blocks of block_size. When this fan
+ * consumes one rank of an upstream fan, it only sees every upstream_consumers'th
+ * upstream block, so the frame is first mapped to its position in the sequence
+ * of frames this rank receives and the sub-blocks are distributed from there.
+ * With equal block sizes this gives the same mapping as a single fan with
+ * upstream_consumers * num_consumers consumers, where this fan's consumer m of
+ * upstream rank r takes the place of rank r + upstream_consumers * m.
+ *
+ * \param[in] frame The frame number
+ * \param[in] offset Offset applied to the frame number
+ * \param[in] block_size Number of consecutive frames sent to each consumer
+ * \param[in] num_consumers Number of consumers
+ * \param[in] upstream_block_size Block size of the upstream fan
+ * \param[in] upstream_consumers Number of consumers of the upstream fan, or 0 if there is none
+ * \return The consumer rank
+ */
+int GetConsumerIndexForFrame(
+  uint64_t frame,
+  int offset,
+  int block_size,
+  int num_consumers,
+  int upstream_block_size,
+  int upstream_consumers
+) {
+  int64_t position = frame + offset;
+  if (upstream_consumers > 0) {
+    int64_t upstream_block = position / upstream_block_size;
+    position = (upstream_block / upstream_consumers) * upstream_block_size + position % upstream_block_size;
+  }
+  return (position / block_size) % num_consumers;
+}
+
+/**
+ * Get the rank of the consumer a frame should be sent to when routing by trigger phase
+ *
+ * For pump-probe, each cycle of phase_period frames holds one frame of each
+ * phase (e.g. pumped and unpumped). The consumers are split into phase_period
+ * groups of consecutive ranks, one per phase, and within its group each frame
+ * is distributed in blocks of block_size by its position in the sequence of
+ * frames of that phase, as if the group were fed by a fan of its own.
+ *
+ * \param[in] frame The frame number
+ * \param[in] offset Offset applied to the position of the frame within its phase
+ * \param[in] block_size Number of consecutive frames of a phase sent to each consumer
+ * \param[in] num_consumers Number of consumers, a multiple of phase_period
+ * \param[in] phase_period Number of frames in each trigger cycle
+ * \return The consumer rank
+ */
+int GetConsumerIndexForPhase(
+  uint64_t frame,
+  int offset,
+  int block_size,
+  int num_consumers,
+  int phase_period
+) {
+  int group_size = num_consumers / phase_period;
+  int phase = frame % phase_period;
+  int64_t position = frame / phase_period + offset;
+  return phase * group_size + (position / block_size) % group_size;
+}
+
 /**
  * Default constructor for the EigerFan class
  */
@@ -74,7 +144,8 @@ EigerFan::EigerFan()
 : ctx_(EigerFanDefaults::DEFAULT_NUM_CONTEXT_THREADS),
   controlSocket(ctx_, ZMQ_ROUTER),
   forwardSocket(ctx_, ZMQ_PUSH),
-  broker(BROKER_INPROC_ENDPOINT, EigerFanDefaults::DEFAULT_NUM_THREADS)
+  rx_queue_(RX_QUEUE_CAPACITY),
+  broker(new MultiPullBroker(EigerFanDefaults::DEFAULT_NUM_THREADS))
 {
   this->log = log4cxx::Logger::getLogger("ED.EigerFan");
   LOG4CXX_INFO(log, "Creating EigerFan object from default options");
@@ -88,7 +159,25 @@ EigerFan::EigerFan()
   currentOffset = 0;
   numConnectedForwardingSockets = 0;
   forwardStream = false;
+  forwardCurrentImage = true;
   devShmCache = false;
+  compressRequested = false;
+  compressImages = false;
+  stream2Requested = config.stream_protocol.compare(STREAM_PROTOCOL_STREAM2) == 0;
+  stream2Protocol = stream2Requested;
+  seriesStarted = false;
+  seriesBlockSize = 0;
+  seriesPhasePeriod = 0;
+  heldMessageCount = 0;
+  drainSeries = -1;
+  releasingEnd = false;
+  controlLaneSequence = 0;
+  seriesStalled = false;
+  stallsDetected = 0;
+  stallTimeoutMs = config.stall_timeout_ms;
+  stallIntervals = config.stall_intervals;
+  lastStallFrame = 0;
+  lateMessagesDiscarded = 0;
 }
 
 /**
@@ -100,11 +189,64 @@ EigerFan::EigerFan(EigerFanConfig config_)
 : ctx_(config_.num_zmq_context_threads),
   controlSocket(ctx_, ZMQ_ROUTER),
   forwardSocket(ctx_, ZMQ_PUSH),
-  broker(BROKER_INPROC_ENDPOINT, config_.num_threads)
+  rx_queue_(RX_QUEUE_CAPACITY)
 {
   this->log = log4cxx::Logger::getLogger("ED.EigerFan");
   config = config_;
   LOG4CXX_INFO(log, "Creating EigerFan object from config options");
+  if (config.upstream_consumers > 0) {
+    // Frames must arrive in order from the upstream rank, and it only expects one consumer
+    LOG4CXX_INFO(log, "Consuming rank of upstream EigerFan with " << config.upstream_consumers << " consumers");
+    if (config.num_threads != 1 || config.max_threads > 1) {
+      LOG4CXX_WARN(log, "Using a single connection to the upstream EigerFan");
+    }
+    config.num_threads = 1;
+    config.min_threads = 1;
+    config.max_threads = 1;
+  }
+  if (config.phase_period > 1 && (config.upstream_consumers > 0 || config.num_consumers % config.phase_period != 0)) {
+    LOG4CXX_ERROR(log, "Phase routing needs a multiple of " << config.phase_period
+                       << " consumers and no upstream EigerFan - routing by block only");
+    config.phase_period = 0;
+  }
+  if (config.ingest_engine.compare(INGEST_ENGINE_IO_URING) == 0) {
+    if (UringZmtpIngest::supported()) {
+      // Use the configured number of threads as the number of connections to the detector
+      broker.reset(new UringZmtpIngest(config.num_threads));
+    } else {
+      LOG4CXX_WARN(log, "io_uring ingest engine is not available - falling back to " << INGEST_ENGINE_ZMQ);
+      config.ingest_engine = INGEST_ENGINE_ZMQ;
+    }
+  }
+  if (FrameCompressor::supported()) {
+    compressor.reset(new FrameCompressor(std::max(config.compression_threads - 1, 0)));
+  } else if (config.compression.compare(COMPRESSION_NONE) != 0) {
+    LOG4CXX_WARN(log, "Image compression is not available - built without LZ4");
+    config.compression = COMPRESSION_NONE;
+  }
+  if (!broker) {
+    // Resize the worker pool between the bounds, starting from the configured number of threads
+    if (config.min_threads <= 0) {
+      config.min_threads = config.num_threads;
+    }
+    if (config.max_threads < config.min_threads) {
+      config.max_threads = std::max(config.num_threads, config.min_threads);
+    }
+    config.num_threads = std::max(config.min_threads, std::min(config.max_threads, config.num_threads));
+    broker.reset(new MultiPullBroker(config.num_threads));
+    broker->set_thread_bounds(config.min_threads, config.max_threads);
+  }
+  if (!config.ingest_cpus.empty() && !broker->set_cpus(config.ingest_cpus)) {
+    LOG4CXX_WARN(log, "Ingest engine " << config.ingest_engine << " cannot pin its workers");
+  }
+  SetSpinCount(config.spin_count);
+  if (!config.coordinator_endpoint.empty() && config.instance_name.empty()) {
+    // Name the instance after the host and control port
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+    hostname[HOST_NAME_MAX-1] = '\0';
+    config.instance_name = std::string(hostname) + ":" + config.ctrl_channel_port;
+  }
   killRequested = false;
   state = WAITING_CONSUMERS;
   currentSeries = 0;
@@ -115,13 +257,41 @@ EigerFan::EigerFan(EigerFanConfig config_)
   currentOffset = 0;
   numConnectedForwardingSockets = 0;
   forwardStream = false;
+  forwardCurrentImage = true;
   devShmCache = false;
+  compressRequested = false;
+  compressImages = false;
+  stream2Requested = config.stream_protocol.compare(STREAM_PROTOCOL_STREAM2) == 0;
+  stream2Protocol = stream2Requested;
+  seriesStarted = false;
+  seriesBlockSize = 0;
+  seriesPhasePeriod = 0;
+  heldMessageCount = 0;
+  drainSeries = -1;
+  releasingEnd = false;
+  controlLaneSequence = 0;
+  seriesStalled = false;
+  stallsDetected = 0;
+  stallTimeoutMs = config.stall_timeout_ms;
+  stallIntervals = config.stall_intervals;
+  lastStallFrame = 0;
+  lateMessagesDiscarded = 0;
+  compressRequested = config.compression.compare(COMPRESSION_BSLZ4) == 0;
+  compressImages = compressRequested;
+  if (stream2Requested && compressRequested) {
+    LOG4CXX_WARN(log, "Compression only applies to the legacy stream - stream2 images are sent as received");
+  }
 }
 
 /**
  * Destructor
  */
 EigerFan::~EigerFan() {
+  // The rx thread is joined by run(), unless run() did not get that far
+  killRequested = true;
+  if (rx_thread_ && rx_thread_->joinable()) {
+    rx_thread_->join();
+  }
 }
 
 /**
@@ -155,10 +325,37 @@ void EigerFan::run() {
     EigerConsumer consumer;
     consumer.connected = false;
     consumer.sendSocket = sendSocket;
+    consumer.overflowing = false;
+    consumer.midMessage = false;
+    if (config.nonblocking_send) {
+      std::ostringstream spillPath;
+      spillPath << config.spill_dir << "/eigerfan_overflow_" << port << ".spill";
+      consumer.overflow.reset(new OverflowStore(spillPath.str(), config.overflow_ram));
+    }
+    if (i < config.shared_transports.size() && !config.shared_transports[i].empty()) {
+      LOG4CXX_INFO(log, "Sending image data to rank " << i << " through shared transport " << config.shared_transports[i]);
+      consumer.sharedWriter.reset(new SharedFrameWriter(config.shared_transports[i]));
+    }
+    if (config.control_lane_port_start > 0) {
+      std::ostringstream laneAddress;
+      laneAddress << "tcp://*:" << config.control_lane_port_start + i;
+      LOG4CXX_INFO(log, std::string("Binding control lane address to ").append(laneAddress.str()));
+      consumer.laneSocket.reset(new zmq::socket_t(ctx_, ZMQ_PUSH));
+      consumer.laneSocket->setsockopt(ZMQ_SNDHWM, &SEND_HWM, sizeof (SEND_HWM));
+      consumer.laneSocket->bind(laneAddress.str().c_str());
+      consumer.laneSocket->setsockopt (ZMQ_LINGER, &LINGER_TIMEOUT, sizeof (LINGER_TIMEOUT));
+    }
     consumers.push_back(consumer);
     num_frames_consumed.push_back(0);
   }
 
+  // Budget shared by the consumers and the forwarding socket, which is the last destination
+  sendBudget.reset(new SendBudget(config.memory_budget, config.num_consumers + 1));
+  if (config.memory_budget > 0) {
+    LOG4CXX_INFO(log, "Send queues limited to " << config.memory_budget << " bytes, "
+                 << sendBudget->share() << " per destination, with policy " << config.budget_policy);
+  }
+
   std::vector<boost::shared_ptr<zmq::socket_t> > monitorSockets;
   for (int i = 0; i < config.num_consumers; i++) {
     std::ostringstream monitorAddress;
@@ -259,6 +456,9 @@ void EigerFan::run() {
     for (int i = 0; i < config.num_consumers; i++) {
       monitorSockets[i]->close();
       consumers[i].sendSocket->close();
+      if (consumers[i].laneSocket) {
+        consumers[i].laneSocket->close();
+      }
     }
     forwardSocket.close();
     controlSocket.close();
@@ -305,7 +505,7 @@ void EigerFan::run() {
   // Spawn rx thread
   LOG4CXX_INFO(log, "Spawning rx thread");
   this->rx_thread_ = boost::shared_ptr<boost::thread>(
-    new boost::thread(boost::bind(&EigerFan::HandleRxSocket, this, streamConnectionAddress, config.num_zmq_context_threads))
+    new boost::thread(boost::bind(&EigerFan::HandleRxSocket, this, streamConnectionAddress))
   );
 
   while (state != WAITING_STREAM) {
@@ -344,10 +544,17 @@ void EigerFan::run() {
     }
   }
 
+  // The rx thread uses the consumers and the broker until it sees the kill request
+  LOG4CXX_INFO(log, "Waiting for rx thread to finish");
+  rx_thread_->join();
+
   LOG4CXX_INFO(log, "Shutting down EigerFan sockets");
   for (int i = 0; i < config.num_consumers; i++) {
     monitorSockets[i]->close();
     consumers[i].sendSocket->close();
+    if (consumers[i].laneSocket) {
+      consumers[i].laneSocket->close();
+    }
   }
 
   forwardSocket.close();
@@ -357,31 +564,61 @@ void EigerFan::run() {
 /**
  * Connect broker to detector and handle the messages it produces
  */
-void EigerFan::HandleRxSocket(std::string& endpoint, int num_zmq_context_threads) {
-  zmq::context_t inproc_context(num_zmq_context_threads);
-  zmq::socket_t rx_socket(inproc_context, ZMQ_PULL);
-  rx_socket.setsockopt(ZMQ_RCVHWM, &RECEIVE_HWM, sizeof(RECEIVE_HWM));
-  rx_socket.bind(BROKER_INPROC_ENDPOINT.c_str());
-  rx_socket.setsockopt(ZMQ_LINGER, &LINGER_TIMEOUT, sizeof(LINGER_TIMEOUT));
-  this->broker.connect(endpoint, &inproc_context);
+void EigerFan::HandleRxSocket(std::string& endpoint) {
+  if (config.rx_cpu >= 0) {
+    if (PinCurrentThread(config.rx_cpu)) {
+      LOG4CXX_INFO(log, "Pinned rx thread to CPU " << config.rx_cpu);
+    } else {
+      LOG4CXX_WARN(log, "Unable to pin rx thread to CPU " << config.rx_cpu);
+    }
+  }
+  if (!config.coordinator_endpoint.empty()) {
+    // Share the detector stream with other instances
+    coordinator.reset(new FanCoordinatorClient(ctx_, config.coordinator_endpoint, config.instance_name));
+    coordinator->register_instance(config.num_consumers, GetBlockSize());
+  }
+
+  this->broker->connect(endpoint, &rx_queue_);
 
   state = WAITING_STREAM;
-  LOG4CXX_INFO(log, "Processing rx socket");
+  LOG4CXX_INFO(log, "Processing rx queue");
 
   zmq::message_t message;
-  zmq::pollitem_t pollItems [] = {{rx_socket, 0, ZMQ_POLLIN, 0}};
-  boost::shared_ptr<zmq::socket_t> socket_ptr(&rx_socket);
   while (!killRequested) {
-    // Stream socket events
-    zmq::poll(&pollItems[0], 1, -1);
-    if (pollItems[0].revents & ZMQ_POLLIN) {
-      rx_socket.recv(&message);
-      HandleStreamMessage(message, socket_ptr);
+    // Wake up periodically to check for a kill request, or often to drain overflow
+    bool overflowPending = OverflowPending();
+    MultipartMessage* received = rx_queue_.pop(overflowPending ? OVERFLOW_DRAIN_INTERVAL_MS : RX_QUEUE_TIMEOUT_MS);
+    if (overflowPending && !killRequested) {
+      DrainOverflows();
+    }
+    if (coordinator) {
+      HandleCoordinatorMessages(received == NULL);
+    }
+    if (received != NULL) {
+      if (state != DSTR_HEADER && state != DSTR_IMAGE) {
+        // Take up a protocol change from the control thread between series
+        stream2Protocol = stream2Requested;
+      }
+      boost::shared_ptr<MultipartMessage> parts(received);
+      parts->recv(&message);
+      bool sizeNotice = false;
+      if (stream2Protocol && config.upstream_consumers > 0 && parts->more()) {
+        // An upstream fan puts the acquisition ID in front of the CBOR message
+        upstreamAcquisitionID.assign(static_cast<char*>(message.data()), message.size());
+        parts->recv(&message);
+      } else if (stream2Protocol && config.upstream_consumers > 0 && message.size() > SIZE_NOTICE_PREFIX.size()) {
+        // A size notice from an upstream fan is not passed on, as the start is announced again
+        sizeNotice = memcmp(message.data(), SIZE_NOTICE_PREFIX.data(), SIZE_NOTICE_PREFIX.size()) == 0;
+      }
+      if (!sizeNotice) {
+        lastStreamMessageTime = boost::posix_time::microsec_clock::universal_time();
+        DispatchStreamMessage(message, parts);
+      }
     }
+    CheckForStall();
   }
 
-  rx_socket.close();
-  broker.shutdown();
+  broker->shutdown();
 
   LOG4CXX_INFO(log, "RX thread done");
 }
@@ -395,13 +632,27 @@ void EigerFan::Stop() {
   state = KILL_REQUESTED;
 }
 
+/**
+ * Pass a message to the handler for the configured stream protocol
+ *
+ * \param[in] message The first part of the message
+ * \param[in] parts The remaining parts of the message
+ */
+void EigerFan::DispatchStreamMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts) {
+  if (stream2Protocol) {
+    HandleStream2Message(message, parts);
+  } else {
+    HandleStreamMessage(message, parts);
+  }
+}
+
 /**
  * Handle a message from the zmq stream
  *
  * \param[in] message The zeromq message to handle
- * \param[in] socket The socket that the message was received on
+ * \param[in] parts The remaining parts of the message
  */
-void EigerFan::HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<zmq::socket_t> socket) {
+void EigerFan::HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts) {
 
   try {
     std::string smessage(static_cast<char*>(message.data()), message.size());
@@ -412,52 +663,57 @@ void EigerFan::HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<zm
       LOG4CXX_ERROR(log, "Error parsing stream message into json");
     } else {
       rapidjson::Value& headerTypeValue = jsonDocument[HEADER_TYPE_KEY.c_str()];
-      std::string htype(headerTypeValue.GetString());
-      if (htype.compare(GLOBAL_HEADER_TYPE) == 0) {
-        // At the start of an acquisition so set the current offset to any configured offset
-        currentOffset = configuredOffset;
-        configuredOffset = 0;
-        lastFrameSent = 0;
-        broker.start_message_counter();
-        num_frames_sent = 0;
-        for(int j=0; j<num_frames_consumed.size(); j++) {
-          num_frames_consumed[j] = 0;
+      EigerMessageParentType messageType = PARENT_MESSAGE_TYPE_GLOBAL;
+      if (!ClassifyMessageType(headerTypeValue.GetString(), headerTypeValue.GetStringLength(), messageType)) {
+        LOG4CXX_ERROR(log, std::string("Unknown header type ").append(headerTypeValue.GetString()));
+      } else if (messageType == PARENT_MESSAGE_TYPE_GLOBAL) {
+        if (config.upstream_consumers > 0 && jsonDocument.HasMember(ACQUISITION_ID_KEY.c_str())) {
+          // Keep the acquisition ID applied by the upstream fan
+          upstreamAcquisitionID = jsonDocument[ACQUISITION_ID_KEY.c_str()].GetString();
         }
-        currentAcquisitionID = configuredAcquisitionID;
+        if (coordinator && drainSeries >= 0) {
+          // A new series means this instance has nothing more from the last one
+          SendDrained();
+        }
+        StartAcquisition();
         // Handle Message
-        HandleGlobalHeaderMessage(socket);
-      } else if (htype.compare(IMAGE_HEADER_TYPE) == 0) {
+        HandleGlobalHeaderMessage(parts);
+        if (coordinator) {
+          StartCoordinatedSeries();
+        }
+      } else if (messageType == PARENT_MESSAGE_TYPE_IMAGE_DATA) {
         rapidjson::Value& frameValue = jsonDocument[FRAME_KEY.c_str()];
         int64_t frame(frameValue.GetInt64());
-        currentConsumerIndexToSendTo = ((frame + currentOffset) / config.block_size) % config.num_consumers;
-        HandleImageDataMessage(socket, frame);
-        if (frame > lastFrameSent) {
-          lastFrameSent = frame;
+        if (coordinator && !CoordinatedSeriesStarted(jsonDocument[SERIES_KEY.c_str()].GetInt())) {
+          HoldMessage(message, parts);
+          return;
         }
-        num_frames_sent++;
-        if (currentConsumerIndexToSendTo < num_frames_consumed.size()) {
-          num_frames_consumed[currentConsumerIndexToSendTo]++;
+        if (seriesStalled) {
+          // The consumers have already been sent the end of this series
+          lateMessagesDiscarded++;
+          DiscardRemainingMessageParts(parts);
+          return;
         }
-        else {
-          LOG4CXX_WARN(log, "Error counting consumer frames for logging");
+        currentConsumerIndexToSendTo = GetConsumerIndex(frame);
+        if (HandleImageDataMessage(parts, frame)) {
+          RecordFrameSent(frame);
         }
-      } else if (htype.compare(END_HEADER_TYPE) == 0) {
-        LOG4CXX_INFO(
-          log,
-          "End of series message received after " + boost::lexical_cast<std::string>(broker.messages_received()) + \
-          " messages received and " + boost::lexical_cast<std::string>(num_frames_sent) + " frames sent."
-        );
-        std::string consumer_frames;
-        for(int j=0; j<num_frames_consumed.size(); j++) {
-          consumer_frames +=
-                  boost::lexical_cast<std::string>(j) + ": " + \
-                          boost::lexical_cast<std::string>(num_frames_consumed[j]) + " ";
+      } else {
+        if (coordinator && !releasingEnd) {
+          HoldEndMessage(message, parts);
+          return;
+        }
+        if (seriesStalled) {
+          LOG4CXX_INFO(log, "End of series received for series already ended after a stall");
+          lateMessagesDiscarded++;
+          seriesStalled = false;
+          state = WAITING_STREAM;
+          DiscardRemainingMessageParts(parts);
+          return;
         }
-        LOG4CXX_INFO(log, "Consumer frame counts " + consumer_frames);
-        HandleEndOfSeriesMessage(socket);
+        EndAcquisition();
+        HandleEndOfSeriesMessage(parts);
         state = WAITING_STREAM;
-      } else {
-        LOG4CXX_ERROR(log, std::string("Unknown header type ").append(htype));
       }
     }
   }
@@ -470,202 +726,406 @@ void EigerFan::HandleStreamMessage(zmq::message_t &message, boost::shared_ptr<zm
     LOG4CXX_ERROR(log, "Unexpected exception handling stream message");
   }
 
-  // Ensure there aren't any leftover messages on the socket
-  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-  while (more == MORE_MESSAGES) {
-    zmq::message_t messagePartExtra;
-    socket->recv(&messagePartExtra);
-    LOG4CXX_ERROR(log, "Unexpected unhandled message in stream");
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-  }
+  DiscardRemainingMessageParts(parts);
 }
 
 /**
- * Handle the Global Header message
+ * Handle a stream2 message from the zmq stream
  *
- * This is a multipart message sent by the Eiger at the start of an acquisition and can contain different amounts of meta data
+ * stream2 messages are single part CBOR documents. The CBOR is only scanned to
+ * find the message type and image number; the message itself is forwarded
+ * unmodified (without copying) behind a part containing the acquisition ID.
  *
- * \param[in] socket The socket that the message was received on
+ * \param[in] message The zeromq message to handle
+ * \param[in] parts The remaining parts of the message
  */
-void EigerFan::HandleGlobalHeaderMessage(boost::shared_ptr<zmq::socket_t> socket) {
-  std::vector<zmq::message_t*> messageList;
+void EigerFan::HandleStream2Message(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts) {
 
-  // Add the Acquisition ID to part 1 for easier downstream processing
-  std::string part1WithAcquisitionID = AddAcquisitionIDToPart1();
-  zmq::message_t newPart1message(part1WithAcquisitionID.size());
-  memcpy (newPart1message.data (), part1WithAcquisitionID.c_str(), part1WithAcquisitionID.size());
-
-  LOG4CXX_INFO(log, std::string("Received Global Header message: ").append(part1WithAcquisitionID));
-
-  rapidjson::Value& seriesValue = jsonDocument[SERIES_KEY.c_str()];
-  currentSeries = seriesValue.GetInt();
+  try {
+    Stream2Message stream2;
+    if (!ParseStream2Message(message.data(), message.size(), stream2)) {
+      LOG4CXX_ERROR(log, "Error parsing stream2 message as CBOR");
+    } else if (stream2.type == STREAM2_START) {
+      if (coordinator && drainSeries >= 0) {
+        // A new series means this instance has nothing more from the last one
+        SendDrained();
+      }
+      StartAcquisition();
+      currentSeries = stream2.series_id;
+      LOG4CXX_INFO(log, "Received stream2 start message for series " << currentSeries);
 
-  rapidjson::Value& headerDetailValue = jsonDocument[HEADER_DETAIL_KEY.c_str()];
-  std::string headerDetail(headerDetailValue.GetString());
+      zmq::message_t acquisitionIDMessage(currentAcquisitionID.size());
+      memcpy (acquisitionIDMessage.data (), currentAcquisitionID.c_str(), currentAcquisitionID.size());
 
-  this->WriteMessageToFile(newPart1message, "start_0");
+      this->WriteMessageToFile(message, "start_0");
 
-  if (headerDetail.compare(HEADER_DETAIL_NONE) == 0) {
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more == MORE_MESSAGES) {
-      LOG4CXX_DEBUG(log, "Header has appendix");
-      zmq::message_t messageAppendix;
-      socket->recv(&messageAppendix);
+      if (config.control_lane_port_start == 0) {
+        // With a flatfield and pixel mask the start can be larger than a frame buffer
+        SendSizeNotice(message.size());
+      }
+      std::vector<zmq::message_t*> messageList;
+      messageList.push_back(&acquisitionIDMessage);
+      messageList.push_back(&message);
+      SendMessagesToAllConsumers(messageList);
 
-      this->WriteMessageToFile(messageAppendix, "start_appendix");
+      if (state != WAITING_STREAM) {
+        LOG4CXX_WARN(log, std::string("Received start message in unexpected state: ").append(GetStateString(state)));
+      }
+      state = DSTR_HEADER;
+      if (coordinator) {
+        StartCoordinatedSeries();
+      }
+    } else if (stream2.type == STREAM2_IMAGE) {
+      if (coordinator && !CoordinatedSeriesStarted(stream2.series_id)) {
+        HoldMessage(message, parts);
+        return;
+      }
+      if (seriesStalled) {
+        // The consumers have already been sent the end of this series
+        lateMessagesDiscarded++;
+        return;
+      }
+      uint64_t frame = stream2.image_id;
+      currentConsumerIndexToSendTo = GetConsumerIndex(frame);
 
-      messageList.push_back(&newPart1message);
-      messageList.push_back(&messageAppendix);
-      SendMessagesToAllConsumers(messageList);
-    } else {
-      SendMessageToAllConsumers(newPart1message);
-    }
+      zmq::message_t acquisitionIDMessage(currentAcquisitionID.size());
+      memcpy (acquisitionIDMessage.data (), currentAcquisitionID.c_str(), currentAcquisitionID.size());
 
-  } else if (headerDetail.compare(HEADER_DETAIL_BASIC) == 0) {
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 1 part but expected 2 for 'basic' detail");
-      return;
-    }
+      this->WriteMessageToFile(message, "image_" + PadInt(frame) + "_0");
 
-    zmq::message_t messagePart2;
-    socket->recv(&messagePart2);
+      if (AdmitImage(message.size())) {
+        SendMessageToSingleConsumer(acquisitionIDMessage, ZMQ_SNDMORE);
+        SendPayloadToSingleConsumer(message, 0);
+        RecordFrameSent(frame);
+      }
+      forwardCurrentImage = true;
 
-    this->WriteMessageToFile(messagePart2, "start_1");
+      if (state != DSTR_IMAGE && state != DSTR_HEADER) {
+        LOG4CXX_WARN(log, std::string("Received image message in unexpected state: ").append(GetStateString(state)));
+      }
+      state = DSTR_IMAGE;
+    } else if (stream2.type == STREAM2_END) {
+      if (coordinator && !releasingEnd) {
+        HoldEndMessage(message, parts);
+        return;
+      }
+      if (seriesStalled) {
+        LOG4CXX_INFO(log, "End of series received for series " << currentSeries << " already ended after a stall");
+        lateMessagesDiscarded++;
+        seriesStalled = false;
+        state = WAITING_STREAM;
+        return;
+      }
+      EndAcquisition();
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more == MORE_MESSAGES) {
-      LOG4CXX_DEBUG(log, "Header has appendix");
-      zmq::message_t messageAppendix;
-      socket->recv(&messageAppendix);
+      zmq::message_t acquisitionIDMessage(currentAcquisitionID.size());
+      memcpy (acquisitionIDMessage.data (), currentAcquisitionID.c_str(), currentAcquisitionID.size());
 
-      this->WriteMessageToFile(messageAppendix, "start_appendix");
+      this->WriteMessageToFile(message, "end");
 
-      messageList.push_back(&newPart1message);
-      messageList.push_back(&messagePart2);
-      messageList.push_back(&messageAppendix);
-      SendMessagesToAllConsumers(messageList);
-    } else {
-      messageList.push_back(&newPart1message);
-      messageList.push_back(&messagePart2);
+      std::vector<zmq::message_t*> messageList;
+      messageList.push_back(&acquisitionIDMessage);
+      messageList.push_back(&message);
       SendMessagesToAllConsumers(messageList);
-    }
 
-  } else if (headerDetail.compare(HEADER_DETAIL_ALL) == 0) {
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 1 part but expected 8 for 'all' detail");
-      return;
+      if (state != DSTR_IMAGE) {
+        LOG4CXX_WARN(log, std::string("Received end message in unexpected state: ").append(GetStateString(state)));
+      }
+      state = WAITING_STREAM;
     }
+  }
+  catch (std::exception& e)
+  {
+    LOG4CXX_ERROR(log, "Generic exception handling stream2 message:\n" << e.what());
+  }
+  catch (...)
+  {
+    LOG4CXX_ERROR(log, "Unexpected exception handling stream2 message");
+  }
 
-    // Part 2
-    zmq::message_t messagePart2;
-    socket->recv(&messagePart2);
+  DiscardRemainingMessageParts(parts);
+}
 
-    this->WriteMessageToFile(messagePart2, "start_1");
+/**
+ * Ensure there aren't any leftover message parts
+ *
+ * \param[in] parts The remaining parts of the message
+ */
+void EigerFan::DiscardRemainingMessageParts(boost::shared_ptr<MultipartMessage> parts) {
+  more = parts->more();
+  while (more == MORE_MESSAGES) {
+    zmq::message_t messagePartExtra;
+    parts->recv(&messagePartExtra);
+    LOG4CXX_ERROR(log, "Unexpected unhandled message in stream");
+    more = parts->more();
+  }
+}
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 2 parts but expected 8 for 'all' detail");
-      return;
+/**
+ * Reset the per acquisition counters at the start of a new acquisition
+ */
+void EigerFan::StartAcquisition() {
+  // Take the settings for this series from the front of the queue if there are any
+  QueuedAcquisition queued;
+  bool fromQueue = false;
+  {
+    boost::lock_guard<boost::mutex> lock(acquisitionQueueMutex);
+    if (!acquisitionQueue.empty()) {
+      queued = acquisitionQueue.front();
+      acquisitionQueue.pop_front();
+      fromQueue = true;
     }
+  }
 
-    // Part 3
-    zmq::message_t messagePart3;
-    socket->recv(&messagePart3);
+  // At the start of an acquisition so set the current offset to any configured offset
+  currentOffset = configuredOffset;
+  configuredOffset = 0;
+  if (fromQueue) {
+    LOG4CXX_INFO(log, "Starting acquisition " << queued.acquisitionID << " from the queue");
+    if (queued.hasOffset) {
+      currentOffset = queued.offset;
+    }
+  }
+  // Take the block size for the whole series, from the queue entry if it sets one
+  seriesBlockSize = fromQueue && queued.blockSize > 0 ? queued.blockSize : GetBlockSize();
+  // Take up a compression change from the control thread
+  compressImages = compressRequested;
+  lastFrameSent = 0;
+  seriesStalled = false;
+  seriesStartTime = boost::posix_time::microsec_clock::universal_time();
+  lastStreamMessageTime = seriesStartTime;
+  broker->start_message_counter();
+  rx_queue_.reset_max_depth();
+  sendBudget->reset_peaks();
+  AttachSharedTransports();
+  num_frames_sent = 0;
+  for(int j=0; j<num_frames_consumed.size(); j++) {
+    num_frames_consumed[j] = 0;
+  }
+  {
+    // Take the phase period for the whole series
+    boost::lock_guard<boost::mutex> lock(phaseMutex);
+    seriesPhasePeriod = config.phase_period;
+    phaseFramesSent.assign(std::max(seriesPhasePeriod, 0), 0);
+  }
+  if (config.upstream_consumers > 0 && !upstreamAcquisitionID.empty()) {
+    currentAcquisitionID = upstreamAcquisitionID;
+  } else if (fromQueue) {
+    currentAcquisitionID = queued.acquisitionID;
+  } else {
+    currentAcquisitionID = configuredAcquisitionID;
+  }
+}
 
-    this->WriteMessageToFile(messagePart3, "start_2");
+/**
+ * Parse entries for the acquisition ID queue
+ *
+ * Each entry is either an acquisition ID, or an object with an acqid and
+ * optionally an offset and block_size to apply to that series.
+ *
+ * \param[in] value A single entry or an array of entries
+ * \param[out] entries The parsed entries
+ * \return false if any entry is invalid
+ */
+bool EigerFan::ParseQueuedAcquisitions(rapidjson::Value &value, std::vector<QueuedAcquisition> &entries) {
+  std::vector<rapidjson::Value*> values;
+  if (value.IsArray()) {
+    for (rapidjson::SizeType i = 0; i < value.Size(); i++) {
+      values.push_back(&value[i]);
+    }
+  } else {
+    values.push_back(&value);
+  }
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 3 parts but expected 8 for 'all' detail");
-      return;
+  for (size_t i = 0; i < values.size(); i++) {
+    rapidjson::Value& entryValue = *values[i];
+    QueuedAcquisition entry;
+    entry.hasOffset = false;
+    entry.offset = 0;
+    entry.blockSize = 0;
+    if (entryValue.IsString()) {
+      entry.acquisitionID = entryValue.GetString();
+    } else if (entryValue.IsObject() && entryValue.HasMember(CONTROL_ACQ_ID.c_str()) &&
+               entryValue[CONTROL_ACQ_ID.c_str()].IsString()) {
+      entry.acquisitionID = entryValue[CONTROL_ACQ_ID.c_str()].GetString();
+      if (entryValue.HasMember(CONTROL_OFFSET.c_str())) {
+        if (!entryValue[CONTROL_OFFSET.c_str()].IsInt()) {
+          LOG4CXX_ERROR(log, "Invalid offset for queued acquisition " << entry.acquisitionID);
+          return false;
+        }
+        entry.hasOffset = true;
+        entry.offset = entryValue[CONTROL_OFFSET.c_str()].GetInt();
+      }
+      if (entryValue.HasMember(CONTROL_BLOCK_SIZE.c_str())) {
+        if (!entryValue[CONTROL_BLOCK_SIZE.c_str()].IsInt() || entryValue[CONTROL_BLOCK_SIZE.c_str()].GetInt() < 1) {
+          LOG4CXX_ERROR(log, "Invalid block size for queued acquisition " << entry.acquisitionID);
+          return false;
+        }
+        entry.blockSize = entryValue[CONTROL_BLOCK_SIZE.c_str()].GetInt();
+      }
+    } else {
+      LOG4CXX_ERROR(log, "Queued acquisition must be an acquisition ID or an object with an " << CONTROL_ACQ_ID);
+      return false;
     }
+    entries.push_back(entry);
+  }
+  return true;
+}
 
-    // Part 4
-    zmq::message_t messagePart4;
-    socket->recv(&messagePart4);
+/**
+ * Get the rank of the consumer a frame of the current series should be sent to
+ *
+ * \param[in] frame The frame number
+ * \return The consumer rank
+ */
+int EigerFan::GetConsumerIndex(uint64_t frame) {
+  int blockSize = seriesBlockSize > 0 ? seriesBlockSize : GetBlockSize();
+  if (seriesPhasePeriod > 1) {
+    return GetConsumerIndexForPhase(frame, currentOffset, blockSize, config.num_consumers, seriesPhasePeriod);
+  }
+  return GetConsumerIndexForFrame(
+    frame, currentOffset, blockSize, config.num_consumers, config.upstream_block_size, config.upstream_consumers
+  );
+}
 
-    this->WriteMessageToFile(messagePart4, "start_3");
+/**
+ * Get the configured block size
+ *
+ * The block size is configured by the control thread and by the coordinator
+ * on the rx thread, so it is only accessed under blockSizeMutex. Each series
+ * takes its block size at its start.
+ *
+ * \return The block size
+ */
+int EigerFan::GetBlockSize() {
+  boost::lock_guard<boost::mutex> lock(blockSizeMutex);
+  return config.block_size;
+}
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 4 parts but expected 8 for 'all' detail");
-      return;
-    }
+/**
+ * Set the configured block size
+ *
+ * \param[in] blockSize The block size
+ */
+void EigerFan::SetBlockSize(int blockSize) {
+  boost::lock_guard<boost::mutex> lock(blockSizeMutex);
+  config.block_size = blockSize;
+}
 
-    // Part 5
-    zmq::message_t messagePart5;
-    socket->recv(&messagePart5);
+/**
+ * Update the frame counters after a frame has been sent to the current consumer
+ *
+ * \param[in] frame The frame number that was sent
+ */
+void EigerFan::RecordFrameSent(uint64_t frame) {
+  if (frame > lastFrameSent) {
+    lastFrameSent = frame;
+  }
+  num_frames_sent++;
+  if (seriesPhasePeriod > 1) {
+    boost::lock_guard<boost::mutex> lock(phaseMutex);
+    phaseFramesSent[frame % seriesPhasePeriod]++;
+  }
+  if (currentConsumerIndexToSendTo < num_frames_consumed.size()) {
+    num_frames_consumed[currentConsumerIndexToSendTo]++;
+  }
+  else {
+    LOG4CXX_WARN(log, "Error counting consumer frames for logging");
+  }
+}
 
-    this->WriteMessageToFile(messagePart5, "start_4");
+/**
+ * Finish the current series
+ *
+ * Settings that applied to the series only are dropped, so the configured
+ * block size applies again from the next series.
+ */
+void EigerFan::EndAcquisition() {
+  LogSeriesSummary();
+  seriesBlockSize = 0;
+}
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 5 parts but expected 8 for 'all' detail");
-      return;
-    }
+/**
+ * Log the message and frame counts at the end of a series
+ */
+void EigerFan::LogSeriesSummary() {
+  LOG4CXX_INFO(
+    log,
+    "End of series message received after " + boost::lexical_cast<std::string>(broker->messages_received()) + \
+    " messages received and " + boost::lexical_cast<std::string>(num_frames_sent) + " frames sent." + \
+    " Peak rx queue depth " + boost::lexical_cast<std::string>(rx_queue_.max_depth()) + "."
+  );
+  std::string consumer_frames;
+  for(int j=0; j<num_frames_consumed.size(); j++) {
+    consumer_frames +=
+            boost::lexical_cast<std::string>(j) + ": " + \
+                    boost::lexical_cast<std::string>(num_frames_consumed[j]) + " ";
+  }
+  LOG4CXX_INFO(log, "Consumer frame counts " + consumer_frames);
+}
 
-    // Part 6
-    zmq::message_t messagePart6;
-    socket->recv(&messagePart6);
+/**
+ * Handle the Global Header message
+ *
+ * This is a multipart message sent by the Eiger at the start of an acquisition and can contain different amounts of meta data
+ *
+ * \param[in] parts The remaining parts of the message
+ */
+void EigerFan::HandleGlobalHeaderMessage(boost::shared_ptr<MultipartMessage> parts) {
+  std::vector<zmq::message_t*> messageList;
 
-    this->WriteMessageToFile(messagePart6, "start_5");
+  // Add the Acquisition ID to part 1 for easier downstream processing
+  std::string part1WithAcquisitionID = AddAcquisitionIDToPart1();
+  zmq::message_t newPart1message(part1WithAcquisitionID.size());
+  memcpy (newPart1message.data (), part1WithAcquisitionID.c_str(), part1WithAcquisitionID.size());
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 6 parts but expected 8 for 'all' detail");
-      return;
-    }
+  LOG4CXX_INFO(log, std::string("Received Global Header message: ").append(part1WithAcquisitionID));
 
-    // Part 7
-    zmq::message_t messagePart7;
-    socket->recv(&messagePart7);
+  rapidjson::Value& seriesValue = jsonDocument[SERIES_KEY.c_str()];
+  currentSeries = seriesValue.GetInt();
 
-    this->WriteMessageToFile(messagePart7, "start_6");
+  rapidjson::Value& headerDetailValue = jsonDocument[HEADER_DETAIL_KEY.c_str()];
+  std::string headerDetail(headerDetailValue.GetString());
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
-    if (more != MORE_MESSAGES) {
-      LOG4CXX_ERROR(log, "Header only contained 7 parts but expected 8 for 'all' detail");
-      return;
-    }
+  this->WriteMessageToFile(newPart1message, "start_0");
 
-    // Part 8
-    zmq::message_t messagePart8;
-    socket->recv(&messagePart8);
+  const HeaderDetailSpec* detail = FindHeaderDetail(headerDetail.c_str());
+  if (detail) {
+    // Receive the rest of the parts sent for this header detail, then any appendix
+    std::vector<boost::shared_ptr<zmq::message_t> > headerParts;
+    messageList.push_back(&newPart1message);
+    for (int part = global_detector_config_part; part <= detail->last_part; part++) {
+      more = parts->more();
+      if (more != MORE_MESSAGES) {
+        LOG4CXX_ERROR(log, "Header only contained " << part - 1 << (part == 2 ? " part" : " parts") << " but expected "
+            << detail->last_part << " for '" << detail->name << "' detail");
+        return;
+      }
+      boost::shared_ptr<zmq::message_t> messagePart(new zmq::message_t());
+      parts->recv(messagePart.get());
 
-    this->WriteMessageToFile(messagePart8, "start_7");
+      this->WriteMessageToFile(*messagePart, "start_" + boost::lexical_cast<std::string>(part - 1));
 
-    socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+      headerParts.push_back(messagePart);
+      messageList.push_back(messagePart.get());
+    }
+
+    zmq::message_t messageAppendix;
+    more = parts->more();
     if (more == MORE_MESSAGES) {
       LOG4CXX_DEBUG(log, "Header has appendix");
-      zmq::message_t messageAppendix;
-      socket->recv(&messageAppendix);
+      parts->recv(&messageAppendix);
 
       this->WriteMessageToFile(messageAppendix, "start_appendix");
 
-      messageList.push_back(&newPart1message);
-      messageList.push_back(&messagePart2);
-      messageList.push_back(&messagePart3);
-      messageList.push_back(&messagePart4);
-      messageList.push_back(&messagePart5);
-      messageList.push_back(&messagePart6);
-      messageList.push_back(&messagePart7);
-      messageList.push_back(&messagePart8);
       messageList.push_back(&messageAppendix);
-      SendMessagesToAllConsumers(messageList);
+    }
+
+    if (messageList.size() == 1) {
+      SendMessageToAllConsumers(newPart1message);
     } else {
-      messageList.push_back(&newPart1message);
-      messageList.push_back(&messagePart2);
-      messageList.push_back(&messagePart3);
-      messageList.push_back(&messagePart4);
-      messageList.push_back(&messagePart5);
-      messageList.push_back(&messagePart6);
-      messageList.push_back(&messagePart7);
-      messageList.push_back(&messagePart8);
       SendMessagesToAllConsumers(messageList);
     }
-
   }
   else {
     LOG4CXX_ERROR(log, "Unexpected header detail type");
@@ -683,15 +1143,15 @@ void EigerFan::HandleGlobalHeaderMessage(boost::shared_ptr<zmq::socket_t> socket
  *
  * This is a a multipart message sent by the Eiger containing the image and associated meta data
  *
- * \param[in] socket The socket that the message was received on
+ * \param[in] parts The remaining parts of the message
  */
-void EigerFan::HandleImageDataMessage(boost::shared_ptr<zmq::socket_t> socket, uint64_t frame_number) {
+bool EigerFan::HandleImageDataMessage(boost::shared_ptr<MultipartMessage> parts, uint64_t frame_number) {
   LOG4CXX_DEBUG(log, "Handling Image Data Message");
 
-  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+  more = parts->more();
   if (more != MORE_MESSAGES) {
     LOG4CXX_ERROR(log, "Image Data only contained 1 part");
-    return;
+    return false;
   }
 
   // Add the current Acquisition ID to part 1 for easier downstream processing
@@ -701,27 +1161,31 @@ void EigerFan::HandleImageDataMessage(boost::shared_ptr<zmq::socket_t> socket, u
 
   // Part 2 - shape and size
   zmq::message_t messagePart2;
-  socket->recv(&messagePart2);
+  parts->recv(&messagePart2);
 
-  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+  more = parts->more();
   if (more != MORE_MESSAGES) {
     LOG4CXX_ERROR(log, "Image Data only contained 2 parts");
-    return;
+    return false;
   }
 
   // Part 3 - data blob
   zmq::message_t messagePart3;
-  socket->recv(&messagePart3);
+  parts->recv(&messagePart3);
 
-  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+  more = parts->more();
   if (more != MORE_MESSAGES) {
     LOG4CXX_ERROR(log, "Image Data only contained 3 parts");
-    return;
+    return false;
   }
 
   //Part 4 - times
   zmq::message_t messagePart4;
-  socket->recv(&messagePart4);
+  parts->recv(&messagePart4);
+
+  if (compressImages) {
+    CompressImage(messagePart2, messagePart3);
+  }
 
   this->WriteMessageToFile(newPart1message, "image_" + PadInt(frame_number) + "_0");
   this->WriteMessageToFile(messagePart2, "image_" + PadInt(frame_number) + "_1");
@@ -729,33 +1193,109 @@ void EigerFan::HandleImageDataMessage(boost::shared_ptr<zmq::socket_t> socket, u
   this->WriteMessageToFile(messagePart4, "image_" + PadInt(frame_number) + "_3");
 
   // Handle appendix
-  socket->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+  more = parts->more();
   if (more == MORE_MESSAGES) {
     LOG4CXX_DEBUG(log, "Image has appendix");
     zmq::message_t messageAppendix;
-    socket->recv(&messageAppendix);
+    parts->recv(&messageAppendix);
 
     this->WriteMessageToFile(messageAppendix, "image_" + PadInt(frame_number) + "_appendix");
 
+    if (!AdmitImage(messagePart3.size() + messageAppendix.size())) {
+      return false;
+    }
     // Send the data on to a consumer
     SendMessageToSingleConsumer(newPart1message, ZMQ_SNDMORE);
     SendMessageToSingleConsumer(messagePart2, ZMQ_SNDMORE);
-    SendMessageToSingleConsumer(messagePart3, ZMQ_SNDMORE);
+    SendPayloadToSingleConsumer(messagePart3, ZMQ_SNDMORE);
     SendMessageToSingleConsumer(messagePart4, ZMQ_SNDMORE);
     SendMessageToSingleConsumer(messageAppendix, 0);
   } else {
+    if (!AdmitImage(messagePart3.size())) {
+      return false;
+    }
     // Send the data on to a consumer
     SendMessageToSingleConsumer(newPart1message, ZMQ_SNDMORE);
     SendMessageToSingleConsumer(messagePart2, ZMQ_SNDMORE);
-    SendMessageToSingleConsumer(messagePart3, ZMQ_SNDMORE);
+    SendPayloadToSingleConsumer(messagePart3, ZMQ_SNDMORE);
     SendMessageToSingleConsumer(messagePart4, 0);
   }
+  forwardCurrentImage = true;
 
   if (state != DSTR_IMAGE && state != DSTR_HEADER) {
     LOG4CXX_WARN(log, std::string("Received Image Data message in unexpected state: ").append(GetStateString(state)));
   }
   state = DSTR_IMAGE;
   LOG4CXX_DEBUG(log, "Finished Handling Image Data Message");
+  return true;
+}
+
+/**
+ * Compress an uncompressed image, updating its encoding and size to match
+ *
+ * Images the detector has already compressed, or of a type that cannot be
+ * bitshuffled, are left as they are. Only legacy stream images are
+ * compressed; stream2 image messages are dispatched as received.
+ *
+ * Compression runs inline on the rx thread, which splits the image across the
+ * compressor's worker pool and waits for it, so no further messages are taken
+ * from the rx queue until the image is compressed. The queue and the ingest
+ * workers absorb the delay, and compression_threads must be high enough for
+ * each image to be compressed within the frame period.
+ *
+ * \param[in,out] messagePart2 The part giving the shape, type, encoding and size
+ * \param[in,out] messagePart3 The data blob
+ * \return true if the image was compressed
+ */
+bool EigerFan::CompressImage(zmq::message_t &messagePart2, zmq::message_t &messagePart3) {
+  rapidjson::Document document;
+  std::string part2(static_cast<char*>(messagePart2.data()), messagePart2.size());
+  document.Parse(part2.c_str());
+  if (document.HasParseError() || !document.IsObject() ||
+      !document.HasMember(ENCODING_KEY.c_str()) || !document.HasMember(DATA_TYPE_KEY.c_str())) {
+    LOG4CXX_ERROR(log, "Unable to compress image without its encoding and type");
+    return false;
+  }
+  std::string encoding(document[ENCODING_KEY.c_str()].GetString());
+  if (encoding.find("lz4") != std::string::npos) {
+    return false;
+  }
+  std::string type(document[DATA_TYPE_KEY.c_str()].GetString());
+  size_t elemSize = 0;
+  if (type.compare("uint8") == 0 || type.compare("int8") == 0) {
+    elemSize = 1;
+  } else if (type.compare("uint16") == 0 || type.compare("int16") == 0) {
+    elemSize = 2;
+  } else if (type.compare("uint32") == 0 || type.compare("int32") == 0 || type.compare("float32") == 0) {
+    elemSize = 4;
+  } else {
+    LOG4CXX_DEBUG(log, "Not compressing image of type " << type);
+    return false;
+  }
+
+  zmq::message_t compressed;
+  if (!compressor->compress(messagePart3, elemSize, compressed)) {
+    LOG4CXX_ERROR(log, "Unable to compress image - sending it uncompressed");
+    return false;
+  }
+
+  // Keep the byte order of the original encoding
+  std::ostringstream newEncoding;
+  newEncoding << "bs" << elemSize * 8 << "-lz4" << (!encoding.empty() && encoding[encoding.size()-1] == '>' ? ">" : "<");
+  document[ENCODING_KEY.c_str()].SetString(newEncoding.str(), document.GetAllocator());
+  if (document.HasMember(SIZE_KEY.c_str())) {
+    document[SIZE_KEY.c_str()].SetUint64(compressed.size());
+  } else {
+    rapidjson::Value keySize(SIZE_KEY, document.GetAllocator());
+    document.AddMember(keySize, rapidjson::Value(static_cast<uint64_t>(compressed.size())), document.GetAllocator());
+  }
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  document.Accept(writer);
+  messagePart2.rebuild(buffer.GetSize());
+  memcpy(messagePart2.data(), buffer.GetString(), buffer.GetSize());
+  messagePart3.move(&compressed);
+  return true;
 }
 
 /**
@@ -763,9 +1303,9 @@ void EigerFan::HandleImageDataMessage(boost::shared_ptr<zmq::socket_t> socket, u
  *
  * This is a single message sent by the Eiger at the end of an acquisition
  *
- * \param[in] socket The socket that the message was received on
+ * \param[in] parts The remaining parts of the message
  */
-void EigerFan::HandleEndOfSeriesMessage(boost::shared_ptr<zmq::socket_t> socket) {
+void EigerFan::HandleEndOfSeriesMessage(boost::shared_ptr<MultipartMessage> parts) {
   LOG4CXX_INFO(log, "Handling EndOfSeries Message");
   std::string part1WithAcquisitionID = AddAcquisitionIDToPart1();
   zmq::message_t newPart1message(part1WithAcquisitionID.size());
@@ -967,19 +1507,163 @@ void EigerFan::HandleControlMessage(zmq::message_t &message, zmq::message_t &idM
 
       // Add Number of messages received
       rapidjson::Value keyMessagesReceived("messages_received", document.GetAllocator());
-      rapidjson::Value valueMessagesReceived(broker.messages_received());
+      rapidjson::Value valueMessagesReceived(broker->messages_received());
       document.AddMember(keyMessagesReceived, valueMessagesReceived, document.GetAllocator());
 
+      // Add depth of the queue between the ingest engine and the fan
+      rapidjson::Value keyQueueDepth("rx_queue_depth", document.GetAllocator());
+      rapidjson::Value valueQueueDepth(static_cast<uint64_t>(rx_queue_.depth()));
+      document.AddMember(keyQueueDepth, valueQueueDepth, document.GetAllocator());
+
+      // Add high water mark of the queue for this acquisition
+      rapidjson::Value keyQueueMaxDepth("rx_queue_max_depth", document.GetAllocator());
+      rapidjson::Value valueQueueMaxDepth(static_cast<uint64_t>(rx_queue_.max_depth()));
+      document.AddMember(keyQueueMaxDepth, valueQueueMaxDepth, document.GetAllocator());
+
+      // Add number of bytes received from the detector
+      rapidjson::Value keyBytesReceived("bytes_received", document.GetAllocator());
+      rapidjson::Value valueBytesReceived(broker->bytes_received());
+      document.AddMember(keyBytesReceived, valueBytesReceived, document.GetAllocator());
+
+      // Add current number of ingest workers
+      rapidjson::Value keyWorkers("ingest_workers", document.GetAllocator());
+      rapidjson::Value valueWorkers(broker->worker_count());
+      document.AddMember(keyWorkers, valueWorkers, document.GetAllocator());
+
       // Add Number of Frames sent
       rapidjson::Value keyFramesSent("frames_sent", document.GetAllocator());
       rapidjson::Value valueFramesSent(num_frames_sent);
       document.AddMember(keyFramesSent, valueFramesSent, document.GetAllocator());
 
+      // Add frames sent for each phase of the trigger cycle
+      rapidjson::Value keyPhaseFrames("phase_frames_sent", document.GetAllocator());
+      rapidjson::Value valuePhaseFrames(rapidjson::kArrayType);
+      {
+        boost::lock_guard<boost::mutex> lock(phaseMutex);
+        for (size_t i = 0; i < phaseFramesSent.size(); i++) {
+          valuePhaseFrames.PushBack(phaseFramesSent[i], document.GetAllocator());
+        }
+      }
+      document.AddMember(keyPhaseFrames, valuePhaseFrames, document.GetAllocator());
+
       // Add current offset being applied to the fan distribution
       rapidjson::Value keyOffset("fan_offset", document.GetAllocator());
       rapidjson::Value valueOffset(currentOffset);
       document.AddMember(keyOffset, valueOffset, document.GetAllocator());
 
+      // Add number of frames sent through shared transports, over TCP for lack of a buffer, and bad buffers lent
+      uint64_t sharedFrames = 0;
+      uint64_t sharedUnavailable = 0;
+      uint64_t sharedRejected = 0;
+      for (int i = 0; i < consumers.size(); i++) {
+        if (consumers[i].sharedWriter) {
+          sharedFrames += consumers[i].sharedWriter->frames_written();
+          sharedUnavailable += consumers[i].sharedWriter->frames_unavailable();
+          sharedRejected += consumers[i].sharedWriter->buffers_rejected();
+        }
+      }
+      rapidjson::Value keySharedFrames("shared_frames_sent", document.GetAllocator());
+      rapidjson::Value valueSharedFrames(sharedFrames);
+      document.AddMember(keySharedFrames, valueSharedFrames, document.GetAllocator());
+      rapidjson::Value keySharedUnavailable("shared_buffers_unavailable", document.GetAllocator());
+      rapidjson::Value valueSharedUnavailable(sharedUnavailable);
+      document.AddMember(keySharedUnavailable, valueSharedUnavailable, document.GetAllocator());
+      rapidjson::Value keySharedRejected("shared_buffers_rejected", document.GetAllocator());
+      rapidjson::Value valueSharedRejected(sharedRejected);
+      document.AddMember(keySharedRejected, valueSharedRejected, document.GetAllocator());
+
+      // Add bytes queued, peak bytes queued and images dropped per consumer, then for the forwarding socket
+      rapidjson::Value valueQueued(rapidjson::kArrayType);
+      rapidjson::Value valuePeakQueued(rapidjson::kArrayType);
+      rapidjson::Value valueBudgetDropped(rapidjson::kArrayType);
+      for (int i = 0; i < config.num_consumers + 1; i++) {
+        valueQueued.PushBack(rapidjson::Value(sendBudget->queued_bytes(i)), document.GetAllocator());
+        valuePeakQueued.PushBack(rapidjson::Value(sendBudget->peak_queued_bytes(i)), document.GetAllocator());
+        valueBudgetDropped.PushBack(rapidjson::Value(sendBudget->dropped_frames(i)), document.GetAllocator());
+      }
+      rapidjson::Value keyQueued("queued_bytes", document.GetAllocator());
+      document.AddMember(keyQueued, valueQueued, document.GetAllocator());
+      rapidjson::Value keyPeakQueued("peak_queued_bytes", document.GetAllocator());
+      document.AddMember(keyPeakQueued, valuePeakQueued, document.GetAllocator());
+      rapidjson::Value keyBudgetDropped("budget_dropped_frames", document.GetAllocator());
+      document.AddMember(keyBudgetDropped, valueBudgetDropped, document.GetAllocator());
+
+      // Add messages waiting in each consumer's overflow store, and messages spilled to file
+      rapidjson::Value valueOverflowDepth(rapidjson::kArrayType);
+      rapidjson::Value valueOverflowSpilled(rapidjson::kArrayType);
+      for (int i = 0; i < consumers.size(); i++) {
+        uint64_t depth = consumers[i].overflow ? consumers[i].overflow->depth() : 0;
+        uint64_t spilled = consumers[i].overflow ? consumers[i].overflow->spilled_messages() : 0;
+        valueOverflowDepth.PushBack(rapidjson::Value(depth), document.GetAllocator());
+        valueOverflowSpilled.PushBack(rapidjson::Value(spilled), document.GetAllocator());
+      }
+      rapidjson::Value keyOverflowDepth("overflow_depth", document.GetAllocator());
+      document.AddMember(keyOverflowDepth, valueOverflowDepth, document.GetAllocator());
+      rapidjson::Value keyOverflowSpilled("overflow_spilled", document.GetAllocator());
+      document.AddMember(keyOverflowSpilled, valueOverflowSpilled, document.GetAllocator());
+
+      // Add sequence number of the last message sent through the control lanes
+      rapidjson::Value keyLaneSequence("control_lane_sequence", document.GetAllocator());
+      rapidjson::Value valueLaneSequence(controlLaneSequence);
+      document.AddMember(keyLaneSequence, valueLaneSequence, document.GetAllocator());
+
+      // Add number of images compressed by the fan, and the bytes before and after
+      uint64_t compressedFrames = compressor ? compressor->frames_compressed() : 0;
+      uint64_t compressedBytesIn = compressor ? compressor->bytes_in() : 0;
+      uint64_t compressedBytesOut = compressor ? compressor->bytes_out() : 0;
+      rapidjson::Value keyCompressedFrames("compressed_frames", document.GetAllocator());
+      document.AddMember(keyCompressedFrames, rapidjson::Value(compressedFrames), document.GetAllocator());
+      rapidjson::Value keyCompressedBytesIn("compressed_bytes_in", document.GetAllocator());
+      document.AddMember(keyCompressedBytesIn, rapidjson::Value(compressedBytesIn), document.GetAllocator());
+      rapidjson::Value keyCompressedBytesOut("compressed_bytes_out", document.GetAllocator());
+      document.AddMember(keyCompressedBytesOut, rapidjson::Value(compressedBytesOut), document.GetAllocator());
+
+      // Add messages received while spinning and after blocking, by the rx thread and the ingest workers
+      rapidjson::Value keyRxSpinHits("rx_spin_hits", document.GetAllocator());
+      document.AddMember(keyRxSpinHits, rapidjson::Value(rx_queue_.spin_hits()), document.GetAllocator());
+      rapidjson::Value keyRxWakeups("rx_wakeups", document.GetAllocator());
+      document.AddMember(keyRxWakeups, rapidjson::Value(rx_queue_.wakeups()), document.GetAllocator());
+      rapidjson::Value keyIngestSpinHits("ingest_spin_hits", document.GetAllocator());
+      document.AddMember(keyIngestSpinHits, rapidjson::Value(broker->spin_hits()), document.GetAllocator());
+      rapidjson::Value keyIngestWakeups("ingest_wakeups", document.GetAllocator());
+      document.AddMember(keyIngestWakeups, rapidjson::Value(broker->wakeups()), document.GetAllocator());
+
+      // Add series ended by the stall watchdog and the last frame sent before the most recent
+      rapidjson::Value keyStalls("stalls_detected", document.GetAllocator());
+      document.AddMember(keyStalls, rapidjson::Value(stallsDetected), document.GetAllocator());
+      rapidjson::Value keyStallFrame("last_stall_frame", document.GetAllocator());
+      document.AddMember(keyStallFrame, rapidjson::Value(lastStallFrame), document.GetAllocator());
+      rapidjson::Value keyLateMessages("late_messages_discarded", document.GetAllocator());
+      document.AddMember(keyLateMessages, rapidjson::Value(lateMessagesDiscarded), document.GetAllocator());
+
+      // Add acquisition IDs queued for the next series
+      rapidjson::Value keyAcqIDQueue(CONTROL_ACQ_ID_QUEUE, document.GetAllocator());
+      rapidjson::Value valueAcqIDQueue(rapidjson::kArrayType);
+      {
+        boost::lock_guard<boost::mutex> lock(acquisitionQueueMutex);
+        for (size_t i = 0; i < acquisitionQueue.size(); i++) {
+          rapidjson::Value entry(rapidjson::kObjectType);
+          rapidjson::Value keyEntryAcqID(CONTROL_ACQ_ID, document.GetAllocator());
+          rapidjson::Value valueEntryAcqID(acquisitionQueue[i].acquisitionID, document.GetAllocator());
+          entry.AddMember(keyEntryAcqID, valueEntryAcqID, document.GetAllocator());
+          if (acquisitionQueue[i].hasOffset) {
+            rapidjson::Value keyEntryOffset(CONTROL_OFFSET, document.GetAllocator());
+            entry.AddMember(keyEntryOffset, rapidjson::Value(acquisitionQueue[i].offset), document.GetAllocator());
+          }
+          if (acquisitionQueue[i].blockSize > 0) {
+            rapidjson::Value keyEntryBlockSize(CONTROL_BLOCK_SIZE, document.GetAllocator());
+            entry.AddMember(keyEntryBlockSize, rapidjson::Value(acquisitionQueue[i].blockSize), document.GetAllocator());
+          }
+          valueAcqIDQueue.PushBack(entry, document.GetAllocator());
+        }
+      }
+      document.AddMember(keyAcqIDQueue, valueAcqIDQueue, document.GetAllocator());
+
+      // Add number of images held waiting for a coordinated series to start
+      rapidjson::Value keyHeld("held_messages", document.GetAllocator());
+      rapidjson::Value valueHeld(static_cast<uint64_t>(heldMessageCount.load()));
+      document.AddMember(keyHeld, valueHeld, document.GetAllocator());
+
       rapidjson::StringBuffer buffer;
       rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
 
@@ -999,6 +1683,14 @@ void EigerFan::HandleControlMessage(zmq::message_t &message, zmq::message_t &idM
       rapidjson::Value valueNumThreads(config.num_threads);
       document.AddMember(keyNumThreads, valueNumThreads, document.GetAllocator());
 
+      // Add worker thread bounds
+      rapidjson::Value keyMinThreads(CONTROL_MIN_THREADS, document.GetAllocator());
+      rapidjson::Value valueMinThreads(config.min_threads);
+      document.AddMember(keyMinThreads, valueMinThreads, document.GetAllocator());
+      rapidjson::Value keyMaxThreads(CONTROL_MAX_THREADS, document.GetAllocator());
+      rapidjson::Value valueMaxThreads(config.max_threads);
+      document.AddMember(keyMaxThreads, valueMaxThreads, document.GetAllocator());
+
       // Add Number of 0MQ context threads
       rapidjson::Value keyNumZMQContextThreads("num_zmq_context_threads", document.GetAllocator());
       rapidjson::Value valueNumZMQContextThreads(config.num_zmq_context_threads);
@@ -1036,9 +1728,111 @@ void EigerFan::HandleControlMessage(zmq::message_t &message, zmq::message_t &idM
 
       // Add block size
       rapidjson::Value keyBlockSize(CONTROL_BLOCK_SIZE, document.GetAllocator());
-      rapidjson::Value valueBlockSize(config.block_size);
+      rapidjson::Value valueBlockSize(GetBlockSize());
       document.AddMember(keyBlockSize, valueBlockSize, document.GetAllocator());
 
+      // Add upstream fan consumers
+      rapidjson::Value keyUpstreamConsumers(CONTROL_UPSTREAM_CONSUMERS, document.GetAllocator());
+      rapidjson::Value valueUpstreamConsumers(config.upstream_consumers);
+      document.AddMember(keyUpstreamConsumers, valueUpstreamConsumers, document.GetAllocator());
+
+      // Add upstream fan block size
+      rapidjson::Value keyUpstreamBlockSize(CONTROL_UPSTREAM_BLOCK_SIZE, document.GetAllocator());
+      rapidjson::Value valueUpstreamBlockSize(config.upstream_block_size);
+      document.AddMember(keyUpstreamBlockSize, valueUpstreamBlockSize, document.GetAllocator());
+
+      // Add stream protocol
+      rapidjson::Value keyStreamProtocol(CONTROL_STREAM_PROTOCOL, document.GetAllocator());
+      rapidjson::Value valueStreamProtocol(config.stream_protocol, document.GetAllocator());
+      document.AddMember(keyStreamProtocol, valueStreamProtocol, document.GetAllocator());
+
+      // Add ingest engine
+      rapidjson::Value keyIngestEngine(CONTROL_INGEST_ENGINE, document.GetAllocator());
+      rapidjson::Value valueIngestEngine(config.ingest_engine, document.GetAllocator());
+      document.AddMember(keyIngestEngine, valueIngestEngine, document.GetAllocator());
+
+      // Add coordinator and the name of this instance
+      rapidjson::Value keyCoordinator(CONTROL_COORDINATOR, document.GetAllocator());
+      rapidjson::Value valueCoordinator(config.coordinator_endpoint, document.GetAllocator());
+      document.AddMember(keyCoordinator, valueCoordinator, document.GetAllocator());
+      rapidjson::Value keyInstanceName(CONTROL_INSTANCE_NAME, document.GetAllocator());
+      rapidjson::Value valueInstanceName(config.instance_name, document.GetAllocator());
+      document.AddMember(keyInstanceName, valueInstanceName, document.GetAllocator());
+
+      // Add memory budget for the send queues and the policy when it is used up
+      rapidjson::Value keyMemoryBudget(CONTROL_MEMORY_BUDGET, document.GetAllocator());
+      rapidjson::Value valueMemoryBudget(config.memory_budget);
+      document.AddMember(keyMemoryBudget, valueMemoryBudget, document.GetAllocator());
+      rapidjson::Value keyBudgetPolicy(CONTROL_BUDGET_POLICY, document.GetAllocator());
+      rapidjson::Value valueBudgetPolicy(config.budget_policy, document.GetAllocator());
+      document.AddMember(keyBudgetPolicy, valueBudgetPolicy, document.GetAllocator());
+
+      // Add non-blocking send settings
+      rapidjson::Value keyNonblocking(CONTROL_NONBLOCKING_SEND, document.GetAllocator());
+      rapidjson::Value valueNonblocking;
+      valueNonblocking.SetBool(config.nonblocking_send);
+      document.AddMember(keyNonblocking, valueNonblocking, document.GetAllocator());
+      rapidjson::Value keyOverflowRam(CONTROL_OVERFLOW_RAM, document.GetAllocator());
+      rapidjson::Value valueOverflowRam(config.overflow_ram);
+      document.AddMember(keyOverflowRam, valueOverflowRam, document.GetAllocator());
+      rapidjson::Value keySpillDir(CONTROL_SPILL_DIR, document.GetAllocator());
+      rapidjson::Value valueSpillDir(config.spill_dir, document.GetAllocator());
+      document.AddMember(keySpillDir, valueSpillDir, document.GetAllocator());
+
+      // Add compression of uncompressed images
+      rapidjson::Value keyCompression(CONTROL_COMPRESSION, document.GetAllocator());
+      rapidjson::Value valueCompression(config.compression, document.GetAllocator());
+      document.AddMember(keyCompression, valueCompression, document.GetAllocator());
+      rapidjson::Value keyCompressionThreads(CONTROL_COMPRESSION_THREADS, document.GetAllocator());
+      rapidjson::Value valueCompressionThreads(config.compression_threads);
+      document.AddMember(keyCompressionThreads, valueCompressionThreads, document.GetAllocator());
+
+      // Add trigger phase routing period
+      rapidjson::Value keyPhasePeriod(CONTROL_PHASE_PERIOD, document.GetAllocator());
+      int phasePeriod;
+      {
+        boost::lock_guard<boost::mutex> lock(phaseMutex);
+        phasePeriod = config.phase_period;
+      }
+      rapidjson::Value valuePhasePeriod(phasePeriod);
+      document.AddMember(keyPhasePeriod, valuePhasePeriod, document.GetAllocator());
+
+      // Add busy-poll and thread pinning settings
+      rapidjson::Value keySpinCount(CONTROL_SPIN_COUNT, document.GetAllocator());
+      rapidjson::Value valueSpinCount(config.spin_count);
+      document.AddMember(keySpinCount, valueSpinCount, document.GetAllocator());
+      rapidjson::Value keyRxCpu(CONTROL_RX_CPU, document.GetAllocator());
+      rapidjson::Value valueRxCpu(config.rx_cpu);
+      document.AddMember(keyRxCpu, valueRxCpu, document.GetAllocator());
+      rapidjson::Value keyIngestCpus(CONTROL_INGEST_CPUS, document.GetAllocator());
+      rapidjson::Value valueIngestCpus(rapidjson::kArrayType);
+      for (size_t i = 0; i < config.ingest_cpus.size(); i++) {
+        valueIngestCpus.PushBack(config.ingest_cpus[i], document.GetAllocator());
+      }
+      document.AddMember(keyIngestCpus, valueIngestCpus, document.GetAllocator());
+
+      // Add stall watchdog settings
+      rapidjson::Value keyStallTimeout(CONTROL_STALL_TIMEOUT, document.GetAllocator());
+      rapidjson::Value valueStallTimeout(config.stall_timeout_ms);
+      document.AddMember(keyStallTimeout, valueStallTimeout, document.GetAllocator());
+      rapidjson::Value keyStallIntervals(CONTROL_STALL_INTERVALS, document.GetAllocator());
+      rapidjson::Value valueStallIntervals(config.stall_intervals);
+      document.AddMember(keyStallIntervals, valueStallIntervals, document.GetAllocator());
+
+      // Add control lane port start
+      rapidjson::Value keyLanePort(CONTROL_CONTROL_LANE_PORT, document.GetAllocator());
+      rapidjson::Value valueLanePort(config.control_lane_port_start);
+      document.AddMember(keyLanePort, valueLanePort, document.GetAllocator());
+
+      // Add shared transport per rank
+      rapidjson::Value keySharedTransport(CONTROL_SHARED_TRANSPORT, document.GetAllocator());
+      rapidjson::Value valueSharedTransport(rapidjson::kArrayType);
+      for (int i = 0; i < config.shared_transports.size(); i++) {
+        rapidjson::Value transport(config.shared_transports[i], document.GetAllocator());
+        valueSharedTransport.PushBack(transport, document.GetAllocator());
+      }
+      document.AddMember(keySharedTransport, valueSharedTransport, document.GetAllocator());
+
       // Add configured offset value
       rapidjson::Value keyOffset(CONTROL_OFFSET, document.GetAllocator());
       rapidjson::Value valueOffset(configuredOffset);
@@ -1144,6 +1938,30 @@ void EigerFan::HandleControlMessage(zmq::message_t &message, zmq::message_t &idM
           LOG4CXX_INFO(log, "Acquisition ID changed to " << configuredAcquisitionID);
           replyString.assign(CONTROL_RESPONSE_OK.c_str());
         }
+        if (paramsValue.HasMember(CONTROL_ACQ_ID_QUEUE.c_str()) || paramsValue.HasMember(CONTROL_QUEUE_ACQ_ID.c_str())) {
+          // Replace the acquisition ID queue and/or add to the end of it
+          std::vector<QueuedAcquisition> replacement;
+          std::vector<QueuedAcquisition> additions;
+          bool replace = paramsValue.HasMember(CONTROL_ACQ_ID_QUEUE.c_str());
+          bool valid = true;
+          if (replace) {
+            valid = ParseQueuedAcquisitions(paramsValue[CONTROL_ACQ_ID_QUEUE.c_str()], replacement);
+          }
+          if (valid && paramsValue.HasMember(CONTROL_QUEUE_ACQ_ID.c_str())) {
+            valid = ParseQueuedAcquisitions(paramsValue[CONTROL_QUEUE_ACQ_ID.c_str()], additions);
+          }
+          if (valid) {
+            boost::lock_guard<boost::mutex> lock(acquisitionQueueMutex);
+            if (replace) {
+              acquisitionQueue.assign(replacement.begin(), replacement.end());
+            }
+            acquisitionQueue.insert(acquisitionQueue.end(), additions.begin(), additions.end());
+            LOG4CXX_INFO(log, "Acquisition ID queue changed to " << acquisitionQueue.size() << " entries");
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          } else {
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          }
+        }
         if (paramsValue.HasMember(CONTROL_FWD_STREAM.c_str())) {
           // Change whether to forward the stream or not
           forwardStream = paramsValue[CONTROL_FWD_STREAM.c_str()].GetBool();
@@ -1163,8 +1981,126 @@ void EigerFan::HandleControlMessage(zmq::message_t &message, zmq::message_t &idM
         }
         if (paramsValue.HasMember(CONTROL_BLOCK_SIZE.c_str())) {
           // Change the block size
-          config.block_size = paramsValue[CONTROL_BLOCK_SIZE.c_str()].GetInt();
-          LOG4CXX_INFO(log, "Block size changed to " << config.block_size);
+          int blockSize = paramsValue[CONTROL_BLOCK_SIZE.c_str()].GetInt();
+          SetBlockSize(blockSize);
+          LOG4CXX_INFO(log, "Block size changed to " << blockSize);
+          replyString.assign(CONTROL_RESPONSE_OK.c_str());
+        }
+        if (paramsValue.HasMember(CONTROL_MIN_THREADS.c_str()) || paramsValue.HasMember(CONTROL_MAX_THREADS.c_str())) {
+          // Change the bounds the ingest worker pool is resized within
+          int minThreads = config.min_threads;
+          int maxThreads = config.max_threads;
+          if (paramsValue.HasMember(CONTROL_MIN_THREADS.c_str())) {
+            minThreads = paramsValue[CONTROL_MIN_THREADS.c_str()].GetInt();
+          }
+          if (paramsValue.HasMember(CONTROL_MAX_THREADS.c_str())) {
+            maxThreads = paramsValue[CONTROL_MAX_THREADS.c_str()].GetInt();
+          }
+          if (config.upstream_consumers > 0 && maxThreads > 1) {
+            LOG4CXX_ERROR(log, "Only a single connection can be made to an upstream EigerFan");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (broker->set_thread_bounds(minThreads, maxThreads)) {
+            config.min_threads = minThreads;
+            config.max_threads = maxThreads;
+            LOG4CXX_INFO(log, "Ingest thread bounds changed to " << minThreads << " - " << maxThreads);
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          } else {
+            LOG4CXX_ERROR(log, "Unable to set ingest thread bounds to " << minThreads << " - " << maxThreads);
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          }
+        }
+        if (paramsValue.HasMember(CONTROL_UPSTREAM_BLOCK_SIZE.c_str())) {
+          // Change the block size of the upstream fan, only possible between acquisitions
+          int upstreamBlockSize = paramsValue[CONTROL_UPSTREAM_BLOCK_SIZE.c_str()].GetInt();
+          if (upstreamBlockSize < 1) {
+            LOG4CXX_ERROR(log, "Invalid upstream block size " << upstreamBlockSize);
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (state == DSTR_HEADER || state == DSTR_IMAGE) {
+            LOG4CXX_ERROR(log, "Cannot change upstream block size during an acquisition");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else {
+            config.upstream_block_size = upstreamBlockSize;
+            LOG4CXX_INFO(log, "Upstream block size changed to " << config.upstream_block_size);
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          }
+        }
+        if (paramsValue.HasMember(CONTROL_STREAM_PROTOCOL.c_str())) {
+          // Change the detector stream protocol, only possible between acquisitions
+          std::string protocol = paramsValue[CONTROL_STREAM_PROTOCOL.c_str()].GetString();
+          if (protocol.compare(STREAM_PROTOCOL_LEGACY) != 0 && protocol.compare(STREAM_PROTOCOL_STREAM2) != 0) {
+            LOG4CXX_ERROR(log, "Unknown stream protocol " << protocol);
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (state == DSTR_HEADER || state == DSTR_IMAGE) {
+            LOG4CXX_ERROR(log, "Cannot change stream protocol during an acquisition");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else {
+            config.stream_protocol = protocol;
+            stream2Requested = protocol.compare(STREAM_PROTOCOL_STREAM2) == 0;
+            LOG4CXX_INFO(log, "Stream protocol changed to " << config.stream_protocol);
+            if (stream2Requested && compressRequested) {
+              LOG4CXX_WARN(log, "Compression only applies to the legacy stream - stream2 images are sent as received");
+            }
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          }
+        }
+        if (paramsValue.HasMember(CONTROL_COMPRESSION.c_str())) {
+          // Change the compression of uncompressed images, only possible between acquisitions
+          std::string compression = paramsValue[CONTROL_COMPRESSION.c_str()].GetString();
+          if (compression.compare(COMPRESSION_NONE) != 0 && compression.compare(COMPRESSION_BSLZ4) != 0) {
+            LOG4CXX_ERROR(log, "Unknown compression " << compression);
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (compression.compare(COMPRESSION_BSLZ4) == 0 && !compressor) {
+            LOG4CXX_ERROR(log, "Image compression is not available - built without LZ4");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (state == DSTR_HEADER || state == DSTR_IMAGE) {
+            LOG4CXX_ERROR(log, "Cannot change compression during an acquisition");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else {
+            config.compression = compression;
+            compressRequested = config.compression.compare(COMPRESSION_BSLZ4) == 0;
+            LOG4CXX_INFO(log, "Compression changed to " << config.compression);
+            if (stream2Requested && compressRequested) {
+              LOG4CXX_WARN(log, "Compression only applies to the legacy stream - stream2 images are sent as received");
+            }
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          }
+        }
+        if (paramsValue.HasMember(CONTROL_STALL_TIMEOUT.c_str())) {
+          // Change the minimum time without messages before a series is ended as stalled
+          config.stall_timeout_ms = paramsValue[CONTROL_STALL_TIMEOUT.c_str()].GetInt();
+          stallTimeoutMs = config.stall_timeout_ms;
+          LOG4CXX_INFO(log, "Stall timeout changed to " << config.stall_timeout_ms << " ms");
+          replyString.assign(CONTROL_RESPONSE_OK.c_str());
+        }
+        if (paramsValue.HasMember(CONTROL_PHASE_PERIOD.c_str())) {
+          // Change the routing of frames by trigger phase, only possible between acquisitions
+          int phasePeriod = paramsValue[CONTROL_PHASE_PERIOD.c_str()].GetInt();
+          if (phasePeriod > 1 && (config.upstream_consumers > 0 || config.num_consumers % phasePeriod != 0)) {
+            LOG4CXX_ERROR(log, "Phase routing needs a multiple of " << phasePeriod << " consumers and no upstream EigerFan");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else if (state == DSTR_HEADER || state == DSTR_IMAGE) {
+            LOG4CXX_ERROR(log, "Cannot change phase period during an acquisition");
+            replyString.assign(CONTROL_RESPONSE_UNABLE.c_str());
+          } else {
+            {
+              boost::lock_guard<boost::mutex> lock(phaseMutex);
+              config.phase_period = phasePeriod;
+            }
+            LOG4CXX_INFO(log, "Phase period changed to " << phasePeriod);
+            replyString.assign(CONTROL_RESPONSE_OK.c_str());
+          }
+        }
+        if (paramsValue.HasMember(CONTROL_SPIN_COUNT.c_str())) {
+          // Change the non-blocking receives the rx path tries before blocking
+          SetSpinCount(paramsValue[CONTROL_SPIN_COUNT.c_str()].GetUint());
+          LOG4CXX_INFO(log, "Spin count changed to " << config.spin_count);
+          replyString.assign(CONTROL_RESPONSE_OK.c_str());
+        }
+        if (paramsValue.HasMember(CONTROL_STALL_INTERVALS.c_str())) {
+          // Change the mean frame intervals without messages before a series is ended as stalled
+          config.stall_intervals = paramsValue[CONTROL_STALL_INTERVALS.c_str()].GetInt();
+          stallIntervals = config.stall_intervals;
+          LOG4CXX_INFO(log, "Stall intervals changed to " << config.stall_intervals);
           replyString.assign(CONTROL_RESPONSE_OK.c_str());
         }
       } else {
@@ -1226,18 +2162,24 @@ void EigerFan::SendMessageToAllConsumers(zmq::message_t& message, int flags) {
   {
     zmq::message_t forwardingMessageCopy;
     forwardingMessageCopy.copy(&message);
-    if (forwardSocket.send(forwardingMessageCopy, flags) == false) {
+    if (SendTracked(forwardSocket, config.num_consumers, forwardingMessageCopy, flags) == false) {
       LOG4CXX_ERROR(log, "Send socket returned false for forwarding socket");
     }
   }
 
+  if (config.control_lane_port_start > 0) {
+    std::vector<zmq::message_t*> messageList(1, &message);
+    SendThroughControlLane(messageList);
+    return;
+  }
+
   LOG4CXX_DEBUG(log, "Sending message to all consumers. Number of consumers = " << GetNumberOfConnectedConsumers());
   // Make as many copies as necessary (number to send minus 1) and send them
   for (int i = 0; i < numConsumersToSendTo-1; i++) {
     if (consumers.at(i).connected > 0) {
       zmq::message_t messageCopy;
       messageCopy.copy(&message);
-      if (consumers.at(i).sendSocket->send(messageCopy, flags) == false) {
+      if (SendToConsumer(i, messageCopy, flags) == false) {
         LOG4CXX_ERROR(log, "Send socket returned false");
       }
     } else {
@@ -1246,7 +2188,7 @@ void EigerFan::SendMessageToAllConsumers(zmq::message_t& message, int flags) {
   }
   // Send the actual message for the last one
   if (consumers.at(numConsumersToSendTo-1).connected > 0) {
-    if (consumers.at(numConsumersToSendTo-1).sendSocket->send(message, flags) == false) {
+    if (SendToConsumer(numConsumersToSendTo-1, message, flags) == false) {
       LOG4CXX_ERROR(log, "Send socket returned false");
     }
   } else {
@@ -1273,17 +2215,23 @@ void EigerFan::SendMessagesToAllConsumers(std::vector<zmq::message_t*> &messageL
       zmq::message_t forwardingMessageCopy;
       forwardingMessageCopy.copy(messageList[messageCount]);
       if (messageCount != messageListSize - 1) {
-        if (forwardSocket.send(forwardingMessageCopy, ZMQ_SNDMORE) == false) {
+        if (SendTracked(forwardSocket, config.num_consumers, forwardingMessageCopy, ZMQ_SNDMORE) == false) {
           LOG4CXX_ERROR(log, "Send socket returned false for forwarding socket");
         }
       } else {
-        if (forwardSocket.send(forwardingMessageCopy) == false) {
+        if (SendTracked(forwardSocket, config.num_consumers, forwardingMessageCopy) == false) {
           LOG4CXX_ERROR(log, "Send socket returned false for forwarding socket");
         }
       }
     }
   }
 
+  if (config.control_lane_port_start > 0) {
+    SendThroughControlLane(messageList);
+    messageList.clear();
+    return;
+  }
+
   LOG4CXX_DEBUG(log, "Sending multiple messages to all consumers. Number of consumers = " << GetNumberOfConnectedConsumers());
   // Make as many copies as necessary (number to send minus 1) and send them
   for (int consumerCount = 0; consumerCount < numConsumersToSendTo-1; consumerCount++) {
@@ -1293,11 +2241,11 @@ void EigerFan::SendMessagesToAllConsumers(std::vector<zmq::message_t*> &messageL
         zmq::message_t messageCopy;
         messageCopy.copy(messageList[messageCount]);
         if (messageCount != messageListSize - 1) {
-          if (consumers.at(consumerCount).sendSocket->send(messageCopy, ZMQ_SNDMORE) == false) {
+          if (SendToConsumer(consumerCount, messageCopy, ZMQ_SNDMORE) == false) {
             LOG4CXX_ERROR(log, "Send socket returned false");
           }
         } else {
-          if (consumers.at(consumerCount).sendSocket->send(messageCopy) == false) {
+          if (SendToConsumer(consumerCount, messageCopy) == false) {
             LOG4CXX_ERROR(log, "Send socket returned false");
           }
         }
@@ -1311,11 +2259,11 @@ void EigerFan::SendMessagesToAllConsumers(std::vector<zmq::message_t*> &messageL
     for (int messageCount = 0; messageCount < messageListSize; messageCount++)
     {
       if (messageCount != messageListSize - 1) {
-        if (consumers.at(numConsumersToSendTo-1).sendSocket->send(*messageList[messageCount], ZMQ_SNDMORE) == false) {
+        if (SendToConsumer(numConsumersToSendTo-1, *messageList[messageCount], ZMQ_SNDMORE) == false) {
           LOG4CXX_ERROR(log, "Send socket returned false");
         }
       } else {
-        if (consumers.at(numConsumersToSendTo-1).sendSocket->send(*messageList[messageCount]) == false) {
+        if (SendToConsumer(numConsumersToSendTo-1, *messageList[messageCount]) == false) {
           LOG4CXX_ERROR(log, "Send socket returned false");
         }
       }
@@ -1340,18 +2288,18 @@ void EigerFan::SendMessageToSingleConsumer(zmq::message_t& message, int flags) {
   LOG4CXX_DEBUG(log, "Sending message to single consumer at index:" << currentConsumerIndexToSendTo);
 
   //Send the message to the forwarding stream
-  if (forwardStream && numConnectedForwardingSockets > 0)
+  if (forwardStream && numConnectedForwardingSockets > 0 && forwardCurrentImage)
   {
     zmq::message_t forwardingMessageCopy;
     forwardingMessageCopy.copy(&message);
-    if (forwardSocket.send(forwardingMessageCopy, flags) == false) {
+    if (SendTracked(forwardSocket, config.num_consumers, forwardingMessageCopy, flags) == false) {
       LOG4CXX_ERROR(log, "Send socket returned false for forwarding socket");
     }
   }
 
   // Send the message to a consumer
   if (consumers.at(currentConsumerIndexToSendTo).connected > 0) {
-    if (consumers.at(currentConsumerIndexToSendTo).sendSocket->send(message, flags) == false) {
+    if (SendToConsumer(currentConsumerIndexToSendTo, message, flags) == false) {
       LOG4CXX_ERROR(log, "Send socket returned false");
     }
   } else {
@@ -1361,6 +2309,449 @@ void EigerFan::SendMessageToSingleConsumer(zmq::message_t& message, int flags) {
   LOG4CXX_DEBUG(log, "Finished Sending message to single consumer");
 }
 
+/**
+ * Send the payload part of an image message to the appropriate consumer
+ *
+ * If the consumer is on this host the payload is written into a buffer it has
+ * lent through its shared transport and only a descriptor is sent. Otherwise,
+ * or if no buffer is lent, the payload is sent over TCP. The forwarding stream
+ * needs the payload itself, so the shared transport is not used while forwarding.
+ *
+ * \param[in] message The zeromq message containing the payload
+ * \param[in] flags Any flags to apply to the message (e.g. more messages to come)
+ */
+void EigerFan::SendPayloadToSingleConsumer(zmq::message_t& message, int flags) {
+  EigerConsumer& consumer = consumers.at(currentConsumerIndexToSendTo);
+  bool forwarding = forwardStream && numConnectedForwardingSockets > 0 && forwardCurrentImage;
+  if (consumer.sharedWriter && consumer.connected > 0 && !forwarding) {
+    SharedFrameDescriptor descriptor;
+    if (consumer.sharedWriter->write(message.data(), message.size(), descriptor)) {
+      zmq::message_t descriptorMessage(sizeof(descriptor));
+      memcpy(descriptorMessage.data(), &descriptor, sizeof(descriptor));
+      if (SendToConsumer(currentConsumerIndexToSendTo, descriptorMessage, flags) == false) {
+        LOG4CXX_ERROR(log, "Send socket returned false");
+      }
+      return;
+    }
+  }
+  SendMessageToSingleConsumer(message, flags);
+}
+
+/**
+ * Send a message to all consumers through their control lanes
+ *
+ * Each consumer receives the message on its control lane behind a fence with
+ * the next sequence number, and the fence alone on its image socket in the
+ * place of the message. The header and end messages then do not wait behind
+ * queued images, and the consumer applies each one when it reaches its fence,
+ * so it is still in order with the images either side of it.
+ *
+ * \param[in] messageList The list of zeromq messages to send
+ */
+void EigerFan::SendThroughControlLane(std::vector<zmq::message_t*> &messageList) {
+  controlLaneSequence++;
+  std::ostringstream fence;
+  fence << FENCE_MESSAGE_PREFIX << controlLaneSequence << "}";
+  std::string fenceString = fence.str();
+
+  LOG4CXX_DEBUG(log, "Sending message " << controlLaneSequence << " through control lanes. Number of consumers = " << GetNumberOfConnectedConsumers());
+  for (int consumerCount = 0; consumerCount < config.num_consumers; consumerCount++) {
+    if (consumers.at(consumerCount).connected > 0) {
+      zmq::message_t laneFence(fenceString.size());
+      memcpy(laneFence.data(), fenceString.data(), fenceString.size());
+      if (SendTracked(*consumers[consumerCount].laneSocket, consumerCount, laneFence, ZMQ_SNDMORE) == false) {
+        LOG4CXX_ERROR(log, "Control lane socket returned false");
+      }
+      for (int messageCount = 0; messageCount < messageList.size(); messageCount++) {
+        zmq::message_t messageCopy;
+        messageCopy.copy(messageList[messageCount]);
+        int flags = messageCount != messageList.size() - 1 ? ZMQ_SNDMORE : 0;
+        if (SendTracked(*consumers[consumerCount].laneSocket, consumerCount, messageCopy, flags) == false) {
+          LOG4CXX_ERROR(log, "Control lane socket returned false");
+        }
+      }
+
+      zmq::message_t imageFence(fenceString.size());
+      memcpy(imageFence.data(), fenceString.data(), fenceString.size());
+      if (SendToConsumer(consumerCount, imageFence) == false) {
+        LOG4CXX_ERROR(log, "Send socket returned false");
+      }
+    } else {
+      LOG4CXX_ERROR(log, "Consumer with rank " << consumerCount << " not connected");
+    }
+  }
+}
+
+/**
+ * Announce the size of the next stream2 message to all consumers
+ *
+ * The consumers receive the message into a buffer of that size rather than a
+ * frame buffer. Messages sent through the control lane need no notice, as
+ * their size is known when they are applied.
+ *
+ * \param[in] size Size of the CBOR part of the message
+ */
+void EigerFan::SendSizeNotice(size_t size) {
+  std::ostringstream notice;
+  notice << SIZE_NOTICE_PREFIX << size << "}";
+  std::string noticeString = notice.str();
+
+  for (int consumerCount = 0; consumerCount < config.num_consumers; consumerCount++) {
+    if (consumers.at(consumerCount).connected > 0) {
+      zmq::message_t noticeMessage(noticeString.size());
+      memcpy(noticeMessage.data(), noticeString.data(), noticeString.size());
+      if (SendToConsumer(consumerCount, noticeMessage) == false) {
+        LOG4CXX_ERROR(log, "Send socket returned false");
+      }
+    }
+  }
+}
+
+/**
+ * Send a message, counting it against the memory budget of its destination
+ *
+ * \param[in] socket The socket to send on
+ * \param[in] destination The consumer rank, or the number of consumers for the forwarding socket
+ * \param[in] message The zeromq message to send
+ * \param[in] flags Any flags to apply to the message (e.g. more messages to come)
+ */
+bool EigerFan::SendTracked(zmq::socket_t &socket, size_t destination, zmq::message_t &message, int flags) {
+  return sendBudget->send(socket, message, destination, flags);
+}
+
+/**
+ * Send a message to a consumer
+ *
+ * When sending without blocking, a message the consumer cannot take yet is
+ * moved to its overflow store, as is every later message until the store has
+ * drained, so the consumer still receives messages in order. Only the first
+ * part of a message can be refused, so the decision is made there and applies
+ * to every part of the message. A refused message is given back uncounted by
+ * the budget, so it is only counted once it is sent from the store.
+ *
+ * \param[in] rank The consumer rank
+ * \param[in] message The zeromq message to send
+ * \param[in] flags Any flags to apply to the message (e.g. more messages to come)
+ */
+bool EigerFan::SendToConsumer(int rank, zmq::message_t &message, int flags) {
+  EigerConsumer& consumer = consumers.at(rank);
+  if (!consumer.overflow) {
+    return SendTracked(*consumer.sendSocket, rank, message, flags);
+  }
+
+  bool sent = true;
+  if (!consumer.midMessage) {
+    DrainOverflow(rank);
+    consumer.overflowing = !consumer.overflow->empty() || !ConsumerWritable(rank);
+    if (!consumer.overflowing) {
+      sent = SendTracked(*consumer.sendSocket, rank, message, flags | ZMQ_DONTWAIT);
+      consumer.overflowing = !sent;
+    }
+  } else if (!consumer.overflowing) {
+    sent = SendTracked(*consumer.sendSocket, rank, message, flags);
+  }
+  if (consumer.overflowing) {
+    consumer.overflow->append(message, flags & ZMQ_SNDMORE);
+    sent = true;
+  }
+  consumer.midMessage = flags & ZMQ_SNDMORE;
+  return sent;
+}
+
+/**
+ * Send stored messages to a consumer until it stops taking them
+ *
+ * \param[in] rank The consumer rank
+ */
+void EigerFan::DrainOverflow(int rank) {
+  EigerConsumer& consumer = consumers.at(rank);
+  if (!consumer.overflow || consumer.midMessage) {
+    return;
+  }
+  while (!consumer.overflow->empty() && ConsumerWritable(rank)) {
+    OverflowMessage& stored = consumer.overflow->front();
+    if (!stored.empty()) {
+      int more = stored.size() > 1 ? ZMQ_SNDMORE : 0;
+      if (!SendTracked(*consumer.sendSocket, rank, *stored[0], more | ZMQ_DONTWAIT)) {
+        return;
+      }
+      for (size_t i = 1; i < stored.size(); i++) {
+        more = i < stored.size() - 1 ? ZMQ_SNDMORE : 0;
+        SendTracked(*consumer.sendSocket, rank, *stored[i], more);
+      }
+    }
+    consumer.overflow->pop_front();
+  }
+}
+
+/**
+ * Send stored messages to every consumer with messages in its overflow store
+ */
+void EigerFan::DrainOverflows() {
+  for (int i = 0; i < consumers.size(); i++) {
+    DrainOverflow(i);
+  }
+}
+
+/**
+ * Check whether a consumer's send queue can take another message
+ *
+ * \param[in] rank The consumer rank
+ */
+bool EigerFan::ConsumerWritable(int rank) {
+  int events = 0;
+  size_t eventsSize = sizeof(events);
+  consumers.at(rank).sendSocket->getsockopt(ZMQ_EVENTS, &events, &eventsSize);
+  return events & ZMQ_POLLOUT;
+}
+
+/**
+ * Check whether any consumer has messages waiting in its overflow store
+ */
+bool EigerFan::OverflowPending() {
+  for (int i = 0; i < consumers.size(); i++) {
+    if (consumers[i].overflow && !consumers[i].overflow->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Check the current consumer and the forwarding socket have budget for an image
+ *
+ * Under the block policy this waits for the consumer to take queued messages,
+ * which pushes back through the rx queue onto the detector stream, draining
+ * the overflow stores while it waits so other consumers are not held up. Under the
+ * drop policy the image is dropped and counted. Forwarding never holds up the
+ * consumers - an image the forwarding socket has no budget for is not forwarded.
+ *
+ * \param[in] bytes Size of the image data
+ * \return false if the image should be dropped
+ */
+bool EigerFan::AdmitImage(uint64_t bytes) {
+  if (forwardStream && numConnectedForwardingSockets > 0 && !sendBudget->has_space(config.num_consumers, bytes)) {
+    sendBudget->record_drop(config.num_consumers, bytes);
+    forwardCurrentImage = false;
+  }
+
+  if (config.budget_policy == BUDGET_POLICY_DROP) {
+    if (!sendBudget->has_space(currentConsumerIndexToSendTo, bytes)) {
+      sendBudget->record_drop(currentConsumerIndexToSendTo, bytes);
+      forwardCurrentImage = true;
+      return false;
+    }
+  } else if (!sendBudget->has_space(currentConsumerIndexToSendTo, bytes)) {
+    LOG4CXX_DEBUG(log, "Rank " << currentConsumerIndexToSendTo << " over budget - waiting");
+    while (true) {
+      bool overflowPending = OverflowPending();
+      if (overflowPending) {
+        DrainOverflows();
+      }
+      int timeout = overflowPending ? OVERFLOW_DRAIN_INTERVAL_MS : RX_QUEUE_TIMEOUT_MS;
+      if (sendBudget->wait_for_space(currentConsumerIndexToSendTo, bytes, timeout)) {
+        break;
+      }
+      if (killRequested) {
+        forwardCurrentImage = true;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Attach to the shared transports of co-located consumers
+ *
+ * Called at the start of each acquisition, so consumers that were started or
+ * restarted after the fan are picked up.
+ */
+void EigerFan::AttachSharedTransports() {
+  for (int i = 0; i < consumers.size(); i++) {
+    if (consumers[i].sharedWriter && !consumers[i].sharedWriter->attach()) {
+      LOG4CXX_WARN(log, "Shared transport " << consumers[i].sharedWriter->name()
+                   << " for rank " << i << " not ready - sending image data over TCP");
+    }
+  }
+}
+
+/**
+ * Handle messages from the coordinator
+ *
+ * \param[in] rxIdle True if the rx queue was empty, so any series being drained has been sent
+ */
+void EigerFan::HandleCoordinatorMessages(bool rxIdle) {
+  rapidjson::Document document;
+  while (coordinator->receive(document)) {
+    std::string type = document[COORDINATOR_MSG_TYPE_KEY.c_str()].GetString();
+    if (type == COORDINATOR_REGISTERED) {
+      int numConsumers = document[COORDINATOR_NUM_CONSUMERS_KEY.c_str()].GetInt();
+      if (numConsumers != config.num_consumers) {
+        LOG4CXX_ERROR(log, "Coordinator routes to " << numConsumers << " consumers but this instance has "
+                      << config.num_consumers << " - frames will be sent to the wrong consumers");
+      }
+      int blockSize = document[COORDINATOR_BLOCK_SIZE_KEY.c_str()].GetInt();
+      SetBlockSize(blockSize);
+      LOG4CXX_INFO(log, "Registered with coordinator as " << config.instance_name
+                   << " with block size " << blockSize);
+      if (document.HasMember(COORDINATOR_SERIES_KEY.c_str())) {
+        // Joined while a series is in progress
+        AdoptCoordinatedSeries(
+          document[COORDINATOR_SERIES_KEY.c_str()].GetInt(),
+          document[COORDINATOR_ACQ_ID_KEY.c_str()].GetString(),
+          document[COORDINATOR_OFFSET_KEY.c_str()].GetInt(),
+          blockSize
+        );
+      }
+    } else if (type == COORDINATOR_START) {
+      AdoptCoordinatedSeries(
+        document[COORDINATOR_SERIES_KEY.c_str()].GetInt(),
+        document[COORDINATOR_ACQ_ID_KEY.c_str()].GetString(),
+        document[COORDINATOR_OFFSET_KEY.c_str()].GetInt(),
+        document[COORDINATOR_BLOCK_SIZE_KEY.c_str()].GetInt()
+      );
+    } else if (type == COORDINATOR_END) {
+      drainSeries = document[COORDINATOR_SERIES_KEY.c_str()].GetInt();
+      LOG4CXX_INFO(log, "End of series " << drainSeries << " received by another instance - draining");
+    } else if (type == COORDINATOR_RELEASE_END) {
+      LOG4CXX_INFO(log, "All instances drained series " << document[COORDINATOR_SERIES_KEY.c_str()].GetInt()
+                   << " after " << document[COORDINATOR_FRAMES_KEY.c_str()].GetUint64() << " frames sent");
+      if (heldEndMessage.message) {
+        HeldMessage endMessage = heldEndMessage;
+        heldEndMessage = HeldMessage();
+        releasingEnd = true;
+        DispatchStreamMessage(*endMessage.message, endMessage.parts);
+        releasingEnd = false;
+      } else {
+        LOG4CXX_ERROR(log, "Coordinator released an end of series this instance does not hold");
+      }
+      seriesStarted = false;
+    } else {
+      LOG4CXX_ERROR(log, "Unknown coordinator message type " << type);
+    }
+  }
+
+  if (drainSeries >= 0 && rxIdle) {
+    SendDrained();
+  }
+}
+
+/**
+ * Check whether a series has been started by this or another instance
+ *
+ * \param[in] series The series of a received image
+ */
+bool EigerFan::CoordinatedSeriesStarted(int series) {
+  return seriesStarted && series == currentSeries;
+}
+
+/**
+ * Hold an image received before its series was started
+ *
+ * The global header goes to only one instance, so the others can receive
+ * images before the coordinator tells them the series has started.
+ *
+ * \param[in] message The first part of the message
+ * \param[in] parts The remaining parts of the message
+ */
+void EigerFan::HoldMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts) {
+  if (drainSeries >= 0) {
+    // An image from a later series means the series being drained has been sent
+    SendDrained();
+  }
+  if (heldMessages.size() >= MAX_HELD_MESSAGES) {
+    LOG4CXX_ERROR(log, "Too many images held waiting for a series to start - dropping image");
+    DiscardRemainingMessageParts(parts);
+    return;
+  }
+  HeldMessage held;
+  held.message.reset(new zmq::message_t());
+  held.message->move(&message);
+  held.parts = parts;
+  heldMessages.push_back(held);
+  heldMessageCount = heldMessages.size();
+}
+
+/**
+ * Hold the end of series until every instance has sent its frames
+ *
+ * \param[in] message The first part of the message
+ * \param[in] parts The remaining parts of the message
+ */
+void EigerFan::HoldEndMessage(zmq::message_t &message, boost::shared_ptr<MultipartMessage> parts) {
+  LOG4CXX_INFO(log, "Holding end of series " << currentSeries << " until all instances have drained");
+  heldEndMessage.message.reset(new zmq::message_t());
+  heldEndMessage.message->move(&message);
+  heldEndMessage.parts = parts;
+  coordinator->send_end(currentSeries);
+}
+
+/**
+ * Dispatch the images held before the current series was started
+ */
+void EigerFan::ReleaseHeldMessages() {
+  std::deque<HeldMessage> held;
+  held.swap(heldMessages);
+  heldMessageCount = 0;
+  if (!held.empty()) {
+    LOG4CXX_INFO(log, "Releasing " << held.size() << " images held before series " << currentSeries << " started");
+  }
+  for (std::deque<HeldMessage>::iterator it = held.begin(); it != held.end(); ++it) {
+    DispatchStreamMessage(*it->message, it->parts);
+  }
+}
+
+/**
+ * Tell the other instances this instance received the start of the current series
+ */
+void EigerFan::StartCoordinatedSeries() {
+  coordinator->send_start(currentSeries, currentAcquisitionID, currentOffset, seriesBlockSize);
+  seriesStarted = true;
+  ReleaseHeldMessages();
+}
+
+/**
+ * Start a series whose start was received by another instance
+ *
+ * \param[in] series The series number
+ * \param[in] acquisitionID The acquisition ID applied to the series
+ * \param[in] offset The offset applied to the series
+ * \param[in] blockSize The block size applied to the series
+ */
+void EigerFan::AdoptCoordinatedSeries(int series, const std::string& acquisitionID, int offset, int blockSize) {
+  if (seriesStarted && series == currentSeries) {
+    return;
+  }
+  if (drainSeries >= 0) {
+    SendDrained();
+  }
+  LOG4CXX_INFO(log, "Series " << series << " started by another instance with acquisition ID " << acquisitionID);
+  StartAcquisition();
+  currentSeries = series;
+  currentAcquisitionID = acquisitionID;
+  currentOffset = offset;
+  seriesBlockSize = blockSize;
+  seriesStarted = true;
+  state = DSTR_HEADER;
+  ReleaseHeldMessages();
+}
+
+/**
+ * Tell the coordinator this instance has sent all its frames for the series being drained
+ */
+void EigerFan::SendDrained() {
+  LOG4CXX_INFO(log, "Drained series " << drainSeries << " after " << num_frames_sent << " frames sent");
+  coordinator->send_drained(drainSeries, num_frames_sent);
+  if (!heldEndMessage.message) {
+    // The instance holding the end of series finishes the series when it is released
+    EndAcquisition();
+    state = WAITING_STREAM;
+    seriesStarted = false;
+  }
+  drainSeries = -1;
+}
+
 /**
  * Send a fabricated end message
  *
@@ -1370,6 +2761,28 @@ void EigerFan::SendMessageToSingleConsumer(zmq::message_t& message, int flags) {
 void EigerFan::SendFabricatedEndMessage() {
   LOG4CXX_INFO(log, "Sending Fabricated EndOfSeries Message");
 
+  if (stream2Protocol) {
+    CborWriter cbor;
+    cbor.write_map(2);
+    cbor.write_text(STREAM2_TYPE_KEY);
+    cbor.write_text(STREAM2_END_TYPE);
+    cbor.write_text(STREAM2_SERIES_ID_KEY);
+    cbor.write_uint(currentSeries);
+
+    zmq::message_t acquisitionIDMessage(currentAcquisitionID.size());
+    memcpy (acquisitionIDMessage.data (), currentAcquisitionID.c_str(), currentAcquisitionID.size());
+    zmq::message_t endMessage(cbor.str().size());
+    memcpy (endMessage.data (), cbor.str().data(), cbor.str().size());
+
+    std::vector<zmq::message_t*> messageList;
+    messageList.push_back(&acquisitionIDMessage);
+    messageList.push_back(&endMessage);
+    SendMessagesToAllConsumers(messageList);
+    state = DSTR_END;
+    LOG4CXX_DEBUG(log, "Finished Sending Fabricated EndOfSeries Message");
+    return;
+  }
+
   rapidjson::Document documentEoS;
   documentEoS.Parse(END_STREAM_MESSAGE.c_str());
 
@@ -1393,6 +2806,55 @@ void EigerFan::SendFabricatedEndMessage() {
   LOG4CXX_DEBUG(log, "Finished Sending Fabricated EndOfSeries Message");
 }
 
+/**
+ * End the current series if the detector stream has stalled
+ *
+ * Once images have started, a series is treated as stalled when no message
+ * has been received for the longer of the stall timeout and the configured
+ * number of mean frame intervals seen so far in the series. The consumers are
+ * sent a fabricated end so they can close their files and free their buffers
+ * rather than wait for frames that are not coming. Anything else received for
+ * the series is discarded.
+ */
+void EigerFan::CheckForStall() {
+  int timeoutSettingMs = stallTimeoutMs;
+  if (timeoutSettingMs <= 0 || state != DSTR_IMAGE || coordinator || num_frames_sent == 0) {
+    return;
+  }
+  boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+  int64_t idleMs = (now - lastStreamMessageTime).total_milliseconds();
+  int64_t meanIntervalMs = (lastStreamMessageTime - seriesStartTime).total_milliseconds() / num_frames_sent;
+  int64_t timeoutMs = std::max(static_cast<int64_t>(timeoutSettingMs), meanIntervalMs * stallIntervals);
+  if (idleMs < timeoutMs) {
+    return;
+  }
+
+  LOG4CXX_WARN(log, "Series " << currentSeries << " stalled - no messages for " << idleMs << " ms after frame "
+                    << lastFrameSent << " (mean frame interval " << meanIntervalMs << " ms)");
+  stallsDetected++;
+  lastStallFrame = lastFrameSent;
+  EndAcquisition();
+  SendFabricatedEndMessage();
+  seriesStalled = true;
+}
+
+/**
+ * Set the number of non-blocking receives the rx path tries before blocking
+ *
+ * Spinning saves the wakeup latency and scheduler jitter on each message, at
+ * the cost of keeping the rx thread and ingest workers busy while the stream
+ * is idle, so it is best combined with pinning them to dedicated CPUs.
+ *
+ * \param[in] spinCount Receives to try before blocking (0 to block straight away)
+ */
+void EigerFan::SetSpinCount(unsigned int spinCount) {
+  config.spin_count = spinCount;
+  rx_queue_.set_spin(spinCount);
+  if (!broker->set_spin(spinCount) && spinCount > 0) {
+    LOG4CXX_WARN(log, "Ingest engine " << config.ingest_engine << " does not busy-poll - only the rx queue will spin");
+  }
+}
+
 /**
  * Sets the configure number of consumers
  *
@@ -1412,9 +2874,14 @@ void EigerFan::SetNumberOfConsumers(int number) {
  * \return The string of the first message part which now also contains the acquisition id
  */
 std::string EigerFan::AddAcquisitionIDToPart1() {
-  rapidjson::Value keyAcquisitionID(Eiger::ACQUISITION_ID_KEY.c_str(), jsonDocument.GetAllocator());
-  rapidjson::Value valueAcquisitionID(currentAcquisitionID, jsonDocument.GetAllocator());
-  jsonDocument.AddMember(keyAcquisitionID, valueAcquisitionID, jsonDocument.GetAllocator());
+  if (jsonDocument.HasMember(Eiger::ACQUISITION_ID_KEY.c_str())) {
+    // Already added by an upstream fan
+    jsonDocument[Eiger::ACQUISITION_ID_KEY.c_str()].SetString(currentAcquisitionID, jsonDocument.GetAllocator());
+  } else {
+    rapidjson::Value keyAcquisitionID(Eiger::ACQUISITION_ID_KEY.c_str(), jsonDocument.GetAllocator());
+    rapidjson::Value valueAcquisitionID(currentAcquisitionID, jsonDocument.GetAllocator());
+    jsonDocument.AddMember(keyAcquisitionID, valueAcquisitionID, jsonDocument.GetAllocator());
+  }
 
   rapidjson::StringBuffer buffer;
   rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
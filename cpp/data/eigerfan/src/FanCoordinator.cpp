@@ -0,0 +1,360 @@
+#include "FanCoordinator.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "boost/date_time/posix_time/posix_time.hpp"
+
+#include "EigerDefinitions.h"
+
+using namespace Eiger;
+
+static const int COORDINATOR_POLL_MS = 100;
+// Time to wait for every instance to drain before releasing an end of series anyway
+static const int END_DRAIN_TIMEOUT_MS = 5000;
+
+/**
+ * Create a message of the given type
+ *
+ * \param[in] type The message type
+ */
+CoordinatorMessage::CoordinatorMessage(const std::string& type) {
+  document_.SetObject();
+  this->set(COORDINATOR_MSG_TYPE_KEY, type);
+}
+
+void CoordinatorMessage::set(const std::string& key, int value) {
+  rapidjson::Value keyValue(key, document_.GetAllocator());
+  document_.AddMember(keyValue, rapidjson::Value(value), document_.GetAllocator());
+}
+
+void CoordinatorMessage::set(const std::string& key, uint64_t value) {
+  rapidjson::Value keyValue(key, document_.GetAllocator());
+  document_.AddMember(keyValue, rapidjson::Value(value), document_.GetAllocator());
+}
+
+void CoordinatorMessage::set(const std::string& key, const std::string& value) {
+  rapidjson::Value keyValue(key, document_.GetAllocator());
+  rapidjson::Value valueValue(value, document_.GetAllocator());
+  document_.AddMember(keyValue, valueValue, document_.GetAllocator());
+}
+
+std::string CoordinatorMessage::encode() const {
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  document_.Accept(writer);
+  return buffer.GetString();
+}
+
+/**
+ * Parse a received message
+ *
+ * \param[in] message The received message
+ * \param[out] document The parsed message
+ * \return false if the message is not a coordinator message
+ */
+bool CoordinatorMessage::parse(zmq::message_t& message, rapidjson::Document& document) {
+  std::string json(static_cast<char*>(message.data()), message.size());
+  document.Parse(json.c_str());
+  return !document.HasParseError() && document.IsObject() &&
+         document.HasMember(COORDINATOR_MSG_TYPE_KEY.c_str()) && document[COORDINATOR_MSG_TYPE_KEY.c_str()].IsString();
+}
+
+/**
+ * Construct a coordinator to bind to endpoint
+ *
+ * \param[in] endpoint Endpoint for the instances to connect to
+ */
+FanCoordinator::FanCoordinator(const std::string& endpoint) :
+  endpoint_(endpoint),
+  ctx_(1),
+  stop_requested_(false),
+  num_consumers_(-1),
+  block_size_(-1),
+  series_active_(false),
+  series_(0),
+  offset_(0),
+  end_series_(-1)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.FanCoordinator");
+}
+
+FanCoordinator::~FanCoordinator() {
+  this->stop();
+}
+
+/**
+ * Start serving instances on a new thread
+ */
+void FanCoordinator::start() {
+  thread_ = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&FanCoordinator::run, this)));
+}
+
+/**
+ * Stop serving instances
+ */
+void FanCoordinator::stop() {
+  stop_requested_ = true;
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+}
+
+/**
+ * Entry point for the coordinator thread
+ */
+void FanCoordinator::run() {
+  zmq::socket_t socket(ctx_, ZMQ_ROUTER);
+  socket.setsockopt(ZMQ_LINGER, &LINGER_TIMEOUT, sizeof(LINGER_TIMEOUT));
+  socket.bind(endpoint_.c_str());
+  LOG4CXX_INFO(logger_, "Coordinating EigerFan instances on " << endpoint_);
+
+  zmq::pollitem_t poll_items[] = {{socket, 0, ZMQ_POLLIN, 0}};
+  while (!stop_requested_) {
+    zmq::poll(&poll_items[0], 1, COORDINATOR_POLL_MS);
+    if (poll_items[0].revents & ZMQ_POLLIN) {
+      zmq::message_t identity;
+      zmq::message_t message;
+      socket.recv(&identity);
+      socket.recv(&message);
+      std::string id(static_cast<char*>(identity.data()), identity.size());
+      rapidjson::Document document;
+      if (CoordinatorMessage::parse(message, document)) {
+        handle_message(socket, id, document);
+      } else {
+        LOG4CXX_ERROR(logger_, "Invalid coordinator message received");
+      }
+    }
+    check_drained(socket);
+  }
+  socket.close();
+}
+
+/**
+ * Handle a message from an instance
+ *
+ * \param[in] socket The coordinator socket
+ * \param[in] identity Socket identity of the instance
+ * \param[in] document The message
+ */
+void FanCoordinator::handle_message(zmq::socket_t& socket, const std::string& identity, rapidjson::Document& document) {
+  std::string type = document[COORDINATOR_MSG_TYPE_KEY.c_str()].GetString();
+
+  if (type == COORDINATOR_REGISTER) {
+    Instance instance;
+    instance.name = document[COORDINATOR_INSTANCE_KEY.c_str()].GetString();
+    instance.drained = false;
+    instance.frames_sent = 0;
+    instances_[identity] = instance;
+    if (num_consumers_ < 0) {
+      num_consumers_ = document[COORDINATOR_NUM_CONSUMERS_KEY.c_str()].GetInt();
+      block_size_ = document[COORDINATOR_BLOCK_SIZE_KEY.c_str()].GetInt();
+      LOG4CXX_INFO(logger_, "Routing table set by " << instance.name << ": "
+                   << num_consumers_ << " consumers with block size " << block_size_);
+    }
+    LOG4CXX_INFO(logger_, "Instance " << instance.name << " registered - " << instances_.size() << " instances");
+
+    // Reply with the routing table and the series in progress, if any
+    CoordinatorMessage reply(COORDINATOR_REGISTERED);
+    reply.set(COORDINATOR_NUM_CONSUMERS_KEY, num_consumers_);
+    reply.set(COORDINATOR_BLOCK_SIZE_KEY, block_size_);
+    if (series_active_) {
+      reply.set(COORDINATOR_SERIES_KEY, series_);
+      reply.set(COORDINATOR_ACQ_ID_KEY, acquisition_id_);
+      reply.set(COORDINATOR_OFFSET_KEY, offset_);
+    }
+    send(socket, identity, reply);
+
+  } else if (instances_.count(identity) == 0) {
+    LOG4CXX_ERROR(logger_, "Message " << type << " from an instance that has not registered");
+
+  } else if (type == COORDINATOR_START) {
+    series_active_ = true;
+    series_ = document[COORDINATOR_SERIES_KEY.c_str()].GetInt();
+    acquisition_id_ = document[COORDINATOR_ACQ_ID_KEY.c_str()].GetString();
+    offset_ = document[COORDINATOR_OFFSET_KEY.c_str()].GetInt();
+    block_size_ = document[COORDINATOR_BLOCK_SIZE_KEY.c_str()].GetInt();
+    LOG4CXX_INFO(logger_, "Series " << series_ << " started by " << instances_[identity].name
+                 << " with acquisition ID " << acquisition_id_);
+    CoordinatorMessage start(COORDINATOR_START);
+    start.set(COORDINATOR_SERIES_KEY, series_);
+    start.set(COORDINATOR_ACQ_ID_KEY, acquisition_id_);
+    start.set(COORDINATOR_OFFSET_KEY, offset_);
+    start.set(COORDINATOR_BLOCK_SIZE_KEY, block_size_);
+    for (std::map<std::string, Instance>::iterator it = instances_.begin(); it != instances_.end(); ++it) {
+      if (it->first != identity) {
+        send(socket, it->first, start);
+      }
+    }
+
+  } else if (type == COORDINATOR_END) {
+    end_series_ = document[COORDINATOR_SERIES_KEY.c_str()].GetInt();
+    end_holder_ = identity;
+    end_received_ = boost::posix_time::microsec_clock::universal_time();
+    LOG4CXX_INFO(logger_, "End of series " << end_series_ << " received by " << instances_[identity].name);
+    CoordinatorMessage end(COORDINATOR_END);
+    end.set(COORDINATOR_SERIES_KEY, end_series_);
+    for (std::map<std::string, Instance>::iterator it = instances_.begin(); it != instances_.end(); ++it) {
+      it->second.drained = false;
+      it->second.frames_sent = 0;
+      send(socket, it->first, end);
+    }
+
+  } else if (type == COORDINATOR_DRAINED) {
+    int series = document[COORDINATOR_SERIES_KEY.c_str()].GetInt();
+    if (series != end_series_) {
+      LOG4CXX_WARN(logger_, "Instance " << instances_[identity].name << " drained series " << series
+                   << " but waiting for series " << end_series_);
+    } else {
+      instances_[identity].drained = true;
+      instances_[identity].frames_sent = document[COORDINATOR_FRAMES_KEY.c_str()].GetUint64();
+    }
+
+  } else {
+    LOG4CXX_ERROR(logger_, "Unknown coordinator message type " << type);
+  }
+}
+
+/**
+ * Release the end of series once every instance has drained, or on timeout
+ *
+ * \param[in] socket The coordinator socket
+ */
+void FanCoordinator::check_drained(zmq::socket_t& socket) {
+  if (end_series_ < 0) {
+    return;
+  }
+
+  bool drained = true;
+  uint64_t frames_sent = 0;
+  for (std::map<std::string, Instance>::iterator it = instances_.begin(); it != instances_.end(); ++it) {
+    drained = drained && it->second.drained;
+    frames_sent += it->second.frames_sent;
+  }
+  boost::posix_time::time_duration waited = boost::posix_time::microsec_clock::universal_time() - end_received_;
+  if (!drained && waited.total_milliseconds() < END_DRAIN_TIMEOUT_MS) {
+    return;
+  }
+  if (!drained) {
+    for (std::map<std::string, Instance>::iterator it = instances_.begin(); it != instances_.end(); ++it) {
+      if (!it->second.drained) {
+        LOG4CXX_WARN(logger_, "Instance " << it->second.name << " did not drain series " << end_series_);
+      }
+    }
+  }
+
+  LOG4CXX_INFO(logger_, "Releasing end of series " << end_series_ << " after " << frames_sent
+               << " frames sent by " << instances_.size() << " instances");
+  CoordinatorMessage release(COORDINATOR_RELEASE_END);
+  release.set(COORDINATOR_SERIES_KEY, end_series_);
+  release.set(COORDINATOR_FRAMES_KEY, frames_sent);
+  send(socket, end_holder_, release);
+  end_series_ = -1;
+  series_active_ = false;
+}
+
+/**
+ * Send a message to one instance
+ *
+ * \param[in] socket The coordinator socket
+ * \param[in] identity Socket identity of the instance
+ * \param[in] message The message
+ */
+void FanCoordinator::send(zmq::socket_t& socket, const std::string& identity, const CoordinatorMessage& message) {
+  std::string json = message.encode();
+  socket.send(identity.c_str(), identity.size(), ZMQ_SNDMORE);
+  socket.send(json.c_str(), json.size());
+}
+
+/**
+ * Connect to the coordinator
+ *
+ * \param[in] ctx Context to create the socket in
+ * \param[in] endpoint Endpoint of the coordinator
+ * \param[in] name Name of this instance
+ */
+FanCoordinatorClient::FanCoordinatorClient(zmq::context_t& ctx, const std::string& endpoint, const std::string& name) :
+  name_(name),
+  socket_(ctx, ZMQ_DEALER)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.FanCoordinatorClient");
+  socket_.setsockopt(ZMQ_LINGER, &LINGER_TIMEOUT, sizeof(LINGER_TIMEOUT));
+  socket_.connect(endpoint.c_str());
+  LOG4CXX_INFO(logger_, "Instance " << name_ << " connecting to coordinator at " << endpoint);
+}
+
+/**
+ * Register with the coordinator, offering this instance's routing table
+ *
+ * \param[in] num_consumers Number of consumers
+ * \param[in] block_size Block size
+ */
+void FanCoordinatorClient::register_instance(int num_consumers, int block_size) {
+  CoordinatorMessage message(COORDINATOR_REGISTER);
+  message.set(COORDINATOR_INSTANCE_KEY, name_);
+  message.set(COORDINATOR_NUM_CONSUMERS_KEY, num_consumers);
+  message.set(COORDINATOR_BLOCK_SIZE_KEY, block_size);
+  send(message);
+}
+
+/**
+ * Tell the other instances a series has started
+ *
+ * \param[in] series The series number
+ * \param[in] acquisition_id The acquisition ID applied to the series
+ * \param[in] offset The offset applied to the series
+ * \param[in] block_size The block size applied to the series
+ */
+void FanCoordinatorClient::send_start(int series, const std::string& acquisition_id, int offset, int block_size) {
+  CoordinatorMessage message(COORDINATOR_START);
+  message.set(COORDINATOR_SERIES_KEY, series);
+  message.set(COORDINATOR_ACQ_ID_KEY, acquisition_id);
+  message.set(COORDINATOR_OFFSET_KEY, offset);
+  message.set(COORDINATOR_BLOCK_SIZE_KEY, block_size);
+  send(message);
+}
+
+/**
+ * Tell the coordinator this instance has received the end of series
+ *
+ * \param[in] series The series number
+ */
+void FanCoordinatorClient::send_end(int series) {
+  CoordinatorMessage message(COORDINATOR_END);
+  message.set(COORDINATOR_SERIES_KEY, series);
+  send(message);
+}
+
+/**
+ * Tell the coordinator this instance has sent all its frames for a series
+ *
+ * \param[in] series The series number
+ * \param[in] frames_sent Number of frames this instance sent
+ */
+void FanCoordinatorClient::send_drained(int series, uint64_t frames_sent) {
+  CoordinatorMessage message(COORDINATOR_DRAINED);
+  message.set(COORDINATOR_SERIES_KEY, series);
+  message.set(COORDINATOR_FRAMES_KEY, frames_sent);
+  send(message);
+}
+
+/**
+ * Receive the next message from the coordinator without blocking
+ *
+ * \param[out] document The message
+ * \return false if there is no message
+ */
+bool FanCoordinatorClient::receive(rapidjson::Document& document) {
+  zmq::message_t message;
+  while (socket_.recv(&message, ZMQ_DONTWAIT)) {
+    if (CoordinatorMessage::parse(message, document)) {
+      return true;
+    }
+    LOG4CXX_ERROR(logger_, "Invalid message from coordinator");
+  }
+  return false;
+}
+
+void FanCoordinatorClient::send(const CoordinatorMessage& message) {
+  std::string json = message.encode();
+  socket_.send(json.c_str(), json.size());
+}
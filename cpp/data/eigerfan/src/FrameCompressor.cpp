@@ -0,0 +1,285 @@
+#include <string.h>
+#include <algorithm>
+
+#ifdef EIGERFAN_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#include "FrameCompressor.h"
+
+// Bitshuffle block sizing, as used by the detector and the HDF5 filter
+static const size_t TARGET_BLOCK_BYTES = 8192;
+static const size_t BLOCK_MULTIPLE = 8;
+static const size_t MIN_BLOCK_ELEMENTS = 128;
+// Size of the header giving the uncompressed size and block size
+static const size_t HEADER_BYTES = 12;
+// Ranges each frame is split into per thread compressing it, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace {
+  void write_uint64_be(uint8_t* out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+      out[i] = value & 0xff;
+      value >>= 8;
+    }
+  }
+
+  void write_uint32_be(uint8_t* out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+      out[i] = value & 0xff;
+      value >>= 8;
+    }
+  }
+
+  /**
+   * Transpose an 8x8 bit matrix held one row per byte
+   */
+  uint64_t transpose_bits(uint64_t x) {
+    uint64_t t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+  }
+}
+
+/**
+ * Construct a compressor and start its workers
+ *
+ * \param[in] num_workers Number of worker threads (0 to compress on the calling thread only)
+ */
+FrameCompressor::FrameCompressor(size_t num_workers) :
+  stop_(false),
+  num_workers_(num_workers),
+  next_range_(0),
+  ranges_done_(0),
+  input_(NULL),
+  elem_size_(1),
+  num_ranges_(0),
+  frames_compressed_(0),
+  bytes_in_(0),
+  bytes_out_(0)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.FrameCompressor");
+  for (size_t i = 0; i < num_workers_; i++) {
+    workers_.create_thread(boost::bind(&FrameCompressor::worker_loop, this));
+  }
+}
+
+FrameCompressor::~FrameCompressor() {
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_ready_.notify_all();
+  workers_.join_all();
+}
+
+/**
+ * Check whether the fan was built with LZ4
+ */
+bool FrameCompressor::supported() {
+#ifdef EIGERFAN_HAS_LZ4
+  return true;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Number of elements in each bitshuffle block
+ *
+ * \param[in] elem_size Bytes per element
+ */
+size_t FrameCompressor::block_size(size_t elem_size) {
+  size_t elements = (TARGET_BLOCK_BYTES / elem_size / BLOCK_MULTIPLE) * BLOCK_MULTIPLE;
+  return std::max(elements, MIN_BLOCK_ELEMENTS);
+}
+
+/**
+ * Bitshuffle a block of elements
+ *
+ * The output holds one row of bits for each bit of an element, least
+ * significant first, and each row holds that bit of every element in turn.
+ *
+ * \param[in] in The elements
+ * \param[out] out The shuffled block, the same size as the input
+ * \param[in] elements Number of elements, a multiple of 8
+ * \param[in] elem_size Bytes per element
+ */
+void FrameCompressor::bitshuffle(const uint8_t* in, uint8_t* out, size_t elements, size_t elem_size) {
+  size_t row_bytes = elements / BLOCK_MULTIPLE;
+  for (size_t byte = 0; byte < elem_size; byte++) {
+    for (size_t group = 0; group < row_bytes; group++) {
+      // Take this byte of 8 elements, then transpose so each byte holds one bit of all 8
+      const uint8_t* element = in + group * BLOCK_MULTIPLE * elem_size + byte;
+      uint64_t x = 0;
+      for (size_t k = 0; k < BLOCK_MULTIPLE; k++) {
+        x |= static_cast<uint64_t>(element[k * elem_size]) << (8 * k);
+      }
+      x = transpose_bits(x);
+      uint8_t* row = out + byte * BLOCK_MULTIPLE * row_bytes + group;
+      for (size_t bit = 0; bit < BLOCK_MULTIPLE; bit++) {
+        row[bit * row_bytes] = x & 0xff;
+        x >>= 8;
+      }
+    }
+  }
+}
+
+/**
+ * Compress a frame
+ *
+ * Elements left over after the last multiple of 8 are copied uncompressed to
+ * the end, as the bitshuffle filter does.
+ *
+ * \param[in] in The uncompressed frame
+ * \param[in] elem_size Bytes per element
+ * \param[out] out The compressed frame
+ * \return false if the frame could not be compressed
+ */
+bool FrameCompressor::compress(const zmq::message_t& in, size_t elem_size, zmq::message_t& out) {
+  size_t bytes = in.size();
+  if (!supported() || elem_size == 0 || bytes % elem_size != 0) {
+    return false;
+  }
+  size_t elements = bytes / elem_size;
+  size_t block_elements = block_size(elem_size);
+  size_t full_blocks = elements / block_elements;
+  size_t last_block_elements = elements % block_elements;
+  last_block_elements -= last_block_elements % BLOCK_MULTIPLE;
+  size_t leftover_bytes = (elements % BLOCK_MULTIPLE) * elem_size;
+
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  // Split the full blocks into ranges, with the last partial block as a range of its own
+  size_t num_full_ranges = std::min(full_blocks, (num_workers_ + 1) * RANGES_PER_THREAD);
+  num_ranges_ = num_full_ranges + (last_block_elements > 0 ? 1 : 0);
+  if (ranges_.size() < num_ranges_) {
+    ranges_.resize(num_ranges_);
+  }
+  size_t first_block = 0;
+  for (size_t i = 0; i < num_full_ranges; i++) {
+    size_t num_blocks = full_blocks / num_full_ranges + (i < full_blocks % num_full_ranges ? 1 : 0);
+    ranges_[i].first_element = first_block * block_elements;
+    ranges_[i].num_blocks = num_blocks;
+    ranges_[i].block_elements = block_elements;
+    first_block += num_blocks;
+  }
+  if (last_block_elements > 0) {
+    ranges_[num_full_ranges].first_element = full_blocks * block_elements;
+    ranges_[num_full_ranges].num_blocks = 1;
+    ranges_[num_full_ranges].block_elements = last_block_elements;
+  }
+  input_ = static_cast<const uint8_t*>(in.data());
+  elem_size_ = elem_size;
+  next_range_ = 0;
+  ranges_done_ = 0;
+  work_ready_.notify_all();
+
+  // Compress ranges here too until they have all been taken
+  while (next_range_ < num_ranges_) {
+    Range& range = ranges_[next_range_++];
+    lock.unlock();
+    compress_range(range);
+    lock.lock();
+    ranges_done_++;
+  }
+  while (ranges_done_ < num_ranges_) {
+    work_done_.wait(lock);
+  }
+
+  size_t compressed = HEADER_BYTES + leftover_bytes;
+  for (size_t i = 0; i < num_ranges_; i++) {
+    if (!ranges_[i].ok) {
+      LOG4CXX_ERROR(logger_, "LZ4 compression failed");
+      return false;
+    }
+    compressed += ranges_[i].output_size;
+  }
+
+  out.rebuild(compressed);
+  uint8_t* output = static_cast<uint8_t*>(out.data());
+  write_uint64_be(output, bytes);
+  write_uint32_be(output + 8, block_elements * elem_size);
+  size_t offset = HEADER_BYTES;
+  for (size_t i = 0; i < num_ranges_; i++) {
+    memcpy(output + offset, ranges_[i].output.data(), ranges_[i].output_size);
+    offset += ranges_[i].output_size;
+  }
+  memcpy(output + offset, input_ + bytes - leftover_bytes, leftover_bytes);
+
+  frames_compressed_++;
+  bytes_in_ += bytes;
+  bytes_out_ += compressed;
+  return true;
+}
+
+/**
+ * Take ranges of the current frame to compress until told to stop
+ */
+void FrameCompressor::worker_loop() {
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (true) {
+    while (!stop_ && next_range_ >= num_ranges_) {
+      work_ready_.wait(lock);
+    }
+    if (stop_) {
+      return;
+    }
+    Range& range = ranges_[next_range_++];
+    lock.unlock();
+    compress_range(range);
+    lock.lock();
+    if (++ranges_done_ == num_ranges_) {
+      work_done_.notify_all();
+    }
+  }
+}
+
+/**
+ * Bitshuffle and compress each block of a range
+ *
+ * Each block is written as its compressed size, as a big endian 32 bit
+ * integer, followed by the LZ4 block.
+ *
+ * \param[in,out] range The range, holding its output on return
+ */
+void FrameCompressor::compress_range(Range& range) {
+  range.ok = false;
+  range.output_size = 0;
+#ifdef EIGERFAN_HAS_LZ4
+  size_t block_bytes = range.block_elements * elem_size_;
+  int bound = LZ4_compressBound(block_bytes);
+  range.shuffled.resize(block_bytes);
+  range.output.resize(range.num_blocks * (sizeof(uint32_t) + bound));
+  size_t offset = 0;
+  for (size_t i = 0; i < range.num_blocks; i++) {
+    const uint8_t* block = input_ + (range.first_element + i * range.block_elements) * elem_size_;
+    bitshuffle(block, range.shuffled.data(), range.block_elements, elem_size_);
+    int size = LZ4_compress_default(reinterpret_cast<const char*>(range.shuffled.data()),
+                                    reinterpret_cast<char*>(range.output.data() + offset + sizeof(uint32_t)),
+                                    block_bytes, bound);
+    if (size <= 0) {
+      return;
+    }
+    write_uint32_be(range.output.data() + offset, size);
+    offset += sizeof(uint32_t) + size;
+  }
+  range.output_size = offset;
+  range.ok = true;
+#endif
+}
+
+uint64_t FrameCompressor::frames_compressed() const {
+  return frames_compressed_;
+}
+
+uint64_t FrameCompressor::bytes_in() const {
+  return bytes_in_;
+}
+
+uint64_t FrameCompressor::bytes_out() const {
+  return bytes_out_;
+}
@@ -0,0 +1,223 @@
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <boost/thread.hpp>
+
+#include "MessageQueue.h"
+#include "ThreadTuning.h"
+
+static const int FULL_RETRY_US = 50;
+
+/**
+ * Construct a queue holding at least capacity messages
+ *
+ * \param[in] capacity Number of messages, rounded up to a power of 2
+ */
+MessageQueue::MessageQueue(size_t capacity) :
+  enqueue_pos_(0),
+  dequeue_pos_(0),
+  consumer_waiting_(false),
+  max_depth_(0),
+  spin_count_(0),
+  spin_hits_(0),
+  wakeups_(0)
+{
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  cells_ = new Cell[size];
+  for (size_t i = 0; i < size; i++) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+    cells_[i].message = NULL;
+  }
+  event_fd_ = eventfd(0, EFD_NONBLOCK);
+}
+
+MessageQueue::~MessageQueue() {
+  MultipartMessage* message;
+  while ((message = this->try_pop()) != NULL) {
+    delete message;
+  }
+  delete[] cells_;
+  close(event_fd_);
+}
+
+/**
+ * Add a message to the queue if there is space
+ *
+ * \param[in] message The message to add; the queue takes ownership on success
+ * \return false if the queue is full
+ */
+bool MessageQueue::try_push(MultipartMessage* message) {
+  Cell* cell;
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->message = message;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+
+  // Record the high water mark
+  size_t depth = pos + 1 - dequeue_pos_.load(std::memory_order_relaxed);
+  size_t max_depth = max_depth_.load(std::memory_order_relaxed);
+  while (depth > max_depth && !max_depth_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed)) {}
+
+  // Only make the syscall if the consumer is blocked on the eventfd
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (consumer_waiting_.load(std::memory_order_seq_cst)) {
+    uint64_t one = 1;
+    ssize_t rc = write(event_fd_, &one, sizeof(one));
+    (void) rc;
+  }
+  return true;
+}
+
+/**
+ * Add a message to the queue, waiting for space if it is full
+ *
+ * \param[in] message The message to add; the queue takes ownership on success
+ * \param[in] timeout_ms Time to wait for space
+ * \return false if the queue was still full after timeout_ms
+ */
+bool MessageQueue::push(MultipartMessage* message, int timeout_ms) {
+  int waited_us = 0;
+  while (!this->try_push(message)) {
+    if (waited_us >= timeout_ms * 1000) {
+      return false;
+    }
+    boost::this_thread::sleep(boost::posix_time::microseconds(FULL_RETRY_US));
+    waited_us += FULL_RETRY_US;
+  }
+  return true;
+}
+
+/**
+ * Take the next message from the queue if there is one
+ *
+ * Must only be called from the consumer thread.
+ *
+ * \return The message, owned by the caller, or NULL if the queue is empty
+ */
+MultipartMessage* MessageQueue::try_pop() {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell* cell = &cells_[pos & mask_];
+  size_t sequence = cell->sequence.load(std::memory_order_acquire);
+  if (sequence != pos + 1) {
+    return NULL;
+  }
+  MultipartMessage* message = cell->message;
+  cell->message = NULL;
+  cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+  dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+  return message;
+}
+
+/**
+ * Take the next message from the queue, blocking on the eventfd if it is empty
+ *
+ * If a spin count is set the queue is checked that many times before
+ * blocking. Must only be called from the consumer thread.
+ *
+ * \param[in] timeout_ms Time to wait for a message, or -1 to wait forever
+ * \return The message, owned by the caller, or NULL on timeout
+ */
+MultipartMessage* MessageQueue::pop(int timeout_ms) {
+  MultipartMessage* message = this->try_pop();
+  if (message != NULL) {
+    return message;
+  }
+
+  unsigned spin_count = spin_count_.load(std::memory_order_relaxed);
+  for (unsigned i = 0; i < spin_count; i++) {
+    CpuRelax();
+    message = this->try_pop();
+    if (message != NULL) {
+      spin_hits_.fetch_add(1, std::memory_order_relaxed);
+      return message;
+    }
+  }
+
+  consumer_waiting_.store(true, std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  message = this->try_pop();
+  if (message == NULL) {
+    struct pollfd poll_fd = {event_fd_, POLLIN, 0};
+    poll(&poll_fd, 1, timeout_ms);
+    uint64_t count;
+    ssize_t rc = read(event_fd_, &count, sizeof(count));
+    (void) rc;
+    message = this->try_pop();
+    if (message != NULL) {
+      wakeups_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  consumer_waiting_.store(false, std::memory_order_relaxed);
+  return message;
+}
+
+/**
+ * Set the number of attempts pop makes before blocking
+ *
+ * \param[in] spin_count Attempts to pop before blocking (0 to block straight away)
+ */
+void MessageQueue::set_spin(unsigned spin_count) {
+  spin_count_.store(spin_count, std::memory_order_relaxed);
+}
+
+/** Return the number of messages the queue can hold
+ *
+ */
+size_t MessageQueue::capacity() const {
+  return mask_ + 1;
+}
+
+/** Return the number of messages currently in the queue
+ *
+ */
+size_t MessageQueue::depth() const {
+  size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+  size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+  return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/** Return the largest depth seen since the last reset
+ *
+ */
+size_t MessageQueue::max_depth() const {
+  return max_depth_.load(std::memory_order_relaxed);
+}
+
+/** Reset the high water mark
+ *
+ */
+void MessageQueue::reset_max_depth() {
+  max_depth_.store(this->depth(), std::memory_order_relaxed);
+}
+
+/** Return the number of messages popped while spinning
+ *
+ */
+uint64_t MessageQueue::spin_hits() const {
+  return spin_hits_.load(std::memory_order_relaxed);
+}
+
+/** Return the number of messages popped after blocking
+ *
+ */
+uint64_t MessageQueue::wakeups() const {
+  return wakeups_.load(std::memory_order_relaxed);
+}
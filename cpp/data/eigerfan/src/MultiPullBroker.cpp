@@ -1,21 +1,37 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cmath>
 
 #include <log4cxx/logger.h>  // getLogger
+#include "boost/date_time/posix_time/posix_time.hpp"
 
 #include "EigerDefinitions.h"
 #include "MultiPullBroker.h"
+#include "ThreadTuning.h"
 
 using namespace Eiger;
 
-MultiPullBroker::MultiPullBroker(
-  std::string& sink_endpoint,
-  int thread_count
-) :
-  sink_endpoint_(sink_endpoint),
+// Worker pool sizing
+static const int ADAPT_INTERVAL_MS = 1000;
+static const double TARGET_UTILISATION = 0.7;  // Fraction of time workers should spend receiving
+static const int SHRINK_INTERVALS = 10;  // Intervals of low load before a worker is retired
+static const int DRAIN_TIMEOUT_MS = 100;
+
+MultiPullBroker::MultiPullBroker(int thread_count) :
+  queue_(NULL),
   thread_count_(thread_count),
+  min_threads_(thread_count),
+  max_threads_(thread_count),
+  active_workers_(0),
   messages_received_(0),
+  retired_bytes_received_(0),
+  retired_spin_hits_(0),
+  retired_wakeups_(0),
+  spin_count_(0),
+  next_cpu_(0),
+  shrink_intervals_(0),
   shutdown_requested_(false)
 {
   logger_ = log4cxx::Logger::getLogger("EigerFan.MultiPullBroker");
@@ -29,27 +45,36 @@ MultiPullBroker::~MultiPullBroker() {
  * Spawn worker threads to connect to endpoint
  *
  * \param[in] endpoint Endpoint of socket to pull data from
- * \param[in] inproc_context zmq context to create inproc socket in
+ * \param[in] queue Queue to push complete messages onto
  */
-void MultiPullBroker::connect(std::string& endpoint, void* inproc_context) {
-  // Store inproc context for workers to create sockets in
-  this->inproc_context_ = static_cast<zmq::context_t*>(inproc_context);
+void MultiPullBroker::connect(std::string& endpoint, MessageQueue* queue) {
+  // Store queue for workers to push messages onto
+  this->queue_ = queue;
+  this->source_endpoint_ = endpoint;
 
   LOG4CXX_INFO(logger_, "Spawning " << this->thread_count_ << " worker threads");
 
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
   for (int _i = 0; _i < this->thread_count_; _i++) {
-    worker_threads_.push_back(boost::shared_ptr<boost::thread>(
-      new boost::thread(boost::bind(&MultiPullBroker::worker_loop, this, endpoint))
-    ));
+    start_worker();
   }
+
+  supervisor_thread_ = boost::shared_ptr<boost::thread>(
+    new boost::thread(boost::bind(&MultiPullBroker::supervisor_loop, this))
+  );
 }
 
 /**
  * Entry point for worker threads
  *
  * \param[in] endpoint Endpoint of socket to pull data from
+ * \param[in] worker The worker state shared with the supervisor
  */
-void MultiPullBroker::worker_loop(std::string& endpoint) {
+void MultiPullBroker::worker_loop(std::string& endpoint, boost::shared_ptr<Worker> worker) {
+
+  if (worker->cpu >= 0 && !PinCurrentThread(worker->cpu)) {
+    LOG4CXX_WARN(this->logger_, "Unable to pin worker thread to CPU " << worker->cpu);
+  }
 
   // Create source in new isolated context
   // It is important to create a new context in each worker thread, as there are
@@ -61,49 +86,255 @@ void MultiPullBroker::worker_loop(std::string& endpoint) {
   source_socket.setsockopt(ZMQ_LINGER, &LINGER_TIMEOUT, sizeof(LINGER_TIMEOUT));
   source_socket.connect(endpoint.c_str());
 
-  // Create sink socket in context of main thread
-  // The sink sockets must use the context from the main thread to use the inproc://
-  // protocol. If it uses a different context the client will not see the messages.
-  zmq::socket_t sink_socket(*this->inproc_context_, ZMQ_PUSH);
-  sink_socket.setsockopt(ZMQ_SNDHWM, &WORKER_HWM, sizeof(WORKER_HWM));
-  sink_socket.setsockopt(ZMQ_LINGER, &LINGER_TIMEOUT, sizeof(LINGER_TIMEOUT));
-  sink_socket.connect(this->sink_endpoint_.c_str());
-
   // Initialise recv variables
   int more;
   size_t more_size = sizeof(more);
+  bool draining = false;
 
   // Run loop until asked to shutdown
   zmq::pollitem_t poll_items[] = {{source_socket, 0, ZMQ_POLLIN, 0}};
   while (!this->shutdown_requested_) {
-    zmq::message_t message;
+    if (worker->stop_requested && !draining) {
+      // Stop the detector sending to this worker, then receive what it has already sent
+      source_socket.disconnect(endpoint.c_str());
+      draining = true;
+    }
+
+    MultipartMessage* message = new MultipartMessage();
 
-    // Receive multi-part messages from source and forward to sink
+    // Receive multi-part messages from source and hand them to the fan as one
     more = 0;
+    bool timed_out = false;
     while (true) {
-      zmq::poll(&poll_items[0], 1, 1000);
-      if (!poll_items[0].revents & ZMQ_POLLIN) {
+      boost::shared_ptr<zmq::message_t> part(new zmq::message_t());
+      boost::posix_time::ptime poll_start = boost::posix_time::microsec_clock::universal_time();
+
+      // Try a bounded number of non-blocking receives before paying for a wakeup
+      bool received = false;
+      unsigned spin_count = draining ? 0 : this->spin_count_.load(std::memory_order_relaxed);
+      for (unsigned spin = 0; spin < spin_count && !received; spin++) {
+        received = source_socket.recv(part.get(), ZMQ_DONTWAIT);
+        if (!received) {
+          CpuRelax();
+        }
+      }
+      if (received) {
+        worker->spin_hits++;
+      } else {
+        zmq::poll(&poll_items[0], 1, draining ? DRAIN_TIMEOUT_MS : 1000);
+      }
+      worker->poll_us += (boost::posix_time::microsec_clock::universal_time() - poll_start).total_microseconds();
+      if (!received && !(poll_items[0].revents & ZMQ_POLLIN)) {
         if (more == 1) {
           LOG4CXX_WARN(this->logger_, "Timed out expecting more of multipart message");
         }
+        timed_out = true;
         break;
       }
 
-      source_socket.recv(&message);
+      if (!received) {
+        source_socket.recv(part.get());
+        worker->wakeups++;
+      }
+      message->add(part);
+      worker->bytes_received += part->size();
 
       source_socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
-      if (more == 1) {
-        sink_socket.send(message, ZMQ_SNDMORE);
-      } else {
-        sink_socket.send(message);
+      if (more != 1) {
+        // Wait for space in the queue, holding off the detector while the fan catches up
+        while (!this->queue_->push(message, 100)) {
+          if (this->shutdown_requested_) {
+            delete message;
+            break;
+          }
+        }
+        message = NULL;
         ++this->messages_received_;
         break;
       }
     }
+
+    // Discard anything left from an incomplete message
+    delete message;
+
+    if (draining && timed_out) {
+      break;
+    }
   }
 
   source_socket.close();
-  sink_socket.close();
+  worker->finished = true;
+}
+
+/**
+ * Entry point for the supervisor thread that resizes the worker pool
+ */
+void MultiPullBroker::supervisor_loop() {
+  boost::posix_time::ptime last = boost::posix_time::microsec_clock::universal_time();
+  while (!this->shutdown_requested_) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    double interval_s = (now - last).total_microseconds() / 1e6;
+    if (interval_s * 1000 >= ADAPT_INTERVAL_MS) {
+      adapt_workers(interval_s);
+      last = now;
+    }
+  }
+}
+
+/**
+ * Resize the worker pool for the rate measured over the last interval
+ *
+ * Each worker's busy fraction is the part of the interval it did not spend
+ * waiting in poll, so bytes/s divided by busy fraction estimates the rate one
+ * worker can sustain. The pool is sized so the measured rate keeps workers at
+ * TARGET_UTILISATION, within the configured bounds. Workers are added as soon
+ * as they are needed but only retired after SHRINK_INTERVALS of low load,
+ * because a retiring worker has to drain its connection.
+ *
+ * \param[in] interval_s Length of the interval in seconds
+ */
+void MultiPullBroker::adapt_workers(double interval_s) {
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
+
+  // Clean up workers that have finished draining
+  for (size_t i = 0; i < retired_workers_.size();) {
+    if (retired_workers_[i]->finished) {
+      retired_workers_[i]->thread->join();
+      retired_bytes_received_ += retired_workers_[i]->bytes_received;
+      retired_spin_hits_ += retired_workers_[i]->spin_hits;
+      retired_wakeups_ += retired_workers_[i]->wakeups;
+      retired_workers_.erase(retired_workers_.begin() + i);
+    } else {
+      i++;
+    }
+  }
+
+  int count = workers_.size();
+  double rate = 0.0;
+  double busy = 0.0;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker& worker = *workers_[i];
+    uint64_t bytes = worker.bytes_received;
+    uint64_t poll_us = worker.poll_us;
+    double worker_busy = 1.0 - (poll_us - worker.last_poll_us) / (interval_s * 1e6);
+    rate += (bytes - worker.last_bytes_received) / interval_s;
+    busy += std::max(0.0, std::min(1.0, worker_busy));
+    worker.last_bytes_received = bytes;
+    worker.last_poll_us = poll_us;
+  }
+
+  int required = min_threads_;
+  if (rate > 0 && busy > 0) {
+    double worker_capacity = rate / busy;
+    required = static_cast<int>(std::ceil(rate / (worker_capacity * TARGET_UTILISATION)));
+    LOG4CXX_DEBUG(logger_, "Ingest " << rate / 1e6 << " MB/s on " << count << " workers, "
+                  << worker_capacity / 1e6 << " MB/s per busy worker - " << required << " workers required");
+  }
+  required = std::max(static_cast<int>(min_threads_), std::min(static_cast<int>(max_threads_), required));
+
+  if (required > count) {
+    LOG4CXX_INFO(logger_, "Growing worker pool from " << count << " to " << required << " threads");
+    for (int i = count; i < required; i++) {
+      start_worker();
+    }
+    shrink_intervals_ = 0;
+  } else if (count > max_threads_) {
+    // Bounds have been lowered
+    LOG4CXX_INFO(logger_, "Shrinking worker pool from " << count << " to " << max_threads_ << " threads");
+    for (int i = max_threads_; i < count; i++) {
+      retire_worker();
+    }
+    shrink_intervals_ = 0;
+  } else if (required < count) {
+    if (++shrink_intervals_ >= SHRINK_INTERVALS) {
+      LOG4CXX_INFO(logger_, "Shrinking worker pool from " << count << " to " << count - 1 << " threads");
+      retire_worker();
+      shrink_intervals_ = 0;
+    }
+  } else {
+    shrink_intervals_ = 0;
+  }
+}
+
+/**
+ * Spawn a new worker thread; workers_mutex_ must be held
+ */
+void MultiPullBroker::start_worker() {
+  boost::shared_ptr<Worker> worker(new Worker);
+  worker->stop_requested = false;
+  worker->finished = false;
+  worker->bytes_received = 0;
+  worker->poll_us = 0;
+  worker->spin_hits = 0;
+  worker->wakeups = 0;
+  worker->cpu = -1;
+  if (!cpus_.empty()) {
+    worker->cpu = cpus_[next_cpu_++ % cpus_.size()];
+  }
+  worker->last_bytes_received = 0;
+  worker->last_poll_us = 0;
+  worker->thread = boost::shared_ptr<boost::thread>(
+    new boost::thread(boost::bind(&MultiPullBroker::worker_loop, this, this->source_endpoint_, worker))
+  );
+  workers_.push_back(worker);
+  active_workers_ = workers_.size();
+}
+
+/**
+ * Ask the most recently started worker to drain and stop; workers_mutex_ must be held
+ */
+void MultiPullBroker::retire_worker() {
+  boost::shared_ptr<Worker> worker = workers_.back();
+  workers_.pop_back();
+  worker->stop_requested = true;
+  retired_workers_.push_back(worker);
+  active_workers_ = workers_.size();
+}
+
+/**
+ * Set the bounds the worker pool is resized within
+ *
+ * \param[in] min_threads Minimum number of worker threads
+ * \param[in] max_threads Maximum number of worker threads
+ * \return true if the bounds are valid
+ */
+bool MultiPullBroker::set_thread_bounds(int min_threads, int max_threads) {
+  if (min_threads < 1 || max_threads < min_threads) {
+    LOG4CXX_ERROR(logger_, "Invalid worker thread bounds " << min_threads << " - " << max_threads);
+    return false;
+  }
+  this->min_threads_ = min_threads;
+  this->max_threads_ = max_threads;
+  LOG4CXX_INFO(logger_, "Worker thread bounds set to " << min_threads << " - " << max_threads);
+  return true;
+}
+
+/**
+ * Set the number of non-blocking receives workers try before blocking in poll
+ *
+ * \param[in] spin_count Receives to try before blocking (0 to block straight away)
+ * \return true, as the workers always support spinning
+ */
+bool MultiPullBroker::set_spin(unsigned spin_count) {
+  this->spin_count_ = spin_count;
+  return true;
+}
+
+/**
+ * Set the CPUs to pin workers to, in turn as they are started
+ *
+ * Only applies to workers started after it is called, so should be set
+ * before connecting.
+ *
+ * \param[in] cpus The CPUs (empty to leave workers unpinned)
+ * \return true, as the workers can always be pinned
+ */
+bool MultiPullBroker::set_cpus(const std::vector<int>& cpus) {
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
+  this->cpus_ = cpus;
+  this->next_cpu_ = 0;
+  return true;
 }
 
 /** Start the message counter, having received the first message
@@ -121,6 +352,62 @@ uint64_t MultiPullBroker::messages_received()
   return this->messages_received_;
 }
 
+/** Return number of bytes received from the detector
+ *
+ */
+uint64_t MultiPullBroker::bytes_received()
+{
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
+  uint64_t bytes = this->retired_bytes_received_;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    bytes += workers_[i]->bytes_received;
+  }
+  for (size_t i = 0; i < retired_workers_.size(); i++) {
+    bytes += retired_workers_[i]->bytes_received;
+  }
+  return bytes;
+}
+
+/** Return number of message parts received while spinning
+ *
+ */
+uint64_t MultiPullBroker::spin_hits()
+{
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
+  uint64_t spin_hits = this->retired_spin_hits_;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    spin_hits += workers_[i]->spin_hits;
+  }
+  for (size_t i = 0; i < retired_workers_.size(); i++) {
+    spin_hits += retired_workers_[i]->spin_hits;
+  }
+  return spin_hits;
+}
+
+/** Return number of message parts received after blocking in poll
+ *
+ */
+uint64_t MultiPullBroker::wakeups()
+{
+  boost::lock_guard<boost::mutex> lock(workers_mutex_);
+  uint64_t wakeups = this->retired_wakeups_;
+  for (size_t i = 0; i < workers_.size(); i++) {
+    wakeups += workers_[i]->wakeups;
+  }
+  for (size_t i = 0; i < retired_workers_.size(); i++) {
+    wakeups += retired_workers_[i]->wakeups;
+  }
+  return wakeups;
+}
+
+/** Return number of active worker threads
+ *
+ */
+int MultiPullBroker::worker_count()
+{
+  return this->active_workers_;
+}
+
 /**
  * Request to stop worker threads and shutdown
  */
@@ -130,7 +417,13 @@ void MultiPullBroker::shutdown() {
   }
 
   this->shutdown_requested_ = true;
-  for (int i = 0; i < this->worker_threads_.size(); ++i) {
-    this->worker_threads_[i]->join();
+  if (supervisor_thread_) {
+    supervisor_thread_->join();
+  }
+  for (int i = 0; i < this->workers_.size(); ++i) {
+    this->workers_[i]->thread->join();
+  }
+  for (int i = 0; i < this->retired_workers_.size(); ++i) {
+    this->retired_workers_[i]->thread->join();
   }
 }
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "OverflowStore.h"
+
+/**
+ * Construct an empty store
+ *
+ * \param[in] spill_path File to spill to once the memory limit is reached
+ * \param[in] ram_limit Bytes to hold in memory before spilling
+ */
+OverflowStore::OverflowStore(const std::string& spill_path, uint64_t ram_limit) :
+  spill_path_(spill_path),
+  ram_limit_(ram_limit),
+  ram_bytes_(0),
+  spill_fd_(-1),
+  spill_write_offset_(0),
+  spill_read_offset_(0),
+  spill_depth_(0),
+  spilled_messages_(0),
+  spilled_bytes_(0)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.OverflowStore");
+}
+
+OverflowStore::~OverflowStore() {
+  if (spill_fd_ >= 0) {
+    close(spill_fd_);
+    unlink(spill_path_.c_str());
+  }
+}
+
+/**
+ * Append a part, storing the message once its last part is appended
+ *
+ * \param[in] part The part, which is moved into the store
+ * \param[in] more True if more parts of the message follow
+ */
+void OverflowStore::append(zmq::message_t& part, bool more) {
+  boost::shared_ptr<zmq::message_t> stored(new zmq::message_t());
+  stored->move(&part);
+  current_.push_back(stored);
+  if (more) {
+    return;
+  }
+
+  uint64_t size = 0;
+  for (size_t i = 0; i < current_.size(); i++) {
+    size += current_[i]->size();
+  }
+  if (spill_depth_ == 0 && spill_front_.empty() && ram_bytes_ + size <= ram_limit_) {
+    ram_.push_back(current_);
+    ram_bytes_ += size;
+  } else if (spill(current_)) {
+    spilled_messages_++;
+    spilled_bytes_ += size;
+  } else {
+    // Keep the message in memory rather than lose it
+    ram_.push_back(current_);
+    ram_bytes_ += size;
+  }
+  current_.clear();
+}
+
+/**
+ * Check whether any complete messages are stored
+ */
+bool OverflowStore::empty() const {
+  return ram_.empty() && spill_depth_ == 0 && spill_front_.empty();
+}
+
+/**
+ * Return the oldest stored message
+ *
+ * Only valid if the store is not empty.
+ */
+OverflowMessage& OverflowStore::front() {
+  if (!ram_.empty()) {
+    return ram_.front();
+  }
+  if (spill_front_.empty() && !read_spilled(spill_front_)) {
+    LOG4CXX_ERROR(logger_, "Unable to read back message from " << spill_path_ << " - discarding spill file");
+    spill_depth_ = 0;
+    spill_read_offset_ = spill_write_offset_ = 0;
+    if (ftruncate(spill_fd_, 0) < 0) {
+      LOG4CXX_ERROR(logger_, "Unable to truncate " << spill_path_ << ": " << strerror(errno));
+    }
+  }
+  return spill_front_;
+}
+
+/**
+ * Remove the oldest stored message
+ */
+void OverflowStore::pop_front() {
+  if (!ram_.empty()) {
+    for (size_t i = 0; i < ram_.front().size(); i++) {
+      ram_bytes_ -= ram_.front()[i]->size();
+    }
+    ram_.pop_front();
+  } else {
+    spill_front_.clear();
+    if (spill_depth_ == 0 && spill_fd_ >= 0) {
+      // Everything has been read back, so start the file again
+      spill_read_offset_ = spill_write_offset_ = 0;
+      if (ftruncate(spill_fd_, 0) < 0) {
+        LOG4CXX_ERROR(logger_, "Unable to truncate " << spill_path_ << ": " << strerror(errno));
+      }
+    }
+  }
+}
+
+/**
+ * Write a message to the end of the spill file
+ *
+ * Each message is written as its number of parts, followed by the size and
+ * data of each part.
+ *
+ * \param[in] message The message
+ * \return false if the message could not be written
+ */
+bool OverflowStore::spill(const OverflowMessage& message) {
+  if (spill_fd_ < 0) {
+    spill_fd_ = open(spill_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spill_fd_ < 0) {
+      LOG4CXX_ERROR(logger_, "Unable to open spill file " << spill_path_ << ": " << strerror(errno));
+      return false;
+    }
+    LOG4CXX_INFO(logger_, "Spilling overflow to " << spill_path_);
+  }
+
+  off_t offset = spill_write_offset_;
+  uint32_t parts = message.size();
+  if (pwrite(spill_fd_, &parts, sizeof(parts), offset) != sizeof(parts)) {
+    LOG4CXX_ERROR(logger_, "Unable to write to spill file " << spill_path_ << ": " << strerror(errno));
+    return false;
+  }
+  offset += sizeof(parts);
+  for (size_t i = 0; i < message.size(); i++) {
+    uint64_t size = message[i]->size();
+    if (pwrite(spill_fd_, &size, sizeof(size), offset) != sizeof(size) ||
+        pwrite(spill_fd_, message[i]->data(), size, offset + sizeof(size)) != static_cast<ssize_t>(size)) {
+      LOG4CXX_ERROR(logger_, "Unable to write to spill file " << spill_path_ << ": " << strerror(errno));
+      return false;
+    }
+    offset += sizeof(size) + size;
+  }
+  spill_write_offset_ = offset;
+  spill_depth_++;
+  return true;
+}
+
+/**
+ * Read the next message back from the spill file
+ *
+ * \param[out] message The message
+ * \return false if the message could not be read
+ */
+bool OverflowStore::read_spilled(OverflowMessage& message) {
+  if (spill_depth_ == 0) {
+    return false;
+  }
+  off_t offset = spill_read_offset_;
+  uint32_t parts = 0;
+  if (pread(spill_fd_, &parts, sizeof(parts), offset) != sizeof(parts)) {
+    return false;
+  }
+  offset += sizeof(parts);
+  message.clear();
+  for (uint32_t i = 0; i < parts; i++) {
+    uint64_t size = 0;
+    if (pread(spill_fd_, &size, sizeof(size), offset) != sizeof(size)) {
+      return false;
+    }
+    boost::shared_ptr<zmq::message_t> part(new zmq::message_t(size));
+    if (pread(spill_fd_, part->data(), size, offset + sizeof(size)) != static_cast<ssize_t>(size)) {
+      return false;
+    }
+    message.push_back(part);
+    offset += sizeof(size) + size;
+  }
+  spill_read_offset_ = offset;
+  spill_depth_--;
+  return true;
+}
+
+size_t OverflowStore::depth() const {
+  return ram_.size() + spill_depth_ + (spill_front_.empty() ? 0 : 1);
+}
+
+uint64_t OverflowStore::ram_bytes() const {
+  return ram_bytes_;
+}
+
+size_t OverflowStore::spill_depth() const {
+  return spill_depth_;
+}
+
+uint64_t OverflowStore::spilled_messages() const {
+  return spilled_messages_;
+}
+
+uint64_t OverflowStore::spilled_bytes() const {
+  return spilled_bytes_;
+}
@@ -0,0 +1,202 @@
+#include "SendBudget.h"
+
+// Messages smaller than this are sent as normal and not counted
+static const size_t TRACK_MIN_BYTES = 1024;
+
+/**
+ * A message handed to 0MQ, kept until 0MQ releases its data
+ */
+struct SendBudget::TrackedMessage
+{
+  zmq::message_t message;
+  SendBudget* budget;
+  size_t destination;
+  size_t size;  // Bytes counted against the destination, 0 once given back
+};
+
+/**
+ * Construct a budget
+ *
+ * \param[in] budget_bytes Total bytes the send queues may hold (0 for no limit)
+ * \param[in] num_destinations Number of destinations sharing the budget
+ */
+SendBudget::SendBudget(uint64_t budget_bytes, size_t num_destinations) :
+  budget_(budget_bytes),
+  share_(num_destinations > 0 ? budget_bytes / num_destinations : budget_bytes),
+  num_destinations_(num_destinations),
+  destinations_(new Destination[num_destinations])
+{
+  for (size_t i = 0; i < num_destinations_; i++) {
+    destinations_[i].queued = 0;
+    destinations_[i].peak = 0;
+    destinations_[i].dropped_frames = 0;
+    destinations_[i].dropped_bytes = 0;
+  }
+}
+
+/**
+ * Replace a message about to be sent with one that counts against the budget
+ *
+ * The data is not copied. The original message is kept until 0MQ has
+ * finished with the data, when its bytes are given back to the destination.
+ *
+ * \param[in,out] message The message to send
+ * \param[in] destination The destination it will be sent to
+ */
+void SendBudget::track(zmq::message_t& message, size_t destination) {
+  track_message(message, destination);
+}
+
+/**
+ * Send a message, counting it against the budget only if 0MQ takes it
+ *
+ * A message refused by a send without blocking is given back unchanged and
+ * uncounted, so it can be kept and sent again later.
+ *
+ * \param[in] socket The socket to send on
+ * \param[in,out] message The message to send
+ * \param[in] destination The destination it is sent to
+ * \param[in] flags Any flags to apply to the message
+ * \return false if the message was refused
+ */
+bool SendBudget::send(zmq::socket_t& socket, zmq::message_t& message, size_t destination, int flags) {
+  TrackedMessage* tracked = track_message(message, destination);
+  if (socket.send(message, flags)) {
+    return true;
+  }
+  if (tracked) {
+    destinations_[destination].queued.fetch_sub(tracked->size);
+    tracked->size = 0;
+    // Closing the replacement releases the tracked message, with nothing left to give back
+    zmq::message_t original;
+    original.move(&tracked->message);
+    message.move(&original);
+  }
+  return false;
+}
+
+/**
+ * Replace a message with one that counts against the budget
+ *
+ * \param[in,out] message The message to send
+ * \param[in] destination The destination it will be sent to
+ * \return The tracked message, or NULL if the message is not counted
+ */
+SendBudget::TrackedMessage* SendBudget::track_message(zmq::message_t& message, size_t destination) {
+  size_t size = message.size();
+  if (size < TRACK_MIN_BYTES || destination >= num_destinations_) {
+    return NULL;
+  }
+  TrackedMessage* tracked = new TrackedMessage;
+  tracked->budget = this;
+  tracked->destination = destination;
+  tracked->size = size;
+  tracked->message.move(&message);
+
+  Destination& counters = destinations_[destination];
+  uint64_t queued = counters.queued.fetch_add(size) + size;
+  uint64_t peak = counters.peak.load(std::memory_order_relaxed);
+  while (queued > peak && !counters.peak.compare_exchange_weak(peak, queued)) {
+  }
+  message.rebuild(tracked->message.data(), size, &SendBudget::release, tracked);
+  return tracked;
+}
+
+/**
+ * Called by 0MQ when it has finished with the data of a tracked message
+ *
+ * \param[in] data The message data, which belongs to the tracked message
+ * \param[in] hint The TrackedMessage holding the original message
+ */
+void SendBudget::release(void* /* data */, void* hint) {
+  TrackedMessage* tracked = static_cast<TrackedMessage*>(hint);
+  SendBudget* budget = tracked->budget;
+  budget->destinations_[tracked->destination].queued.fetch_sub(tracked->size);
+  delete tracked;
+  {
+    boost::lock_guard<boost::mutex> lock(budget->mutex_);
+  }
+  budget->released_.notify_all();
+}
+
+/**
+ * Check whether a destination can take more bytes within its share
+ *
+ * A destination with nothing queued can always take a message, so a message
+ * larger than the share is not held back forever.
+ *
+ * \param[in] destination The destination
+ * \param[in] bytes The bytes to be sent
+ */
+bool SendBudget::has_space(size_t destination, uint64_t bytes) const {
+  if (budget_ == 0 || destination >= num_destinations_) {
+    return true;
+  }
+  uint64_t queued = destinations_[destination].queued.load();
+  return queued == 0 || queued + bytes <= share_;
+}
+
+/**
+ * Wait for a destination to have space for more bytes
+ *
+ * \param[in] destination The destination
+ * \param[in] bytes The bytes to be sent
+ * \param[in] timeout_ms Time to wait
+ * \return false if there is still no space after the timeout
+ */
+bool SendBudget::wait_for_space(size_t destination, uint64_t bytes, int timeout_ms) {
+  boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (!has_space(destination, bytes)) {
+    if (!released_.timed_wait(lock, deadline)) {
+      return has_space(destination, bytes);
+    }
+  }
+  return true;
+}
+
+/**
+ * Count a frame dropped because its destination was over its share
+ *
+ * \param[in] destination The destination
+ * \param[in] bytes The bytes dropped
+ */
+void SendBudget::record_drop(size_t destination, uint64_t bytes) {
+  if (destination < num_destinations_) {
+    destinations_[destination].dropped_frames++;
+    destinations_[destination].dropped_bytes += bytes;
+  }
+}
+
+/**
+ * Restart the peak queued bytes from the bytes currently queued
+ */
+void SendBudget::reset_peaks() {
+  for (size_t i = 0; i < num_destinations_; i++) {
+    destinations_[i].peak = destinations_[i].queued.load();
+  }
+}
+
+uint64_t SendBudget::budget() const {
+  return budget_;
+}
+
+uint64_t SendBudget::share() const {
+  return share_;
+}
+
+uint64_t SendBudget::queued_bytes(size_t destination) const {
+  return destination < num_destinations_ ? destinations_[destination].queued.load() : 0;
+}
+
+uint64_t SendBudget::peak_queued_bytes(size_t destination) const {
+  return destination < num_destinations_ ? destinations_[destination].peak.load() : 0;
+}
+
+uint64_t SendBudget::dropped_frames(size_t destination) const {
+  return destination < num_destinations_ ? destinations_[destination].dropped_frames : 0;
+}
+
+uint64_t SendBudget::dropped_bytes(size_t destination) const {
+  return destination < num_destinations_ ? destinations_[destination].dropped_bytes : 0;
+}
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SharedFrameWriter.h"
+
+SharedFrameWriter::SharedFrameWriter(const std::string& transport_name) :
+  transport_name_(transport_name),
+  control_(NULL),
+  attached_ino_(0),
+  pool_(NULL),
+  pool_size_(0),
+  frames_written_(0),
+  frames_unavailable_(0),
+  buffers_rejected_(0)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.SharedFrameWriter");
+}
+
+SharedFrameWriter::~SharedFrameWriter() {
+  this->detach();
+}
+
+/**
+ * Map the control segment and the frame pool it names
+ *
+ * Reattaches if the decoder has recreated the control segment since the last
+ * attach, as it does when the FrameReceiver is restarted or reconfigured.
+ *
+ * \return true if attached and ready to write
+ */
+bool SharedFrameWriter::attach() {
+  int fd = shm_open(transport_name_.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    if (control_) {
+      LOG4CXX_WARN(logger_, "Shared transport " << transport_name_ << " has been removed");
+      this->detach();
+    }
+    return false;
+  }
+
+  // Nothing to do if still attached to the current segment
+  struct stat transport_stat;
+  fstat(fd, &transport_stat);
+  if (control_) {
+    if (attached_ino_ == transport_stat.st_ino) {
+      close(fd);
+      return true;
+    }
+    LOG4CXX_INFO(logger_, "Shared transport " << transport_name_ << " has been recreated - reattaching");
+    this->detach();
+  }
+
+  if (transport_stat.st_size < static_cast<off_t>(sizeof(Eiger::SharedTransportControl))) {
+    close(fd);
+    return false;
+  }
+  void* address = mmap(NULL, sizeof(Eiger::SharedTransportControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    LOG4CXX_ERROR(logger_, "Unable to map shared transport " << transport_name_ << ": " << strerror(errno));
+    return false;
+  }
+  Eiger::SharedTransportControl* control = static_cast<Eiger::SharedTransportControl*>(address);
+  if (control->magic != Eiger::SHARED_TRANSPORT_MAGIC || control->version != Eiger::SHARED_TRANSPORT_VERSION ||
+      control->state.load(std::memory_order_acquire) != Eiger::SHARED_TRANSPORT_READY) {
+    // The decoder has not finished setting up the transport yet
+    munmap(address, sizeof(Eiger::SharedTransportControl));
+    return false;
+  }
+
+  std::string buffer_name(control->buffer_name, strnlen(control->buffer_name, sizeof(control->buffer_name)));
+  int pool_fd = shm_open(buffer_name.c_str(), O_RDWR, 0);
+  if (pool_fd < 0) {
+    LOG4CXX_ERROR(logger_, "Unable to open frame pool " << buffer_name << ": " << strerror(errno));
+    munmap(address, sizeof(Eiger::SharedTransportControl));
+    return false;
+  }
+  struct stat pool_stat;
+  fstat(pool_fd, &pool_stat);
+  void* pool = mmap(NULL, pool_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
+  close(pool_fd);
+  if (pool == MAP_FAILED) {
+    LOG4CXX_ERROR(logger_, "Unable to map frame pool " << buffer_name << ": " << strerror(errno));
+    munmap(address, sizeof(Eiger::SharedTransportControl));
+    return false;
+  }
+
+  control_ = control;
+  attached_ino_ = transport_stat.st_ino;
+  pool_ = static_cast<char*>(pool);
+  pool_size_ = pool_stat.st_size;
+  LOG4CXX_INFO(logger_, "Attached to shared transport " << transport_name_ << " for frame pool " << buffer_name);
+  return true;
+}
+
+/**
+ * Unmap the control segment and frame pool
+ */
+void SharedFrameWriter::detach() {
+  if (control_) {
+    munmap(control_, sizeof(Eiger::SharedTransportControl));
+    control_ = NULL;
+  }
+  if (pool_) {
+    munmap(pool_, pool_size_);
+    pool_ = NULL;
+  }
+}
+
+bool SharedFrameWriter::attached() const {
+  return control_ != NULL;
+}
+
+/**
+ * Copy a payload into the next lent buffer
+ *
+ * A buffer is only taken once the payload has been written to it. A lent
+ * buffer that lies outside the frame pool as mapped here is left in the ring,
+ * so it stays lent rather than being lost to the decoder, and the transport
+ * is detached to be mapped again at the next attach.
+ *
+ * \param[in] data The payload
+ * \param[in] size Size of the payload
+ * \param[out] descriptor Descriptor to send in place of the payload
+ * \return false if no suitable buffer is lent, in which case the payload should be sent over TCP
+ */
+bool SharedFrameWriter::write(const void* data, size_t size, Eiger::SharedFrameDescriptor& descriptor) {
+  if (!control_ || size > control_->buffer_size - control_->payload_offset) {
+    return false;
+  }
+  Eiger::SharedFrameSlot slot;
+  if (!Eiger::SharedTransportPeek(control_, slot)) {
+    ++frames_unavailable_;
+    return false;
+  }
+  if (slot.offset + control_->payload_offset + size > pool_size_) {
+    LOG4CXX_ERROR(logger_, "Buffer " << slot.buffer_id << " lent by " << transport_name_
+        << " is outside the frame pool - detaching until the next attach");
+    ++buffers_rejected_;
+    this->detach();
+    return false;
+  }
+
+  memcpy(pool_ + slot.offset + control_->payload_offset, data, size);
+  Eiger::SharedTransportPop(control_, slot);
+  descriptor.magic = Eiger::SHARED_DESCRIPTOR_MAGIC;
+  descriptor.buffer_id = slot.buffer_id;
+  descriptor.size = size;
+  ++frames_written_;
+  return true;
+}
+
+const std::string& SharedFrameWriter::name() const {
+  return transport_name_;
+}
+
+uint64_t SharedFrameWriter::frames_written() const {
+  return frames_written_;
+}
+
+uint64_t SharedFrameWriter::frames_unavailable() const {
+  return frames_unavailable_;
+}
+
+uint64_t SharedFrameWriter::buffers_rejected() const {
+  return buffers_rejected_;
+}
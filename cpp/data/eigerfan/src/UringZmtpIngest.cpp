@@ -0,0 +1,630 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#ifdef EIGERFAN_HAS_IO_URING
+#include <liburing.h>
+#endif
+
+#include <log4cxx/logger.h>  // getLogger
+
+#include "EigerDefinitions.h"
+#include "UringZmtpIngest.h"
+
+using namespace Eiger;
+
+static const size_t ZMTP_GREETING_SIZE = 64;
+
+// Operations encoded in the top half of the io_uring user data
+enum { OP_MULTISHOT = 1, OP_DIRECT = 2, OP_CANCEL = 3 };
+
+static const unsigned int QUEUE_DEPTH = 64;
+static const int BUFFER_GROUP_ID = 7;
+static const unsigned int BUFFER_COUNT = 256;  // Must be a power of 2
+static const unsigned int BUFFER_SIZE = 64 * 1024;
+// Frames at least this big are received directly into the message passed to the fan
+static const uint64_t DIRECT_RECEIVE_THRESHOLD = 64 * 1024;
+static const uint64_t RECONNECT_INTERVAL_MS = 100;
+static const int CONNECT_TIMEOUT_MS = 100;
+static const int HANDSHAKE_TIMEOUT_S = 1;
+
+static uint64_t monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool send_all(int fd, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = ::send(fd, data, length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+static bool recv_all(int fd, uint8_t* data, size_t length) {
+  while (length > 0) {
+    ssize_t received = ::recv(fd, data, length, MSG_WAITALL);
+    if (received <= 0) {
+      if (received < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += received;
+    length -= received;
+  }
+  return true;
+}
+
+static uint64_t encode_user_data(int op, int index) {
+  return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(index);
+}
+
+UringZmtpIngest::UringZmtpIngest(int connection_count) :
+  queue_(NULL),
+  connection_count_(connection_count),
+  messages_received_(0),
+  bytes_received_(0),
+  shutdown_requested_(false),
+  ring_(NULL),
+  buffer_ring_(NULL),
+  buffers_(NULL)
+{
+  logger_ = log4cxx::Logger::getLogger("EigerFan.UringZmtpIngest");
+}
+
+UringZmtpIngest::~UringZmtpIngest() {
+  this->shutdown();
+}
+
+/**
+ * Check whether the running kernel supports the io_uring features used
+ *
+ * \return true if io_uring with provided buffer rings is available
+ */
+bool UringZmtpIngest::supported() {
+#ifdef EIGERFAN_HAS_IO_URING
+  struct io_uring ring;
+  if (io_uring_queue_init(8, &ring, 0) < 0) {
+    return false;
+  }
+  int ret = 0;
+  struct io_uring_buf_ring* buffer_ring = io_uring_setup_buf_ring(&ring, 8, BUFFER_GROUP_ID, 0, &ret);
+  bool available = buffer_ring != NULL;
+  if (available) {
+    io_uring_free_buf_ring(&ring, buffer_ring, 8, BUFFER_GROUP_ID);
+  }
+  io_uring_queue_exit(&ring);
+  return available;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Spawn the ingest thread to connect to endpoint
+ *
+ * \param[in] endpoint Endpoint of socket to pull data from (tcp://host:port)
+ * \param[in] queue Queue to push complete messages onto
+ */
+void UringZmtpIngest::connect(std::string& endpoint, MessageQueue* queue) {
+  this->queue_ = queue;
+
+  LOG4CXX_INFO(logger_, "Spawning io_uring ingest thread with " << this->connection_count_ << " connections");
+
+  ingest_thread_ = boost::shared_ptr<boost::thread>(
+    new boost::thread(boost::bind(&UringZmtpIngest::ingest_loop, this, endpoint))
+  );
+}
+
+/**
+ * Entry point for the ingest thread
+ *
+ * \param[in] endpoint Endpoint of socket to pull data from
+ */
+void UringZmtpIngest::ingest_loop(std::string endpoint) {
+#ifdef EIGERFAN_HAS_IO_URING
+  std::string address = endpoint;
+  if (address.compare(0, 6, "tcp://") == 0) {
+    address = address.substr(6);
+  }
+  size_t separator = address.rfind(':');
+  if (separator == std::string::npos) {
+    LOG4CXX_ERROR(logger_, "Unable to parse endpoint " << endpoint);
+    return;
+  }
+  std::string host = address.substr(0, separator);
+  std::string port = address.substr(separator + 1);
+
+  struct io_uring ring;
+  int rc = io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+  if (rc < 0) {
+    LOG4CXX_ERROR(logger_, "io_uring_queue_init failed: " << strerror(-rc));
+    return;
+  }
+  ring_ = &ring;
+
+  // Preallocate the receive buffers and provide them to the kernel
+  buffers_ = static_cast<uint8_t*>(aligned_alloc(4096, BUFFER_COUNT * BUFFER_SIZE));
+  buffer_ring_ = io_uring_setup_buf_ring(ring_, BUFFER_COUNT, BUFFER_GROUP_ID, 0, &rc);
+  if (buffer_ring_ == NULL || buffers_ == NULL) {
+    LOG4CXX_ERROR(logger_, "Unable to set up io_uring provided buffers: " << strerror(-rc));
+    free(buffers_);
+    io_uring_queue_exit(ring_);
+    ring_ = NULL;
+    return;
+  }
+  for (unsigned int i = 0; i < BUFFER_COUNT; i++) {
+    io_uring_buf_ring_add(
+      buffer_ring_, buffers_ + i * BUFFER_SIZE, BUFFER_SIZE, i, io_uring_buf_ring_mask(BUFFER_COUNT), i
+    );
+  }
+  io_uring_buf_ring_advance(buffer_ring_, BUFFER_COUNT);
+
+  connections_.resize(this->connection_count_);
+  for (int i = 0; i < this->connection_count_; i++) {
+    connections_[i].fd = -1;
+    connections_[i].last_attempt_ms = 0;
+    reset_frame(connections_[i]);
+  }
+
+  while (!this->shutdown_requested_) {
+    // (Re)connect any closed connections
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < this->connection_count_; i++) {
+      if (connections_[i].fd < 0 && now - connections_[i].last_attempt_ms >= RECONNECT_INTERVAL_MS) {
+        connections_[i].last_attempt_ms = now;
+        if (open_connection(connections_[i], host, port)) {
+          arm_multishot(i);
+        }
+      }
+    }
+
+    io_uring_submit(ring_);
+
+    struct io_uring_cqe* cqe;
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = RECONNECT_INTERVAL_MS * 1000000;
+    rc = io_uring_wait_cqe_timeout(ring_, &cqe, &timeout);
+    if (rc == -ETIME || rc == -EINTR) {
+      continue;
+    } else if (rc < 0) {
+      LOG4CXX_ERROR(logger_, "io_uring_wait_cqe_timeout failed: " << strerror(-rc));
+      continue;
+    }
+
+    unsigned int head;
+    unsigned int count = 0;
+    io_uring_for_each_cqe(ring_, head, cqe) {
+      handle_completion(io_uring_cqe_get_data64(cqe), cqe->res, cqe->flags);
+      count++;
+    }
+    io_uring_cq_advance(ring_, count);
+  }
+
+  for (int i = 0; i < this->connection_count_; i++) {
+    close_connection(connections_[i]);
+  }
+  io_uring_free_buf_ring(ring_, buffer_ring_, BUFFER_COUNT, BUFFER_GROUP_ID);
+  io_uring_queue_exit(ring_);
+  free(buffers_);
+  ring_ = NULL;
+  buffer_ring_ = NULL;
+  buffers_ = NULL;
+#else
+  LOG4CXX_ERROR(logger_, "eigerfan was built without io_uring support - unable to receive from " << endpoint);
+#endif
+}
+
+/**
+ * Open a TCP connection to the detector and perform the ZMTP 3.0 NULL handshake as a PULL socket
+ *
+ * \param[in] connection The connection to open
+ * \param[in] host Host to connect to
+ * \param[in] port Port to connect to
+ * \return true if the connection is ready to receive messages
+ */
+bool UringZmtpIngest::open_connection(Connection& connection, const std::string& host, const std::string& port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+    LOG4CXX_ERROR(logger_, "Unable to resolve " << host << ":" << port);
+    return false;
+  }
+
+  int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+  if (fd < 0) {
+    freeaddrinfo(result);
+    return false;
+  }
+
+  // Connect without blocking the ingest loop for long if the detector is not there
+  int fd_flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+  int rc = ::connect(fd, result->ai_addr, result->ai_addrlen);
+  freeaddrinfo(result);
+  if (rc < 0 && errno == EINPROGRESS) {
+    struct pollfd poll_fd = {fd, POLLOUT, 0};
+    int error = ETIMEDOUT;
+    socklen_t error_size = sizeof(error);
+    if (poll(&poll_fd, 1, CONNECT_TIMEOUT_MS) == 1) {
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+    }
+    rc = error == 0 ? 0 : -1;
+  }
+  if (rc < 0) {
+    ::close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, fd_flags);
+
+  struct timeval handshake_timeout = {HANDSHAKE_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &handshake_timeout, sizeof(handshake_timeout));
+
+  // Greeting: signature, version 3.0, NULL mechanism, not as-server
+  uint8_t greeting[ZMTP_GREETING_SIZE];
+  memset(greeting, 0, sizeof(greeting));
+  greeting[0] = 0xff;
+  greeting[9] = 0x7f;
+  greeting[10] = 3;
+  greeting[11] = 0;
+  memcpy(&greeting[12], "NULL", 4);
+
+  // READY command with Socket-Type PULL
+  const uint8_t ready[] = {
+    ZMTP_COMMAND, 26,
+    5, 'R', 'E', 'A', 'D', 'Y',
+    11, 'S', 'o', 'c', 'k', 'e', 't', '-', 'T', 'y', 'p', 'e',
+    0, 0, 0, 4, 'P', 'U', 'L', 'L'
+  };
+
+  uint8_t peer_greeting[ZMTP_GREETING_SIZE];
+  bool ok = send_all(fd, greeting, sizeof(greeting)) && recv_all(fd, peer_greeting, sizeof(peer_greeting));
+  if (ok && (peer_greeting[0] != 0xff || (peer_greeting[9] & 0x01) == 0 || peer_greeting[10] < 3 ||
+             memcmp(&peer_greeting[12], "NULL", 4) != 0)) {
+    LOG4CXX_ERROR(logger_, "Detector did not send a ZMTP 3 NULL greeting");
+    ok = false;
+  }
+
+  // Exchange READY commands
+  ok = ok && send_all(fd, ready, sizeof(ready));
+  uint8_t flags = 0;
+  ok = ok && recv_all(fd, &flags, 1);
+  uint64_t size = 0;
+  if (ok && (flags & ZMTP_LONG)) {
+    uint8_t size_bytes[8];
+    ok = recv_all(fd, size_bytes, 8);
+    for (int i = 0; ok && i < 8; i++) {
+      size = (size << 8) | size_bytes[i];
+    }
+  } else if (ok) {
+    uint8_t size_byte;
+    ok = recv_all(fd, &size_byte, 1);
+    size = size_byte;
+  }
+  std::string peer_ready;
+  if (ok && size < 65536) {
+    peer_ready.resize(size);
+    ok = size == 0 || recv_all(fd, reinterpret_cast<uint8_t*>(&peer_ready[0]), size);
+  } else {
+    ok = false;
+  }
+  if (ok && (!(flags & ZMTP_COMMAND) || peer_ready.compare(0, 6, "\x05READY") != 0)) {
+    LOG4CXX_ERROR(logger_, "Detector did not send a ZMTP READY command");
+    ok = false;
+  }
+
+  if (!ok) {
+    ::close(fd);
+    return false;
+  }
+
+  // Receives are now driven by io_uring
+  struct timeval no_timeout = {0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+  connection.fd = fd;
+  connection.multishot_armed = false;
+  connection.direct_receive = false;
+  connection.parts.clear();
+  reset_frame(connection);
+  LOG4CXX_INFO(logger_, "Connected to " << host << ":" << port);
+  return true;
+}
+
+/**
+ * Close a connection, discarding any partially received message
+ *
+ * \param[in] connection The connection to close
+ */
+void UringZmtpIngest::close_connection(Connection& connection) {
+  if (connection.fd < 0) {
+    return;
+  }
+  if (!connection.parts.empty() || !connection.parser.idle()) {
+    LOG4CXX_WARN(logger_, "Connection closed part way through a message");
+  }
+  ::close(connection.fd);
+  connection.fd = -1;
+  connection.multishot_armed = false;
+  connection.direct_receive = false;
+  connection.parts.clear();
+  reset_frame(connection);
+}
+
+/**
+ * Start a multishot receive into the provided buffer ring
+ *
+ * \param[in] index Index of the connection
+ */
+void UringZmtpIngest::arm_multishot(int index) {
+#ifdef EIGERFAN_HAS_IO_URING
+  struct io_uring_sqe* sqe = io_uring_get_sqe(ring_);
+  if (sqe == NULL) {
+    io_uring_submit(ring_);
+    sqe = io_uring_get_sqe(ring_);
+  }
+  io_uring_prep_recv_multishot(sqe, connections_[index].fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP_ID;
+  io_uring_sqe_set_data64(sqe, encode_user_data(OP_MULTISHOT, index));
+  connections_[index].multishot_armed = true;
+#else
+  (void)index;
+#endif
+}
+
+/**
+ * Cancel the multishot receive so the rest of a large frame can be received directly
+ *
+ * \param[in] index Index of the connection
+ */
+void UringZmtpIngest::cancel_multishot(int index) {
+#ifdef EIGERFAN_HAS_IO_URING
+  struct io_uring_sqe* sqe = io_uring_get_sqe(ring_);
+  if (sqe == NULL) {
+    io_uring_submit(ring_);
+    sqe = io_uring_get_sqe(ring_);
+  }
+  io_uring_prep_cancel64(sqe, encode_user_data(OP_MULTISHOT, index), 0);
+  io_uring_sqe_set_data64(sqe, encode_user_data(OP_CANCEL, index));
+#else
+  (void)index;
+#endif
+}
+
+/**
+ * Receive the remainder of the current frame straight into its message
+ *
+ * \param[in] index Index of the connection
+ */
+void UringZmtpIngest::receive_direct(int index) {
+#ifdef EIGERFAN_HAS_IO_URING
+  Connection& connection = connections_[index];
+  struct io_uring_sqe* sqe = io_uring_get_sqe(ring_);
+  if (sqe == NULL) {
+    io_uring_submit(ring_);
+    sqe = io_uring_get_sqe(ring_);
+  }
+  io_uring_prep_recv(
+    sqe,
+    connection.fd,
+    connection.parser.body_position(),
+    connection.parser.remaining(),
+    MSG_WAITALL
+  );
+  io_uring_sqe_set_data64(sqe, encode_user_data(OP_DIRECT, index));
+#else
+  (void)index;
+#endif
+}
+
+/**
+ * Handle an io_uring completion
+ *
+ * \param[in] user_data The operation and connection index
+ * \param[in] result The result of the operation
+ * \param[in] cqe_flags The completion flags
+ */
+void UringZmtpIngest::handle_completion(uint64_t user_data, int result, uint32_t cqe_flags) {
+#ifdef EIGERFAN_HAS_IO_URING
+  int op = user_data >> 32;
+  int index = user_data & 0xffffffff;
+  Connection& connection = connections_[index];
+
+  if (op == OP_MULTISHOT) {
+    if (result > 0 && (cqe_flags & IORING_CQE_F_BUFFER)) {
+      unsigned int buffer_id = cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+      uint8_t* buffer = buffers_ + buffer_id * BUFFER_SIZE;
+      consume(index, buffer, result);
+      // Hand the buffer straight back to the kernel
+      io_uring_buf_ring_add(
+        buffer_ring_, buffer, BUFFER_SIZE, buffer_id, io_uring_buf_ring_mask(BUFFER_COUNT), 0
+      );
+      io_uring_buf_ring_advance(buffer_ring_, 1);
+    }
+    if (!(cqe_flags & IORING_CQE_F_MORE)) {
+      connection.multishot_armed = false;
+      if (result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED)) {
+        if (result < 0) {
+          LOG4CXX_ERROR(logger_, "Receive failed: " << strerror(-result));
+        }
+        close_connection(connection);
+      } else if (connection.direct_receive && connection.parser.in_body()) {
+        receive_direct(index);
+      } else {
+        connection.direct_receive = false;
+        arm_multishot(index);
+      }
+    }
+  } else if (op == OP_DIRECT) {
+    if (result > 0) {
+      this->bytes_received_ += result;
+      if (connection.parser.body_received(result)) {
+        complete_frame(connection);
+        connection.direct_receive = false;
+        arm_multishot(index);
+      } else {
+        receive_direct(index);
+      }
+    } else if (result == -EINTR || result == -EAGAIN) {
+      receive_direct(index);
+    } else {
+      if (result < 0) {
+        LOG4CXX_ERROR(logger_, "Direct receive failed: " << strerror(-result));
+      }
+      close_connection(connection);
+    }
+  }
+#else
+  (void)user_data;
+  (void)result;
+  (void)cqe_flags;
+#endif
+}
+
+/**
+ * Parse received bytes into ZMTP frames
+ *
+ * \param[in] index Index of the connection the data was received on
+ * \param[in] data The received data
+ * \param[in] length Number of bytes received
+ */
+void UringZmtpIngest::consume(int index, const uint8_t* data, size_t length) {
+  Connection& connection = connections_[index];
+  this->bytes_received_ += length;
+
+  while (length > 0) {
+    ZmtpFrameParser::Event event = connection.parser.parse(data, length);
+    if (event == ZmtpFrameParser::PARSE_FRAME_STARTED) {
+      if (!connection.parser.command() && connection.parser.size() >= DIRECT_RECEIVE_THRESHOLD &&
+          connection.multishot_armed && !connection.direct_receive) {
+        // Stop the multishot so the bulk of this frame can go straight into the message
+        connection.direct_receive = true;
+        cancel_multishot(index);
+      }
+    } else if (event == ZmtpFrameParser::PARSE_FRAME_COMPLETE) {
+      complete_frame(connection);
+    }
+  }
+}
+
+/**
+ * Handle a completely received frame
+ *
+ * Data frames are collected until the last part of the message, then the whole
+ * multipart message is pushed onto the queue. PING commands are answered; all
+ * other commands are ignored.
+ *
+ * \param[in] connection The connection the frame was received on
+ */
+void UringZmtpIngest::complete_frame(Connection& connection) {
+  const std::string& command = connection.parser.command_body();
+  if (connection.parser.command()) {
+    if (command.compare(0, 5, "\x04PING") == 0 && command.size() >= 7) {
+      std::string context = command.substr(7);
+      std::string pong("\x04PONG", 5);
+      pong.append(context);
+      uint8_t header[2] = {ZMTP_COMMAND, static_cast<uint8_t>(pong.size())};
+      send_all(connection.fd, header, 2);
+      send_all(connection.fd, reinterpret_cast<const uint8_t*>(pong.c_str()), pong.size());
+    }
+  } else {
+    connection.parts.push_back(connection.parser.body());
+    if (!connection.parser.more()) {
+      MultipartMessage* message = new MultipartMessage();
+      for (size_t i = 0; i < connection.parts.size(); i++) {
+        message->add(connection.parts[i]);
+      }
+      connection.parts.clear();
+      // Wait for space in the queue; this holds off the detector through TCP flow control
+      while (!this->queue_->push(message, 100)) {
+        if (this->shutdown_requested_) {
+          delete message;
+          break;
+        }
+      }
+      ++this->messages_received_;
+    }
+  }
+  reset_frame(connection);
+}
+
+/**
+ * Reset the frame parser ready for the next frame
+ *
+ * \param[in] connection The connection to reset
+ */
+void UringZmtpIngest::reset_frame(Connection& connection) {
+  connection.parser.reset();
+}
+
+/** Start the message counter, having received the first message
+ *
+ */
+void UringZmtpIngest::start_message_counter() {
+  this->messages_received_ = 1;
+}
+
+/** Return number of messages received
+ *
+ */
+uint64_t UringZmtpIngest::messages_received()
+{
+  return this->messages_received_;
+}
+
+/** Return number of bytes received from the detector
+ *
+ */
+uint64_t UringZmtpIngest::bytes_received()
+{
+  return this->bytes_received_;
+}
+
+/** Return number of connections to the detector
+ *
+ */
+int UringZmtpIngest::worker_count()
+{
+  return this->connection_count_;
+}
+
+/**
+ * Request to stop the ingest thread and shutdown
+ */
+void UringZmtpIngest::shutdown() {
+  if (this->shutdown_requested_) {
+    return;
+  }
+
+  this->shutdown_requested_ = true;
+  if (ingest_thread_) {
+    ingest_thread_->join();
+  }
+}
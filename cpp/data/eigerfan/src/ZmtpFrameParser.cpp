@@ -0,0 +1,139 @@
+#include <string.h>
+#include <algorithm>
+
+#include "ZmtpFrameParser.h"
+
+ZmtpFrameParser::ZmtpFrameParser()
+{
+  reset();
+}
+
+/**
+ * Parse received bytes until a frame starts or completes, or the bytes run out
+ *
+ * Frames without a body complete as soon as their size is read, without
+ * being reported as started.
+ *
+ * \param[in,out] data The received bytes, advanced past those consumed
+ * \param[in,out] length Number of bytes, reduced by those consumed
+ * \return What was parsed
+ */
+ZmtpFrameParser::Event ZmtpFrameParser::parse(const uint8_t*& data, size_t& length)
+{
+  while (length > 0) {
+    if (state_ == FRAME_FLAGS) {
+      flags_ = *data++;
+      length--;
+      size_ = 0;
+      size_bytes_remaining_ = (flags_ & ZMTP_LONG) ? 8 : 1;
+      state_ = FRAME_SIZE;
+    } else if (state_ == FRAME_SIZE) {
+      size_ = (size_ << 8) | *data++;
+      length--;
+      if (--size_bytes_remaining_ > 0) {
+        continue;
+      }
+      body_received_ = 0;
+      state_ = FRAME_BODY;
+      if (flags_ & ZMTP_COMMAND) {
+        command_.clear();
+      } else {
+        body_.reset(new zmq::message_t(size_));
+      }
+      return size_ == 0 ? PARSE_FRAME_COMPLETE : PARSE_FRAME_STARTED;
+    } else {
+      size_t count = std::min<uint64_t>(length, remaining());
+      if (flags_ & ZMTP_COMMAND) {
+        command_.append(reinterpret_cast<const char*>(data), count);
+      } else {
+        memcpy(body_position(), data, count);
+      }
+      body_received_ += count;
+      data += count;
+      length -= count;
+      if (body_received_ == size_) {
+        return PARSE_FRAME_COMPLETE;
+      }
+    }
+  }
+  return PARSE_MORE;
+}
+
+/**
+ * Record bytes of the body received directly into the message by the caller
+ *
+ * \param[in] count Number of bytes received at body_position()
+ * \return true if the frame is complete
+ */
+bool ZmtpFrameParser::body_received(size_t count)
+{
+  body_received_ += count;
+  return body_received_ == size_;
+}
+
+/**
+ * Reset the parser ready for the next frame
+ */
+void ZmtpFrameParser::reset()
+{
+  state_ = FRAME_FLAGS;
+  flags_ = 0;
+  size_ = 0;
+  size_bytes_remaining_ = 0;
+  body_received_ = 0;
+  body_.reset();
+}
+
+/** Whether the parser is between frames */
+bool ZmtpFrameParser::idle() const
+{
+  return state_ == FRAME_FLAGS;
+}
+
+/** Whether the parser is part way through the body of a frame */
+bool ZmtpFrameParser::in_body() const
+{
+  return state_ == FRAME_BODY;
+}
+
+/** Whether the current frame is a command */
+bool ZmtpFrameParser::command() const
+{
+  return (flags_ & ZMTP_COMMAND) != 0;
+}
+
+/** Whether more frames of the same message follow the current frame */
+bool ZmtpFrameParser::more() const
+{
+  return (flags_ & ZMTP_MORE) != 0;
+}
+
+/** Size of the body of the current frame */
+uint64_t ZmtpFrameParser::size() const
+{
+  return size_;
+}
+
+/** Bytes of the body of the current frame still to be received */
+uint64_t ZmtpFrameParser::remaining() const
+{
+  return size_ - body_received_;
+}
+
+/** Where the next byte of the body of the current data frame goes */
+uint8_t* ZmtpFrameParser::body_position() const
+{
+  return static_cast<uint8_t*>(body_->data()) + body_received_;
+}
+
+/** The body of the current data frame */
+boost::shared_ptr<zmq::message_t> ZmtpFrameParser::body() const
+{
+  return body_;
+}
+
+/** The body of the current command frame */
+const std::string& ZmtpFrameParser::command_body() const
+{
+  return command_;
+}
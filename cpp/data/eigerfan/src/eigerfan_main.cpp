@@ -22,9 +22,12 @@
 #include <log4cxx/helpers/exception.h>
 #include <log4cxx/xml/domconfigurator.h>
 #include <log4cxx/mdc.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 #include "EigerFan.h"
 #include "EigerFanConfig.h"
+#include "FanCoordinator.h"
 
 using namespace log4cxx;
 using namespace log4cxx::helpers;
@@ -101,9 +104,19 @@ int main(int argc, char *argv[])
   int rc = parse_arguments(argc, argv, cfg);
 
   if (rc == 0) {
+    boost::shared_ptr<FanCoordinator> coordinator;
+    if (!cfg.getCoordinatorBind().empty()) {
+      coordinator.reset(new FanCoordinator(cfg.getCoordinatorBind()));
+      coordinator->start();
+    }
+
     EigerFan eiger_fan(cfg);
 
     eiger_fan.run();
+
+    if (coordinator) {
+      coordinator->stop();
+    }
   }
 
   return rc;
@@ -150,6 +163,10 @@ int parse_arguments(int argc, char** argv, EigerFanConfig &cfg)
           "Set the log4cxx logging configuration file")
       ("threads,t", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_NUM_THREADS),
           "Set the number of threads to create to pull detector data")
+      ("min-threads", po::value<unsigned int>()->default_value(0),
+          "Set the minimum number of threads to pull detector data with when resizing (0 for --threads)")
+      ("max-threads", po::value<unsigned int>()->default_value(0),
+          "Set the maximum number of threads to pull detector data with when resizing (0 for --threads)")
       ("consumers,n", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_NUM_CONSUMERS),
           "Set the number of expected consumers")
       ("eigerport,e", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_EIGER_PORT_NUMBER),
@@ -164,6 +181,50 @@ int parse_arguments(int argc, char** argv, EigerFanConfig &cfg)
           "Set the number of zmq context threads to connect to the Eiger with")
       ("blocksize,b", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_BLOCK_SIZE),
           "Set the block size being used by the downstream data file writers to")
+      ("upstream-consumers", po::value<unsigned int>()->default_value(0),
+          "Set the number of consumers of the upstream EigerFan when consuming one of its ranks instead of the detector (0 for none)")
+      ("upstream-blocksize", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_BLOCK_SIZE),
+          "Set the block size being used by the upstream EigerFan")
+      ("protocol", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_STREAM_PROTOCOL),
+          "Set the detector stream protocol to receive (legacy or stream2)")
+      ("ingest", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_INGEST_ENGINE),
+          "Set the engine used to receive the detector stream (zmq or io_uring)")
+      ("shared-transport", po::value<std::string>(),
+          "Comma separated shared transport names per rank for FrameReceivers on this host (leave a rank empty for TCP)")
+      ("coordinator", po::value<std::string>(),
+          "Endpoint of the coordinator of EigerFan instances sharing the detector stream")
+      ("coordinator-bind", po::value<std::string>(),
+          "Run a coordinator in this process bound to the given endpoint")
+      ("instance-name", po::value<std::string>(),
+          "Name of this instance when coordinated (defaults to host:ctrl port)")
+      ("memory-budget", po::value<unsigned int>()->default_value(0),
+          "Set the MB the send queues may hold, shared equally between the consumers and forwarding (0 for no limit)")
+      ("budget-policy", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_BUDGET_POLICY),
+          "Set what to do with an image when its consumer is over budget (block or drop)")
+      ("nonblocking-send", po::bool_switch()->default_value(false),
+          "Store messages for a congested consumer instead of blocking the other consumers")
+      ("overflow-ram", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_OVERFLOW_RAM_MB),
+          "Set the MB of stored messages each consumer may hold in memory before spilling to file")
+      ("spill-dir", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_SPILL_DIR),
+          "Set the directory for overflow spill files")
+      ("control-lane-port", po::value<unsigned int>()->default_value(0),
+          "Set the first port of the per-consumer control lanes for header and end messages (0 for none)")
+      ("compression", po::value<std::string>()->default_value(EigerFanDefaults::DEFAULT_COMPRESSION),
+          "Set the compression applied to uncompressed legacy stream images (none or bslz4)")
+      ("compression-threads", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_COMPRESSION_THREADS),
+          "Set the number of threads compressing each image")
+      ("stall-timeout", po::value<unsigned int>()->default_value(0),
+          "Set the ms without messages before a series is ended as stalled (0 to disable)")
+      ("stall-intervals", po::value<unsigned int>()->default_value(EigerFanDefaults::DEFAULT_STALL_INTERVALS),
+          "Set the mean frame intervals without messages before a series is ended as stalled")
+      ("spin-count", po::value<unsigned int>()->default_value(0),
+          "Set the non-blocking receives the rx path tries before blocking (0 to block straight away)")
+      ("rx-cpu", po::value<int>()->default_value(-1),
+          "Set the CPU to pin the rx thread to (-1 for none)")
+      ("ingest-cpus", po::value<std::string>(),
+          "Comma separated CPUs to pin the ingest worker threads to in turn")
+      ("phase-period", po::value<unsigned int>()->default_value(0),
+          "Set the frames in each trigger cycle, sending each phase to its own group of consumers (0 for none)")
       ;
 
     // Group the variables for parsing at the command line and/or from the configuration file
@@ -231,6 +292,18 @@ int parse_arguments(int argc, char** argv, EigerFanConfig &cfg)
       LOG4CXX_DEBUG(logger, "Setting number of threads to " << cfg.getNumThreads());
     }
 
+    if (vm.count("min-threads"))
+    {
+      cfg.setMinThreads(vm["min-threads"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting minimum number of threads to " << cfg.getMinThreads());
+    }
+
+    if (vm.count("max-threads"))
+    {
+      cfg.setMaxThreads(vm["max-threads"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting maximum number of threads to " << cfg.getMaxThreads());
+    }
+
     if (vm.count("consumers"))
     {
       cfg.setNumConsumers(vm["consumers"].as<unsigned int>());
@@ -273,6 +346,180 @@ int parse_arguments(int argc, char** argv, EigerFanConfig &cfg)
       LOG4CXX_DEBUG(logger, "Setting block size to " << cfg.getBlockSize());
     }
 
+    if (vm.count("upstream-consumers"))
+    {
+      cfg.setUpstreamConsumers(vm["upstream-consumers"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting number of upstream consumers to " << cfg.getUpstreamConsumers());
+    }
+
+    if (vm.count("upstream-blocksize"))
+    {
+      cfg.setUpstreamBlockSize(vm["upstream-blocksize"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting upstream block size to " << cfg.getUpstreamBlockSize());
+    }
+
+    if (vm.count("protocol"))
+    {
+      std::string protocol = vm["protocol"].as<std::string>();
+      if (protocol != Eiger::STREAM_PROTOCOL_LEGACY && protocol != Eiger::STREAM_PROTOCOL_STREAM2) {
+        LOG4CXX_ERROR(logger, "Unknown stream protocol " << protocol);
+        return 1;
+      }
+      cfg.setStreamProtocol(protocol);
+      LOG4CXX_DEBUG(logger, "Setting stream protocol to " << cfg.getStreamProtocol());
+    }
+
+    if (vm.count("ingest"))
+    {
+      std::string engine = vm["ingest"].as<std::string>();
+      if (engine != Eiger::INGEST_ENGINE_ZMQ && engine != Eiger::INGEST_ENGINE_IO_URING) {
+        LOG4CXX_ERROR(logger, "Unknown ingest engine " << engine);
+        return 1;
+      }
+      cfg.setIngestEngine(engine);
+      LOG4CXX_DEBUG(logger, "Setting ingest engine to " << cfg.getIngestEngine());
+    }
+
+    if (vm.count("shared-transport"))
+    {
+      std::vector<std::string> transports;
+      boost::split(transports, vm["shared-transport"].as<std::string>(), boost::is_any_of(","));
+      if (transports.size() > cfg.getNumConsumers()) {
+        LOG4CXX_ERROR(logger, "More shared transports than consumers");
+        return 1;
+      }
+      cfg.setSharedTransports(transports);
+      LOG4CXX_DEBUG(logger, "Setting shared transports to " << vm["shared-transport"].as<std::string>());
+    }
+
+    if (vm.count("coordinator"))
+    {
+      cfg.setCoordinatorEndpoint(vm["coordinator"].as<std::string>());
+      LOG4CXX_DEBUG(logger, "Setting coordinator to " << cfg.getCoordinatorEndpoint());
+    }
+
+    if (vm.count("coordinator-bind"))
+    {
+      cfg.setCoordinatorBind(vm["coordinator-bind"].as<std::string>());
+      LOG4CXX_DEBUG(logger, "Running coordinator on " << cfg.getCoordinatorBind());
+    }
+
+    if (vm.count("instance-name"))
+    {
+      cfg.setInstanceName(vm["instance-name"].as<std::string>());
+      LOG4CXX_DEBUG(logger, "Setting instance name to " << cfg.getInstanceName());
+    }
+
+    if (vm.count("memory-budget"))
+    {
+      cfg.setMemoryBudget(static_cast<uint64_t>(vm["memory-budget"].as<unsigned int>()) * 1024 * 1024);
+      LOG4CXX_DEBUG(logger, "Setting memory budget to " << cfg.getMemoryBudget() << " bytes");
+    }
+
+    if (vm.count("budget-policy"))
+    {
+      std::string policy = vm["budget-policy"].as<std::string>();
+      if (policy != Eiger::BUDGET_POLICY_BLOCK && policy != Eiger::BUDGET_POLICY_DROP) {
+        LOG4CXX_ERROR(logger, "Unknown budget policy " << policy);
+        return 1;
+      }
+      cfg.setBudgetPolicy(policy);
+      LOG4CXX_DEBUG(logger, "Setting budget policy to " << cfg.getBudgetPolicy());
+    }
+
+    if (vm.count("nonblocking-send"))
+    {
+      cfg.setNonblockingSend(vm["nonblocking-send"].as<bool>());
+      LOG4CXX_DEBUG(logger, "Setting non-blocking send to " << cfg.getNonblockingSend());
+    }
+
+    if (vm.count("overflow-ram"))
+    {
+      cfg.setOverflowRam(static_cast<uint64_t>(vm["overflow-ram"].as<unsigned int>()) * 1024 * 1024);
+      LOG4CXX_DEBUG(logger, "Setting overflow memory to " << cfg.getOverflowRam() << " bytes per consumer");
+    }
+
+    if (vm.count("spill-dir"))
+    {
+      cfg.setSpillDir(vm["spill-dir"].as<std::string>());
+      LOG4CXX_DEBUG(logger, "Setting spill directory to " << cfg.getSpillDir());
+    }
+
+    if (vm.count("control-lane-port"))
+    {
+      cfg.setControlLanePortStart(vm["control-lane-port"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting control lane port start to " << cfg.getControlLanePortStart());
+    }
+
+    if (vm.count("compression"))
+    {
+      std::string compression = vm["compression"].as<std::string>();
+      if (compression != Eiger::COMPRESSION_NONE && compression != Eiger::COMPRESSION_BSLZ4) {
+        LOG4CXX_ERROR(logger, "Unknown compression " << compression);
+        return 1;
+      }
+      cfg.setCompression(compression);
+      LOG4CXX_DEBUG(logger, "Setting compression to " << cfg.getCompression());
+    }
+
+    if (vm.count("compression-threads"))
+    {
+      cfg.setCompressionThreads(vm["compression-threads"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting compression threads to " << cfg.getCompressionThreads());
+    }
+
+    if (vm.count("stall-timeout"))
+    {
+      cfg.setStallTimeout(vm["stall-timeout"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting stall timeout to " << cfg.getStallTimeout());
+    }
+
+    if (vm.count("stall-intervals"))
+    {
+      cfg.setStallIntervals(vm["stall-intervals"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting stall intervals to " << cfg.getStallIntervals());
+    }
+
+    if (vm.count("spin-count"))
+    {
+      cfg.setSpinCount(vm["spin-count"].as<unsigned int>());
+      LOG4CXX_DEBUG(logger, "Setting spin count to " << cfg.getSpinCount());
+    }
+
+    if (vm.count("rx-cpu"))
+    {
+      cfg.setRxCpu(vm["rx-cpu"].as<int>());
+      LOG4CXX_DEBUG(logger, "Setting rx CPU to " << cfg.getRxCpu());
+    }
+
+    if (vm.count("ingest-cpus"))
+    {
+      std::vector<std::string> cpuList;
+      boost::split(cpuList, vm["ingest-cpus"].as<std::string>(), boost::is_any_of(","));
+      std::vector<int> cpus;
+      for (size_t i = 0; i < cpuList.size(); i++) {
+        try {
+          cpus.push_back(boost::lexical_cast<int>(cpuList[i]));
+        } catch (boost::bad_lexical_cast&) {
+          LOG4CXX_ERROR(logger, "Invalid ingest CPU " << cpuList[i]);
+          return 1;
+        }
+      }
+      cfg.setIngestCpus(cpus);
+      LOG4CXX_DEBUG(logger, "Setting ingest CPUs to " << vm["ingest-cpus"].as<std::string>());
+    }
+
+    if (vm.count("phase-period"))
+    {
+      unsigned int phasePeriod = vm["phase-period"].as<unsigned int>();
+      if (phasePeriod > 1 && cfg.getNumConsumers() % phasePeriod != 0) {
+        LOG4CXX_ERROR(logger, "Number of consumers must be a multiple of the phase period");
+        return 1;
+      }
+      cfg.setPhasePeriod(phasePeriod);
+      LOG4CXX_DEBUG(logger, "Setting phase period to " << cfg.getPhasePeriod());
+    }
+
   }
   catch (Exception &e)
   {
@@ -0,0 +1,92 @@
+/*
+ * AzimuthalIntegrator.h
+ *
+ * Reduction of images to 1D profiles of the mean count against q or 2θ.
+ */
+
+#ifndef FRAMEPROCESSOR_AZIMUTHALINTEGRATOR_H_
+#define FRAMEPROCESSOR_AZIMUTHALINTEGRATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "DetectorGeometry.h"
+#include "FrameProcessorDefinitions.h"
+#include "WorkerPool.h"
+
+namespace FrameProcessor
+{
+
+  /** Radial coordinate of the profiles */
+  typedef enum
+  {
+    RADIAL_Q,  // Inverse Angstroms
+    RADIAL_TWO_THETA  // Degrees
+  } RadialUnit;
+
+  /**
+   * Integrate images over rings of equal q or 2θ
+   *
+   * Each pixel not set in the detector mask falls in the bin holding the q or
+   * 2θ of its centre. The bins are kept as a lookup table in compressed
+   * sparse row form, a list of pixel indices for each bin, built once per
+   * geometry. Integrating an image is then a sparse matrix-vector product of
+   * the table with the image, one range of bins per task, summing the pixels
+   * of each bin with vector gathers. Pixels the detector flags invalid in an
+   * image are left out of that image's profile.
+   */
+  class AzimuthalIntegrator
+  {
+  public:
+    AzimuthalIntegrator(WorkerPool& pool);
+
+    void set_geometry(size_t width, size_t height, const DetectorGeometry& geometry, const uint32_t* mask,
+                      RadialUnit unit, size_t bins, double radial_min, double radial_max);
+    void integrate(const void* pixels, DataType data_type, std::vector<double>& profile);
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+    size_t bins() const { return row_start_.empty() ? 0 : row_start_.size() - 1; }
+    size_t entries() const { return column_.size(); }
+    double radial_min() const { return radial_min_; }
+    double radial_max() const { return radial_max_; }
+
+  private:
+    WorkerPool& pool_;
+    size_t width_;
+    size_t height_;
+    double radial_min_;
+    double radial_max_;
+    std::vector<uint32_t> row_start_;  // First entry of each bin, and the number of entries at the end
+    std::vector<uint32_t> column_;  // Pixel index of each entry, ascending in each bin
+
+    // The table being built, split into ranges of pixels
+    const DetectorGeometry* geometry_;
+    const uint32_t* mask_;
+    RadialUnit unit_;
+    std::vector<float> radial_;  // Radial coordinate of each pixel, NAN for masked pixels
+    std::vector<float> task_min_;
+    std::vector<float> task_max_;
+    std::vector<std::vector<uint32_t> > task_counts_;  // Entries of each bin in each range
+
+    // The image being integrated, split into ranges of bins
+    const void* pixels_;
+    DataType data_type_;
+    std::vector<size_t> task_rows_;
+    std::vector<uint64_t> sums_;
+    std::vector<uint64_t> counted_;
+
+    void radial_range(size_t task, size_t num_tasks);
+    void count_range(size_t task, size_t num_tasks);
+    void fill_range(size_t task, size_t num_tasks);
+    void integrate_rows(size_t task);
+    long bin(float radial) const;
+
+    AzimuthalIntegrator(const AzimuthalIntegrator&);
+    AzimuthalIntegrator& operator=(const AzimuthalIntegrator&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_AZIMUTHALINTEGRATOR_H_ */
@@ -0,0 +1,73 @@
+/*
+ * DetectorGeometry.h
+ *
+ * Position of each pixel relative to the beam, from the beam centre, detector
+ * distance, pixel size and wavelength the detector sends in its global header
+ * config.
+ */
+
+#ifndef FRAMEPROCESSOR_DETECTORGEOMETRY_H_
+#define FRAMEPROCESSOR_DETECTORGEOMETRY_H_
+
+#include <math.h>
+
+namespace FrameProcessor
+{
+
+  typedef struct DetectorGeometry
+  {
+    double beam_center_x;  // Pixels
+    double beam_center_y;  // Pixels
+    double distance;  // Sample to detector distance, metres
+    double pixel_size_x;  // Metres
+    double pixel_size_y;  // Metres
+    double wavelength;  // Angstroms
+
+    /**
+     * Check every value needed has been given
+     */
+    bool valid() const
+    {
+      return distance > 0 && pixel_size_x > 0 && pixel_size_y > 0 && wavelength > 0;
+    }
+
+    /**
+     * Scattering angle 2θ of a pixel, in radians
+     *
+     * \param[in] x Pixel column
+     * \param[in] y Pixel row
+     */
+    double two_theta(double x, double y) const
+    {
+      double dx = (x - beam_center_x) * pixel_size_x;
+      double dy = (y - beam_center_y) * pixel_size_y;
+      return atan2(sqrt(dx * dx + dy * dy), distance);
+    }
+
+    /**
+     * Resolution of a pixel, as a d-spacing in Angstroms, infinite at the beam centre
+     *
+     * \param[in] x Pixel column
+     * \param[in] y Pixel row
+     */
+    double resolution(double x, double y) const
+    {
+      double sin_theta = sin(two_theta(x, y) / 2);
+      return sin_theta > 0 ? wavelength / (2 * sin_theta) : INFINITY;
+    }
+
+    /**
+     * Momentum transfer q of a pixel, in inverse Angstroms
+     *
+     * \param[in] x Pixel column
+     * \param[in] y Pixel row
+     */
+    double q(double x, double y) const
+    {
+      return 4 * M_PI * sin(two_theta(x, y) / 2) / wavelength;
+    }
+  } DetectorGeometry;
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_DETECTORGEOMETRY_H_ */
@@ -0,0 +1,108 @@
+/*
+ * EigerAzimuthalIntegrationPlugin.h
+ *
+ * Live 1D profiles of Eiger images for SAXS, WAXS and powder diffraction.
+ */
+
+#ifndef FRAMEPROCESSOR_EIGERAZIMUTHALINTEGRATIONPLUGIN_H_
+#define FRAMEPROCESSOR_EIGERAZIMUTHALINTEGRATIONPLUGIN_H_
+
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/propertyconfigurator.h>
+#include <log4cxx/helpers/exception.h>
+using namespace log4cxx;
+using namespace log4cxx::helpers;
+
+#include "FrameProcessorPlugin.h"
+#include "ClassLoader.h"
+#include "AzimuthalIntegrator.h"
+#include "FrameDecompressor.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  /** Azimuthal integration of Eiger images.
+   *
+   * The EigerAzimuthalIntegrationPlugin class sits after the
+   * EigerProcessPlugin. It integrates each image over rings of equal q or 2θ
+   * around the beam centre, using the geometry and mask in the global header,
+   * and publishes the profile of mean counts on the meta channel. Images are
+   * passed on unchanged.
+   *
+   * The lookup table of the pixels in each ring is rebuilt whenever the
+   * global header, image size or bins change. Without a complete geometry in
+   * the global header, images are passed on without being integrated.
+   */
+  class EigerAzimuthalIntegrationPlugin : public FrameProcessorPlugin
+  {
+  public:
+    EigerAzimuthalIntegrationPlugin();
+    virtual ~EigerAzimuthalIntegrationPlugin();
+
+    void configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply);
+    void requestConfiguration(OdinData::IpcMessage& reply);
+    void status(OdinData::IpcMessage& status);
+    bool reset_statistics();
+
+    int get_version_major();
+    int get_version_minor();
+    int get_version_patch();
+    std::string get_version_short();
+    std::string get_version_long();
+
+  private:
+    /** Configuration constant for the number of worker threads */
+    static const std::string CONFIG_THREADS;
+    /** Configuration constant for the number of bins in each profile */
+    static const std::string CONFIG_BINS;
+    /** Configuration constant for the radial coordinate, q or 2theta */
+    static const std::string CONFIG_UNIT;
+    /** Configuration constant for the lower edge of the first bin */
+    static const std::string CONFIG_RADIAL_MIN;
+    /** Configuration constant for the upper edge of the last bin, or 0 to cover the detector */
+    static const std::string CONFIG_RADIAL_MAX;
+
+    static const std::string UNIT_Q;
+    static const std::string UNIT_TWO_THETA;
+
+    void process_frame(boost::shared_ptr<Frame> frame);
+    bool update_table(const dimensions_t& dimensions);
+
+    /** Pointer to logger */
+    LoggerPtr logger_;
+    WorkerPool pool_;
+    FrameDecompressor decompressor_;
+    AzimuthalIntegrator integrator_;
+    unsigned int threads_;
+    unsigned int bins_;
+    std::string unit_;
+    double radial_min_;
+    double radial_max_;
+    std::vector<double> profile_;
+
+    /** Global header generation the table was built for, 0 for none */
+    uint64_t table_generation_;
+    /** Image size the table was built for */
+    size_t table_width_;
+    size_t table_height_;
+    /** Set when the configured bins change, to rebuild the table */
+    bool table_stale_;
+    /** Set if the table was built, clear without a geometry */
+    bool table_valid_;
+
+    uint64_t frames_integrated_;
+    uint64_t frames_failed_;
+  };
+
+  /**
+   * Registration of this plugin through the ClassLoader.  This macro
+   * registers the class without needing to worry about name mangling
+   */
+  REGISTER(FrameProcessorPlugin, EigerAzimuthalIntegrationPlugin, "EigerAzimuthalIntegrationPlugin");
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_EIGERAZIMUTHALINTEGRATIONPLUGIN_H_ */
@@ -0,0 +1,111 @@
+/*
+ * EigerBitDepthPlugin.h
+ *
+ * Reduction of 32 bit Eiger images to 16 bits where the counts allow.
+ */
+
+#ifndef FRAMEPROCESSOR_EIGERBITDEPTHPLUGIN_H_
+#define FRAMEPROCESSOR_EIGERBITDEPTHPLUGIN_H_
+
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/propertyconfigurator.h>
+#include <log4cxx/helpers/exception.h>
+using namespace log4cxx;
+using namespace log4cxx::helpers;
+
+#include "FrameProcessorPlugin.h"
+#include "ClassLoader.h"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  /** Bit depth reduction of Eiger images.
+   *
+   * The EigerBitDepthPlugin class sits after the EigerProcessPlugin. In 32
+   * bit mode the detector sends 32 bit images even if no pixel counts past
+   * 65535, which is most images at typical count rates. Each 32 bit image
+   * with every valid pixel below 65535 is passed on as 16 bits, with the
+   * pixels the detector flags invalid keeping the 16 bit invalid value, so no
+   * information is lost. Images that were bslz4 compressed are compressed
+   * again.
+   *
+   * An HDF5 dataset has one type, so each image goes to one of two datasets,
+   * both of which must be defined in the FileWriterPlugin:
+   *
+   *   - Narrowed images keep the dataset the EigerProcessPlugin names, "data",
+   *     which must be configured as uint16.
+   *   - Images that need 32 bits are passed on unchanged in the wide_dataset,
+   *     "data_32bit" unless configured, which must be configured as uint32
+   *     with the same dims and compression.
+   *
+   * test/integrationTest/config/eiger-fp.json shows the configuration. Each
+   * frame is written at its frame number in one dataset only, and the bit
+   * depth of every image is published on the meta channel and written per
+   * frame in the meta file, saying which dataset holds the image.
+   */
+  class EigerBitDepthPlugin : public FrameProcessorPlugin
+  {
+  public:
+    EigerBitDepthPlugin();
+    virtual ~EigerBitDepthPlugin();
+
+    void configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply);
+    void requestConfiguration(OdinData::IpcMessage& reply);
+    void status(OdinData::IpcMessage& status);
+    bool reset_statistics();
+
+    int get_version_major();
+    int get_version_minor();
+    int get_version_patch();
+    std::string get_version_short();
+    std::string get_version_long();
+
+  private:
+    /** Configuration constant for the number of worker threads */
+    static const std::string CONFIG_THREADS;
+    /** Configuration constant for the dataset images that need 32 bits are passed on in */
+    static const std::string CONFIG_WIDE_DATASET;
+
+    void process_frame(boost::shared_ptr<Frame> frame);
+    bool narrow(const uint32_t* pixels, uint16_t* narrowed, size_t num_pixels);
+    void narrow_range(size_t task);
+
+    /** Pointer to logger */
+    LoggerPtr logger_;
+    WorkerPool pool_;
+    FrameDecompressor decompressor_;
+    boost::shared_ptr<FrameCompressor> compressor_;
+    unsigned int threads_;
+    std::string wide_dataset_;
+
+    // The image being narrowed, split into ranges
+    const uint32_t* pixels_;
+    uint16_t* narrowed_;
+    size_t num_pixels_;
+    std::vector<size_t> too_large_;
+
+    /** Images to compress once narrowed */
+    zmq::message_t narrow_;
+    zmq::message_t compressed_;
+
+    uint64_t frames_narrowed_;
+    uint64_t frames_wide_;
+    uint64_t frames_failed_;
+    uint64_t bytes_in_;
+    uint64_t bytes_out_;
+  };
+
+  /**
+   * Registration of this plugin through the ClassLoader.  This macro
+   * registers the class without needing to worry about name mangling
+   */
+  REGISTER(FrameProcessorPlugin, EigerBitDepthPlugin, "EigerBitDepthPlugin");
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_EIGERBITDEPTHPLUGIN_H_ */
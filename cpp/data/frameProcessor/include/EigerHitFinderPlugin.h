@@ -0,0 +1,110 @@
+/*
+ * EigerHitFinderPlugin.h
+ *
+ * Veto of images with no diffraction before they are written.
+ */
+
+#ifndef FRAMEPROCESSOR_EIGERHITFINDERPLUGIN_H_
+#define FRAMEPROCESSOR_EIGERHITFINDERPLUGIN_H_
+
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/propertyconfigurator.h>
+#include <log4cxx/helpers/exception.h>
+using namespace log4cxx;
+using namespace log4cxx::helpers;
+
+#include "FrameProcessorPlugin.h"
+#include "ClassLoader.h"
+#include "FrameDecompressor.h"
+#include "HitScorer.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  /** Hit finding on Eiger images.
+   *
+   * The EigerHitFinderPlugin class sits after the EigerProcessPlugin. It
+   * scores each image by the number of pixels at or above a count threshold
+   * in a resolution ring, leaving out pixels set in the mask from the global
+   * header. Images scoring below the hit threshold are either dropped or
+   * passed on in a separate dataset for a low priority writer.
+   *
+   * Dropped images leave gaps in the frame numbers the writer sees, which
+   * cost no space in chunked datasets. The score of every image is published
+   * on the meta channel, along with the running kept and vetoed counts.
+   */
+  class EigerHitFinderPlugin : public FrameProcessorPlugin
+  {
+  public:
+    EigerHitFinderPlugin();
+    virtual ~EigerHitFinderPlugin();
+
+    void configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply);
+    void requestConfiguration(OdinData::IpcMessage& reply);
+    void status(OdinData::IpcMessage& status);
+    bool reset_statistics();
+
+    int get_version_major();
+    int get_version_minor();
+    int get_version_patch();
+    std::string get_version_short();
+    std::string get_version_long();
+
+  private:
+    /** Configuration constant for the number of worker threads */
+    static const std::string CONFIG_THREADS;
+    /** Configuration constant for the count at or above which a pixel is bright */
+    static const std::string CONFIG_PIXEL_THRESHOLD;
+    /** Configuration constant for the number of bright pixels that makes an image a hit */
+    static const std::string CONFIG_HIT_THRESHOLD;
+    /** Configuration constant for the low resolution limit of the ring, in Angstroms */
+    static const std::string CONFIG_LOW_RESOLUTION;
+    /** Configuration constant for the high resolution limit of the ring, in Angstroms */
+    static const std::string CONFIG_HIGH_RESOLUTION;
+    /** Configuration constant for what to do with images that are not hits */
+    static const std::string CONFIG_VETO_MODE;
+    /** Configuration constant for the dataset vetoed images are diverted to */
+    static const std::string CONFIG_VETO_DATASET;
+
+    static const std::string VETO_MODE_OFF;
+    static const std::string VETO_MODE_DROP;
+    static const std::string VETO_MODE_DIVERT;
+
+    void process_frame(boost::shared_ptr<Frame> frame);
+    bool update_region(const dimensions_t& dimensions);
+
+    /** Pointer to logger */
+    LoggerPtr logger_;
+    WorkerPool pool_;
+    FrameDecompressor decompressor_;
+    HitScorer scorer_;
+    unsigned int threads_;
+    uint32_t pixel_threshold_;
+    uint64_t hit_threshold_;
+    double low_resolution_;
+    double high_resolution_;
+    std::string veto_mode_;
+    std::string veto_dataset_;
+
+    /** Global header generation the region was built for, 0 for none */
+    uint64_t region_generation_;
+    /** Set when the configured ring changes, to rebuild the region */
+    bool region_stale_;
+
+    uint64_t frames_kept_;
+    uint64_t frames_vetoed_;
+    uint64_t frames_failed_;
+  };
+
+  /**
+   * Registration of this plugin through the ClassLoader.  This macro
+   * registers the class without needing to worry about name mangling
+   */
+  REGISTER(FrameProcessorPlugin, EigerHitFinderPlugin, "EigerHitFinderPlugin");
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_EIGERHITFINDERPLUGIN_H_ */
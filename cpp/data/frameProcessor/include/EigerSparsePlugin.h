@@ -0,0 +1,101 @@
+/*
+ * EigerSparsePlugin.h
+ *
+ * Sparse writing of low occupancy Eiger images.
+ */
+
+#ifndef FRAMEPROCESSOR_EIGERSPARSEPLUGIN_H_
+#define FRAMEPROCESSOR_EIGERSPARSEPLUGIN_H_
+
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/propertyconfigurator.h>
+#include <log4cxx/helpers/exception.h>
+using namespace log4cxx;
+using namespace log4cxx::helpers;
+
+#include "FrameProcessorPlugin.h"
+#include "ClassLoader.h"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "SparseEncoder.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  /** Sparse encoding of Eiger images.
+   *
+   * The EigerSparsePlugin class sits after the EigerProcessPlugin. Images with
+   * at most occupancy_threshold of their pixels counting are passed on as a
+   * sparse record of the index and count of each of those pixels, in a
+   * separate dataset alongside the image dataset. Busier images are passed on
+   * unchanged. Each frame is written to one dataset or the other, and the
+   * frame missing from the other dataset costs no space.
+   *
+   * The records are a fixed length for the image size and threshold, given
+   * in the record_length status item, which the sparse dataset must be
+   * configured with in the FileWriterPlugin, as uint32 with bslz4
+   * compression. See SparseEncoder.h for the record layout.
+   */
+  class EigerSparsePlugin : public FrameProcessorPlugin
+  {
+  public:
+    EigerSparsePlugin();
+    virtual ~EigerSparsePlugin();
+
+    void configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply);
+    void requestConfiguration(OdinData::IpcMessage& reply);
+    void status(OdinData::IpcMessage& status);
+    bool reset_statistics();
+
+    int get_version_major();
+    int get_version_minor();
+    int get_version_patch();
+    std::string get_version_short();
+    std::string get_version_long();
+
+  private:
+    /** Configuration constant for the number of worker threads */
+    static const std::string CONFIG_THREADS;
+    /** Configuration constant for the largest fraction of pixels counting in an image written sparse */
+    static const std::string CONFIG_OCCUPANCY_THRESHOLD;
+    /** Configuration constant for the dataset sparse records are written to */
+    static const std::string CONFIG_SPARSE_DATASET;
+
+    void process_frame(boost::shared_ptr<Frame> frame);
+    bool update_mask(const dimensions_t& dimensions);
+    void push_record(boost::shared_ptr<Frame> frame);
+
+    /** Pointer to logger */
+    LoggerPtr logger_;
+    WorkerPool pool_;
+    FrameDecompressor decompressor_;
+    SparseEncoder encoder_;
+    boost::shared_ptr<FrameCompressor> compressor_;
+    unsigned int threads_;
+    double occupancy_threshold_;
+    std::string sparse_dataset_;
+
+    /** Global header generation the mask was taken from, 0 for none */
+    uint64_t mask_generation_;
+    /** Most pixels a record can hold for the current image size */
+    size_t capacity_;
+    zmq::message_t raw_record_;
+    zmq::message_t compressed_record_;
+
+    uint64_t frames_sparse_;
+    uint64_t frames_dense_;
+    uint64_t frames_failed_;
+  };
+
+  /**
+   * Registration of this plugin through the ClassLoader.  This macro
+   * registers the class without needing to worry about name mangling
+   */
+  REGISTER(FrameProcessorPlugin, EigerSparsePlugin, "EigerSparsePlugin");
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_EIGERSPARSEPLUGIN_H_ */
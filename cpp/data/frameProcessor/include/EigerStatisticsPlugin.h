@@ -0,0 +1,95 @@
+/*
+ * EigerStatisticsPlugin.h
+ *
+ * Per frame statistics for monitoring the beam and sample while the data is
+ * taken.
+ */
+
+#ifndef FRAMEPROCESSOR_EIGERSTATISTICSPLUGIN_H_
+#define FRAMEPROCESSOR_EIGERSTATISTICSPLUGIN_H_
+
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <log4cxx/propertyconfigurator.h>
+#include <log4cxx/helpers/exception.h>
+using namespace log4cxx;
+using namespace log4cxx::helpers;
+
+#include "FrameProcessorPlugin.h"
+#include "ClassLoader.h"
+#include "FrameDecompressor.h"
+#include "PixelKernels.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  /** Statistics of each Eiger image.
+   *
+   * The EigerStatisticsPlugin class sits after the EigerProcessPlugin. It
+   * decompresses each image and publishes its sum, maximum, saturated pixel
+   * count and number of masked pixels on the meta channel, leaving out pixels
+   * the detector flags invalid and those in the pixel mask of the global
+   * header, then passes the frame on unchanged.
+   */
+  class EigerStatisticsPlugin : public FrameProcessorPlugin
+  {
+  public:
+    EigerStatisticsPlugin();
+    virtual ~EigerStatisticsPlugin();
+
+    void configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply);
+    void requestConfiguration(OdinData::IpcMessage& reply);
+    void status(OdinData::IpcMessage& status);
+    bool reset_statistics();
+
+    int get_version_major();
+    int get_version_minor();
+    int get_version_patch();
+    std::string get_version_short();
+    std::string get_version_long();
+
+  private:
+    /** Configuration constant for the number of worker threads */
+    static const std::string CONFIG_THREADS;
+    /** Configuration constant for the value at or above which a pixel is saturated */
+    static const std::string CONFIG_SATURATION;
+
+    void process_frame(boost::shared_ptr<Frame> frame);
+    void compute_range(size_t task);
+    void update_mask(const dimensions_t& dimensions);
+
+    /** Pointer to logger */
+    LoggerPtr logger_;
+    WorkerPool pool_;
+    FrameDecompressor decompressor_;
+    unsigned int threads_;
+    /** Saturation value, 0 for the largest valid value of the pixel type */
+    uint32_t saturation_;
+
+    // The image being reduced, split into ranges
+    const void* pixels_;
+    DataType data_type_;
+    size_t pixel_count_;
+    uint32_t threshold_;
+    std::vector<PixelStatistics> partial_;
+
+    /** Pixels to leave out, from the global header, empty for none */
+    std::vector<uint8_t> masked_;
+    uint64_t mask_generation_;
+    size_t mask_pixels_;
+
+    uint64_t frames_processed_;
+    uint64_t frames_failed_;
+  };
+
+  /**
+   * Registration of this plugin through the ClassLoader.  This macro
+   * registers the class without needing to worry about name mangling
+   */
+  REGISTER(FrameProcessorPlugin, EigerStatisticsPlugin, "EigerStatisticsPlugin");
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_EIGERSTATISTICSPLUGIN_H_ */
@@ -0,0 +1,75 @@
+/*
+ * FrameDecompressor.h
+ *
+ * Decompression of Eiger images for the plugins that look at pixel values.
+ * Images arrive as the detector sent them, so bs<BIT>-lz4 images are in the
+ * chunk format of the HDF5 bitshuffle filter and lz4 images are a single LZ4
+ * block.
+ */
+
+#ifndef FRAMEPROCESSOR_FRAMEDECOMPRESSOR_H_
+#define FRAMEPROCESSOR_FRAMEDECOMPRESSOR_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <log4cxx/logger.h>
+
+#include "Frame.h"
+#include "WorkerPool.h"
+
+namespace FrameProcessor
+{
+
+  /**
+   * Decompress images into a buffer reused from frame to frame
+   *
+   * The bitshuffle blocks of an image are independent, so they are split into
+   * ranges that are decompressed in parallel on a WorkerPool.
+   */
+  class FrameDecompressor
+  {
+  public:
+    FrameDecompressor(WorkerPool& pool);
+
+    static bool supported();
+    static size_t pixel_count(const dimensions_t& dimensions);
+    static void bitunshuffle(const uint8_t* in, uint8_t* out, size_t elements, size_t elem_size);
+
+    const void* pixels(const boost::shared_ptr<Frame>& frame);
+    bool decompress(const void* data, size_t size, CompressionType compression, size_t elem_size,
+                    size_t elements, uint8_t* out);
+
+  private:
+    typedef struct
+    {
+      size_t offset;  // Offset in the image of the block's compressed size
+      size_t elements;
+    } Block;
+
+    log4cxx::LoggerPtr logger_;
+    WorkerPool& pool_;
+    std::vector<uint8_t> buffer_;  // The decompressed image
+    std::vector<Block> blocks_;
+    std::vector<std::vector<uint8_t> > scratch_;  // One block before unshuffling, for each task
+
+    // The image being decompressed
+    const uint8_t* input_;
+    size_t input_size_;
+    uint8_t* output_;
+    size_t elem_size_;
+    size_t block_elements_;
+    size_t num_tasks_;
+    std::vector<uint8_t> task_ok_;
+
+    bool decompress_bslz4(const uint8_t* in, size_t size, size_t elem_size, size_t elements, uint8_t* out);
+    void decompress_range(size_t task);
+
+    FrameDecompressor(const FrameDecompressor&);
+    FrameDecompressor& operator=(const FrameDecompressor&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_FRAMEDECOMPRESSOR_H_ */
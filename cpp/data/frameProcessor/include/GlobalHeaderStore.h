@@ -0,0 +1,71 @@
+/*
+ * GlobalHeaderStore.h
+ *
+ * The global header of the current series, for plugins after the
+ * EigerProcessPlugin. Only image frames are passed down the chain, so the
+ * EigerProcessPlugin records the config and mask here as it publishes them.
+ */
+
+#ifndef FRAMEPROCESSOR_GLOBALHEADERSTORE_H_
+#define FRAMEPROCESSOR_GLOBALHEADERSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#include <log4cxx/logger.h>
+
+#include "DetectorGeometry.h"
+
+namespace FrameProcessor
+{
+
+  typedef struct
+  {
+    uint64_t series;
+    uint64_t generation;  // Changes whenever any part of the header changes
+    std::string config;  // The detector config JSON, empty with header_detail none
+    DetectorGeometry geometry;
+    uint32_t count_cutoff;  // Counts at or above which a pixel is saturated, 0 if not given
+    std::vector<uint32_t> mask;  // Non-zero for pixels to ignore, empty unless header_detail is all
+    size_t mask_width;
+    size_t mask_height;
+  } GlobalHeader;
+
+  /**
+   * The global header shared by the plugins of a FrameProcessor
+   *
+   * Plugins run on their own threads, so they take a copy of the current
+   * header, which is replaced rather than changed as each part arrives.
+   */
+  class GlobalHeaderStore
+  {
+  public:
+    static GlobalHeaderStore& instance();
+
+    void start_series(uint64_t series);
+    void set_config(uint64_t series, const std::string& config);
+    void set_mask(uint64_t series, const uint32_t* mask, size_t width, size_t height);
+    boost::shared_ptr<const GlobalHeader> current();
+
+  private:
+    GlobalHeaderStore();
+
+    boost::shared_ptr<GlobalHeader> next(uint64_t series);
+
+    log4cxx::LoggerPtr logger_;
+    boost::mutex mutex_;
+    boost::shared_ptr<const GlobalHeader> current_;
+    uint64_t generation_;
+
+    GlobalHeaderStore(const GlobalHeaderStore&);
+    GlobalHeaderStore& operator=(const GlobalHeaderStore&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_GLOBALHEADERSTORE_H_ */
@@ -0,0 +1,70 @@
+/*
+ * HitScorer.h
+ *
+ * Scoring of images for diffraction, as the number of pixels at or above a
+ * count threshold in a resolution ring.
+ */
+
+#ifndef FRAMEPROCESSOR_HITSCORER_H_
+#define FRAMEPROCESSOR_HITSCORER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "DetectorGeometry.h"
+#include "FrameProcessorDefinitions.h"
+#include "PixelKernels.h"
+#include "WorkerPool.h"
+
+namespace FrameProcessor
+{
+
+  /**
+   * Count bright pixels in the scoring region of each image
+   *
+   * The region is every pixel in the resolution ring, or the whole image
+   * without a valid geometry, less the pixels set in the detector mask. It is
+   * built once per geometry and kept as one byte per pixel for the kernels.
+   */
+  class HitScorer
+  {
+  public:
+    HitScorer(WorkerPool& pool);
+
+    void set_region(size_t width, size_t height, const DetectorGeometry* geometry, const uint32_t* mask,
+                    double low_resolution, double high_resolution);
+    uint64_t score(const void* pixels, DataType data_type, uint32_t threshold);
+
+    size_t width() const { return width_; }
+    size_t height() const { return height_; }
+    size_t region_pixels() const { return region_pixels_; }
+
+  private:
+    WorkerPool& pool_;
+    size_t width_;
+    size_t height_;
+    size_t region_pixels_;
+    std::vector<uint8_t> exclude_;  // Non-zero for pixels outside the region
+
+    // The region being built
+    const DetectorGeometry* geometry_;
+    const uint32_t* mask_;
+    double low_resolution_;
+    double high_resolution_;
+
+    // The image being scored, split into ranges
+    const void* pixels_;
+    DataType data_type_;
+    uint32_t threshold_;
+    std::vector<PixelStatistics> partial_;
+
+    void build_rows(size_t task, size_t num_tasks);
+    void score_range(size_t task);
+
+    HitScorer(const HitScorer&);
+    HitScorer& operator=(const HitScorer&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_HITSCORER_H_ */
@@ -0,0 +1,60 @@
+/*
+ * PixelKernels.h
+ *
+ * Reductions over the pixels of an image, vectorised with AVX2 where the CPU
+ * has it. Pixels the detector flags as invalid hold the largest value of the
+ * pixel type, and are left out along with any pixels excluded by a mask.
+ */
+
+#ifndef FRAMEPROCESSOR_PIXELKERNELS_H_
+#define FRAMEPROCESSOR_PIXELKERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FrameProcessor
+{
+
+  typedef struct
+  {
+    uint64_t sum;  // Sum of the pixels counted
+    uint64_t max;  // Largest pixel counted
+    uint64_t over_threshold;  // Pixels counted at or above the threshold
+    uint64_t excluded;  // Pixels flagged invalid or excluded by the mask
+  } PixelStatistics;
+
+  static const PixelStatistics EMPTY_PIXEL_STATISTICS = {0, 0, 0, 0};
+
+  /**
+   * Combine the statistics of two sets of pixels
+   *
+   * \param[in,out] total Statistics to add to
+   * \param[in] part Statistics of more pixels
+   */
+  inline void merge_pixel_statistics(PixelStatistics& total, const PixelStatistics& part)
+  {
+    total.sum += part.sum;
+    total.max = part.max > total.max ? part.max : total.max;
+    total.over_threshold += part.over_threshold;
+    total.excluded += part.excluded;
+  }
+
+  void pixel_statistics(const uint16_t* pixels, const uint8_t* exclude, size_t count, uint16_t threshold,
+                        PixelStatistics& stats);
+  void pixel_statistics(const uint32_t* pixels, const uint8_t* exclude, size_t count, uint32_t threshold,
+                        PixelStatistics& stats);
+  size_t changed_pixels(const uint16_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                        uint32_t* indices);
+  size_t changed_pixels(const uint32_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                        uint32_t* indices);
+  void indexed_pixel_sum(const uint16_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                         uint64_t& counted);
+  void indexed_pixel_sum(const uint32_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                         uint64_t& counted);
+  size_t narrow_pixels(const uint32_t* pixels, uint16_t* narrowed, size_t count);
+  void set_scalar_pixel_kernels(bool scalar);
+  const char* pixel_kernel_name();
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_PIXELKERNELS_H_ */
@@ -0,0 +1,87 @@
+/*
+ * SparseEncoder.h
+ *
+ * Sparse records of low occupancy images, as the index and count of each
+ * pixel that is not empty.
+ *
+ * A record is a fixed length array of uint32, so records stack into a chunked
+ * dataset with one chunk per frame:
+ *
+ *   [1, n, index 0 .. index n-1, count 0 .. count n-1, 0 ...]
+ *
+ * Records are compressed, so the zeros after the last count cost almost
+ * nothing. A frame with no record reads back as all zeros, so a first value
+ * of 0 says the frame was written to the dense dataset instead.
+ *
+ * A pixel is empty if it is zero or, where the detector mask is set, if it
+ * holds the invalid value the detector fills masked pixels with. The reader
+ * rebuilds an image from the mask in the global header and the record.
+ */
+
+#ifndef FRAMEPROCESSOR_SPARSEENCODER_H_
+#define FRAMEPROCESSOR_SPARSEENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "FrameProcessorDefinitions.h"
+#include "WorkerPool.h"
+
+namespace FrameProcessor
+{
+
+  /** Value of the first element of a record for a frame written sparse */
+  static const uint32_t SPARSE_RECORD_PRESENT = 1;
+  /** Elements of a record before the indices */
+  static const size_t SPARSE_RECORD_HEADER = 2;
+
+  /**
+   * Encode images as sparse records across a pool of threads
+   *
+   * Each image is split into ranges that are searched in parallel. A range is
+   * searched a block at a time, counting the pixels that are not empty and
+   * then collecting their indices and counts while the block is in cache, so
+   * the image is read from memory once. The ranges all stop once more pixels
+   * are found than fit in the record, and are otherwise joined in order.
+   */
+  class SparseEncoder
+  {
+  public:
+    SparseEncoder(WorkerPool& pool);
+
+    static size_t record_length(size_t capacity);
+
+    void set_mask(size_t pixels, const uint32_t* mask);
+    bool encode(const void* pixels, DataType data_type, size_t capacity, uint32_t* record);
+
+    size_t pixels() const { return pixels_; }
+    size_t entries() const { return entries_; }
+
+  private:
+    WorkerPool& pool_;
+    size_t pixels_;
+    std::vector<uint8_t> masked_;  // 1 for pixels the detector mask sets, empty for no mask
+    size_t entries_;  // Pixels found in the last image encoded
+
+    // The image being encoded, split into ranges
+    const void* image_;
+    DataType data_type_;
+    size_t capacity_;
+    std::atomic<size_t> found_;  // Pixels found so far across the ranges
+    std::vector<std::vector<uint32_t> > indices_;
+    std::vector<std::vector<uint32_t> > counts_;
+
+    void encode_range(size_t task);
+    template <typename T>
+    void collect(const T* image, size_t first, size_t end, std::vector<uint32_t>& indices,
+                 std::vector<uint32_t>& counts);
+
+    SparseEncoder(const SparseEncoder&);
+    SparseEncoder& operator=(const SparseEncoder&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_SPARSEENCODER_H_ */
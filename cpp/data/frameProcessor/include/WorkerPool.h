@@ -0,0 +1,81 @@
+/*
+ * WorkerPool.h
+ *
+ * Pool of threads the Eiger plugins use to split the work on one frame, such
+ * as decompressing its blocks or reducing its pixels, into independent tasks.
+ */
+
+#ifndef FRAMEPROCESSOR_WORKERPOOL_H_
+#define FRAMEPROCESSOR_WORKERPOOL_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace FrameProcessor
+{
+
+  /**
+   * Run a set of tasks over a pool of worker threads and the calling thread
+   *
+   * One set of tasks runs at a time, and run() returns once every task of the
+   * set has finished, so a plugin keeps handling its frames in order.
+   */
+  class WorkerPool
+  {
+  public:
+    WorkerPool();
+    ~WorkerPool();
+
+    void resize(size_t num_workers);
+    void request_resize(size_t num_workers);
+    bool apply_requested_size();
+    void run(size_t num_tasks, const boost::function<void(size_t)>& task);
+    size_t num_threads() const;
+
+    /**
+     * Split a count into one range per task
+     *
+     * \param[in] count Number of items
+     * \param[in] num_tasks Number of ranges
+     * \param[in] task The range to find
+     * \param[out] first First item of the range
+     * \param[out] end One past the last item of the range
+     */
+    static void task_range(size_t count, size_t num_tasks, size_t task, size_t& first, size_t& end)
+    {
+      first = count / num_tasks * task + std::min(task, count % num_tasks);
+      end = first + count / num_tasks + (task < count % num_tasks ? 1 : 0);
+    }
+
+  private:
+    std::vector<boost::shared_ptr<boost::thread> > workers_;
+    boost::mutex mutex_;
+    boost::condition_variable work_ready_;
+    boost::condition_variable work_done_;
+    bool stop_;
+    size_t num_workers_;
+    std::atomic<size_t> requested_workers_;  // Size asked for by request_resize, NO_REQUEST once applied
+
+    // The set of tasks being run
+    const boost::function<void(size_t)>* task_;
+    size_t num_tasks_;
+    size_t next_task_;
+    size_t tasks_done_;
+
+    void start(size_t num_workers);
+    void stop();
+    void worker_loop();
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+  };
+
+} /* namespace FrameProcessor */
+
+#endif /* FRAMEPROCESSOR_WORKERPOOL_H_ */
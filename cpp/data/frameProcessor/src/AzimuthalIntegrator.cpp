@@ -0,0 +1,232 @@
+/*
+ * AzimuthalIntegrator.cpp
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include <boost/bind/bind.hpp>
+
+#include "AzimuthalIntegrator.h"
+#include "PixelKernels.h"
+
+// Ranges each image is split into per thread, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace FrameProcessor
+{
+
+  /**
+   * Construct an integrator with no bins
+   *
+   * \param[in] pool Threads to build the table and integrate images on
+   */
+  AzimuthalIntegrator::AzimuthalIntegrator(WorkerPool& pool) :
+    pool_(pool),
+    width_(0),
+    height_(0),
+    radial_min_(0),
+    radial_max_(0),
+    geometry_(NULL),
+    mask_(NULL),
+    unit_(RADIAL_Q),
+    pixels_(NULL),
+    data_type_(raw_unknown)
+  {
+  }
+
+  /**
+   * Build the lookup table for a geometry
+   *
+   * \param[in] width Pixels in each row of the images
+   * \param[in] height Number of rows of the images
+   * \param[in] geometry The detector geometry, which must be valid
+   * \param[in] mask Non-zero for pixels to leave out, width by height, or NULL for none
+   * \param[in] unit Radial coordinate of the bins
+   * \param[in] bins Number of bins
+   * \param[in] radial_min Lower edge of the first bin
+   * \param[in] radial_max Upper edge of the last bin, or no more than radial_min to cover every pixel
+   */
+  void AzimuthalIntegrator::set_geometry(size_t width, size_t height, const DetectorGeometry& geometry,
+                                         const uint32_t* mask, RadialUnit unit, size_t bins, double radial_min,
+                                         double radial_max)
+  {
+    width_ = width;
+    height_ = height;
+    geometry_ = &geometry;
+    mask_ = mask;
+    unit_ = unit;
+
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    radial_.resize(width * height);
+    task_min_.assign(num_tasks, INFINITY);
+    task_max_.assign(num_tasks, -INFINITY);
+    pool_.run(num_tasks, boost::bind(&AzimuthalIntegrator::radial_range, this, boost::placeholders::_1, num_tasks));
+    if (radial_max > radial_min) {
+      radial_min_ = radial_min;
+      radial_max_ = radial_max;
+    } else {
+      radial_min_ = *std::min_element(task_min_.begin(), task_min_.end());
+      radial_max_ = *std::max_element(task_max_.begin(), task_max_.end());
+      if (!(radial_max_ > radial_min_)) {
+        // No pixels, or all at one radius
+        radial_min_ = isfinite(radial_min_) ? radial_min_ : 0;
+        radial_max_ = radial_min_ + 1;
+      }
+    }
+
+    // Count the entries of each bin in each range of pixels, then turn the
+    // counts into the offset each range fills its part of each bin from
+    row_start_.assign(bins + 1, 0);
+    task_counts_.assign(num_tasks, std::vector<uint32_t>(bins, 0));
+    pool_.run(num_tasks, boost::bind(&AzimuthalIntegrator::count_range, this, boost::placeholders::_1, num_tasks));
+    uint32_t entries = 0;
+    for (size_t b = 0; b < bins; b++) {
+      row_start_[b] = entries;
+      for (size_t t = 0; t < num_tasks; t++) {
+        uint32_t count = task_counts_[t][b];
+        task_counts_[t][b] = entries;
+        entries += count;
+      }
+    }
+    row_start_[bins] = entries;
+    column_.resize(entries);
+    pool_.run(num_tasks, boost::bind(&AzimuthalIntegrator::fill_range, this, boost::placeholders::_1, num_tasks));
+
+    std::vector<float>().swap(radial_);
+    std::vector<std::vector<uint32_t> >().swap(task_counts_);
+    geometry_ = NULL;
+    mask_ = NULL;
+  }
+
+  /**
+   * Integrate an image
+   *
+   * \param[in] pixels The image, the size of the table
+   * \param[in] data_type Type of the pixels, raw_16bit or raw_32bit
+   * \param[out] profile Mean count of the valid pixels in each bin, 0 for bins with none
+   */
+  void AzimuthalIntegrator::integrate(const void* pixels, DataType data_type, std::vector<double>& profile)
+  {
+    size_t num_bins = bins();
+    if (num_bins == 0) {
+      profile.clear();
+      return;
+    }
+    pixels_ = pixels;
+    data_type_ = data_type;
+    sums_.assign(num_bins, 0);
+    counted_.assign(num_bins, 0);
+
+    // Split the bins into ranges of about the same number of entries
+    size_t num_tasks = std::min(pool_.num_threads() * RANGES_PER_THREAD, num_bins);
+    task_rows_.resize(num_tasks + 1);
+    for (size_t t = 0; t <= num_tasks; t++) {
+      uint64_t target = static_cast<uint64_t>(entries()) * t / num_tasks;
+      task_rows_[t] = std::lower_bound(row_start_.begin(), row_start_.end() - 1, target) - row_start_.begin();
+    }
+    task_rows_[num_tasks] = num_bins;
+    pool_.run(num_tasks, boost::bind(&AzimuthalIntegrator::integrate_rows, this, boost::placeholders::_1));
+    pixels_ = NULL;
+
+    profile.resize(num_bins);
+    for (size_t b = 0; b < num_bins; b++) {
+      profile[b] = counted_[b] > 0 ? static_cast<double>(sums_[b]) / counted_[b] : 0;
+    }
+  }
+
+  /**
+   * Find the radial coordinate of each pixel in one range of rows
+   */
+  void AzimuthalIntegrator::radial_range(size_t task, size_t num_tasks)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(height_, num_tasks, task, first, end);
+    float low = INFINITY;
+    float high = -INFINITY;
+    for (size_t y = first; y < end; y++) {
+      for (size_t x = 0; x < width_; x++) {
+        size_t i = y * width_ + x;
+        if (mask_ && mask_[i]) {
+          radial_[i] = NAN;
+          continue;
+        }
+        double radial = unit_ == RADIAL_Q ? geometry_->q(x, y) : geometry_->two_theta(x, y) * 180 / M_PI;
+        radial_[i] = radial;
+        low = std::min(low, radial_[i]);
+        high = std::max(high, radial_[i]);
+      }
+    }
+    task_min_[task] = low;
+    task_max_[task] = high;
+  }
+
+  /**
+   * Count the pixels falling in each bin in one range of rows
+   */
+  void AzimuthalIntegrator::count_range(size_t task, size_t num_tasks)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(height_, num_tasks, task, first, end);
+    std::vector<uint32_t>& counts = task_counts_[task];
+    for (size_t i = first * width_; i < end * width_; i++) {
+      long b = bin(radial_[i]);
+      if (b >= 0) {
+        counts[b]++;
+      }
+    }
+  }
+
+  /**
+   * Add the pixels of one range of rows to the table
+   */
+  void AzimuthalIntegrator::fill_range(size_t task, size_t num_tasks)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(height_, num_tasks, task, first, end);
+    std::vector<uint32_t>& offsets = task_counts_[task];
+    for (size_t i = first * width_; i < end * width_; i++) {
+      long b = bin(radial_[i]);
+      if (b >= 0) {
+        column_[offsets[b]++] = i;
+      }
+    }
+  }
+
+  /**
+   * Integrate one range of bins of the current image
+   */
+  void AzimuthalIntegrator::integrate_rows(size_t task)
+  {
+    for (size_t b = task_rows_[task]; b < task_rows_[task + 1]; b++) {
+      const uint32_t* indices = column_.data() + row_start_[b];
+      size_t count = row_start_[b + 1] - row_start_[b];
+      if (data_type_ == raw_16bit) {
+        indexed_pixel_sum(static_cast<const uint16_t*>(pixels_), indices, count, sums_[b], counted_[b]);
+      } else {
+        indexed_pixel_sum(static_cast<const uint32_t*>(pixels_), indices, count, sums_[b], counted_[b]);
+      }
+    }
+  }
+
+  /**
+   * Bin of a radial coordinate
+   *
+   * \param[in] radial The radial coordinate, NAN for a masked pixel
+   * \return The bin, or -1 if outside the bins
+   */
+  long AzimuthalIntegrator::bin(float radial) const
+  {
+    size_t num_bins = row_start_.size() - 1;
+    if (!(radial >= radial_min_ && radial <= radial_max_)) {
+      return -1;
+    }
+    long b = static_cast<long>((radial - radial_min_) / (radial_max_ - radial_min_) * num_bins);
+    // The upper edge belongs to the last bin
+    return std::min(b, static_cast<long>(num_bins) - 1);
+  }
+
+} /* namespace FrameProcessor */
@@ -0,0 +1,251 @@
+/*
+ * EigerAzimuthalIntegrationPlugin.cpp
+ */
+
+#include <EigerAzimuthalIntegrationPlugin.h>
+#include "GlobalHeaderStore.h"
+#include "Json.h"
+#include "version.h"
+
+// Worker threads, as well as the processing thread, unless configured
+static const unsigned int DEFAULT_THREADS = 2;
+static const unsigned int DEFAULT_BINS = 1000;
+
+namespace FrameProcessor
+{
+
+  const std::string EigerAzimuthalIntegrationPlugin::CONFIG_THREADS = "threads";
+  const std::string EigerAzimuthalIntegrationPlugin::CONFIG_BINS = "bins";
+  const std::string EigerAzimuthalIntegrationPlugin::CONFIG_UNIT = "unit";
+  const std::string EigerAzimuthalIntegrationPlugin::CONFIG_RADIAL_MIN = "radial_min";
+  const std::string EigerAzimuthalIntegrationPlugin::CONFIG_RADIAL_MAX = "radial_max";
+
+  const std::string EigerAzimuthalIntegrationPlugin::UNIT_Q = "q";
+  const std::string EigerAzimuthalIntegrationPlugin::UNIT_TWO_THETA = "2theta";
+
+  /**
+   * Constructor
+   */
+  EigerAzimuthalIntegrationPlugin::EigerAzimuthalIntegrationPlugin() :
+    decompressor_(pool_),
+    integrator_(pool_),
+    threads_(DEFAULT_THREADS),
+    bins_(DEFAULT_BINS),
+    unit_(UNIT_Q),
+    radial_min_(0),
+    radial_max_(0),
+    table_generation_(0),
+    table_width_(0),
+    table_height_(0),
+    table_stale_(true),
+    table_valid_(false),
+    frames_integrated_(0),
+    frames_failed_(0)
+  {
+    // Setup logging for the class
+    logger_ = Logger::getLogger("FP.EigerAzimuthalIntegrationPlugin");
+    logger_->setLevel(Level::getAll());
+    LOG4CXX_TRACE(logger_, "EigerAzimuthalIntegrationPlugin constructor.");
+
+    pool_.resize(threads_);
+    if (!FrameDecompressor::supported()) {
+      LOG4CXX_WARN(logger_, "Built without LZ4, only uncompressed images can be integrated");
+    }
+  }
+
+  /**
+   * Destructor
+   */
+  EigerAzimuthalIntegrationPlugin::~EigerAzimuthalIntegrationPlugin()
+  {
+  }
+
+  /**
+   * Set configuration options for the plugin
+   *
+   * \param[in] config IpcMessage containing configuration data
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerAzimuthalIntegrationPlugin::configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply)
+  {
+    if (config.has_param(CONFIG_THREADS)) {
+      // Applied before the next frame, as a frame may be being processed
+      threads_ = config.get_param<unsigned int>(CONFIG_THREADS);
+      pool_.request_resize(threads_);
+    }
+    if (config.has_param(CONFIG_BINS)) {
+      unsigned int bins = config.get_param<unsigned int>(CONFIG_BINS);
+      if (bins > 0) {
+        bins_ = bins;
+        table_stale_ = true;
+      } else {
+        LOG4CXX_ERROR(logger_, "Number of bins must be at least 1");
+        reply.set_nack("Number of bins must be at least 1");
+      }
+    }
+    if (config.has_param(CONFIG_UNIT)) {
+      std::string unit = config.get_param<std::string>(CONFIG_UNIT);
+      if (unit == UNIT_Q || unit == UNIT_TWO_THETA) {
+        unit_ = unit;
+        table_stale_ = true;
+      } else {
+        LOG4CXX_ERROR(logger_, "Unknown unit " << unit << ", expected " << UNIT_Q << " or " << UNIT_TWO_THETA);
+        reply.set_nack("Unknown unit " + unit);
+      }
+    }
+    if (config.has_param(CONFIG_RADIAL_MIN)) {
+      radial_min_ = config.get_param<double>(CONFIG_RADIAL_MIN);
+      table_stale_ = true;
+    }
+    if (config.has_param(CONFIG_RADIAL_MAX)) {
+      radial_max_ = config.get_param<double>(CONFIG_RADIAL_MAX);
+      table_stale_ = true;
+    }
+  }
+
+  /**
+   * Get the configuration values for this plugin
+   *
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerAzimuthalIntegrationPlugin::requestConfiguration(OdinData::IpcMessage& reply)
+  {
+    reply.set_param(get_name() + "/" + CONFIG_THREADS, threads_);
+    reply.set_param(get_name() + "/" + CONFIG_BINS, bins_);
+    reply.set_param(get_name() + "/" + CONFIG_UNIT, unit_);
+    reply.set_param(get_name() + "/" + CONFIG_RADIAL_MIN, radial_min_);
+    reply.set_param(get_name() + "/" + CONFIG_RADIAL_MAX, radial_max_);
+  }
+
+  /**
+   * Collate status information for the plugin
+   *
+   * \param[out] status Reference to an IpcMessage value to store the status
+   */
+  void EigerAzimuthalIntegrationPlugin::status(OdinData::IpcMessage& status)
+  {
+    status.set_param(get_name() + "/frames_integrated", frames_integrated_);
+    status.set_param(get_name() + "/frames_failed", frames_failed_);
+    status.set_param(get_name() + "/table_entries", static_cast<uint64_t>(integrator_.entries()));
+    status.set_param(get_name() + "/radial_min", integrator_.radial_min());
+    status.set_param(get_name() + "/radial_max", integrator_.radial_max());
+  }
+
+  /**
+   * Reset the frame counts
+   */
+  bool EigerAzimuthalIntegrationPlugin::reset_statistics()
+  {
+    frames_integrated_ = 0;
+    frames_failed_ = 0;
+    return true;
+  }
+
+  /**
+   * Integrate an image, publish its profile and pass it on
+   *
+   * \param[in] frame The frame to process
+   */
+  void EigerAzimuthalIntegrationPlugin::process_frame(boost::shared_ptr<Frame> frame)
+  {
+    pool_.apply_requested_size();
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    DataType data_type = meta_data.get_data_type();
+    if (data_type != raw_16bit && data_type != raw_32bit) {
+      LOG4CXX_ERROR(logger_, "Unable to integrate frame " << frame->get_frame_number() << " of data type "
+                    << data_type);
+      frames_failed_++;
+    } else if (update_table(meta_data.get_dimensions())) {
+      const void* pixels = decompressor_.pixels(frame);
+      if (pixels) {
+        integrator_.integrate(pixels, data_type, profile_);
+        frames_integrated_++;
+
+        OdinData::JsonDict json;
+        json.add("acqID", meta_data.get_acquisition_ID());
+        json.add("frame", static_cast<uint64_t>(frame->get_frame_number()));
+        json.add("unit", unit_);
+        json.add("radial_min", integrator_.radial_min());
+        json.add("radial_max", integrator_.radial_max());
+        json.add("profile", profile_);
+        publish_meta(get_name(), "eiger-azimuthalintegration", json.str(), json.str());
+      } else {
+        LOG4CXX_ERROR(logger_, "Unable to integrate frame " << frame->get_frame_number());
+        frames_failed_++;
+      }
+    }
+
+    this->push(frame);
+  }
+
+  /**
+   * Rebuild the lookup table if the image size, global header or bins have changed
+   *
+   * \param[in] dimensions Dimensions of the image
+   * \return false if the image cannot be integrated
+   */
+  bool EigerAzimuthalIntegrationPlugin::update_table(const dimensions_t& dimensions)
+  {
+    if (dimensions.size() != 2) {
+      return false;
+    }
+    size_t height = dimensions[0];
+    size_t width = dimensions[1];
+    boost::shared_ptr<const GlobalHeader> header = GlobalHeaderStore::instance().current();
+    uint64_t generation = header ? header->generation : 0;
+    if (!table_stale_ && generation == table_generation_ && width == table_width_ && height == table_height_) {
+      return table_valid_;
+    }
+
+    table_generation_ = generation;
+    table_width_ = width;
+    table_height_ = height;
+    table_stale_ = false;
+    table_valid_ = header && header->geometry.valid();
+    if (!table_valid_) {
+      // Logged once per global header, as the table is not rebuilt until it changes
+      LOG4CXX_WARN(logger_, "No detector geometry in the global header, images will not be integrated");
+      return false;
+    }
+
+    const uint32_t* mask = NULL;
+    if (header->mask_width == width && header->mask_height == height) {
+      mask = header->mask.data();
+    } else if (!header->mask.empty()) {
+      LOG4CXX_WARN(logger_, "Ignoring " << header->mask_width << "x" << header->mask_height
+                   << " pixel mask for " << width << "x" << height << " images");
+    }
+    RadialUnit unit = unit_ == UNIT_TWO_THETA ? RADIAL_TWO_THETA : RADIAL_Q;
+    integrator_.set_geometry(width, height, header->geometry, mask, unit, bins_, radial_min_, radial_max_);
+    LOG4CXX_INFO(logger_, "Integrating " << width << "x" << height << " images into " << bins_ << " bins of "
+                 << unit_ << " from " << integrator_.radial_min() << " to " << integrator_.radial_max() << ", "
+                 << integrator_.entries() << " pixels" << (mask ? " with the detector mask" : ""));
+    return true;
+  }
+
+  int EigerAzimuthalIntegrationPlugin::get_version_major()
+  {
+    return EIGER_DETECTOR_VERSION_MAJOR;
+  }
+
+  int EigerAzimuthalIntegrationPlugin::get_version_minor()
+  {
+    return EIGER_DETECTOR_VERSION_MINOR;
+  }
+
+  int EigerAzimuthalIntegrationPlugin::get_version_patch()
+  {
+    return EIGER_DETECTOR_VERSION_PATCH;
+  }
+
+  std::string EigerAzimuthalIntegrationPlugin::get_version_short()
+  {
+    return EIGER_DETECTOR_VERSION_STR_SHORT;
+  }
+
+  std::string EigerAzimuthalIntegrationPlugin::get_version_long()
+  {
+    return EIGER_DETECTOR_VERSION_STR;
+  }
+
+} /* namespace FrameProcessor */
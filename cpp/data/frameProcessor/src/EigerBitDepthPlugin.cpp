@@ -0,0 +1,244 @@
+/*
+ * EigerBitDepthPlugin.cpp
+ */
+
+#include <boost/bind/bind.hpp>
+
+#include <EigerBitDepthPlugin.h>
+#include "DataBlockFrame.h"
+#include "Json.h"
+#include "PixelKernels.h"
+#include "version.h"
+
+// Worker threads, as well as the processing thread, unless configured
+static const unsigned int DEFAULT_THREADS = 2;
+// Ranges each image is split into per thread, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace FrameProcessor
+{
+
+  const std::string EigerBitDepthPlugin::CONFIG_THREADS = "threads";
+  const std::string EigerBitDepthPlugin::CONFIG_WIDE_DATASET = "wide_dataset";
+
+  /**
+   * Constructor
+   */
+  EigerBitDepthPlugin::EigerBitDepthPlugin() :
+    decompressor_(pool_),
+    threads_(DEFAULT_THREADS),
+    wide_dataset_("data_32bit"),
+    pixels_(NULL),
+    narrowed_(NULL),
+    num_pixels_(0),
+    frames_narrowed_(0),
+    frames_wide_(0),
+    frames_failed_(0),
+    bytes_in_(0),
+    bytes_out_(0)
+  {
+    // Setup logging for the class
+    logger_ = Logger::getLogger("FP.EigerBitDepthPlugin");
+    logger_->setLevel(Level::getAll());
+    LOG4CXX_TRACE(logger_, "EigerBitDepthPlugin constructor.");
+
+    pool_.resize(threads_);
+    compressor_.reset(new FrameCompressor(threads_));
+    if (!FrameDecompressor::supported()) {
+      LOG4CXX_WARN(logger_, "Built without LZ4, only uncompressed images can be narrowed");
+    }
+  }
+
+  /**
+   * Destructor
+   */
+  EigerBitDepthPlugin::~EigerBitDepthPlugin()
+  {
+  }
+
+  /**
+   * Set configuration options for the plugin
+   *
+   * \param[in] config IpcMessage containing configuration data
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerBitDepthPlugin::configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply)
+  {
+    if (config.has_param(CONFIG_THREADS)) {
+      // Applied before the next frame, as a frame may be being processed
+      threads_ = config.get_param<unsigned int>(CONFIG_THREADS);
+      pool_.request_resize(threads_);
+    }
+    if (config.has_param(CONFIG_WIDE_DATASET)) {
+      wide_dataset_ = config.get_param<std::string>(CONFIG_WIDE_DATASET);
+    }
+  }
+
+  /**
+   * Get the configuration values for this plugin
+   *
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerBitDepthPlugin::requestConfiguration(OdinData::IpcMessage& reply)
+  {
+    reply.set_param(get_name() + "/" + CONFIG_THREADS, threads_);
+    reply.set_param(get_name() + "/" + CONFIG_WIDE_DATASET, wide_dataset_);
+  }
+
+  /**
+   * Collate status information for the plugin
+   *
+   * \param[out] status Reference to an IpcMessage value to store the status
+   */
+  void EigerBitDepthPlugin::status(OdinData::IpcMessage& status)
+  {
+    status.set_param(get_name() + "/frames_narrowed", frames_narrowed_);
+    status.set_param(get_name() + "/frames_wide", frames_wide_);
+    status.set_param(get_name() + "/frames_failed", frames_failed_);
+    status.set_param(get_name() + "/bytes_in", bytes_in_);
+    status.set_param(get_name() + "/bytes_out", bytes_out_);
+  }
+
+  /**
+   * Reset the frame and byte counts
+   */
+  bool EigerBitDepthPlugin::reset_statistics()
+  {
+    frames_narrowed_ = 0;
+    frames_wide_ = 0;
+    frames_failed_ = 0;
+    bytes_in_ = 0;
+    bytes_out_ = 0;
+    return true;
+  }
+
+  /**
+   * Pass a 32 bit image on as 16 bits if it fits, or in the wide dataset if not
+   *
+   * \param[in] frame The frame to process
+   */
+  void EigerBitDepthPlugin::process_frame(boost::shared_ptr<Frame> frame)
+  {
+    if (pool_.apply_requested_size()) {
+      compressor_.reset(new FrameCompressor(pool_.num_threads() - 1));
+    }
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    if (meta_data.get_data_type() != raw_32bit) {
+      this->push(frame);
+      return;
+    }
+
+    const uint32_t* pixels = static_cast<const uint32_t*>(decompressor_.pixels(frame));
+    size_t num_pixels = FrameDecompressor::pixel_count(meta_data.get_dimensions());
+    CompressionType compression = meta_data.get_compression_type();
+    boost::shared_ptr<Frame> narrow_frame;
+    bool narrowed = false;
+    if (!pixels) {
+      LOG4CXX_ERROR(logger_, "Unable to narrow frame " << frame->get_frame_number());
+      frames_failed_++;
+    } else if (compression == bslz4) {
+      if (narrow_.size() != num_pixels * sizeof(uint16_t)) {
+        narrow_.rebuild(num_pixels * sizeof(uint16_t));
+      }
+      narrowed = narrow(pixels, static_cast<uint16_t*>(narrow_.data()), num_pixels) &&
+          compressor_->compress(narrow_, sizeof(uint16_t), compressed_);
+      if (narrowed) {
+        FrameMetaData narrow_meta_data = frame->get_meta_data_copy();
+        narrow_meta_data.set_data_type(raw_16bit);
+        narrow_meta_data.set_parameter("compressed_size", static_cast<uint32_t>(compressed_.size()));
+        narrow_frame.reset(new DataBlockFrame(narrow_meta_data, compressed_.data(), compressed_.size()));
+      }
+    } else {
+      // Other images are passed on uncompressed, so are narrowed straight into the new frame
+      FrameMetaData narrow_meta_data = frame->get_meta_data_copy();
+      narrow_meta_data.set_data_type(raw_16bit);
+      narrow_meta_data.set_compression_type(no_compression);
+      narrow_meta_data.set_parameter("compressed_size", static_cast<uint32_t>(num_pixels * sizeof(uint16_t)));
+      narrow_frame.reset(new DataBlockFrame(narrow_meta_data, num_pixels * sizeof(uint16_t)));
+      narrowed = narrow(pixels, static_cast<uint16_t*>(narrow_frame->get_data_ptr()), num_pixels);
+    }
+
+    OdinData::JsonDict json;
+    json.add("acqID", meta_data.get_acquisition_ID());
+    json.add("frame", static_cast<uint64_t>(frame->get_frame_number()));
+    json.add("bit_depth", narrowed ? 16 : 32);
+    publish_meta(get_name(), "eiger-bitdepth", json.str(), json.str());
+
+    bytes_in_ += frame->get_image_size();
+    if (narrowed) {
+      frames_narrowed_++;
+      bytes_out_ += narrow_frame->get_image_size();
+      narrow_frame->set_frame_number(frame->get_frame_number());
+      this->push(narrow_frame);
+    } else {
+      frames_wide_++;
+      bytes_out_ += frame->get_image_size();
+      frame->meta_data().set_dataset_name(wide_dataset_);
+      this->push(frame);
+    }
+  }
+
+  /**
+   * Copy an image to 16 bits across the worker threads
+   *
+   * \param[in] pixels The 32 bit image
+   * \param[out] narrowed The 16 bit image
+   * \param[in] num_pixels Number of pixels in the image
+   * \return true if every valid pixel fits in 16 bits, so the copy is exact
+   */
+  bool EigerBitDepthPlugin::narrow(const uint32_t* pixels, uint16_t* narrowed, size_t num_pixels)
+  {
+    pixels_ = pixels;
+    narrowed_ = narrowed;
+    num_pixels_ = num_pixels;
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    too_large_.assign(num_tasks, 0);
+    pool_.run(num_tasks, boost::bind(&EigerBitDepthPlugin::narrow_range, this, boost::placeholders::_1));
+    pixels_ = NULL;
+    narrowed_ = NULL;
+
+    for (size_t i = 0; i < num_tasks; i++) {
+      if (too_large_[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Copy one range of the current image to 16 bits
+   */
+  void EigerBitDepthPlugin::narrow_range(size_t task)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(num_pixels_, too_large_.size(), task, first, end);
+    too_large_[task] = narrow_pixels(pixels_ + first, narrowed_ + first, end - first);
+  }
+
+  int EigerBitDepthPlugin::get_version_major()
+  {
+    return EIGER_DETECTOR_VERSION_MAJOR;
+  }
+
+  int EigerBitDepthPlugin::get_version_minor()
+  {
+    return EIGER_DETECTOR_VERSION_MINOR;
+  }
+
+  int EigerBitDepthPlugin::get_version_patch()
+  {
+    return EIGER_DETECTOR_VERSION_PATCH;
+  }
+
+  std::string EigerBitDepthPlugin::get_version_short()
+  {
+    return EIGER_DETECTOR_VERSION_STR_SHORT;
+  }
+
+  std::string EigerBitDepthPlugin::get_version_long()
+  {
+    return EIGER_DETECTOR_VERSION_STR;
+  }
+
+} /* namespace FrameProcessor */
@@ -0,0 +1,263 @@
+/*
+ * EigerHitFinderPlugin.cpp
+ */
+
+#include <EigerHitFinderPlugin.h>
+#include "GlobalHeaderStore.h"
+#include "Json.h"
+#include "version.h"
+
+// Worker threads, as well as the processing thread, unless configured
+static const unsigned int DEFAULT_THREADS = 2;
+static const uint32_t DEFAULT_PIXEL_THRESHOLD = 5;
+static const uint64_t DEFAULT_HIT_THRESHOLD = 20;
+
+namespace FrameProcessor
+{
+
+  const std::string EigerHitFinderPlugin::CONFIG_THREADS = "threads";
+  const std::string EigerHitFinderPlugin::CONFIG_PIXEL_THRESHOLD = "pixel_threshold";
+  const std::string EigerHitFinderPlugin::CONFIG_HIT_THRESHOLD = "hit_threshold";
+  const std::string EigerHitFinderPlugin::CONFIG_LOW_RESOLUTION = "low_resolution";
+  const std::string EigerHitFinderPlugin::CONFIG_HIGH_RESOLUTION = "high_resolution";
+  const std::string EigerHitFinderPlugin::CONFIG_VETO_MODE = "veto_mode";
+  const std::string EigerHitFinderPlugin::CONFIG_VETO_DATASET = "veto_dataset";
+
+  const std::string EigerHitFinderPlugin::VETO_MODE_OFF = "off";
+  const std::string EigerHitFinderPlugin::VETO_MODE_DROP = "drop";
+  const std::string EigerHitFinderPlugin::VETO_MODE_DIVERT = "divert";
+
+  /**
+   * Constructor
+   */
+  EigerHitFinderPlugin::EigerHitFinderPlugin() :
+    decompressor_(pool_),
+    scorer_(pool_),
+    threads_(DEFAULT_THREADS),
+    pixel_threshold_(DEFAULT_PIXEL_THRESHOLD),
+    hit_threshold_(DEFAULT_HIT_THRESHOLD),
+    low_resolution_(0),
+    high_resolution_(0),
+    veto_mode_(VETO_MODE_DROP),
+    veto_dataset_("vetoed"),
+    region_generation_(0),
+    region_stale_(true),
+    frames_kept_(0),
+    frames_vetoed_(0),
+    frames_failed_(0)
+  {
+    // Setup logging for the class
+    logger_ = Logger::getLogger("FP.EigerHitFinderPlugin");
+    logger_->setLevel(Level::getAll());
+    LOG4CXX_TRACE(logger_, "EigerHitFinderPlugin constructor.");
+
+    pool_.resize(threads_);
+    if (!FrameDecompressor::supported()) {
+      LOG4CXX_WARN(logger_, "Built without LZ4, only uncompressed images can be scored");
+    }
+  }
+
+  /**
+   * Destructor
+   */
+  EigerHitFinderPlugin::~EigerHitFinderPlugin()
+  {
+  }
+
+  /**
+   * Set configuration options for the plugin
+   *
+   * \param[in] config IpcMessage containing configuration data
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerHitFinderPlugin::configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply)
+  {
+    if (config.has_param(CONFIG_THREADS)) {
+      // Applied before the next frame, as a frame may be being processed
+      threads_ = config.get_param<unsigned int>(CONFIG_THREADS);
+      pool_.request_resize(threads_);
+    }
+    if (config.has_param(CONFIG_PIXEL_THRESHOLD)) {
+      pixel_threshold_ = config.get_param<unsigned int>(CONFIG_PIXEL_THRESHOLD);
+    }
+    if (config.has_param(CONFIG_HIT_THRESHOLD)) {
+      hit_threshold_ = config.get_param<unsigned int>(CONFIG_HIT_THRESHOLD);
+    }
+    if (config.has_param(CONFIG_LOW_RESOLUTION)) {
+      low_resolution_ = config.get_param<double>(CONFIG_LOW_RESOLUTION);
+      region_stale_ = true;
+    }
+    if (config.has_param(CONFIG_HIGH_RESOLUTION)) {
+      high_resolution_ = config.get_param<double>(CONFIG_HIGH_RESOLUTION);
+      region_stale_ = true;
+    }
+    if (config.has_param(CONFIG_VETO_MODE)) {
+      std::string mode = config.get_param<std::string>(CONFIG_VETO_MODE);
+      if (mode == VETO_MODE_OFF || mode == VETO_MODE_DROP || mode == VETO_MODE_DIVERT) {
+        veto_mode_ = mode;
+      } else {
+        LOG4CXX_ERROR(logger_, "Unknown veto mode " << mode << ", expected " << VETO_MODE_OFF << ", "
+                      << VETO_MODE_DROP << " or " << VETO_MODE_DIVERT);
+        reply.set_nack("Unknown veto mode " + mode);
+      }
+    }
+    if (config.has_param(CONFIG_VETO_DATASET)) {
+      veto_dataset_ = config.get_param<std::string>(CONFIG_VETO_DATASET);
+    }
+  }
+
+  /**
+   * Get the configuration values for this plugin
+   *
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerHitFinderPlugin::requestConfiguration(OdinData::IpcMessage& reply)
+  {
+    reply.set_param(get_name() + "/" + CONFIG_THREADS, threads_);
+    reply.set_param(get_name() + "/" + CONFIG_PIXEL_THRESHOLD, pixel_threshold_);
+    reply.set_param(get_name() + "/" + CONFIG_HIT_THRESHOLD, hit_threshold_);
+    reply.set_param(get_name() + "/" + CONFIG_LOW_RESOLUTION, low_resolution_);
+    reply.set_param(get_name() + "/" + CONFIG_HIGH_RESOLUTION, high_resolution_);
+    reply.set_param(get_name() + "/" + CONFIG_VETO_MODE, veto_mode_);
+    reply.set_param(get_name() + "/" + CONFIG_VETO_DATASET, veto_dataset_);
+  }
+
+  /**
+   * Collate status information for the plugin
+   *
+   * \param[out] status Reference to an IpcMessage value to store the status
+   */
+  void EigerHitFinderPlugin::status(OdinData::IpcMessage& status)
+  {
+    status.set_param(get_name() + "/frames_kept", frames_kept_);
+    status.set_param(get_name() + "/frames_vetoed", frames_vetoed_);
+    status.set_param(get_name() + "/frames_failed", frames_failed_);
+    status.set_param(get_name() + "/region_pixels", static_cast<uint64_t>(scorer_.region_pixels()));
+  }
+
+  /**
+   * Reset the frame counts
+   */
+  bool EigerHitFinderPlugin::reset_statistics()
+  {
+    frames_kept_ = 0;
+    frames_vetoed_ = 0;
+    frames_failed_ = 0;
+    return true;
+  }
+
+  /**
+   * Score an image and pass it on, divert it or drop it
+   *
+   * \param[in] frame The frame to process
+   */
+  void EigerHitFinderPlugin::process_frame(boost::shared_ptr<Frame> frame)
+  {
+    pool_.apply_requested_size();
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    DataType data_type = meta_data.get_data_type();
+    const void* pixels = NULL;
+    if ((data_type == raw_16bit || data_type == raw_32bit) && update_region(meta_data.get_dimensions())) {
+      pixels = decompressor_.pixels(frame);
+    }
+    if (!pixels) {
+      // Keep images that cannot be scored
+      LOG4CXX_ERROR(logger_, "Unable to score frame " << frame->get_frame_number());
+      frames_failed_++;
+      frames_kept_++;
+      this->push(frame);
+      return;
+    }
+
+    uint64_t score = scorer_.score(pixels, data_type, pixel_threshold_);
+    bool hit = score >= hit_threshold_;
+    if (hit || veto_mode_ == VETO_MODE_OFF) {
+      frames_kept_++;
+    } else {
+      frames_vetoed_++;
+    }
+
+    OdinData::JsonDict json;
+    json.add("acqID", meta_data.get_acquisition_ID());
+    json.add("frame", static_cast<uint64_t>(frame->get_frame_number()));
+    json.add("score", score);
+    json.add("hit", hit);
+    json.add("kept", frames_kept_);
+    json.add("vetoed", frames_vetoed_);
+    publish_meta(get_name(), "eiger-hitfinding", json.str(), json.str());
+
+    if (hit || veto_mode_ == VETO_MODE_OFF) {
+      this->push(frame);
+    } else if (veto_mode_ == VETO_MODE_DIVERT) {
+      frame->meta_data().set_dataset_name(veto_dataset_);
+      this->push(frame);
+    }
+  }
+
+  /**
+   * Rebuild the scoring region if the image size, global header or ring has changed
+   *
+   * \param[in] dimensions Dimensions of the image
+   * \return false if the image cannot be scored
+   */
+  bool EigerHitFinderPlugin::update_region(const dimensions_t& dimensions)
+  {
+    if (dimensions.size() != 2) {
+      return false;
+    }
+    size_t height = dimensions[0];
+    size_t width = dimensions[1];
+    boost::shared_ptr<const GlobalHeader> header = GlobalHeaderStore::instance().current();
+    uint64_t generation = header ? header->generation : 0;
+    if (!region_stale_ && generation == region_generation_ && width == scorer_.width() && height == scorer_.height()) {
+      return true;
+    }
+
+    const DetectorGeometry* geometry = NULL;
+    const uint32_t* mask = NULL;
+    if (header) {
+      geometry = &header->geometry;
+      if (header->mask_width == width && header->mask_height == height) {
+        mask = header->mask.data();
+      } else if (!header->mask.empty()) {
+        LOG4CXX_WARN(logger_, "Ignoring " << header->mask_width << "x" << header->mask_height
+                     << " pixel mask for " << width << "x" << height << " images");
+      }
+    }
+    if ((low_resolution_ > 0 || high_resolution_ > 0) && !(geometry && geometry->valid())) {
+      LOG4CXX_WARN(logger_, "No detector geometry in the global header, scoring the whole image");
+    }
+    scorer_.set_region(width, height, geometry, mask, low_resolution_, high_resolution_);
+    region_generation_ = generation;
+    region_stale_ = false;
+    LOG4CXX_INFO(logger_, "Scoring " << scorer_.region_pixels() << " pixels of " << width << "x" << height
+                 << " images" << (mask ? " with the detector mask" : ""));
+    return true;
+  }
+
+  int EigerHitFinderPlugin::get_version_major()
+  {
+    return EIGER_DETECTOR_VERSION_MAJOR;
+  }
+
+  int EigerHitFinderPlugin::get_version_minor()
+  {
+    return EIGER_DETECTOR_VERSION_MINOR;
+  }
+
+  int EigerHitFinderPlugin::get_version_patch()
+  {
+    return EIGER_DETECTOR_VERSION_PATCH;
+  }
+
+  std::string EigerHitFinderPlugin::get_version_short()
+  {
+    return EIGER_DETECTOR_VERSION_STR_SHORT;
+  }
+
+  std::string EigerHitFinderPlugin::get_version_long()
+  {
+    return EIGER_DETECTOR_VERSION_STR;
+  }
+
+} /* namespace FrameProcessor */
@@ -6,6 +6,7 @@
  */
 
 #include <EigerProcessPlugin.h>
+#include "GlobalHeaderStore.h"
 #include "Json.h"
 
 namespace FrameProcessor
@@ -37,6 +38,8 @@ namespace FrameProcessor
   void EigerProcessPlugin::process_frame(boost::shared_ptr<Frame> frame)
   {
     const Eiger::FrameHeader* hdrPtr = static_cast<const Eiger::FrameHeader*>(frame->get_image_ptr());
+    // The message part follows the header, padded if the decoder aligns it
+    const char* payload = static_cast<const char*>(frame->get_image_ptr()) + hdrPtr->payload_offset;
 
     LOG4CXX_TRACE(logger_, "FrameHeader frame currentMessageType: " << hdrPtr->messageType);
     LOG4CXX_TRACE(logger_, "FrameHeader frame series: " << hdrPtr->series);
@@ -60,7 +63,8 @@ namespace FrameProcessor
     json.add("acqID", acqIDString);
 
     if (hdrPtr->messageType == Eiger::IMAGE_DATA) {
-      frame->set_image_offset(sizeof(Eiger::FrameHeader));
+      // stream2 images are left inside their CBOR message, so skip over the framing
+      frame->set_image_offset(hdrPtr->payload_offset + hdrPtr->data_offset);
       frame->set_image_size(hdrPtr->data_size);
 
       FrameMetaData frame_meta_data;
@@ -118,7 +122,7 @@ namespace FrameProcessor
 
       this->push(frame);
     } else if (hdrPtr->messageType == Eiger::IMAGE_APPENDIX) {
-      std::string dataString((static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size);
+      std::string dataString(payload, hdrPtr->data_size);
 
       // Add Frame number
       json.add("frame", hdrPtr->frame_number);
@@ -128,13 +132,19 @@ namespace FrameProcessor
       // Add Series number
       json.add("series", hdrPtr->series);
 
+      GlobalHeaderStore::instance().start_series(hdrPtr->series);
+
       publish_meta(get_name(), "eiger-globalnone", json.str(), json.str());
     } else if (hdrPtr->messageType == Eiger::GLOBAL_HEADER_CONFIG) {
-      std::string dataString((static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size);
+      std::string dataString(payload, hdrPtr->data_size);
 
       // Add Series number
       json.add("series", hdrPtr->series);
 
+      // Keep the config for the plugins after this one, which only see images
+      GlobalHeaderStore::instance().start_series(hdrPtr->series);
+      GlobalHeaderStore::instance().set_config(hdrPtr->series, dataString);
+
       publish_meta(get_name(), "eiger-globalconfig", dataString, json.str());
     } else if (hdrPtr->messageType == Eiger::GLOBAL_HEADER_FLATFIELD) {
       // Add shape
@@ -147,7 +157,7 @@ namespace FrameProcessor
       std::string dataTypeString(hdrPtr->dataType);
       json.add("type", dataTypeString);
 
-      publish_meta(get_name(), "eiger-globalflatfield", reinterpret_cast<const void*>(static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size, json.str());
+      publish_meta(get_name(), "eiger-globalflatfield", reinterpret_cast<const void*>(payload), hdrPtr->data_size, json.str());
     } else if (hdrPtr->messageType == Eiger::GLOBAL_HEADER_MASK) {
       // Add shape
       std::vector<uint32_t> shape;
@@ -159,7 +169,16 @@ namespace FrameProcessor
       std::string dataTypeString(hdrPtr->dataType);
       json.add("type", dataTypeString);
 
-      publish_meta(get_name(), "eiger-globalmask", reinterpret_cast<const void*>(static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size, json.str());
+      if (dataTypeString == "uint32" &&
+          hdrPtr->data_size == static_cast<size_t>(hdrPtr->shapeSizeX) * hdrPtr->shapeSizeY * sizeof(uint32_t)) {
+        GlobalHeaderStore::instance().set_mask(hdrPtr->series, reinterpret_cast<const uint32_t*>(payload),
+                                               hdrPtr->shapeSizeX, hdrPtr->shapeSizeY);
+      } else {
+        LOG4CXX_WARN(logger_, "Pixel mask of type " << dataTypeString << " with " << hdrPtr->data_size
+                     << " bytes not kept for later plugins");
+      }
+
+      publish_meta(get_name(), "eiger-globalmask", reinterpret_cast<const void*>(payload), hdrPtr->data_size, json.str());
     } else if (hdrPtr->messageType == Eiger::GLOBAL_HEADER_COUNTRATE) {
       // Add shape
       std::vector<uint32_t> shape;
@@ -171,9 +190,9 @@ namespace FrameProcessor
       std::string dataTypeString(hdrPtr->dataType);
       json.add("type", dataTypeString);
 
-      publish_meta(get_name(), "eiger-globalcountrate", reinterpret_cast<const void*>(static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size, json.str());
+      publish_meta(get_name(), "eiger-globalcountrate", reinterpret_cast<const void*>(payload), hdrPtr->data_size, json.str());
     } else if (hdrPtr->messageType == Eiger::GLOBAL_HEADER_APPENDIX) {
-      std::string dataString((static_cast<const char*>(frame->get_image_ptr())+sizeof(Eiger::FrameHeader)), hdrPtr->data_size);
+      std::string dataString(payload, hdrPtr->data_size);
 
       publish_meta(get_name(), "eiger-headerappendix", dataString, json.str());
     } else if (hdrPtr->messageType == Eiger::END_OF_STREAM) {
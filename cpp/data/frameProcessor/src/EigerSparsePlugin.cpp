@@ -0,0 +1,262 @@
+/*
+ * EigerSparsePlugin.cpp
+ */
+
+#include <math.h>
+
+#include <EigerSparsePlugin.h>
+#include "DataBlockFrame.h"
+#include "GlobalHeaderStore.h"
+#include "Json.h"
+#include "version.h"
+
+// Worker threads, as well as the processing thread, unless configured
+static const unsigned int DEFAULT_THREADS = 2;
+static const double DEFAULT_OCCUPANCY_THRESHOLD = 0.01;
+
+namespace FrameProcessor
+{
+
+  const std::string EigerSparsePlugin::CONFIG_THREADS = "threads";
+  const std::string EigerSparsePlugin::CONFIG_OCCUPANCY_THRESHOLD = "occupancy_threshold";
+  const std::string EigerSparsePlugin::CONFIG_SPARSE_DATASET = "sparse_dataset";
+
+  /**
+   * Constructor
+   */
+  EigerSparsePlugin::EigerSparsePlugin() :
+    decompressor_(pool_),
+    encoder_(pool_),
+    threads_(DEFAULT_THREADS),
+    occupancy_threshold_(DEFAULT_OCCUPANCY_THRESHOLD),
+    sparse_dataset_("sparse"),
+    mask_generation_(0),
+    capacity_(0),
+    frames_sparse_(0),
+    frames_dense_(0),
+    frames_failed_(0)
+  {
+    // Setup logging for the class
+    logger_ = Logger::getLogger("FP.EigerSparsePlugin");
+    logger_->setLevel(Level::getAll());
+    LOG4CXX_TRACE(logger_, "EigerSparsePlugin constructor.");
+
+    pool_.resize(threads_);
+    compressor_.reset(new FrameCompressor(threads_));
+    if (!FrameDecompressor::supported()) {
+      LOG4CXX_WARN(logger_, "Built without LZ4, only uncompressed images can be encoded and records are not compressed");
+    }
+  }
+
+  /**
+   * Destructor
+   */
+  EigerSparsePlugin::~EigerSparsePlugin()
+  {
+  }
+
+  /**
+   * Set configuration options for the plugin
+   *
+   * \param[in] config IpcMessage containing configuration data
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerSparsePlugin::configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply)
+  {
+    if (config.has_param(CONFIG_THREADS)) {
+      // Applied before the next frame, as a frame may be being processed
+      threads_ = config.get_param<unsigned int>(CONFIG_THREADS);
+      pool_.request_resize(threads_);
+    }
+    if (config.has_param(CONFIG_OCCUPANCY_THRESHOLD)) {
+      double threshold = config.get_param<double>(CONFIG_OCCUPANCY_THRESHOLD);
+      if (threshold >= 0 && threshold <= 0.5) {
+        occupancy_threshold_ = threshold;
+        capacity_ = static_cast<size_t>(floor(occupancy_threshold_ * encoder_.pixels()));
+      } else {
+        // Above half the pixels a record is bigger than the image
+        LOG4CXX_ERROR(logger_, "Occupancy threshold " << threshold << " is outside 0 to 0.5");
+        reply.set_nack("Occupancy threshold outside 0 to 0.5");
+      }
+    }
+    if (config.has_param(CONFIG_SPARSE_DATASET)) {
+      sparse_dataset_ = config.get_param<std::string>(CONFIG_SPARSE_DATASET);
+    }
+  }
+
+  /**
+   * Get the configuration values for this plugin
+   *
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerSparsePlugin::requestConfiguration(OdinData::IpcMessage& reply)
+  {
+    reply.set_param(get_name() + "/" + CONFIG_THREADS, threads_);
+    reply.set_param(get_name() + "/" + CONFIG_OCCUPANCY_THRESHOLD, occupancy_threshold_);
+    reply.set_param(get_name() + "/" + CONFIG_SPARSE_DATASET, sparse_dataset_);
+  }
+
+  /**
+   * Collate status information for the plugin
+   *
+   * \param[out] status Reference to an IpcMessage value to store the status
+   */
+  void EigerSparsePlugin::status(OdinData::IpcMessage& status)
+  {
+    status.set_param(get_name() + "/frames_sparse", frames_sparse_);
+    status.set_param(get_name() + "/frames_dense", frames_dense_);
+    status.set_param(get_name() + "/frames_failed", frames_failed_);
+    status.set_param(get_name() + "/record_length", static_cast<uint64_t>(SparseEncoder::record_length(capacity_)));
+  }
+
+  /**
+   * Reset the frame counts
+   */
+  bool EigerSparsePlugin::reset_statistics()
+  {
+    frames_sparse_ = 0;
+    frames_dense_ = 0;
+    frames_failed_ = 0;
+    return true;
+  }
+
+  /**
+   * Pass an image on as a sparse record if it fits, or unchanged if not
+   *
+   * \param[in] frame The frame to process
+   */
+  void EigerSparsePlugin::process_frame(boost::shared_ptr<Frame> frame)
+  {
+    if (pool_.apply_requested_size()) {
+      compressor_.reset(new FrameCompressor(pool_.num_threads() - 1));
+    }
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    DataType data_type = meta_data.get_data_type();
+    const void* pixels = NULL;
+    if ((data_type == raw_16bit || data_type == raw_32bit) && update_mask(meta_data.get_dimensions())) {
+      pixels = decompressor_.pixels(frame);
+    }
+    if (!pixels) {
+      // Keep images that cannot be encoded as they are
+      LOG4CXX_ERROR(logger_, "Unable to encode frame " << frame->get_frame_number());
+      frames_failed_++;
+      frames_dense_++;
+      this->push(frame);
+      return;
+    }
+
+    size_t length = SparseEncoder::record_length(capacity_);
+    if (raw_record_.size() != length * sizeof(uint32_t)) {
+      raw_record_.rebuild(length * sizeof(uint32_t));
+    }
+    bool sparse = encoder_.encode(pixels, data_type, capacity_, static_cast<uint32_t*>(raw_record_.data()));
+    if (sparse) {
+      frames_sparse_++;
+    } else {
+      frames_dense_++;
+    }
+
+    OdinData::JsonDict json;
+    json.add("acqID", meta_data.get_acquisition_ID());
+    json.add("frame", static_cast<uint64_t>(frame->get_frame_number()));
+    json.add("entries", static_cast<uint64_t>(encoder_.entries()));
+    json.add("sparse", sparse);
+    publish_meta(get_name(), "eiger-sparse", json.str(), json.str());
+
+    if (sparse) {
+      push_record(frame);
+    } else {
+      this->push(frame);
+    }
+  }
+
+  /**
+   * Pass on the record of the image just encoded, in place of the image
+   *
+   * \param[in] frame The frame encoded
+   */
+  void EigerSparsePlugin::push_record(boost::shared_ptr<Frame> frame)
+  {
+    FrameMetaData record_meta_data = frame->get_meta_data_copy();
+    record_meta_data.set_dataset_name(sparse_dataset_);
+    record_meta_data.set_data_type(raw_32bit);
+    dimensions_t dimensions(1, SparseEncoder::record_length(capacity_));
+    record_meta_data.set_dimensions(dimensions);
+
+    const zmq::message_t* record = &raw_record_;
+    if (compressor_->compress(raw_record_, sizeof(uint32_t), compressed_record_)) {
+      record = &compressed_record_;
+      record_meta_data.set_compression_type(bslz4);
+    } else {
+      record_meta_data.set_compression_type(no_compression);
+    }
+    record_meta_data.set_parameter("compressed_size", static_cast<uint32_t>(record->size()));
+
+    boost::shared_ptr<Frame> record_frame(new DataBlockFrame(record_meta_data, record->data(), record->size()));
+    record_frame->set_frame_number(frame->get_frame_number());
+    this->push(record_frame);
+  }
+
+  /**
+   * Take the mask from the global header if it or the image size has changed
+   *
+   * \param[in] dimensions Dimensions of the image
+   * \return false if the image cannot be encoded
+   */
+  bool EigerSparsePlugin::update_mask(const dimensions_t& dimensions)
+  {
+    if (dimensions.size() != 2) {
+      return false;
+    }
+    size_t height = dimensions[0];
+    size_t width = dimensions[1];
+    boost::shared_ptr<const GlobalHeader> header = GlobalHeaderStore::instance().current();
+    uint64_t generation = header ? header->generation : 0;
+    if (generation == mask_generation_ && width * height == encoder_.pixels()) {
+      return true;
+    }
+
+    const uint32_t* mask = NULL;
+    if (header) {
+      if (header->mask_width == width && header->mask_height == height) {
+        mask = header->mask.data();
+      } else if (!header->mask.empty()) {
+        LOG4CXX_WARN(logger_, "Ignoring " << header->mask_width << "x" << header->mask_height
+                     << " pixel mask for " << width << "x" << height << " images");
+      }
+    }
+    encoder_.set_mask(width * height, mask);
+    mask_generation_ = generation;
+    capacity_ = static_cast<size_t>(floor(occupancy_threshold_ * encoder_.pixels()));
+    LOG4CXX_INFO(logger_, "Encoding " << width << "x" << height << " images with up to " << capacity_
+                 << " pixels counting as records of " << SparseEncoder::record_length(capacity_) << " elements"
+                 << (mask ? " with the detector mask" : ""));
+    return true;
+  }
+
+  int EigerSparsePlugin::get_version_major()
+  {
+    return EIGER_DETECTOR_VERSION_MAJOR;
+  }
+
+  int EigerSparsePlugin::get_version_minor()
+  {
+    return EIGER_DETECTOR_VERSION_MINOR;
+  }
+
+  int EigerSparsePlugin::get_version_patch()
+  {
+    return EIGER_DETECTOR_VERSION_PATCH;
+  }
+
+  std::string EigerSparsePlugin::get_version_short()
+  {
+    return EIGER_DETECTOR_VERSION_STR_SHORT;
+  }
+
+  std::string EigerSparsePlugin::get_version_long()
+  {
+    return EIGER_DETECTOR_VERSION_STR;
+  }
+
+} /* namespace FrameProcessor */
@@ -0,0 +1,244 @@
+/*
+ * EigerStatisticsPlugin.cpp
+ */
+
+#include <limits>
+
+#include <boost/bind/bind.hpp>
+
+#include <EigerStatisticsPlugin.h>
+#include "GlobalHeaderStore.h"
+#include "Json.h"
+#include "version.h"
+
+// Worker threads, as well as the processing thread, unless configured
+static const unsigned int DEFAULT_THREADS = 2;
+// Ranges each image is split into per thread, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace FrameProcessor
+{
+
+  const std::string EigerStatisticsPlugin::CONFIG_THREADS = "threads";
+  const std::string EigerStatisticsPlugin::CONFIG_SATURATION = "saturation_value";
+
+  /**
+   * Constructor
+   */
+  EigerStatisticsPlugin::EigerStatisticsPlugin() :
+    decompressor_(pool_),
+    threads_(DEFAULT_THREADS),
+    saturation_(0),
+    pixels_(NULL),
+    data_type_(raw_unknown),
+    pixel_count_(0),
+    threshold_(0),
+    mask_generation_(0),
+    mask_pixels_(0),
+    frames_processed_(0),
+    frames_failed_(0)
+  {
+    // Setup logging for the class
+    logger_ = Logger::getLogger("FP.EigerStatisticsPlugin");
+    logger_->setLevel(Level::getAll());
+    LOG4CXX_TRACE(logger_, "EigerStatisticsPlugin constructor.");
+
+    pool_.resize(threads_);
+    if (!FrameDecompressor::supported()) {
+      LOG4CXX_WARN(logger_, "Built without LZ4, only uncompressed images can be processed");
+    }
+  }
+
+  /**
+   * Destructor
+   */
+  EigerStatisticsPlugin::~EigerStatisticsPlugin()
+  {
+  }
+
+  /**
+   * Set configuration options for the plugin
+   *
+   * \param[in] config IpcMessage containing configuration data
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerStatisticsPlugin::configure(OdinData::IpcMessage& config, OdinData::IpcMessage& reply)
+  {
+    if (config.has_param(CONFIG_THREADS)) {
+      // Applied before the next frame, as a frame may be being processed
+      threads_ = config.get_param<unsigned int>(CONFIG_THREADS);
+      pool_.request_resize(threads_);
+      LOG4CXX_INFO(logger_, "Computing statistics on " << threads_ << " worker threads");
+    }
+    if (config.has_param(CONFIG_SATURATION)) {
+      saturation_ = config.get_param<unsigned int>(CONFIG_SATURATION);
+    }
+  }
+
+  /**
+   * Get the configuration values for this plugin
+   *
+   * \param[out] reply Response IpcMessage
+   */
+  void EigerStatisticsPlugin::requestConfiguration(OdinData::IpcMessage& reply)
+  {
+    reply.set_param(get_name() + "/" + CONFIG_THREADS, threads_);
+    reply.set_param(get_name() + "/" + CONFIG_SATURATION, saturation_);
+  }
+
+  /**
+   * Collate status information for the plugin
+   *
+   * \param[out] status Reference to an IpcMessage value to store the status
+   */
+  void EigerStatisticsPlugin::status(OdinData::IpcMessage& status)
+  {
+    status.set_param(get_name() + "/frames_processed", frames_processed_);
+    status.set_param(get_name() + "/frames_failed", frames_failed_);
+    status.set_param(get_name() + "/kernel", std::string(pixel_kernel_name()));
+  }
+
+  /**
+   * Reset the frame counts
+   */
+  bool EigerStatisticsPlugin::reset_statistics()
+  {
+    frames_processed_ = 0;
+    frames_failed_ = 0;
+    return true;
+  }
+
+  /**
+   * Publish the statistics of an image and pass the frame on
+   *
+   * \param[in] frame The frame to process
+   */
+  void EigerStatisticsPlugin::process_frame(boost::shared_ptr<Frame> frame)
+  {
+    pool_.apply_requested_size();
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    data_type_ = meta_data.get_data_type();
+    if (data_type_ != raw_16bit && data_type_ != raw_32bit) {
+      LOG4CXX_ERROR(logger_, "No statistics for frame " << frame->get_frame_number() << " of data type " << data_type_);
+      frames_failed_++;
+      this->push(frame);
+      return;
+    }
+
+    pixels_ = decompressor_.pixels(frame);
+    if (!pixels_) {
+      frames_failed_++;
+      this->push(frame);
+      return;
+    }
+    pixel_count_ = FrameDecompressor::pixel_count(meta_data.get_dimensions());
+    update_mask(meta_data.get_dimensions());
+    if (saturation_ > 0) {
+      threshold_ = saturation_;
+    } else if (data_type_ == raw_16bit) {
+      threshold_ = std::numeric_limits<uint16_t>::max() - 1;
+    } else {
+      threshold_ = std::numeric_limits<uint32_t>::max() - 1;
+    }
+
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    partial_.assign(num_tasks, EMPTY_PIXEL_STATISTICS);
+    pool_.run(num_tasks, boost::bind(&EigerStatisticsPlugin::compute_range, this, boost::placeholders::_1));
+    PixelStatistics stats = EMPTY_PIXEL_STATISTICS;
+    for (size_t i = 0; i < num_tasks; i++) {
+      merge_pixel_statistics(stats, partial_[i]);
+    }
+    pixels_ = NULL;
+
+    uint64_t valid = pixel_count_ - stats.excluded;
+    OdinData::JsonDict json;
+    json.add("acqID", meta_data.get_acquisition_ID());
+    json.add("frame", static_cast<uint64_t>(frame->get_frame_number()));
+    json.add("sum", stats.sum);
+    json.add("max", stats.max);
+    json.add("saturated", stats.over_threshold);
+    json.add("masked", stats.excluded);
+    json.add("mean", valid > 0 ? static_cast<double>(stats.sum) / valid : 0.0);
+    publish_meta(get_name(), "eiger-framestatistics", json.str(), json.str());
+    frames_processed_++;
+
+    this->push(frame);
+  }
+
+  /**
+   * Reduce one range of the pixels of the current image
+   *
+   * \param[in] task The range
+   */
+  void EigerStatisticsPlugin::compute_range(size_t task)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(pixel_count_, partial_.size(), task, first, end);
+    const uint8_t* exclude = masked_.empty() ? NULL : masked_.data() + first;
+    if (data_type_ == raw_16bit) {
+      pixel_statistics(static_cast<const uint16_t*>(pixels_) + first, exclude, end - first,
+                       static_cast<uint16_t>(threshold_), partial_[task]);
+    } else {
+      pixel_statistics(static_cast<const uint32_t*>(pixels_) + first, exclude, end - first, threshold_, partial_[task]);
+    }
+  }
+
+  /**
+   * Take the mask from the global header if it or the image size has changed
+   *
+   * \param[in] dimensions Dimensions of the image
+   */
+  void EigerStatisticsPlugin::update_mask(const dimensions_t& dimensions)
+  {
+    boost::shared_ptr<const GlobalHeader> header = GlobalHeaderStore::instance().current();
+    uint64_t generation = header ? header->generation : 0;
+    if (generation == mask_generation_ && pixel_count_ == mask_pixels_) {
+      return;
+    }
+    mask_generation_ = generation;
+    mask_pixels_ = pixel_count_;
+    masked_.clear();
+    if (!header || header->mask.empty() || dimensions.size() != 2) {
+      return;
+    }
+    size_t height = dimensions[0];
+    size_t width = dimensions[1];
+    if (header->mask_width != width || header->mask_height != height) {
+      LOG4CXX_WARN(logger_, "Ignoring " << header->mask_width << "x" << header->mask_height
+                   << " pixel mask for " << width << "x" << height << " images");
+      return;
+    }
+    masked_.resize(pixel_count_);
+    for (size_t i = 0; i < pixel_count_; i++) {
+      masked_[i] = header->mask[i] ? 1 : 0;
+    }
+    LOG4CXX_INFO(logger_, "Computing statistics of " << width << "x" << height << " images with the detector mask");
+  }
+
+  int EigerStatisticsPlugin::get_version_major()
+  {
+    return EIGER_DETECTOR_VERSION_MAJOR;
+  }
+
+  int EigerStatisticsPlugin::get_version_minor()
+  {
+    return EIGER_DETECTOR_VERSION_MINOR;
+  }
+
+  int EigerStatisticsPlugin::get_version_patch()
+  {
+    return EIGER_DETECTOR_VERSION_PATCH;
+  }
+
+  std::string EigerStatisticsPlugin::get_version_short()
+  {
+    return EIGER_DETECTOR_VERSION_STR_SHORT;
+  }
+
+  std::string EigerStatisticsPlugin::get_version_long()
+  {
+    return EIGER_DETECTOR_VERSION_STR;
+  }
+
+} /* namespace FrameProcessor */
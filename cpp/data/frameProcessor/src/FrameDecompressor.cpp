@@ -0,0 +1,379 @@
+/*
+ * FrameDecompressor.cpp
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef FRAMEPROCESSOR_HAS_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <boost/bind/bind.hpp>
+
+#include "FrameDecompressor.h"
+
+// Size of the header giving the uncompressed size and block size
+static const size_t HEADER_BYTES = 12;
+static const size_t BLOCK_MULTIPLE = 8;
+// Ranges each image is split into per thread decompressing it, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace {
+  uint64_t read_uint64_be(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+      value = (value << 8) | in[i];
+    }
+    return value;
+  }
+
+  uint32_t read_uint32_be(const uint8_t* in) {
+    return (static_cast<uint32_t>(in[0]) << 24) | (static_cast<uint32_t>(in[1]) << 16) |
+        (static_cast<uint32_t>(in[2]) << 8) | in[3];
+  }
+
+  /**
+   * Transpose an 8x8 bit matrix held one row per byte
+   */
+  uint64_t transpose_bits(uint64_t x) {
+    uint64_t t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+  }
+
+#ifdef __SSE2__
+  /**
+   * Transpose the 8x8 bit matrix in each 64 bit lane
+   */
+  inline __m128i transpose_bits(__m128i x) {
+    __m128i t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 7)), _mm_set1_epi64x(0x00AA00AA00AA00AALL));
+    x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 7));
+    t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 14)), _mm_set1_epi64x(0x0000CCCC0000CCCCLL));
+    x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 14));
+    t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 28)), _mm_set1_epi64x(0x00000000F0F0F0F0LL));
+    x = _mm_xor_si128(_mm_xor_si128(x, t), _mm_slli_epi64(t, 28));
+    return x;
+  }
+
+  /**
+   * Recover one byte of 128 elements from the 8 bit rows of a byte of the
+   * elements, 16 bytes of each row
+   *
+   * \param[in] rows First byte of the first row
+   * \param[in] row_bytes Bytes in each row
+   * \param[out] bytes The byte of each element, 16 elements in each vector
+   */
+  inline void unshuffle_plane(const uint8_t* rows, size_t row_bytes, __m128i bytes[8]) {
+    __m128i r[8];
+    for (int j = 0; j < 8; j++) {
+      r[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + j * row_bytes));
+    }
+    // Interleave the rows so each 64 bit lane holds the 8 row bytes of one group of 8 elements
+    __m128i t0 = _mm_unpacklo_epi8(r[0], r[1]);
+    __m128i t1 = _mm_unpackhi_epi8(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi8(r[2], r[3]);
+    __m128i t3 = _mm_unpackhi_epi8(r[2], r[3]);
+    __m128i t4 = _mm_unpacklo_epi8(r[4], r[5]);
+    __m128i t5 = _mm_unpackhi_epi8(r[4], r[5]);
+    __m128i t6 = _mm_unpacklo_epi8(r[6], r[7]);
+    __m128i t7 = _mm_unpackhi_epi8(r[6], r[7]);
+    __m128i u0 = _mm_unpacklo_epi16(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi16(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi16(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi16(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi16(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi16(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi16(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi16(t5, t7);
+    bytes[0] = transpose_bits(_mm_unpacklo_epi32(u0, u4));
+    bytes[1] = transpose_bits(_mm_unpackhi_epi32(u0, u4));
+    bytes[2] = transpose_bits(_mm_unpacklo_epi32(u1, u5));
+    bytes[3] = transpose_bits(_mm_unpackhi_epi32(u1, u5));
+    bytes[4] = transpose_bits(_mm_unpacklo_epi32(u2, u6));
+    bytes[5] = transpose_bits(_mm_unpackhi_epi32(u2, u6));
+    bytes[6] = transpose_bits(_mm_unpacklo_epi32(u3, u7));
+    bytes[7] = transpose_bits(_mm_unpackhi_epi32(u3, u7));
+  }
+
+  /**
+   * Reverse the bitshuffle of 128 elements at a time, for 1, 2 and 4 byte elements
+   *
+   * \return Number of groups of 8 elements unshuffled
+   */
+  size_t bitunshuffle_sse2(const uint8_t* in, uint8_t* out, size_t row_bytes, size_t elem_size) {
+    if (elem_size != 1 && elem_size != 2 && elem_size != 4) {
+      return 0;
+    }
+    size_t groups = row_bytes - row_bytes % 16;
+    __m128i planes[4][8];
+    for (size_t group = 0; group < groups; group += 16) {
+      for (size_t byte = 0; byte < elem_size; byte++) {
+        unshuffle_plane(in + byte * 8 * row_bytes + group, row_bytes, planes[byte]);
+      }
+      __m128i* element = reinterpret_cast<__m128i*>(out + group * 8 * elem_size);
+      for (int m = 0; m < 8; m++) {
+        if (elem_size == 1) {
+          _mm_storeu_si128(element + m, planes[0][m]);
+        } else if (elem_size == 2) {
+          _mm_storeu_si128(element + 2 * m, _mm_unpacklo_epi8(planes[0][m], planes[1][m]));
+          _mm_storeu_si128(element + 2 * m + 1, _mm_unpackhi_epi8(planes[0][m], planes[1][m]));
+        } else {
+          __m128i low_lo = _mm_unpacklo_epi8(planes[0][m], planes[1][m]);
+          __m128i low_hi = _mm_unpackhi_epi8(planes[0][m], planes[1][m]);
+          __m128i high_lo = _mm_unpacklo_epi8(planes[2][m], planes[3][m]);
+          __m128i high_hi = _mm_unpackhi_epi8(planes[2][m], planes[3][m]);
+          _mm_storeu_si128(element + 4 * m, _mm_unpacklo_epi16(low_lo, high_lo));
+          _mm_storeu_si128(element + 4 * m + 1, _mm_unpackhi_epi16(low_lo, high_lo));
+          _mm_storeu_si128(element + 4 * m + 2, _mm_unpacklo_epi16(low_hi, high_hi));
+          _mm_storeu_si128(element + 4 * m + 3, _mm_unpackhi_epi16(low_hi, high_hi));
+        }
+      }
+    }
+    return groups;
+  }
+#endif
+}
+
+namespace FrameProcessor
+{
+
+  /**
+   * Construct a decompressor
+   *
+   * \param[in] pool Threads to decompress bitshuffle blocks on
+   */
+  FrameDecompressor::FrameDecompressor(WorkerPool& pool) :
+    pool_(pool),
+    input_(NULL),
+    input_size_(0),
+    output_(NULL),
+    elem_size_(1),
+    block_elements_(0),
+    num_tasks_(0)
+  {
+    logger_ = log4cxx::Logger::getLogger("FP.FrameDecompressor");
+  }
+
+  /**
+   * Check whether the plugins were built with LZ4
+   */
+  bool FrameDecompressor::supported()
+  {
+#ifdef FRAMEPROCESSOR_HAS_LZ4
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /**
+   * Number of pixels in an image
+   *
+   * \param[in] dimensions Dimensions of the image
+   */
+  size_t FrameDecompressor::pixel_count(const dimensions_t& dimensions)
+  {
+    size_t count = dimensions.empty() ? 0 : 1;
+    for (size_t i = 0; i < dimensions.size(); i++) {
+      count *= dimensions[i];
+    }
+    return count;
+  }
+
+  /**
+   * Reverse the bitshuffle of a block of elements
+   *
+   * The input holds one row of bits for each bit of an element, least
+   * significant first, and each row holds that bit of every element in turn.
+   *
+   * \param[in] in The shuffled block
+   * \param[out] out The elements, the same size as the input
+   * \param[in] elements Number of elements, a multiple of 8
+   * \param[in] elem_size Bytes per element
+   */
+  void FrameDecompressor::bitunshuffle(const uint8_t* in, uint8_t* out, size_t elements, size_t elem_size)
+  {
+    size_t row_bytes = elements / BLOCK_MULTIPLE;
+    size_t done = 0;
+#ifdef __SSE2__
+    done = bitunshuffle_sse2(in, out, row_bytes, elem_size);
+#endif
+    for (size_t byte = 0; byte < elem_size; byte++) {
+      const uint8_t* rows = in + byte * BLOCK_MULTIPLE * row_bytes;
+      for (size_t group = done; group < row_bytes; group++) {
+        // Take one bit of 8 elements from each row, then transpose so each byte holds one element's byte
+        uint64_t x = 0;
+        for (size_t bit = 0; bit < BLOCK_MULTIPLE; bit++) {
+          x |= static_cast<uint64_t>(rows[bit * row_bytes + group]) << (8 * bit);
+        }
+        x = transpose_bits(x);
+        uint8_t* element = out + group * BLOCK_MULTIPLE * elem_size + byte;
+        for (size_t k = 0; k < BLOCK_MULTIPLE; k++) {
+          element[k * elem_size] = x & 0xff;
+          x >>= 8;
+        }
+      }
+    }
+  }
+
+  /**
+   * Get the pixels of an image frame, decompressing them if need be
+   *
+   * \param[in] frame The frame, with its meta data set by EigerProcessPlugin
+   * \return The pixels, valid until the next call, or NULL if they could not be decompressed
+   */
+  const void* FrameDecompressor::pixels(const boost::shared_ptr<Frame>& frame)
+  {
+    const FrameMetaData& meta_data = frame->get_meta_data();
+    size_t elem_size = get_size_from_enum(meta_data.get_data_type());
+    size_t elements = pixel_count(meta_data.get_dimensions());
+    if (meta_data.get_compression_type() == no_compression) {
+      if (frame->get_image_size() < elements * elem_size) {
+        LOG4CXX_ERROR(logger_, "Frame " << frame->get_frame_number() << " has " << frame->get_image_size()
+                      << " bytes, expected " << elements * elem_size);
+        return NULL;
+      }
+      return frame->get_image_ptr();
+    }
+
+    if (buffer_.size() < elements * elem_size) {
+      buffer_.resize(elements * elem_size);
+    }
+    if (!decompress(frame->get_image_ptr(), frame->get_image_size(), meta_data.get_compression_type(),
+                    elem_size, elements, buffer_.data())) {
+      LOG4CXX_ERROR(logger_, "Unable to decompress frame " << frame->get_frame_number());
+      return NULL;
+    }
+    return buffer_.data();
+  }
+
+  /**
+   * Decompress an image
+   *
+   * \param[in] data The compressed image
+   * \param[in] size Size of the compressed image
+   * \param[in] compression How the image is compressed
+   * \param[in] elem_size Bytes per pixel
+   * \param[in] elements Number of pixels
+   * \param[out] out The pixels
+   * \return false if the image could not be decompressed
+   */
+  bool FrameDecompressor::decompress(const void* data, size_t size, CompressionType compression, size_t elem_size,
+                                     size_t elements, uint8_t* out)
+  {
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    if (compression == no_compression) {
+      if (size < elements * elem_size) {
+        return false;
+      }
+      memcpy(out, in, elements * elem_size);
+      return true;
+    }
+#ifdef FRAMEPROCESSOR_HAS_LZ4
+    if (compression == lz4) {
+      int bytes = LZ4_decompress_safe(reinterpret_cast<const char*>(in), reinterpret_cast<char*>(out),
+                                      size, elements * elem_size);
+      return bytes == static_cast<int>(elements * elem_size);
+    } else if (compression == bslz4) {
+      return decompress_bslz4(in, size, elem_size, elements, out);
+    }
+#endif
+    return false;
+  }
+
+  /**
+   * Decompress a bitshuffle/LZ4 image
+   *
+   * The offset of each block is found first, since each starts after the one
+   * before, then the blocks are decompressed in parallel. Elements left over
+   * after the last multiple of 8 are stored uncompressed at the end.
+   */
+  bool FrameDecompressor::decompress_bslz4(const uint8_t* in, size_t size, size_t elem_size, size_t elements,
+                                           uint8_t* out)
+  {
+    size_t bytes = elements * elem_size;
+    if (size < HEADER_BYTES || elem_size == 0 || read_uint64_be(in) != bytes) {
+      return false;
+    }
+    size_t block_bytes = read_uint32_be(in + 8);
+    size_t block_elements = block_bytes / elem_size;
+    if (block_elements == 0 || block_elements % BLOCK_MULTIPLE != 0 || block_elements * elem_size != block_bytes) {
+      return false;
+    }
+
+    size_t full_blocks = elements / block_elements;
+    size_t last_block_elements = elements % block_elements;
+    last_block_elements -= last_block_elements % BLOCK_MULTIPLE;
+    size_t leftover_bytes = (elements % BLOCK_MULTIPLE) * elem_size;
+
+    blocks_.clear();
+    size_t offset = HEADER_BYTES;
+    for (size_t i = 0; i < full_blocks + (last_block_elements > 0 ? 1 : 0); i++) {
+      if (offset + sizeof(uint32_t) > size) {
+        return false;
+      }
+      Block block = {offset, i < full_blocks ? block_elements : last_block_elements};
+      blocks_.push_back(block);
+      offset += sizeof(uint32_t) + read_uint32_be(in + offset);
+    }
+    if (offset + leftover_bytes > size) {
+      return false;
+    }
+    memcpy(out + bytes - leftover_bytes, in + offset, leftover_bytes);
+
+    input_ = in;
+    input_size_ = offset;
+    output_ = out;
+    elem_size_ = elem_size;
+    block_elements_ = block_elements;
+    num_tasks_ = std::min(blocks_.size(), pool_.num_threads() * RANGES_PER_THREAD);
+    if (scratch_.size() < num_tasks_) {
+      scratch_.resize(num_tasks_);
+    }
+    task_ok_.assign(num_tasks_, 0);
+    pool_.run(num_tasks_, boost::bind(&FrameDecompressor::decompress_range, this, boost::placeholders::_1));
+
+    return std::find(task_ok_.begin(), task_ok_.end(), 0) == task_ok_.end();
+  }
+
+  /**
+   * Decompress and unshuffle one range of the blocks of the current image
+   *
+   * \param[in] task The range, which has its own scratch buffer
+   */
+  void FrameDecompressor::decompress_range(size_t task)
+  {
+#ifdef FRAMEPROCESSOR_HAS_LZ4
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(blocks_.size(), num_tasks_, task, first, end);
+    std::vector<uint8_t>& scratch = scratch_[task];
+    scratch.resize(block_elements_ * elem_size_);
+    for (size_t i = first; i < end; i++) {
+      const Block& block = blocks_[i];
+      size_t compressed = read_uint32_be(input_ + block.offset);
+      size_t block_bytes = block.elements * elem_size_;
+      if (block.offset + sizeof(uint32_t) + compressed > input_size_) {
+        return;
+      }
+      int bytes = LZ4_decompress_safe(reinterpret_cast<const char*>(input_ + block.offset + sizeof(uint32_t)),
+                                      reinterpret_cast<char*>(scratch.data()), compressed, block_bytes);
+      if (bytes != static_cast<int>(block_bytes)) {
+        return;
+      }
+      bitunshuffle(scratch.data(), output_ + i * block_elements_ * elem_size_, block.elements, elem_size_);
+    }
+    task_ok_[task] = 1;
+#endif
+  }
+
+} /* namespace FrameProcessor */
@@ -0,0 +1,133 @@
+/*
+ * GlobalHeaderStore.cpp
+ */
+
+#include "rapidjson/document.h"
+
+#include "GlobalHeaderStore.h"
+
+namespace {
+  /**
+   * Read a number from the config, leaving the value unchanged if it is not there
+   */
+  void read_number(const rapidjson::Document& doc, const char* name, double& value) {
+    rapidjson::Value::ConstMemberIterator member = doc.FindMember(name);
+    if (member != doc.MemberEnd() && member->value.IsNumber()) {
+      value = member->value.GetDouble();
+    }
+  }
+}
+
+namespace FrameProcessor
+{
+
+  /**
+   * The store shared by every plugin loaded in this process
+   */
+  GlobalHeaderStore& GlobalHeaderStore::instance()
+  {
+    static GlobalHeaderStore store;
+    return store;
+  }
+
+  GlobalHeaderStore::GlobalHeaderStore() :
+    generation_(0)
+  {
+    logger_ = log4cxx::Logger::getLogger("FP.GlobalHeaderStore");
+  }
+
+  /**
+   * Start the header of a new series, with header_detail none
+   *
+   * \param[in] series The series number
+   */
+  void GlobalHeaderStore::start_series(uint64_t series)
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    boost::shared_ptr<GlobalHeader> header = next(series);
+    header->config.clear();
+    header->geometry = DetectorGeometry();
+    header->count_cutoff = 0;
+    header->mask.clear();
+    header->mask_width = 0;
+    header->mask_height = 0;
+    current_ = header;
+  }
+
+  /**
+   * Record the detector config of a series
+   *
+   * \param[in] series The series number
+   * \param[in] config The config JSON
+   */
+  void GlobalHeaderStore::set_config(uint64_t series, const std::string& config)
+  {
+    DetectorGeometry geometry = DetectorGeometry();
+    double count_cutoff = 0;
+    rapidjson::Document doc;
+    doc.Parse(config.c_str());
+    if (doc.HasParseError() || !doc.IsObject()) {
+      LOG4CXX_ERROR(logger_, "Unable to parse global header config for series " << series);
+    } else {
+      read_number(doc, "beam_center_x", geometry.beam_center_x);
+      read_number(doc, "beam_center_y", geometry.beam_center_y);
+      read_number(doc, "detector_distance", geometry.distance);
+      read_number(doc, "x_pixel_size", geometry.pixel_size_x);
+      read_number(doc, "y_pixel_size", geometry.pixel_size_y);
+      read_number(doc, "wavelength", geometry.wavelength);
+      read_number(doc, "countrate_correction_count_cutoff", count_cutoff);
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    boost::shared_ptr<GlobalHeader> header = next(series);
+    header->config = config;
+    header->geometry = geometry;
+    header->count_cutoff = count_cutoff > 0 && count_cutoff < UINT32_MAX ? static_cast<uint32_t>(count_cutoff) : 0;
+    current_ = header;
+  }
+
+  /**
+   * Record the pixel mask of a series
+   *
+   * \param[in] series The series number
+   * \param[in] mask The mask, one value per pixel
+   * \param[in] width Pixels in each row
+   * \param[in] height Number of rows
+   */
+  void GlobalHeaderStore::set_mask(uint64_t series, const uint32_t* mask, size_t width, size_t height)
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    boost::shared_ptr<GlobalHeader> header = next(series);
+    header->mask.assign(mask, mask + width * height);
+    header->mask_width = width;
+    header->mask_height = height;
+    current_ = header;
+  }
+
+  /**
+   * Get the current header
+   *
+   * \return The header, or NULL if none has been received
+   */
+  boost::shared_ptr<const GlobalHeader> GlobalHeaderStore::current()
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return current_;
+  }
+
+  /**
+   * Copy the current header to change, starting afresh for a new series
+   */
+  boost::shared_ptr<GlobalHeader> GlobalHeaderStore::next(uint64_t series)
+  {
+    boost::shared_ptr<GlobalHeader> header(new GlobalHeader());
+    if (current_ && current_->series == series) {
+      *header = *current_;
+    } else {
+      header->series = series;
+    }
+    header->generation = ++generation_;
+    return header;
+  }
+
+} /* namespace FrameProcessor */
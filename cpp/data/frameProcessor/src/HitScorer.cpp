@@ -0,0 +1,129 @@
+/*
+ * HitScorer.cpp
+ */
+
+#include <algorithm>
+
+#include <boost/bind/bind.hpp>
+
+#include "HitScorer.h"
+
+// Ranges each image is split into per thread, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+
+namespace FrameProcessor
+{
+
+  /**
+   * Construct a scorer with an empty region
+   *
+   * \param[in] pool Threads to score images on
+   */
+  HitScorer::HitScorer(WorkerPool& pool) :
+    pool_(pool),
+    width_(0),
+    height_(0),
+    region_pixels_(0),
+    geometry_(NULL),
+    mask_(NULL),
+    low_resolution_(0),
+    high_resolution_(0),
+    pixels_(NULL),
+    data_type_(raw_unknown),
+    threshold_(0)
+  {
+  }
+
+  /**
+   * Build the scoring region
+   *
+   * \param[in] width Pixels in each row of the images
+   * \param[in] height Number of rows of the images
+   * \param[in] geometry The detector geometry, or NULL to score the whole image
+   * \param[in] mask Non-zero for pixels to leave out, width by height, or NULL for none
+   * \param[in] low_resolution Largest d-spacing in the ring in Angstroms, 0 for no limit
+   * \param[in] high_resolution Smallest d-spacing in the ring in Angstroms, 0 for no limit
+   */
+  void HitScorer::set_region(size_t width, size_t height, const DetectorGeometry* geometry, const uint32_t* mask,
+                             double low_resolution, double high_resolution)
+  {
+    width_ = width;
+    height_ = height;
+    exclude_.assign(width * height, 0);
+    geometry_ = geometry && geometry->valid() ? geometry : NULL;
+    mask_ = mask;
+    low_resolution_ = low_resolution;
+    high_resolution_ = high_resolution;
+
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    pool_.run(num_tasks, boost::bind(&HitScorer::build_rows, this, boost::placeholders::_1, num_tasks));
+    region_pixels_ = std::count(exclude_.begin(), exclude_.end(), 0);
+    geometry_ = NULL;
+    mask_ = NULL;
+  }
+
+  /**
+   * Score an image
+   *
+   * \param[in] pixels The image, the size of the region
+   * \param[in] data_type Type of the pixels, raw_16bit or raw_32bit
+   * \param[in] threshold Pixels in the region at or above this count towards the score
+   * \return Number of pixels in the region at or above the threshold
+   */
+  uint64_t HitScorer::score(const void* pixels, DataType data_type, uint32_t threshold)
+  {
+    pixels_ = pixels;
+    data_type_ = data_type;
+    threshold_ = data_type == raw_16bit ? std::min<uint32_t>(threshold, UINT16_MAX) : threshold;
+
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    partial_.assign(num_tasks, EMPTY_PIXEL_STATISTICS);
+    pool_.run(num_tasks, boost::bind(&HitScorer::score_range, this, boost::placeholders::_1));
+    pixels_ = NULL;
+
+    uint64_t score = 0;
+    for (size_t i = 0; i < num_tasks; i++) {
+      score += partial_[i].over_threshold;
+    }
+    return score;
+  }
+
+  /**
+   * Mark the pixels outside the region in one range of rows
+   */
+  void HitScorer::build_rows(size_t task, size_t num_tasks)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(height_, num_tasks, task, first, end);
+    for (size_t y = first; y < end; y++) {
+      uint8_t* row = exclude_.data() + y * width_;
+      for (size_t x = 0; x < width_; x++) {
+        bool outside = mask_ && mask_[y * width_ + x] != 0;
+        if (!outside && geometry_) {
+          double d = geometry_->resolution(x, y);
+          outside = (low_resolution_ > 0 && d > low_resolution_) || (high_resolution_ > 0 && d < high_resolution_);
+        }
+        row[x] = outside ? 1 : 0;
+      }
+    }
+  }
+
+  /**
+   * Score one range of the pixels of the current image
+   */
+  void HitScorer::score_range(size_t task)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(exclude_.size(), partial_.size(), task, first, end);
+    if (data_type_ == raw_16bit) {
+      pixel_statistics(static_cast<const uint16_t*>(pixels_) + first, exclude_.data() + first, end - first,
+                       static_cast<uint16_t>(threshold_), partial_[task]);
+    } else {
+      pixel_statistics(static_cast<const uint32_t*>(pixels_) + first, exclude_.data() + first, end - first,
+                       threshold_, partial_[task]);
+    }
+  }
+
+} /* namespace FrameProcessor */
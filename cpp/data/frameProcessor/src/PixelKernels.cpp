@@ -0,0 +1,538 @@
+/*
+ * PixelKernels.cpp
+ *
+ * Each kernel has a portable version and an AVX2 version chosen at run time,
+ * so the plugins need no special compiler flags and still run on any x86-64.
+ */
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_KERNELS_HAVE_AVX2
+#endif
+
+#include "PixelKernels.h"
+
+namespace {
+
+  using FrameProcessor::PixelStatistics;
+
+  bool scalar_only = false;  // Use the portable kernels even where the CPU has AVX2
+
+  /**
+   * Reduce pixels one at a time, for CPUs without AVX2 and for the pixels
+   * left over after the last full vector
+   */
+  template <typename T>
+  void statistics_scalar(const T* pixels, const uint8_t* exclude, size_t count, T threshold,
+                         PixelStatistics& stats)
+  {
+    const T invalid = std::numeric_limits<T>::max();
+    for (size_t i = 0; i < count; i++) {
+      T pixel = pixels[i];
+      if (pixel == invalid || (exclude && exclude[i])) {
+        stats.excluded++;
+        continue;
+      }
+      stats.sum += pixel;
+      stats.max = pixel > stats.max ? pixel : stats.max;
+      stats.over_threshold += pixel >= threshold ? 1 : 0;
+    }
+  }
+
+  /**
+   * Find pixels that differ from the masked pixel pattern one at a time
+   */
+  template <typename T>
+  size_t changed_scalar(const T* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                        uint32_t* indices)
+  {
+    const T invalid = std::numeric_limits<T>::max();
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+      T expected = masked && masked[i] ? invalid : 0;
+      if (pixels[i] != expected) {
+        if (indices) {
+          indices[found] = first_index + i;
+        }
+        found++;
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Copy 32 bit pixels to 16 bits one at a time
+   */
+  size_t narrow_scalar(const uint32_t* pixels, uint16_t* narrowed, size_t count)
+  {
+    const uint32_t invalid = std::numeric_limits<uint32_t>::max();
+    const uint32_t limit = std::numeric_limits<uint16_t>::max();
+    size_t too_large = 0;
+    for (size_t i = 0; i < count; i++) {
+      uint32_t pixel = pixels[i];
+      too_large += pixel >= limit && pixel != invalid ? 1 : 0;
+      narrowed[i] = static_cast<uint16_t>(pixel < limit ? pixel : limit);
+    }
+    return too_large;
+  }
+
+  /**
+   * Sum pixels picked out by index one at a time
+   */
+  template <typename T>
+  void indexed_sum_scalar(const T* pixels, const uint32_t* indices, size_t count, uint64_t& sum, uint64_t& counted)
+  {
+    const T invalid = std::numeric_limits<T>::max();
+    for (size_t i = 0; i < count; i++) {
+      T pixel = pixels[indices[i]];
+      if (pixel != invalid) {
+        sum += pixel;
+        counted++;
+      }
+    }
+  }
+
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+  __attribute__((target("avx2,popcnt")))
+  void statistics_avx2(const uint16_t* pixels, const uint8_t* exclude, size_t count, uint16_t threshold,
+                       PixelStatistics& stats)
+  {
+    const size_t lanes = 16;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i invalid = _mm256_set1_epi16(-1);
+    const __m256i limit = _mm256_set1_epi16(static_cast<int16_t>(threshold));
+    __m256i max = zero;
+    __m256i sum = zero;  // Four 64 bit sums
+    uint64_t over_bits = 0;  // Two mask bits per pixel
+    uint64_t excluded_bits = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes));
+      __m256i bad = _mm256_cmpeq_epi16(pixel, invalid);
+      if (exclude) {
+        __m256i mask = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(exclude + v * lanes)));
+        bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_cmpeq_epi16(mask, zero), invalid));
+      }
+      __m256i good = _mm256_andnot_si256(bad, pixel);
+      max = _mm256_max_epu16(max, good);
+      // Widen to 32 bits to add pairs of pixels, then to 64 bits to accumulate
+      __m256i pairs = _mm256_add_epi32(_mm256_unpacklo_epi16(good, zero), _mm256_unpackhi_epi16(good, zero));
+      sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(pairs, zero));
+      sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(pairs, zero));
+      __m256i over = _mm256_andnot_si256(bad, _mm256_cmpeq_epi16(_mm256_max_epu16(good, limit), good));
+      over_bits += _mm_popcnt_u32(_mm256_movemask_epi8(over));
+      excluded_bits += _mm_popcnt_u32(_mm256_movemask_epi8(bad));
+    }
+
+    uint16_t max_lanes[lanes];
+    uint64_t sum_lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(max_lanes), max);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(sum_lanes), sum);
+    for (size_t i = 0; i < lanes; i++) {
+      stats.max = max_lanes[i] > stats.max ? max_lanes[i] : stats.max;
+    }
+    stats.sum += sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+    stats.over_threshold += over_bits / 2;
+    stats.excluded += excluded_bits / 2;
+
+    size_t done = vectors * lanes;
+    statistics_scalar(pixels + done, exclude ? exclude + done : NULL, count - done, threshold, stats);
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  void statistics_avx2(const uint32_t* pixels, const uint8_t* exclude, size_t count, uint32_t threshold,
+                       PixelStatistics& stats)
+  {
+    const size_t lanes = 8;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i invalid = _mm256_set1_epi32(-1);
+    const __m256i limit = _mm256_set1_epi32(static_cast<int32_t>(threshold));
+    __m256i max = zero;
+    __m256i sum = zero;  // Four 64 bit sums
+    uint64_t over = 0;
+    uint64_t excluded = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes));
+      __m256i bad = _mm256_cmpeq_epi32(pixel, invalid);
+      if (exclude) {
+        __m256i mask = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(exclude + v * lanes)));
+        bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_cmpeq_epi32(mask, zero), invalid));
+      }
+      __m256i good = _mm256_andnot_si256(bad, pixel);
+      max = _mm256_max_epu32(max, good);
+      sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(good)));
+      sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(good, 1)));
+      __m256i at_limit = _mm256_andnot_si256(bad, _mm256_cmpeq_epi32(_mm256_max_epu32(good, limit), good));
+      over += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(at_limit)));
+      excluded += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(bad)));
+    }
+
+    uint32_t max_lanes[lanes];
+    uint64_t sum_lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(max_lanes), max);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(sum_lanes), sum);
+    for (size_t i = 0; i < lanes; i++) {
+      stats.max = max_lanes[i] > stats.max ? max_lanes[i] : stats.max;
+    }
+    stats.sum += sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+    stats.over_threshold += over;
+    stats.excluded += excluded;
+
+    size_t done = vectors * lanes;
+    statistics_scalar(pixels + done, exclude ? exclude + done : NULL, count - done, threshold, stats);
+  }
+
+  __attribute__((target("avx2,popcnt,bmi")))
+  size_t changed_avx2(const uint16_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                      uint32_t* indices)
+  {
+    const size_t lanes = 16;
+    const __m256i zero = _mm256_setzero_si256();
+    size_t found = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes));
+      __m256i expected = zero;
+      if (masked) {
+        // Masked pixels hold 1, which negates to the invalid value
+        __m256i mask = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(masked + v * lanes)));
+        expected = _mm256_sub_epi16(zero, mask);
+      }
+      // One bit for each pixel, from the low byte of each lane
+      uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi16(pixel, expected));
+      uint32_t changed = ~same & 0x55555555u;
+      if (changed) {
+        if (indices) {
+          uint32_t base = first_index + v * lanes;
+          for (uint32_t bits = changed; bits; bits = _blsr_u32(bits)) {
+            indices[found++] = base + __builtin_ctz(bits) / 2;
+          }
+        } else {
+          found += _mm_popcnt_u32(changed);
+        }
+      }
+    }
+    size_t done = vectors * lanes;
+    return found + changed_scalar(pixels + done, masked ? masked + done : NULL, count - done, first_index + done,
+                                  indices ? indices + found : NULL);
+  }
+
+  __attribute__((target("avx2,popcnt,bmi")))
+  size_t changed_avx2(const uint32_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                      uint32_t* indices)
+  {
+    const size_t lanes = 8;
+    const __m256i zero = _mm256_setzero_si256();
+    size_t found = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i pixel = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes));
+      __m256i expected = zero;
+      if (masked) {
+        // Masked pixels hold 1, which negates to the invalid value
+        __m256i mask = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(masked + v * lanes)));
+        expected = _mm256_sub_epi32(zero, mask);
+      }
+      uint32_t same = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(pixel, expected)));
+      uint32_t changed = ~same & 0xffu;
+      if (changed) {
+        if (indices) {
+          uint32_t base = first_index + v * lanes;
+          for (uint32_t bits = changed; bits; bits = _blsr_u32(bits)) {
+            indices[found++] = base + __builtin_ctz(bits);
+          }
+        } else {
+          found += _mm_popcnt_u32(changed);
+        }
+      }
+    }
+    size_t done = vectors * lanes;
+    return found + changed_scalar(pixels + done, masked ? masked + done : NULL, count - done, first_index + done,
+                                  indices ? indices + found : NULL);
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  size_t narrow_avx2(const uint32_t* pixels, uint16_t* narrowed, size_t count)
+  {
+    const size_t lanes = 16;
+    const __m256i invalid = _mm256_set1_epi32(-1);
+    const __m256i limit = _mm256_set1_epi32(UINT16_MAX);
+    size_t too_large = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes));
+      __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + v * lanes + 8));
+      __m256i low_large = _mm256_andnot_si256(_mm256_cmpeq_epi32(low, invalid),
+                                              _mm256_cmpeq_epi32(_mm256_max_epu32(low, limit), low));
+      __m256i high_large = _mm256_andnot_si256(_mm256_cmpeq_epi32(high, invalid),
+                                               _mm256_cmpeq_epi32(_mm256_max_epu32(high, limit), high));
+      too_large += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(low_large)));
+      too_large += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(high_large)));
+      // Clamp first, as the pack saturates signed values, then put the 64 bit quarters back in order
+      __m256i packed = _mm256_packus_epi32(_mm256_min_epu32(low, limit), _mm256_min_epu32(high, limit));
+      packed = _mm256_permute4x64_epi64(packed, 0xd8);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(narrowed + v * lanes), packed);
+    }
+    size_t done = vectors * lanes;
+    return too_large + narrow_scalar(pixels + done, narrowed + done, count - done);
+  }
+
+  /**
+   * Add the pixels picked out by a vector of indices to four 64 bit sums,
+   * returning the mask bits of the invalid pixels
+   */
+  __attribute__((target("avx2,popcnt")))
+  inline uint32_t add_gathered(__m256i pixel, __m256i invalid, __m256i& sum)
+  {
+    __m256i bad = _mm256_cmpeq_epi32(pixel, invalid);
+    __m256i good = _mm256_andnot_si256(bad, pixel);
+    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(good)));
+    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(good, 1)));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  void indexed_sum_avx2(const uint16_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                        uint64_t& counted)
+  {
+    const size_t lanes = 8;
+    const __m256i low_half = _mm256_set1_epi32(UINT16_MAX);
+    __m256i sums = _mm256_setzero_si256();
+    uint64_t bad = 0;
+    // Each gather reads the pixel after the one it picks out, so the last
+    // index, which may be the last pixel of the image, is left to the scalar loop
+    size_t vectors = count > 0 ? (count - 1) / lanes : 0;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + v * lanes));
+      __m256i pixel = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(pixels), index, 2),
+                                       low_half);
+      bad += _mm_popcnt_u32(add_gathered(pixel, low_half, sums));
+    }
+
+    uint64_t sum_lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(sum_lanes), sums);
+    sum += sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+    counted += vectors * lanes - bad;
+
+    size_t done = vectors * lanes;
+    indexed_sum_scalar(pixels, indices + done, count - done, sum, counted);
+  }
+
+  __attribute__((target("avx2,popcnt")))
+  void indexed_sum_avx2(const uint32_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                        uint64_t& counted)
+  {
+    const size_t lanes = 8;
+    const __m256i invalid = _mm256_set1_epi32(-1);
+    __m256i sums = _mm256_setzero_si256();
+    uint64_t bad = 0;
+    size_t vectors = count / lanes;
+    for (size_t v = 0; v < vectors; v++) {
+      __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + v * lanes));
+      __m256i pixel = _mm256_i32gather_epi32(reinterpret_cast<const int*>(pixels), index, 4);
+      bad += _mm_popcnt_u32(add_gathered(pixel, invalid, sums));
+    }
+
+    uint64_t sum_lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(sum_lanes), sums);
+    sum += sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+    counted += vectors * lanes - bad;
+
+    size_t done = vectors * lanes;
+    indexed_sum_scalar(pixels, indices + done, count - done, sum, counted);
+  }
+
+  bool use_avx2()
+  {
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") &&
+        __builtin_cpu_supports("bmi");
+    return avx2 && !scalar_only;
+  }
+#endif
+
+  template <typename T>
+  void statistics(const T* pixels, const uint8_t* exclude, size_t count, T threshold, PixelStatistics& stats)
+  {
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+    if (use_avx2()) {
+      statistics_avx2(pixels, exclude, count, threshold, stats);
+      return;
+    }
+#endif
+    statistics_scalar(pixels, exclude, count, threshold, stats);
+  }
+
+  template <typename T>
+  size_t changed(const T* pixels, const uint8_t* masked, size_t count, uint32_t first_index, uint32_t* indices)
+  {
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+    if (use_avx2()) {
+      return changed_avx2(pixels, masked, count, first_index, indices);
+    }
+#endif
+    return changed_scalar(pixels, masked, count, first_index, indices);
+  }
+
+  template <typename T>
+  void indexed_sum(const T* pixels, const uint32_t* indices, size_t count, uint64_t& sum, uint64_t& counted)
+  {
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+    if (use_avx2()) {
+      indexed_sum_avx2(pixels, indices, count, sum, counted);
+      return;
+    }
+#endif
+    indexed_sum_scalar(pixels, indices, count, sum, counted);
+  }
+
+  size_t narrow(const uint32_t* pixels, uint16_t* narrowed, size_t count)
+  {
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+    if (use_avx2()) {
+      return narrow_avx2(pixels, narrowed, count);
+    }
+#endif
+    return narrow_scalar(pixels, narrowed, count);
+  }
+}
+
+namespace FrameProcessor
+{
+
+  /**
+   * Add the statistics of a set of 16 bit pixels
+   *
+   * \param[in] pixels The pixels
+   * \param[in] exclude Non-zero for each pixel to leave out, or NULL to count all valid pixels
+   * \param[in] count Number of pixels
+   * \param[in] threshold Pixels at or above this are counted in over_threshold
+   * \param[in,out] stats Statistics to add to
+   */
+  void pixel_statistics(const uint16_t* pixels, const uint8_t* exclude, size_t count, uint16_t threshold,
+                        PixelStatistics& stats)
+  {
+    statistics(pixels, exclude, count, threshold, stats);
+  }
+
+  /**
+   * Add the statistics of a set of 32 bit pixels
+   *
+   * \param[in] pixels The pixels
+   * \param[in] exclude Non-zero for each pixel to leave out, or NULL to count all valid pixels
+   * \param[in] count Number of pixels
+   * \param[in] threshold Pixels at or above this are counted in over_threshold
+   * \param[in,out] stats Statistics to add to
+   */
+  void pixel_statistics(const uint32_t* pixels, const uint8_t* exclude, size_t count, uint32_t threshold,
+                        PixelStatistics& stats)
+  {
+    statistics(pixels, exclude, count, threshold, stats);
+  }
+
+  /**
+   * Find the 16 bit pixels that are not zero, or the invalid value where masked
+   *
+   * \param[in] pixels The pixels
+   * \param[in] masked 1 for each pixel the detector masks, or NULL if there is no mask
+   * \param[in] count Number of pixels
+   * \param[in] first_index Index of the first pixel in the image
+   * \param[out] indices Index in the image of each pixel found, or NULL to count them only
+   * \return Number of pixels found
+   */
+  size_t changed_pixels(const uint16_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                        uint32_t* indices)
+  {
+    return changed(pixels, masked, count, first_index, indices);
+  }
+
+  /**
+   * Find the 32 bit pixels that are not zero, or the invalid value where masked
+   *
+   * \param[in] pixels The pixels
+   * \param[in] masked 1 for each pixel the detector masks, or NULL if there is no mask
+   * \param[in] count Number of pixels
+   * \param[in] first_index Index of the first pixel in the image
+   * \param[out] indices Index in the image of each pixel found, or NULL to count them only
+   * \return Number of pixels found
+   */
+  size_t changed_pixels(const uint32_t* pixels, const uint8_t* masked, size_t count, uint32_t first_index,
+                        uint32_t* indices)
+  {
+    return changed(pixels, masked, count, first_index, indices);
+  }
+
+  /**
+   * Copy 32 bit pixels to 16 bits, keeping the invalid value as the 16 bit
+   * invalid value
+   *
+   * Pixels too large for 16 bits are clamped, so the copy is exact only if
+   * none are found.
+   *
+   * \param[in] pixels The pixels
+   * \param[out] narrowed The pixels as 16 bits
+   * \param[in] count Number of pixels
+   * \return Number of valid pixels too large for 16 bits, which includes the 16 bit invalid value
+   */
+  size_t narrow_pixels(const uint32_t* pixels, uint16_t* narrowed, size_t count)
+  {
+    return narrow(pixels, narrowed, count);
+  }
+
+  /**
+   * Add up the valid 16 bit pixels at a list of indices
+   *
+   * \param[in] pixels The image
+   * \param[in] indices Indices of the pixels to add up, in ascending order
+   * \param[in] count Number of indices
+   * \param[in,out] sum Sum to add the valid pixels to
+   * \param[in,out] counted Count to add the number of valid pixels to
+   */
+  void indexed_pixel_sum(const uint16_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                         uint64_t& counted)
+  {
+    indexed_sum(pixels, indices, count, sum, counted);
+  }
+
+  /**
+   * Add up the valid 32 bit pixels at a list of indices
+   *
+   * \param[in] pixels The image
+   * \param[in] indices Indices of the pixels to add up
+   * \param[in] count Number of indices
+   * \param[in,out] sum Sum to add the valid pixels to
+   * \param[in,out] counted Count to add the number of valid pixels to
+   */
+  void indexed_pixel_sum(const uint32_t* pixels, const uint32_t* indices, size_t count, uint64_t& sum,
+                         uint64_t& counted)
+  {
+    indexed_sum(pixels, indices, count, sum, counted);
+  }
+
+  /**
+   * Use the portable kernels even where the CPU has AVX2, so the two can be
+   * compared. Not to be called while a kernel is running.
+   *
+   * \param[in] scalar true to use the portable kernels, false to choose at run time
+   */
+  void set_scalar_pixel_kernels(bool scalar)
+  {
+    scalar_only = scalar;
+  }
+
+  /**
+   * Name of the kernels in use, for status
+   */
+  const char* pixel_kernel_name()
+  {
+#ifdef PIXEL_KERNELS_HAVE_AVX2
+    if (use_avx2()) {
+      return "avx2";
+    }
+#endif
+    return "scalar";
+  }
+
+} /* namespace FrameProcessor */
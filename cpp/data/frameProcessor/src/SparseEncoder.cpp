@@ -0,0 +1,148 @@
+/*
+ * SparseEncoder.cpp
+ */
+
+#include <algorithm>
+
+#include <boost/bind/bind.hpp>
+
+#include "PixelKernels.h"
+#include "SparseEncoder.h"
+
+// Ranges each image is split into per thread, to balance the load
+static const size_t RANGES_PER_THREAD = 4;
+// Pixels searched at a time, small enough to still be in cache when collected
+static const size_t BLOCK_PIXELS = 16384;
+
+namespace FrameProcessor
+{
+
+  /**
+   * Construct an encoder for images of no pixels
+   *
+   * \param[in] pool Threads to encode images on
+   */
+  SparseEncoder::SparseEncoder(WorkerPool& pool) :
+    pool_(pool),
+    pixels_(0),
+    entries_(0),
+    image_(NULL),
+    data_type_(raw_unknown),
+    capacity_(0),
+    found_(0)
+  {
+  }
+
+  /**
+   * Length of the records with room for a number of pixels
+   *
+   * \param[in] capacity Most pixels a record can hold
+   * \return Number of uint32 elements in each record
+   */
+  size_t SparseEncoder::record_length(size_t capacity)
+  {
+    return SPARSE_RECORD_HEADER + 2 * capacity;
+  }
+
+  /**
+   * Set the size of the images and the pixels the detector masks
+   *
+   * \param[in] pixels Number of pixels in each image
+   * \param[in] mask Non-zero for pixels the detector masks, or NULL for none
+   */
+  void SparseEncoder::set_mask(size_t pixels, const uint32_t* mask)
+  {
+    pixels_ = pixels;
+    masked_.clear();
+    if (mask) {
+      masked_.resize(pixels);
+      for (size_t i = 0; i < pixels; i++) {
+        masked_[i] = mask[i] ? 1 : 0;
+      }
+    }
+  }
+
+  /**
+   * Encode an image if few enough of its pixels are not empty
+   *
+   * \param[in] pixels The image, the size given to set_mask
+   * \param[in] data_type Type of the pixels, raw_16bit or raw_32bit
+   * \param[in] capacity Most pixels to encode
+   * \param[out] record The record of record_length(capacity) elements, written if the image fits
+   * \return false if more than capacity pixels are not empty
+   */
+  bool SparseEncoder::encode(const void* pixels, DataType data_type, size_t capacity, uint32_t* record)
+  {
+    image_ = pixels;
+    data_type_ = data_type;
+    capacity_ = capacity;
+    found_ = 0;
+
+    size_t num_tasks = pool_.num_threads() * RANGES_PER_THREAD;
+    indices_.resize(num_tasks);
+    counts_.resize(num_tasks);
+    pool_.run(num_tasks, boost::bind(&SparseEncoder::encode_range, this, boost::placeholders::_1));
+    image_ = NULL;
+    entries_ = found_;
+    if (entries_ > capacity) {
+      return false;
+    }
+
+    record[0] = SPARSE_RECORD_PRESENT;
+    record[1] = static_cast<uint32_t>(entries_);
+    uint32_t* indices = record + SPARSE_RECORD_HEADER;
+    uint32_t* counts = indices + entries_;
+    for (size_t i = 0; i < num_tasks; i++) {
+      indices = std::copy(indices_[i].begin(), indices_[i].end(), indices);
+      counts = std::copy(counts_[i].begin(), counts_[i].end(), counts);
+    }
+    std::fill(counts, record + record_length(capacity), 0);
+    return true;
+  }
+
+  /**
+   * Collect the pixels that are not empty in one range of the current image
+   */
+  void SparseEncoder::encode_range(size_t task)
+  {
+    size_t first = 0;
+    size_t end = 0;
+    WorkerPool::task_range(pixels_, indices_.size(), task, first, end);
+    indices_[task].clear();
+    counts_[task].clear();
+    if (data_type_ == raw_16bit) {
+      collect(static_cast<const uint16_t*>(image_), first, end, indices_[task], counts_[task]);
+    } else {
+      collect(static_cast<const uint32_t*>(image_), first, end, indices_[task], counts_[task]);
+    }
+  }
+
+  /**
+   * Collect the pixels that are not empty a block at a time, stopping once
+   * there are more in the image than fit in the record
+   */
+  template <typename T>
+  void SparseEncoder::collect(const T* image, size_t first, size_t end, std::vector<uint32_t>& indices,
+                              std::vector<uint32_t>& counts)
+  {
+    for (size_t block = first; block < end && found_ <= capacity_; block += BLOCK_PIXELS) {
+      size_t block_pixels = std::min(BLOCK_PIXELS, end - block);
+      const uint8_t* masked = masked_.empty() ? NULL : masked_.data() + block;
+      size_t found = changed_pixels(image + block, masked, block_pixels, block, NULL);
+      if (found == 0) {
+        continue;
+      }
+      if (found_.fetch_add(found) + found > capacity_) {
+        return;
+      }
+      size_t done = indices.size();
+      indices.resize(done + found);
+      counts.resize(done + found);
+      changed_pixels(image + block, masked, block_pixels, block, indices.data() + done);
+      for (size_t i = done; i < done + found; i++) {
+        counts[i] = image[indices[i]];
+      }
+    }
+  }
+
+} /* namespace FrameProcessor */
@@ -0,0 +1,170 @@
+/*
+ * WorkerPool.cpp
+ */
+
+#include "WorkerPool.h"
+
+namespace FrameProcessor
+{
+
+  // No resize has been requested since the last one was applied
+  static const size_t NO_REQUEST = static_cast<size_t>(-1);
+
+  /**
+   * Construct a pool with no workers, so tasks run on the calling thread
+   */
+  WorkerPool::WorkerPool() :
+    stop_(false),
+    num_workers_(0),
+    requested_workers_(NO_REQUEST),
+    task_(NULL),
+    num_tasks_(0),
+    next_task_(0),
+    tasks_done_(0)
+  {
+  }
+
+  WorkerPool::~WorkerPool()
+  {
+    stop();
+  }
+
+  /**
+   * Change the number of worker threads
+   *
+   * Must not be called while tasks are running.
+   *
+   * \param[in] num_workers Number of worker threads (0 to run tasks on the calling thread only)
+   */
+  void WorkerPool::resize(size_t num_workers)
+  {
+    if (num_workers != num_workers_) {
+      stop();
+      start(num_workers);
+    }
+  }
+
+  /**
+   * Ask for the number of worker threads to change before the next set of tasks
+   *
+   * Unlike resize, this may be called while tasks are running, such as from a
+   * plugin's configure while it processes a frame.
+   *
+   * \param[in] num_workers Number of worker threads
+   */
+  void WorkerPool::request_resize(size_t num_workers)
+  {
+    requested_workers_ = num_workers;
+  }
+
+  /**
+   * Apply any size asked for by request_resize
+   *
+   * Called from the thread that runs tasks, before it runs them.
+   *
+   * \return true if a size had been asked for
+   */
+  bool WorkerPool::apply_requested_size()
+  {
+    size_t num_workers = requested_workers_.exchange(NO_REQUEST);
+    if (num_workers == NO_REQUEST) {
+      return false;
+    }
+    resize(num_workers);
+    return true;
+  }
+
+  /**
+   * Run tasks, returning when they have all finished
+   *
+   * \param[in] num_tasks Number of tasks
+   * \param[in] task Called with the index of each task, from any thread of the pool
+   */
+  void WorkerPool::run(size_t num_tasks, const boost::function<void(size_t)>& task)
+  {
+    if (num_workers_ == 0 || num_tasks < 2) {
+      for (size_t i = 0; i < num_tasks; i++) {
+        task(i);
+      }
+      return;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    task_ = &task;
+    num_tasks_ = num_tasks;
+    next_task_ = 0;
+    tasks_done_ = 0;
+    work_ready_.notify_all();
+
+    // Run tasks here too until they have all been taken
+    while (next_task_ < num_tasks_) {
+      size_t index = next_task_++;
+      lock.unlock();
+      task(index);
+      lock.lock();
+      tasks_done_++;
+    }
+    while (tasks_done_ < num_tasks_) {
+      work_done_.wait(lock);
+    }
+    task_ = NULL;
+    num_tasks_ = 0;
+  }
+
+  /**
+   * Number of threads running tasks, including the calling thread
+   */
+  size_t WorkerPool::num_threads() const
+  {
+    return num_workers_ + 1;
+  }
+
+  void WorkerPool::start(size_t num_workers)
+  {
+    stop_ = false;
+    num_workers_ = num_workers;
+    for (size_t i = 0; i < num_workers_; i++) {
+      workers_.push_back(boost::shared_ptr<boost::thread>(
+          new boost::thread(boost::bind(&WorkerPool::worker_loop, this))));
+    }
+  }
+
+  void WorkerPool::stop()
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_ready_.notify_all();
+    for (size_t i = 0; i < workers_.size(); i++) {
+      workers_[i]->join();
+    }
+    workers_.clear();
+    num_workers_ = 0;
+  }
+
+  /**
+   * Take tasks of the current set until told to stop
+   */
+  void WorkerPool::worker_loop()
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (true) {
+      while (!stop_ && next_task_ >= num_tasks_) {
+        work_ready_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      size_t index = next_task_++;
+      const boost::function<void(size_t)>& task = *task_;
+      lock.unlock();
+      task(index);
+      lock.lock();
+      if (++tasks_done_ == num_tasks_) {
+        work_done_.notify_all();
+      }
+    }
+  }
+
+} /* namespace FrameProcessor */
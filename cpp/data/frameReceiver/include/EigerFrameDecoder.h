@@ -10,16 +10,27 @@
 
 #include "FrameDecoderZMQ.h"
 #include "EigerDefinitions.h"
+#include "Stream2Cbor.h"
+#include "SharedFrameTransport.h"
+#include "ControlLane.h"
+#include "HugePageBuffer.h"
+#include "OverflowPool.h"
+#include "TimeHistogram.h"
 #include "gettime.h"
 #include <stdint.h>
 #include <time.h>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <set>
 #include <sstream>
 #include <time.h>
+#include <deque>
+#include <vector>
 #include <arpa/inet.h>
 #include <boost/format.hpp>
 #include "rapidjson/document.h"
+#include "zmq/zmq.hpp"
 
 namespace FrameReceiver
 {
@@ -40,6 +51,7 @@ namespace FrameReceiver
 
     void monitor_buffers(void);
     void get_status(const std::string param_prefix, OdinData::IpcMessage& status_msg);
+    void reset_statistics(void);
     void request_configuration(const std::string param_prefix, OdinData::IpcMessage& config_reply);
 
     void* get_packet_header_buffer(void);
@@ -53,17 +65,44 @@ namespace FrameReceiver
   private:
 
     unsigned int elapsed_ms(struct timespec& start, struct timespec& end);
+    FrameDecoder::FrameReceiveState decode_message(size_t bytes_received);
+    void count_message_part(size_t bytes_received);
+    void start_acquisition_statistics(void);
+    void update_free_buffer_low_water(void);
     void allocate_next_frame_buffer(void);
+    void allocate_overflow_pool(void);
+    void release_overflow_frames(void);
     void send_buffer(void);
 
     FrameDecoder::FrameReceiveState process_global_header_message(size_t bytes_received);
+    void process_data_header(size_t bytes_received);
 
     FrameDecoder::FrameReceiveState process_image_message(size_t bytes_received);
 
     FrameDecoder::FrameReceiveState process_end_message(size_t bytes_received);
 
-    boost::shared_ptr<void> current_raw_buffer_;
-    boost::shared_ptr<void> dropped_frame_buffer_;
+    FrameDecoder::FrameReceiveState process_stream2_message(size_t bytes_received);
+    void announce_stream2_message(size_t size);
+    void process_stream2_start(const uint8_t* message, size_t size);
+    void send_stream2_array(Eiger::EigerMessageType message_type, const Eiger::Stream2Message& array);
+
+    void open_shared_transport(void);
+    void close_shared_transport(void);
+    bool locate_shared_pool(void);
+    void lend_shared_buffers(void);
+    void receive_shared_payload(size_t& bytes_received);
+
+    void open_control_lane(void);
+    void close_control_lane(void);
+    void receive_control_lane(long timeout_ms);
+    FrameDecoder::FrameReceiveState apply_fence(uint64_t sequence);
+    size_t message_buffer_capacity(const void* buffer) const;
+
+    void allocate_scratch_buffers(void);
+    size_t payload_offset(const void* buffer) const;
+
+    HugePageBuffer current_raw_buffer_;
+    HugePageBuffer dropped_frame_buffer_;
 
     void *current_frame_buffer_;
 
@@ -73,10 +112,19 @@ namespace FrameReceiver
     bool dropping_frame_data_;
 
     std::string detector_model_;
+    std::string stream_protocol_;
     size_t buffer_size;
+    size_t payload_alignment_;  // Alignment of the message part in each frame buffer, 0 to follow the header directly
+    size_t announced_size_;  // Size of the next stream2 message announced by the EigerFan, 0 if none
+    std::vector<uint8_t> stream2_buffer_;  // Announced stream2 messages, which may not fit in a frame buffer
 
     unsigned int frames_allocated_;
 
+    // Frames held in the overflow pool while no frame buffer is free
+    size_t overflow_frames_;  // Slots in the overflow pool, 0 to drop frames straight away
+    OverflowPool overflow_pool_;
+    int current_overflow_slot_;  // Slot the current frame is received into, -1 if none
+
     Eiger::EigerMessageType currentMessageType;
     Eiger::EigerMessageParentType currentParentMessageType;
     int currentMessagePart;
@@ -85,7 +133,46 @@ namespace FrameReceiver
 
     Eiger::FrameHeader currentHeader;
 
+    std::string shared_transport_name_;
+    std::string shared_buffer_name_;
+    Eiger::SharedTransportControl* shared_transport_;
+    void* shared_pool_;
+    size_t shared_pool_size_;
+    int64_t shared_pool_offset_;  // Offset of buffer 0 in the frame pool segment, -1 until located
+    std::set<int> lent_buffers_;
+    uint64_t shared_frames_received_;
+
+    std::string control_lane_endpoint_;
+    boost::shared_ptr<zmq::context_t> control_lane_context_;
+    boost::shared_ptr<zmq::socket_t> control_lane_socket_;
+    Eiger::ControlLaneInbox control_lane_inbox_;  // Received through the control lane, until their fence is reached
+    uint64_t fences_failed_;  // Fences whose message did not fit in the receive buffers
+
+    // Statistics for the current acquisition
+    static const size_t NUM_PARENT_MESSAGE_TYPES = Eiger::PARENT_MESSAGE_TYPE_END + 1;
+    uint64_t message_parts_[NUM_PARENT_MESSAGE_TYPES];  // Parts received by type of the message they belong to
+    uint64_t fence_parts_;
+    uint64_t bytes_received_;
+    unsigned int acquisition_start_frames_dropped_;  // frames_dropped_ at the start of the acquisition
+    size_t free_buffer_low_water_;
+    TimeHistogram<12> process_time_;  // Time in process_message
+
+    // Rates measured over the last rate interval
+    uint64_t total_frames_received_;
+    uint64_t total_bytes_received_;
+    uint64_t rate_frames_received_;  // Totals at the start of the rate interval
+    uint64_t rate_bytes_received_;
+    struct timespec rate_start_;
+    double frame_rate_;
+    double data_rate_mb_;
+
     static const std::string CONFIG_DETECTOR_MODEL;
+    static const std::string CONFIG_STREAM_PROTOCOL;
+    static const std::string CONFIG_SHARED_TRANSPORT;
+    static const std::string CONFIG_SHARED_BUFFER_NAME;
+    static const std::string CONFIG_CONTROL_LANE;
+    static const std::string CONFIG_OVERFLOW_FRAMES;
+    static const std::string CONFIG_PAYLOAD_ALIGNMENT;
     static const std::string DETECTOR_MODEL_500K;
     static const std::string DETECTOR_MODEL_1M;
     static const std::string DETECTOR_MODEL_4M;
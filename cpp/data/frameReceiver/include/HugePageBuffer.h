@@ -0,0 +1,112 @@
+/*
+ * HugePageBuffer.h
+ *
+ * Anonymous memory for the decoder's own buffers, backed by huge pages where
+ * the system allows so large buffers cost few TLB entries and page faults.
+ */
+
+#ifndef SRC_HUGEPAGEBUFFER_H_
+#define SRC_HUGEPAGEBUFFER_H_
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace FrameReceiver
+{
+
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  /**
+   * An anonymous mapping, rounded up to a whole number of huge pages
+   *
+   * Explicit huge pages are used if any are reserved, otherwise the mapping is
+   * advised to use transparent huge pages.
+   */
+  class HugePageBuffer
+  {
+  public:
+    HugePageBuffer() : data_(NULL), size_(0), mapped_size_(0), huge_pages_(false) {}
+    ~HugePageBuffer() { release(); }
+
+    /**
+     * Map the buffer, releasing any previous mapping
+     *
+     * \param[in] size Bytes required
+     * \return false if the memory could not be mapped
+     */
+    bool allocate(size_t size)
+    {
+      release();
+      if (size == 0) {
+        return true;
+      }
+      size_t mapped_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      void* data = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      huge_pages_ = data != MAP_FAILED;
+      if (!huge_pages_) {
+        data = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+          return false;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(data, mapped_size, MADV_HUGEPAGE);
+#endif
+      }
+      data_ = data;
+      size_ = size;
+      mapped_size_ = mapped_size;
+      return true;
+    }
+
+    /**
+     * Fault in every page of the buffer now rather than on first use
+     */
+    void prefault()
+    {
+      if (!data_) {
+        return;
+      }
+#ifdef MADV_POPULATE_WRITE
+      if (madvise(data_, mapped_size_, MADV_POPULATE_WRITE) == 0) {
+        return;
+      }
+#endif
+      size_t page_size = huge_pages_ ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+      volatile char* data = static_cast<volatile char*>(data_);
+      for (size_t offset = 0; offset < mapped_size_; offset += page_size) {
+        data[offset] = 0;
+      }
+    }
+
+    /**
+     * Unmap the buffer
+     */
+    void release()
+    {
+      if (data_) {
+        munmap(data_, mapped_size_);
+      }
+      data_ = NULL;
+      size_ = 0;
+      mapped_size_ = 0;
+      huge_pages_ = false;
+    }
+
+    void* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool huge_pages() const { return huge_pages_; }  // True if explicit huge pages back the buffer
+
+  private:
+    void* data_;
+    size_t size_;
+    size_t mapped_size_;
+    bool huge_pages_;
+
+    HugePageBuffer(const HugePageBuffer&);
+    HugePageBuffer& operator=(const HugePageBuffer&);
+  };
+
+} /* namespace FrameReceiver */
+
+#endif /* SRC_HUGEPAGEBUFFER_H_ */
@@ -0,0 +1,153 @@
+/*
+ * OverflowPool.h
+ *
+ * Frames the decoder holds while no frame buffer is free, so a short stall
+ * downstream does not drop frames. Held frames are passed on oldest first,
+ * ahead of any frame received after them.
+ */
+
+#ifndef SRC_OVERFLOWPOOL_H_
+#define SRC_OVERFLOWPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "EigerDefinitions.h"
+#include "HugePageBuffer.h"
+
+namespace FrameReceiver
+{
+
+  /**
+   * A pool of frame sized slots and the frames held in them, oldest first
+   */
+  class OverflowPool
+  {
+  public:
+    typedef struct
+    {
+      int slot;
+      int frame_number;
+      size_t size;  // Bytes of the message part to copy into a frame buffer
+    } Frame;
+
+    OverflowPool() : slots_(0), frame_size_(0), high_water_(0), frames_held_(0) {}
+
+    /**
+     * Map the pool, unless it already has the same number and size of slots
+     *
+     * \param[in] slots Number of frames the pool can hold
+     * \param[in] frame_size Size of each slot, the size of a frame buffer
+     * \return false if the pool could not be mapped, leaving it empty
+     */
+    bool allocate(size_t slots, size_t frame_size)
+    {
+      if (slots_ == slots && frame_size_ == frame_size) {
+        return true;
+      }
+      free_slots_.clear();
+      pending_.clear();
+      high_water_ = 0;
+      slots_ = 0;
+      frame_size_ = frame_size;
+      if (!pool_.allocate(slots * frame_size)) {
+        return false;
+      }
+      slots_ = slots;
+      pool_.prefault();
+      // Slots are taken from the back, so the first slot is used first
+      for (int slot = static_cast<int>(slots) - 1; slot >= 0; slot--) {
+        free_slots_.push_back(slot);
+      }
+      return true;
+    }
+
+    /**
+     * Take a free slot to receive a frame into
+     *
+     * \param[out] slot The slot taken
+     * \return The start of the slot, or NULL if every slot is in use
+     */
+    char* take_slot(int& slot)
+    {
+      if (free_slots_.empty()) {
+        return NULL;
+      }
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+      return slot_data(slot);
+    }
+
+    /**
+     * Hold a frame received into a slot until a frame buffer is free
+     *
+     * \param[in] frame The frame
+     */
+    void hold(const Frame& frame)
+    {
+      pending_.push_back(frame);
+      high_water_ = std::max(high_water_, pending_.size());
+      frames_held_++;
+    }
+
+    /**
+     * Copy the oldest held frame into a frame buffer and free its slot, if a frame is held
+     *
+     * The FrameHeader is copied as it is, and the message part is moved to
+     * the payload offset of the frame buffer, as it may differ from the
+     * offset in the slot when payloads are aligned.
+     *
+     * \param[in] buffer The frame buffer
+     * \param[in] payload_offset Offset of the message part in the frame buffer
+     * \return The frame number of the frame copied
+     */
+    int release_oldest(char* buffer, size_t payload_offset)
+    {
+      const Frame frame = pending_.front();
+      const char* slot = slot_data(frame.slot);
+      Eiger::FrameHeader* header = reinterpret_cast<Eiger::FrameHeader*>(buffer);
+      memcpy(header, slot, sizeof(Eiger::FrameHeader));
+      memcpy(buffer + payload_offset, slot + header->payload_offset, frame.size);
+      header->payload_offset = payload_offset;
+      free_slots_.push_back(frame.slot);
+      pending_.pop_front();
+      return frame.frame_number;
+    }
+
+    /** Start the high water mark again from the frames held now */
+    void reset_high_water() { high_water_ = pending_.size(); }
+
+    /** Return the start of a slot */
+    char* slot_data(int slot) const { return static_cast<char*>(pool_.data()) + slot * frame_size_; }
+    /** Return the number of frames the pool can hold */
+    size_t capacity() const { return slots_; }
+    /** Return the size of each slot */
+    size_t frame_size() const { return frame_size_; }
+    /** Return whether a slot is free to receive a frame into */
+    bool has_free_slot() const { return !free_slots_.empty(); }
+    /** Return the number of frames held */
+    size_t occupancy() const { return pending_.size(); }
+    /** Return the largest number of frames held since the high water mark was reset */
+    size_t high_water() const { return high_water_; }
+    /** Return the number of frames held since the pool was created */
+    uint64_t frames_held() const { return frames_held_; }
+    /** Return true if explicit huge pages back the pool */
+    bool huge_pages() const { return pool_.huge_pages(); }
+
+  private:
+    HugePageBuffer pool_;
+    size_t slots_;
+    size_t frame_size_;
+    std::vector<int> free_slots_;
+    std::deque<Frame> pending_;  // Held frames, oldest first
+    size_t high_water_;
+    uint64_t frames_held_;
+  };
+
+} /* namespace FrameReceiver */
+
+#endif /* SRC_OVERFLOWPOOL_H_ */
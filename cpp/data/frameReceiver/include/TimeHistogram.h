@@ -0,0 +1,88 @@
+/*
+ * TimeHistogram.h
+ *
+ * Histogram of times in microseconds, in bins doubling in width, used for the
+ * time the decoder spends processing each message part.
+ */
+
+#ifndef SRC_TIMEHISTOGRAM_H_
+#define SRC_TIMEHISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+namespace FrameReceiver
+{
+
+  /**
+   * Counts of times in NUM_BINS bins
+   *
+   * Bin 0 holds times under 1us and bin b times from 2^(b-1)us up to 2^b us,
+   * except the last bin, which holds everything from 2^(NUM_BINS-2)us up.
+   */
+  template <size_t NUM_BINS>
+  class TimeHistogram
+  {
+  public:
+    static const size_t num_bins = NUM_BINS;
+
+    TimeHistogram() { reset(); }
+
+    /**
+     * Return the bin a time falls in
+     *
+     * \param[in] time_us The time in microseconds
+     */
+    static size_t bin(uint64_t time_us)
+    {
+      size_t bin = 0;
+      while (bin < NUM_BINS - 1 && time_us >= (static_cast<uint64_t>(1) << bin)) {
+        bin++;
+      }
+      return bin;
+    }
+
+    /**
+     * Return the label of a bin, by the lower bound of the times it holds
+     *
+     * \param[in] bin The bin
+     */
+    static std::string label(size_t bin)
+    {
+      return bin == 0 ? "lt_1" : "ge_" + std::to_string(static_cast<uint64_t>(1) << (bin - 1));
+    }
+
+    /**
+     * Count a time
+     *
+     * \param[in] time_us The time in microseconds
+     */
+    void add(uint64_t time_us)
+    {
+      counts_[bin(time_us)]++;
+      max_us_ = std::max(max_us_, time_us);
+    }
+
+    /** Clear the counts */
+    void reset()
+    {
+      memset(counts_, 0, sizeof(counts_));
+      max_us_ = 0;
+    }
+
+    /** Return the number of times counted in a bin */
+    uint64_t count(size_t bin) const { return counts_[bin]; }
+    /** Return the longest time counted */
+    uint64_t max_us() const { return max_us_; }
+
+  private:
+    uint64_t counts_[NUM_BINS];
+    uint64_t max_us_;
+  };
+
+} /* namespace FrameReceiver */
+
+#endif /* SRC_TIMEHISTOGRAM_H_ */
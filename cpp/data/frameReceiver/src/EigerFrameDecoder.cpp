@@ -5,18 +5,56 @@
  *      Author: Alan Greer
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <new>
+
 #include "EigerFrameDecoder.h"
+#include "EigerProtocol.h"
+#include "Stream2Cbor.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 
 namespace FrameReceiver
 {
 
 const std::string EigerFrameDecoder::CONFIG_DETECTOR_MODEL = "detector_model";
+const std::string EigerFrameDecoder::CONFIG_STREAM_PROTOCOL = "stream_protocol";
+const std::string EigerFrameDecoder::CONFIG_SHARED_TRANSPORT = "shared_transport";
+const std::string EigerFrameDecoder::CONFIG_SHARED_BUFFER_NAME = "shared_buffer_name";
+const std::string EigerFrameDecoder::CONFIG_CONTROL_LANE = "control_lane";
+const std::string EigerFrameDecoder::CONFIG_OVERFLOW_FRAMES = "overflow_frames";
+const std::string EigerFrameDecoder::CONFIG_PAYLOAD_ALIGNMENT = "payload_alignment";
 const std::string EigerFrameDecoder::DETECTOR_MODEL_500K = "500K";
 const std::string EigerFrameDecoder::DETECTOR_MODEL_1M = "1M";
 const std::string EigerFrameDecoder::DETECTOR_MODEL_4M = "4M";
 const std::string EigerFrameDecoder::DETECTOR_MODEL_9M = "9M";
 const std::string EigerFrameDecoder::DETECTOR_MODEL_16M = "16M";
 
+// Empty buffers kept back from the shared transport for headers and payloads received over TCP
+static const size_t SHARED_TRANSPORT_RESERVE = 4;
+// Range searched for the first frame buffer when locating it in the frame pool segment
+static const size_t SHARED_POOL_SEARCH_BYTES = 4096;
+// Time to wait at a fence for its message to arrive through the control lane, unless the lane has stalled
+static const int CONTROL_LANE_TIMEOUT_MS = 1000;
+static const int CONTROL_LANE_POLL_MS = 10;
+// Largest stream2 message the EigerFan can announce, above which the notice is taken to be corrupt
+static const size_t MAX_ANNOUNCED_SIZE = static_cast<size_t>(1) << 30;
+// Shortest interval the frame and data rates are measured over
+static const double RATE_INTERVAL_S = 1.0;
+
+namespace {
+  double elapsed_s(const struct timespec& start, const struct timespec& end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  }
+}
+
 /**
  * Constructor
  */
@@ -26,15 +64,37 @@ EigerFrameDecoder::EigerFrameDecoder() :
                         current_frame_buffer_id_(-1),
                         current_frame_buffer_(0),
                         dropping_frame_data_(false),
+                        stream_protocol_(Eiger::STREAM_PROTOCOL_LEGACY),
                         buffer_size(Eiger::frame_size_16M),
+                        payload_alignment_(0),
+                        announced_size_(0),
                         frames_allocated_(0),
+                        overflow_frames_(0),
+                        current_overflow_slot_(-1),
                         currentMessagePart(1),
                         currentMessageType(Eiger::GLOBAL_HEADER_NONE),
                         currentParentMessageType(Eiger::PARENT_MESSAGE_TYPE_GLOBAL),
-                        numHeaderMessagesToExpect(1)
+                        numHeaderMessagesToExpect(1),
+                        shared_transport_(NULL),
+                        shared_pool_(NULL),
+                        shared_pool_size_(0),
+                        shared_pool_offset_(-1),
+                        shared_frames_received_(0),
+                        fences_failed_(0),
+                        fence_parts_(0),
+                        bytes_received_(0),
+                        acquisition_start_frames_dropped_(0),
+                        free_buffer_low_water_(0),
+                        total_frames_received_(0),
+                        total_bytes_received_(0),
+                        rate_frames_received_(0),
+                        rate_bytes_received_(0),
+                        frame_rate_(0.0),
+                        data_rate_mb_(0.0)
 {
-  current_raw_buffer_.reset(new uint8_t[Eiger::frame_size_16M]); // Use biggest frame size possible
-  dropped_frame_buffer_.reset(new uint8_t[Eiger::frame_size_16M]); // Use biggest frame size possible
+  memset(&currentHeader, 0, sizeof(currentHeader));
+  memset(message_parts_, 0, sizeof(message_parts_));
+  clock_gettime(CLOCK_MONOTONIC, &rate_start_);
 }
 
 /**
@@ -52,6 +112,21 @@ void EigerFrameDecoder::init(LoggerPtr& logger, OdinData::IpcMessage& config_msg
 
   LOG4CXX_DEBUG_LEVEL(2, logger_, "Got decoder config message: " << config_msg.encode());
 
+  // Extract the stream protocol, which is either the legacy multipart JSON or stream2 CBOR
+  if (config_msg.has_param(CONFIG_STREAM_PROTOCOL))
+  {
+    std::string protocol = config_msg.get_param<std::string>(CONFIG_STREAM_PROTOCOL);
+    if (protocol == Eiger::STREAM_PROTOCOL_LEGACY || protocol == Eiger::STREAM_PROTOCOL_STREAM2)
+    {
+      stream_protocol_ = protocol;
+      LOG4CXX_DEBUG_LEVEL(1, logger_, "Stream protocol set to " << stream_protocol_);
+    }
+    else
+    {
+      LOG4CXX_ERROR(logger_, "Unrecognised stream protocol: " << protocol);
+    }
+  }
+
   // Extract the detector model from the configuration message and set buffer size accordingly
   if (config_msg.has_param(CONFIG_DETECTOR_MODEL))
   {
@@ -83,6 +158,119 @@ void EigerFrameDecoder::init(LoggerPtr& logger, OdinData::IpcMessage& config_msg
     }
   }
 
+  // stream2 images are received with their CBOR framing so need some extra space
+  if (stream_protocol_ == Eiger::STREAM_PROTOCOL_STREAM2 && buffer_size <= Eiger::frame_size_16M)
+  {
+    buffer_size += Eiger::stream2_message_overhead;
+  }
+
+  // Align the message part in each frame buffer, for writers using O_DIRECT
+  if (config_msg.has_param(CONFIG_PAYLOAD_ALIGNMENT))
+  {
+    size_t alignment = config_msg.get_param<unsigned int>(CONFIG_PAYLOAD_ALIGNMENT);
+    if ((alignment & (alignment - 1)) == 0)
+    {
+      payload_alignment_ = alignment;
+      LOG4CXX_DEBUG_LEVEL(1, logger_, "Payload alignment set to " << payload_alignment_);
+    }
+    else
+    {
+      LOG4CXX_ERROR(logger_, "Payload alignment must be a power of 2: " << alignment);
+    }
+  }
+  // Allow for the padding and keep every buffer at the same offset from an aligned address
+  buffer_size = Eiger::AlignedFrameBufferSize(buffer_size, payload_alignment_);
+  allocate_scratch_buffers();
+
+  // Set up the pool that holds frames while no frame buffer is free
+  if (config_msg.has_param(CONFIG_OVERFLOW_FRAMES))
+  {
+    overflow_frames_ = config_msg.get_param<unsigned int>(CONFIG_OVERFLOW_FRAMES);
+  }
+  allocate_overflow_pool();
+
+  // Set up the same-host transport from the EigerFan if requested
+  if (config_msg.has_param(CONFIG_SHARED_TRANSPORT))
+  {
+    shared_transport_name_ = config_msg.get_param<std::string>(CONFIG_SHARED_TRANSPORT);
+  }
+  if (config_msg.has_param(CONFIG_SHARED_BUFFER_NAME))
+  {
+    shared_buffer_name_ = config_msg.get_param<std::string>(CONFIG_SHARED_BUFFER_NAME);
+  }
+  close_shared_transport();
+  if (!shared_transport_name_.empty())
+  {
+    if (shared_buffer_name_.empty())
+    {
+      LOG4CXX_ERROR(logger_, "Shared transport requires the " << CONFIG_SHARED_BUFFER_NAME << " of the frame pool");
+    }
+    else
+    {
+      open_shared_transport();
+    }
+  }
+
+  // Connect to the control lane the EigerFan sends header and end messages through
+  if (config_msg.has_param(CONFIG_CONTROL_LANE))
+  {
+    control_lane_endpoint_ = config_msg.get_param<std::string>(CONFIG_CONTROL_LANE);
+  }
+  close_control_lane();
+  if (!control_lane_endpoint_.empty())
+  {
+    open_control_lane();
+  }
+
+}
+
+/**
+ * Allocate the raw and dropped frame buffers and fault them in, so the first
+ * frames received are not slowed by page faults
+ *
+ * The buffers are kept across a re-init unless the frame buffer size they
+ * depend on has changed.
+ */
+void EigerFrameDecoder::allocate_scratch_buffers(void)
+{
+  size_t scratch_size = Eiger::ScratchBufferSize(buffer_size);
+  if (current_raw_buffer_.size() == scratch_size && dropped_frame_buffer_.size() == scratch_size) {
+    return;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  bool dropping = current_frame_buffer_ && current_frame_buffer_ == dropped_frame_buffer_.data();
+  if (!current_raw_buffer_.allocate(scratch_size) || !dropped_frame_buffer_.allocate(scratch_size)) {
+    LOG4CXX_ERROR(logger_, "Unable to allocate scratch buffers: " << strerror(errno));
+    return;
+  }
+  if (dropping) {
+    // A frame being dropped carries on into the new mapping
+    current_frame_buffer_ = dropped_frame_buffer_.data();
+  }
+  current_raw_buffer_.prefault();
+  dropped_frame_buffer_.prefault();
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  LOG4CXX_INFO(logger_, "Scratch buffers allocated"
+      << (current_raw_buffer_.huge_pages() && dropped_frame_buffer_.huge_pages() ? " in huge pages" : "")
+      << " and faulted in in " << elapsed_s(start, end) * 1000 << "ms");
+}
+
+/**
+ * Gets the offset of the message part in a frame buffer
+ *
+ * The part follows the FrameHeader, padded to the next payload_alignment_
+ * boundary if an alignment is set.
+ *
+ * \param[in] buffer The frame buffer
+ * \return The offset from the start of the buffer
+ */
+size_t EigerFrameDecoder::payload_offset(const void* buffer) const
+{
+  return Eiger::AlignedPayloadOffset(buffer, payload_alignment_);
 }
 
 /**
@@ -90,6 +278,8 @@ void EigerFrameDecoder::init(LoggerPtr& logger, OdinData::IpcMessage& config_msg
  */
 EigerFrameDecoder::~EigerFrameDecoder()
 {
+  close_shared_transport();
+  close_control_lane();
 }
 
 /**
@@ -119,34 +309,86 @@ const size_t EigerFrameDecoder::get_frame_header_size(void) const
  */
 void* EigerFrameDecoder::get_next_message_buffer(void)
 {
-  if ((currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA && currentMessagePart == Eiger::image_data_blob_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA && currentMessagePart == Eiger::image_data_appendix_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL && currentMessagePart == Eiger::global_detector_config_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL && currentMessagePart == Eiger::global_flatfield_data_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL && currentMessagePart == Eiger::global_mask_data_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL && currentMessagePart == Eiger::global_countrate_data_part) ||
-      (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL && currentMessagePart == Eiger::global_appendix_part)) {
+  if (stream_protocol_ == Eiger::STREAM_PROTOCOL_STREAM2) {
+    if (currentMessagePart == Eiger::stream2_cbor_part && announced_size_ > 0) {
+      return reinterpret_cast<void*>(stream2_buffer_.data());
+    }
+    // The CBOR message is received straight into the frame buffer and decoded in place
+    if (currentMessagePart == Eiger::stream2_cbor_part && !shared_transport_) {
+      allocate_next_frame_buffer();
+      return reinterpret_cast<void*>(static_cast<char*>(current_frame_buffer_) + payload_offset(current_frame_buffer_));
+    }
+    return reinterpret_cast<void*>(current_raw_buffer_.data());
+  }
+
+  // With a shared transport the blob part is a descriptor of a lent buffer, unless it was sent over TCP
+  const Eiger::PartSpec& part = Eiger::GetPartSpec(currentParentMessageType, currentMessagePart);
+  if (part.frame_buffer && !(part.content == Eiger::PART_CONTENT_IMAGE_BLOB && shared_transport_)) {
     allocate_next_frame_buffer();
-    return reinterpret_cast<void*>(static_cast<char*>(current_frame_buffer_)+sizeof(Eiger::FrameHeader));
+    return reinterpret_cast<void*>(static_cast<char*>(current_frame_buffer_) + payload_offset(current_frame_buffer_));
   } else {
-    return reinterpret_cast<void*>(current_raw_buffer_.get());
+    return reinterpret_cast<void*>(current_raw_buffer_.data());
   }
 }
 
 /**
- * Processes the message in the current buffer
+ * Processes the message in the current buffer, recording the time taken
  *
  * \param[in] bytes_received The number of bytes received
  * \return The state after processing
  */
 FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_received)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  FrameDecoder::FrameReceiveState frame_state = decode_message(bytes_received);
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  process_time_.add(static_cast<uint64_t>(elapsed_s(start, end) * 1e6));
+
+  return frame_state;
+}
+
+/**
+ * Decodes the message in the current buffer
+ *
+ * \param[in] bytes_received The number of bytes received
+ * \return The state after processing
+ */
+FrameDecoder::FrameReceiveState EigerFrameDecoder::decode_message(size_t bytes_received)
 {
   FrameDecoder::FrameReceiveState frame_state = FrameDecoder::FrameReceiveStateIncomplete;
 
+  // A fence stands in for a message the EigerFan sent through the control lane
+  uint64_t fence_sequence = 0;
+  if (currentMessagePart == 1 && control_lane_socket_ &&
+      Eiger::ParseFence(current_raw_buffer_.data(), bytes_received, fence_sequence)) {
+    fence_parts_++;
+    return apply_fence(fence_sequence);
+  }
+
+  // A size notice announces a stream2 message that may not fit in a frame buffer
+  if (currentMessagePart == 1 && stream_protocol_ == Eiger::STREAM_PROTOCOL_STREAM2 &&
+      bytes_received > Eiger::SIZE_NOTICE_PREFIX.size() &&
+      memcmp(current_raw_buffer_.data(), Eiger::SIZE_NOTICE_PREFIX.data(), Eiger::SIZE_NOTICE_PREFIX.size()) == 0) {
+    std::string notice(static_cast<char*>(current_raw_buffer_.data()), bytes_received);
+    announce_stream2_message(strtoull(notice.c_str() + Eiger::SIZE_NOTICE_PREFIX.size(), NULL, 10));
+    return frame_state;
+  }
+
+  if (stream_protocol_ == Eiger::STREAM_PROTOCOL_STREAM2) {
+    frame_state = process_stream2_message(bytes_received);
+    count_message_part(bytes_received);
+    currentMessagePart++;
+    return frame_state;
+  }
+
   // If on first message part, parse the message to find out what type of message it is
   if (currentMessagePart == 1) {
     char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
+    memcpy(temp_buffer, current_raw_buffer_.data(), bytes_received);
     temp_buffer[bytes_received] = '\0';
 
     jsonDocument.Parse(temp_buffer);
@@ -154,35 +396,31 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_
       LOG4CXX_ERROR(logger_, "Error parsing stream message into json");
     } else {
       rapidjson::Value& headerTypeValue = jsonDocument[Eiger::HEADER_TYPE_KEY.c_str()];
-      std::string htype(headerTypeValue.GetString());
-      if (htype.compare(Eiger::GLOBAL_HEADER_TYPE) == 0) {
+      Eiger::EigerMessageParentType messageType = Eiger::PARENT_MESSAGE_TYPE_GLOBAL;
+      if (!Eiger::ClassifyMessageType(headerTypeValue.GetString(), headerTypeValue.GetStringLength(), messageType)) {
+        LOG4CXX_ERROR(logger_, std::string("Unknown header type ").append(headerTypeValue.GetString()));
+      } else if (messageType == Eiger::PARENT_MESSAGE_TYPE_GLOBAL) {
         currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_GLOBAL;
         // Reset the dropped frame count to start fresh for this acquisition
         frames_allocated_ = 0;
+        start_acquisition_statistics();
         // Get the series number from the message
         rapidjson::Value& seriesValue = jsonDocument[Eiger::SERIES_KEY.c_str()];
         currentHeader.series = seriesValue.GetInt();
         // Get the detail type to determine if there is more header to come
         rapidjson::Value& headerDetailValue = jsonDocument[Eiger::HEADER_DETAIL_KEY.c_str()];
-        std::string hdetail(headerDetailValue.GetString());
-        if (hdetail.compare(Eiger::HEADER_DETAIL_NONE) == 0) {
-          currentMessageType = Eiger::GLOBAL_HEADER_NONE;
-          LOG4CXX_TRACE(logger_, "Global header currentMessageType set to none");
+        const Eiger::HeaderDetailSpec* detail = Eiger::FindHeaderDetail(headerDetailValue.GetString());
+        if (!detail) {
+          LOG4CXX_ERROR(logger_, std::string("Unknown header detail ").append(headerDetailValue.GetString())
+              << " - expecting all header parts");
+          detail = Eiger::FindHeaderDetail(Eiger::HEADER_DETAIL_ALL.c_str());
+        }
+        currentMessageType = detail->message_type;
+        LOG4CXX_TRACE(logger_, "Global header detail " << detail->name << " with " << detail->last_part << " parts");
+        // Set to last message expected
+        numHeaderMessagesToExpect = detail->last_part;
+        if (numHeaderMessagesToExpect == Eiger::global_detector_none_part) {
           process_global_header_message(bytes_received);
-          // Set to last message expected (1)
-          numHeaderMessagesToExpect = Eiger::global_detector_none_part;
-        } else if (hdetail.compare(Eiger::HEADER_DETAIL_BASIC) == 0) {
-          // Current message type is config because 'Basic' includes the config message
-          currentMessageType = Eiger::GLOBAL_HEADER_CONFIG;
-          LOG4CXX_TRACE(logger_, "Global header currentMessageType set to config");
-          // Set to last message expected (2)
-          numHeaderMessagesToExpect = Eiger::global_detector_config_part;
-        } else {
-          // Current message type is config because 'All' includes the config message
-          currentMessageType = Eiger::GLOBAL_HEADER_CONFIG;
-          LOG4CXX_TRACE(logger_, "Global header currentMessageType set to config");
-          // Set to last message expected (8)
-          numHeaderMessagesToExpect = Eiger::global_countrate_data_part;
         }
         // Get the acquisition ID from the global header if it exists
         if (jsonDocument.HasMember(Eiger::ACQUISITION_ID_KEY.c_str()) == true) {
@@ -191,7 +429,7 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_
           strncpy(currentHeader.acquisitionID, acqID.c_str(), sizeof(currentHeader.acquisitionID));
         }
 
-      } else if (htype.compare(Eiger::IMAGE_HEADER_TYPE) == 0) {
+      } else if (messageType == Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA) {
         currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA;
         currentMessageType = Eiger::IMAGE_DATA;
         // Get the frame number from the message
@@ -213,7 +451,7 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_
           std::string acqID(acqIDValue.GetString());
           strncpy(currentHeader.acquisitionID, acqID.c_str(), sizeof(currentHeader.acquisitionID));
         }
-      } else if (htype.compare(Eiger::END_HEADER_TYPE) == 0) {
+      } else {
         currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_END;
         currentMessageType = Eiger::END_OF_STREAM;
         // Get the series number from the message
@@ -224,20 +462,19 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_
         std::string acqID(acqIDValue.GetString());
         strncpy(currentHeader.acquisitionID, acqID.c_str(), sizeof(currentHeader.acquisitionID));
         process_end_message(bytes_received);
-      } else {
-        LOG4CXX_ERROR(logger_, std::string("Unknown header type ").append(htype));
       }
     }
   } else {
-    if (currentMessageType == Eiger::IMAGE_DATA) {
+    if (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA) {
       process_image_message(bytes_received);
-    } else if (currentMessageType == Eiger::END_OF_STREAM) {
+    } else if (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_END) {
       LOG4CXX_ERROR(logger_, "Unexpected message at end of stream");
     } else {
       process_global_header_message(bytes_received);
     }
   }
 
+  count_message_part(bytes_received);
   currentMessagePart++;
 
   // If we're on the global header message, set the current message part to the appendix if we have no more expected messages
@@ -258,102 +495,60 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_message(size_t bytes_
  */
 FrameDecoder::FrameReceiveState EigerFrameDecoder::process_global_header_message(size_t bytes_received) {
   FrameDecoder::FrameReceiveState frame_state = FrameDecoder::FrameReceiveStateIncomplete;
-  if (currentMessagePart == Eiger::global_detector_none_part) {
-    // No buffer allocated, so allocate one
-    allocate_next_frame_buffer();
-    send_buffer();
-  } else if (currentMessagePart == Eiger::global_detector_config_part) {
-    currentHeader.data_size = bytes_received;
-    send_buffer();
-  } else if (currentMessagePart == Eiger::global_flatfield_header_part) {
-    currentMessageType = Eiger::GLOBAL_HEADER_FLATFIELD;
-    char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
-    temp_buffer[bytes_received] = '\0';
-    jsonDocument.Parse(temp_buffer);
-    // Get the shape
-    rapidjson::Value& shapeValue = jsonDocument[Eiger::SHAPE_KEY.c_str()];
-    if (shapeValue.IsArray() && shapeValue.Size() > 1) {
-      rapidjson::Value& s0Value = shapeValue[0];
-      rapidjson::Value& s1Value = shapeValue[1];
-      currentHeader.shapeSizeX = s0Value.GetInt();
-      currentHeader.shapeSizeY = s1Value.GetInt();
-      currentHeader.shapeSizeZ = 0;
-    } else {
-      currentHeader.shapeSizeX = 0;
-      currentHeader.shapeSizeY = 0;
-      currentHeader.shapeSizeZ = 0;
-    }
-    // Get the data type
-    rapidjson::Value& typeValue = jsonDocument[Eiger::DATA_TYPE_KEY.c_str()];
-    std::string type(typeValue.GetString());
-    strncpy(currentHeader.dataType, type.c_str(), sizeof(currentHeader.dataType));
-    currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
-  } else if (currentMessagePart == Eiger::global_flatfield_data_part) {
-    currentHeader.data_size = bytes_received;
-    send_buffer();
-  } else if (currentMessagePart == Eiger::global_mask_header_part) {
-    currentMessageType = Eiger::GLOBAL_HEADER_MASK;
-    char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
-    temp_buffer[bytes_received] = '\0';
-    jsonDocument.Parse(temp_buffer);
-    // Get the shape
-    rapidjson::Value& shapeValue = jsonDocument[Eiger::SHAPE_KEY.c_str()];
-    if (shapeValue.IsArray() && shapeValue.Size() > 1) {
-      rapidjson::Value& s0Value = shapeValue[0];
-      rapidjson::Value& s1Value = shapeValue[1];
-      currentHeader.shapeSizeX = s0Value.GetInt();
-      currentHeader.shapeSizeY = s1Value.GetInt();
-      currentHeader.shapeSizeZ = 0;
-    } else {
-      currentHeader.shapeSizeX = 0;
-      currentHeader.shapeSizeY = 0;
-      currentHeader.shapeSizeZ = 0;
-    }
-    // Get the data type
-    rapidjson::Value& typeValue = jsonDocument[Eiger::DATA_TYPE_KEY.c_str()];
-    std::string type(typeValue.GetString());
-    strncpy(currentHeader.dataType, type.c_str(), sizeof(currentHeader.dataType));
-    currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
-  } else if (currentMessagePart == Eiger::global_mask_data_part) {
-    currentHeader.data_size = bytes_received;
-    send_buffer();
-  } else if (currentMessagePart == Eiger::global_countrate_header_part) {
-    currentMessageType = Eiger::GLOBAL_HEADER_COUNTRATE;
-    char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
-    temp_buffer[bytes_received] = '\0';
-    jsonDocument.Parse(temp_buffer);
-    // Get the shape
-    rapidjson::Value& shapeValue = jsonDocument[Eiger::SHAPE_KEY.c_str()];
-    if (shapeValue.IsArray() && shapeValue.Size() > 1) {
-      rapidjson::Value& s0Value = shapeValue[0];
-      rapidjson::Value& s1Value = shapeValue[1];
-      currentHeader.shapeSizeX = s0Value.GetInt();
-      currentHeader.shapeSizeY = s1Value.GetInt();
-      currentHeader.shapeSizeZ = 0;
-    } else {
-      currentHeader.shapeSizeX = 0;
-      currentHeader.shapeSizeY = 0;
-      currentHeader.shapeSizeZ = 0;
-    }
-    // Get the data type
-    rapidjson::Value& typeValue = jsonDocument[Eiger::DATA_TYPE_KEY.c_str()];
-    std::string type(typeValue.GetString());
-    strncpy(currentHeader.dataType, type.c_str(), sizeof(currentHeader.dataType));
-    currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
-  } else if (currentMessagePart == Eiger::global_countrate_data_part) {
-    currentHeader.data_size = bytes_received;
-    send_buffer();
-  } else if (currentMessagePart == Eiger::global_appendix_part) {
-    currentMessageType = Eiger::GLOBAL_HEADER_APPENDIX;
-    currentHeader.data_size = bytes_received;
-    send_buffer();
+  const Eiger::PartSpec& part = Eiger::GetPartSpec(currentParentMessageType, currentMessagePart);
+  switch (part.content) {
+    case Eiger::PART_CONTENT_MESSAGE_HEADER:
+      // Only processed when the header has no other parts. No buffer allocated, so allocate one
+      allocate_next_frame_buffer();
+      send_buffer();
+      break;
+    case Eiger::PART_CONTENT_DATA_HEADER:
+      currentMessageType = part.message_type;
+      process_data_header(bytes_received);
+      break;
+    case Eiger::PART_CONTENT_DATA:
+    case Eiger::PART_CONTENT_APPENDIX:
+      currentMessageType = part.message_type;
+      currentHeader.data_size = bytes_received;
+      send_buffer();
+      break;
+    default:
+      LOG4CXX_ERROR(logger_, "Unexpected global header part " << currentMessagePart);
+      break;
   }
   return frame_state;
 }
 
+/**
+ * Processes the JSON header of a global header data part, giving its shape and data type
+ *
+ * \param[in] bytes_received The number of bytes received
+ */
+void EigerFrameDecoder::process_data_header(size_t bytes_received) {
+  char temp_buffer[bytes_received+1];
+  memcpy(temp_buffer, current_raw_buffer_.data(), bytes_received);
+  temp_buffer[bytes_received] = '\0';
+  jsonDocument.Parse(temp_buffer);
+  // Get the shape
+  rapidjson::Value& shapeValue = jsonDocument[Eiger::SHAPE_KEY.c_str()];
+  if (shapeValue.IsArray() && shapeValue.Size() > 1) {
+    rapidjson::Value& s0Value = shapeValue[0];
+    rapidjson::Value& s1Value = shapeValue[1];
+    currentHeader.shapeSizeX = s0Value.GetInt();
+    currentHeader.shapeSizeY = s1Value.GetInt();
+    currentHeader.shapeSizeZ = 0;
+  } else {
+    currentHeader.shapeSizeX = 0;
+    currentHeader.shapeSizeY = 0;
+    currentHeader.shapeSizeZ = 0;
+  }
+  // Get the data type
+  rapidjson::Value& typeValue = jsonDocument[Eiger::DATA_TYPE_KEY.c_str()];
+  std::string type(typeValue.GetString());
+  strncpy(currentHeader.dataType, type.c_str(), sizeof(currentHeader.dataType));
+  currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
+}
+
 /**
  * Processes the image message message
  *
@@ -362,10 +557,11 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_global_header_message
  */
 FrameDecoder::FrameReceiveState EigerFrameDecoder::process_image_message(size_t bytes_received) {
   FrameDecoder::FrameReceiveState frame_state = FrameDecoder::FrameReceiveStateIncomplete;
-  if (currentMessagePart == Eiger::image_data_imaged_part) {
+  Eiger::PartContent content = Eiger::GetPartSpec(currentParentMessageType, currentMessagePart).content;
+  if (content == Eiger::PART_CONTENT_IMAGE_HEADER) {
     // This is the message containing the image dimensions and encoding details
     char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
+    memcpy(temp_buffer, current_raw_buffer_.data(), bytes_received);
     temp_buffer[bytes_received] = '\0';
     jsonDocument.Parse(temp_buffer);
     // Get the shape
@@ -403,15 +599,18 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_image_message(size_t
     // Get the size
     rapidjson::Value& sizeValue = jsonDocument[Eiger::SIZE_KEY.c_str()];
     currentHeader.size_in_header = sizeValue.GetInt64();
-  } else if (currentMessagePart == Eiger::image_data_blob_part) {
+  } else if (content == Eiger::PART_CONTENT_IMAGE_BLOB) {
     // This is the message containing the image blob
+    if (shared_transport_) {
+      receive_shared_payload(bytes_received);
+    }
     currentHeader.data_size = bytes_received;
 
     frame_state = FrameDecoder::FrameReceiveStateComplete;
-  } else if (currentMessagePart == Eiger::image_data_time_part) {
+  } else if (content == Eiger::PART_CONTENT_IMAGE_TIMES) {
     // This is the message containing the image times
     char temp_buffer[bytes_received+1];
-    memcpy(temp_buffer, current_raw_buffer_.get(), bytes_received);
+    memcpy(temp_buffer, current_raw_buffer_.data(), bytes_received);
     temp_buffer[bytes_received] = '\0';
     jsonDocument.Parse(temp_buffer);
     // Get the times
@@ -423,8 +622,8 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_image_message(size_t
     currentHeader.realTime = realValue.GetInt64();
     send_buffer();
     frame_state = FrameDecoder::FrameReceiveStateComplete;
-  } else if (currentMessagePart == Eiger::image_data_appendix_part) {
-    currentMessageType = Eiger::IMAGE_APPENDIX;
+  } else if (content == Eiger::PART_CONTENT_APPENDIX) {
+    currentMessageType = Eiger::GetPartSpec(currentParentMessageType, currentMessagePart).message_type;
     currentHeader.data_size = bytes_received;
     send_buffer();
   }
@@ -445,6 +644,547 @@ FrameDecoder::FrameReceiveState EigerFrameDecoder::process_end_message(size_t by
   return frame_state;
 }
 
+/**
+ * Processes a stream2 message part
+ *
+ * The EigerFan sends the acquisition ID followed by the CBOR message from the
+ * detector. The CBOR has already been received into the frame buffer, so it is
+ * decoded in place and the image payload is located by its offset. A start
+ * message is announced by the EigerFan and received into the stream2 buffer
+ * instead, as its flatfield and pixel mask can be larger than a frame buffer.
+ *
+ * \param[in] bytes_received The number of bytes received
+ * \return The state after processing
+ */
+FrameDecoder::FrameReceiveState EigerFrameDecoder::process_stream2_message(size_t bytes_received) {
+  FrameDecoder::FrameReceiveState frame_state = FrameDecoder::FrameReceiveStateIncomplete;
+  if (currentMessagePart == Eiger::stream2_acquisition_id_part) {
+    size_t length = std::min(bytes_received, sizeof(currentHeader.acquisitionID) - 1);
+    memcpy(currentHeader.acquisitionID, current_raw_buffer_.data(), length);
+    currentHeader.acquisitionID[length] = '\0';
+  } else if (currentMessagePart == Eiger::stream2_cbor_part) {
+    bool announced = announced_size_ > 0;
+    const uint8_t* message = stream2_buffer_.data();
+    if (announced) {
+      announced_size_ = 0;
+    } else {
+      if (bytes_received > buffer_size - payload_offset(current_frame_buffer_)) {
+        LOG4CXX_ERROR(logger_, "Rejecting stream2 message of " << bytes_received << " bytes, which is larger than a "
+            << "frame buffer. A start with a flatfield or pixel mask must be announced by the EigerFan");
+        return frame_state;
+      }
+      if (shared_transport_) {
+        receive_shared_payload(bytes_received);
+      }
+      message = static_cast<const uint8_t*>(current_frame_buffer_) + payload_offset(current_frame_buffer_);
+    }
+    Eiger::Stream2Message stream2;
+    if (!Eiger::ParseStream2Message(message, bytes_received, stream2)) {
+      LOG4CXX_ERROR(logger_, "Error parsing stream2 message as CBOR");
+      return frame_state;
+    }
+    currentHeader.series = stream2.series_id;
+    if (stream2.type == Eiger::STREAM2_START) {
+      process_stream2_start(message, bytes_received);
+    } else if (stream2.type == Eiger::STREAM2_IMAGE && announced) {
+      LOG4CXX_ERROR(logger_, "Dropping image " << stream2.image_id << " received in place of an announced message");
+    } else if (stream2.type == Eiger::STREAM2_IMAGE) {
+      currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA;
+      currentMessageType = Eiger::IMAGE_DATA;
+      current_frame_number_ = stream2.image_id;
+      currentHeader.frame_number = current_frame_number_;
+      currentHeader.shapeSizeX = stream2.shape[0];
+      currentHeader.shapeSizeY = stream2.shape[1];
+      currentHeader.shapeSizeZ = stream2.shape[2];
+      currentHeader.startTime = stream2.start_time;
+      currentHeader.stopTime = stream2.stop_time;
+      currentHeader.realTime = stream2.real_time;
+      currentHeader.data_size = stream2.data_size;
+      currentHeader.size_in_header = stream2.data_size;
+      currentHeader.data_offset = stream2.data - message;
+      strncpy(currentHeader.dataType, stream2.data_type, sizeof(currentHeader.dataType));
+      currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
+      std::string encoding = Eiger::Stream2Encoding(stream2);
+      strncpy(currentHeader.encoding, encoding.c_str(), sizeof(currentHeader.encoding));
+      currentHeader.encoding[sizeof(currentHeader.encoding)-1] = '\0';
+      send_buffer();
+      frame_state = FrameDecoder::FrameReceiveStateComplete;
+    } else if (stream2.type == Eiger::STREAM2_END) {
+      currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_END;
+      currentMessageType = Eiger::END_OF_STREAM;
+      // No buffer allocated if the message was announced, so allocate one
+      allocate_next_frame_buffer();
+      send_buffer();
+    }
+  } else {
+    LOG4CXX_ERROR(logger_, "Unexpected message part " << currentMessagePart << " in stream2 message");
+  }
+  return frame_state;
+}
+
+/**
+ * Receive the CBOR part of the next stream2 message into the stream2 buffer
+ *
+ * \param[in] size Size of the CBOR part
+ */
+void EigerFrameDecoder::announce_stream2_message(size_t size)
+{
+  if (size == 0 || size > MAX_ANNOUNCED_SIZE) {
+    LOG4CXX_ERROR(logger_, "Ignoring notice of a stream2 message of " << size << " bytes");
+    return;
+  }
+  if (stream2_buffer_.size() < size) {
+    stream2_buffer_.resize(size);
+  }
+  announced_size_ = size;
+}
+
+/**
+ * Processes a stream2 start message
+ *
+ * The start is passed on as the legacy global header parts so that the
+ * processors and meta writer handle both protocols alike: the config first,
+ * as it starts the series downstream, then the flatfield, pixel mask and
+ * countrate table if the detector sent them.
+ *
+ * \param[in] message The CBOR message
+ * \param[in] size Size of the message in bytes
+ */
+void EigerFrameDecoder::process_stream2_start(const uint8_t* message, size_t size)
+{
+  currentParentMessageType = Eiger::PARENT_MESSAGE_TYPE_GLOBAL;
+  // Reset the dropped frame count to start fresh for this acquisition
+  frames_allocated_ = 0;
+  start_acquisition_statistics();
+
+  // The frame buffer holding the message is reused for the config
+  if (message != stream2_buffer_.data()) {
+    stream2_buffer_.assign(message, message + size);
+    message = stream2_buffer_.data();
+  }
+  Eiger::Stream2Start start;
+  if (!Eiger::ParseStream2Start(message, size, start)) {
+    LOG4CXX_ERROR(logger_, "Error parsing stream2 start message - passing on series " << currentHeader.series
+        << " without its config");
+    currentMessageType = Eiger::GLOBAL_HEADER_NONE;
+    allocate_next_frame_buffer();
+    send_buffer();
+    return;
+  }
+
+  rapidjson::Document config;
+  config.SetObject();
+  rapidjson::Document::AllocatorType& allocator = config.GetAllocator();
+  for (size_t i = 0; i < start.config.size(); i++) {
+    const Eiger::Stream2ConfigEntry& entry = start.config[i];
+    rapidjson::Value key(entry.key.c_str(), allocator);
+    rapidjson::Value value;
+    if (entry.type == Eiger::STREAM2_VALUE_TEXT) {
+      value.SetString(entry.text.c_str(), entry.text.size(), allocator);
+    } else if (entry.type == Eiger::STREAM2_VALUE_BOOL) {
+      value.SetBool(entry.flag);
+    } else {
+      rapidjson::Value array(rapidjson::kArrayType);
+      for (size_t n = 0; n < entry.numbers.size(); n++) {
+        rapidjson::Value number;
+        if (entry.integer) {
+          number.SetInt64(static_cast<int64_t>(entry.numbers[n]));
+        } else {
+          number.SetDouble(entry.numbers[n]);
+        }
+        array.PushBack(number, allocator);
+      }
+      if (entry.type == Eiger::STREAM2_VALUE_ARRAY) {
+        value = array;
+      } else {
+        value = array[0];
+      }
+    }
+    config.AddMember(key, value, allocator);
+  }
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  config.Accept(writer);
+
+  currentMessageType = Eiger::GLOBAL_HEADER_CONFIG;
+  allocate_next_frame_buffer();
+  size_t length = std::min(buffer.GetSize(), buffer_size - payload_offset(current_frame_buffer_));
+  memcpy(static_cast<char*>(current_frame_buffer_) + payload_offset(current_frame_buffer_), buffer.GetString(), length);
+  currentHeader.data_size = length;
+  send_buffer();
+
+  send_stream2_array(Eiger::GLOBAL_HEADER_FLATFIELD, start.flatfield);
+  send_stream2_array(Eiger::GLOBAL_HEADER_MASK, start.pixel_mask);
+  send_stream2_array(Eiger::GLOBAL_HEADER_COUNTRATE, start.countrate);
+}
+
+/**
+ * Send an array from a stream2 start message in a frame buffer of its own
+ *
+ * \param[in] message_type The global header part to pass the array on as
+ * \param[in] array The array, not sent if the start message did not have it
+ */
+void EigerFrameDecoder::send_stream2_array(Eiger::EigerMessageType message_type, const Eiger::Stream2Message& array)
+{
+  if (!array.data) {
+    return;
+  }
+  if (array.compression[0] != '\0') {
+    LOG4CXX_ERROR(logger_, "Unable to pass on " << array.compression << " compressed array of stream2 start message");
+    return;
+  }
+  // Allow for the largest padding, as the offset is not known until a buffer is allocated
+  size_t capacity = buffer_size - sizeof(Eiger::FrameHeader) - payload_alignment_;
+  if (array.data_size > capacity) {
+    LOG4CXX_ERROR(logger_, "Array of " << array.data_size << " bytes from stream2 start message does not fit in a "
+        << buffer_size << " byte frame buffer");
+    return;
+  }
+  currentMessageType = message_type;
+  allocate_next_frame_buffer();
+  memcpy(static_cast<char*>(current_frame_buffer_) + payload_offset(current_frame_buffer_), array.data, array.data_size);
+  currentHeader.shapeSizeX = array.shape[0];
+  currentHeader.shapeSizeY = array.shape[1];
+  currentHeader.shapeSizeZ = 0;
+  currentHeader.data_size = array.data_size;
+  strncpy(currentHeader.dataType, array.data_type, sizeof(currentHeader.dataType));
+  currentHeader.dataType[sizeof(currentHeader.dataType)-1] = '\0';
+  send_buffer();
+}
+
+/**
+ * Create the control segment for the shared transport from a co-located EigerFan
+ *
+ * Any existing segment of the same name is replaced, so a fan attached to a
+ * previous instance stops receiving buffers and reattaches.
+ */
+void EigerFrameDecoder::open_shared_transport(void)
+{
+  shm_unlink(shared_transport_name_.c_str());
+  int fd = shm_open(shared_transport_name_.c_str(), O_CREAT | O_RDWR, 0666);
+  if (fd < 0) {
+    LOG4CXX_ERROR(logger_, "Unable to create shared transport " << shared_transport_name_ << ": " << strerror(errno));
+    return;
+  }
+  if (ftruncate(fd, sizeof(Eiger::SharedTransportControl)) < 0) {
+    LOG4CXX_ERROR(logger_, "Unable to size shared transport " << shared_transport_name_ << ": " << strerror(errno));
+    close(fd);
+    return;
+  }
+  void* address = mmap(NULL, sizeof(Eiger::SharedTransportControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    LOG4CXX_ERROR(logger_, "Unable to map shared transport " << shared_transport_name_ << ": " << strerror(errno));
+    return;
+  }
+
+  // Value-initialise so the atomics are constructed as well as zeroed
+  shared_transport_ = new (address) Eiger::SharedTransportControl();
+  shared_transport_->version = Eiger::SHARED_TRANSPORT_VERSION;
+  strncpy(shared_transport_->buffer_name, shared_buffer_name_.c_str(), sizeof(shared_transport_->buffer_name) - 1);
+  shared_transport_->state.store(Eiger::SHARED_TRANSPORT_INITIALISING);
+  shared_transport_->magic = Eiger::SHARED_TRANSPORT_MAGIC;
+  LOG4CXX_INFO(logger_, "Created shared transport " << shared_transport_name_ << " for frame pool " << shared_buffer_name_);
+}
+
+/**
+ * Remove the shared transport control segment and unmap the frame pool
+ */
+void EigerFrameDecoder::close_shared_transport(void)
+{
+  if (shared_transport_) {
+    munmap(shared_transport_, sizeof(Eiger::SharedTransportControl));
+    shm_unlink(shared_transport_name_.c_str());
+    shared_transport_ = NULL;
+  }
+  if (shared_pool_) {
+    munmap(shared_pool_, shared_pool_size_);
+    shared_pool_ = NULL;
+  }
+  shared_pool_offset_ = -1;
+
+  // Buffers lent to the fan are no longer reachable through the transport
+  for (std::set<int>::iterator it = lent_buffers_.begin(); it != lent_buffers_.end(); ++it) {
+    empty_buffer_queue_.push(*it);
+  }
+  lent_buffers_.clear();
+}
+
+/**
+ * Find where the frame buffers sit in the frame pool segment
+ *
+ * The fan maps the frame pool by name, so it needs buffer offsets rather than
+ * addresses. The pool is mapped here too and a probe written to an empty
+ * buffer through the buffer manager is searched for in that mapping.
+ *
+ * \return true once the pool has been located
+ */
+bool EigerFrameDecoder::locate_shared_pool(void)
+{
+  if (shared_pool_offset_ >= 0) {
+    return true;
+  }
+  if (!buffer_manager_ || empty_buffer_queue_.empty()) {
+    return false;
+  }
+
+  if (!shared_pool_) {
+    int fd = shm_open(shared_buffer_name_.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      LOG4CXX_ERROR(logger_, "Unable to open frame pool " << shared_buffer_name_ << ": " << strerror(errno));
+      close_shared_transport();
+      return false;
+    }
+    struct stat pool_stat;
+    fstat(fd, &pool_stat);
+    shared_pool_size_ = pool_stat.st_size;
+    void* address = mmap(NULL, shared_pool_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+      LOG4CXX_ERROR(logger_, "Unable to map frame pool " << shared_buffer_name_ << ": " << strerror(errno));
+      close_shared_transport();
+      return false;
+    }
+    shared_pool_ = address;
+  }
+
+  int buffer_id = empty_buffer_queue_.front();
+  char* buffer = static_cast<char*>(buffer_manager_->get_buffer_address(buffer_id));
+  size_t buffer_delta = buffer - static_cast<char*>(buffer_manager_->get_buffer_address(0));
+  uint64_t probe = Eiger::SHARED_TRANSPORT_MAGIC ^ reinterpret_cast<uintptr_t>(buffer) ^ getpid();
+  memcpy(buffer, &probe, sizeof(probe));
+
+  char* pool = static_cast<char*>(shared_pool_);
+  for (size_t offset = buffer_delta; offset + sizeof(probe) <= shared_pool_size_ &&
+       offset < buffer_delta + SHARED_POOL_SEARCH_BYTES; offset += sizeof(probe)) {
+    if (memcmp(pool + offset, &probe, sizeof(probe)) == 0) {
+      shared_pool_offset_ = offset - buffer_delta;
+      break;
+    }
+  }
+  memset(buffer, 0, sizeof(probe));
+
+  if (shared_pool_offset_ < 0) {
+    LOG4CXX_ERROR(logger_, "Unable to locate frame buffers in frame pool " << shared_buffer_name_
+        << " - is it the pool this FrameReceiver is using?");
+    close_shared_transport();
+    return false;
+  }
+
+  shared_transport_->buffer_size = buffer_manager_->get_buffer_size();
+  // Buffer sizes are a multiple of the alignment, so the offset is the same in every buffer
+  shared_transport_->payload_offset = payload_offset(buffer_manager_->get_buffer_address(0));
+  shared_transport_->state.store(Eiger::SHARED_TRANSPORT_READY, std::memory_order_release);
+  LOG4CXX_INFO(logger_, "Shared transport ready, frame buffers start at offset " << shared_pool_offset_
+      << " of frame pool " << shared_buffer_name_);
+  return true;
+}
+
+/**
+ * Top up the buffers lent to the fan from the empty buffer queue
+ *
+ * Frames held in the overflow pool have first claim on free buffers, so they
+ * are passed on before any buffer is lent, and a buffer is kept back for each
+ * frame still held or being received into the pool.
+ */
+void EigerFrameDecoder::lend_shared_buffers(void)
+{
+  if (!shared_transport_ || !locate_shared_pool()) {
+    return;
+  }
+  release_overflow_frames();
+  size_t reserve = SHARED_TRANSPORT_RESERVE + overflow_pool_.occupancy() + (current_overflow_slot_ != -1 ? 1 : 0);
+  char* first_buffer = static_cast<char*>(buffer_manager_->get_buffer_address(0));
+  while (empty_buffer_queue_.size() > reserve) {
+    Eiger::SharedFrameSlot slot;
+    slot.buffer_id = empty_buffer_queue_.front();
+    slot.offset = shared_pool_offset_ +
+        (static_cast<char*>(buffer_manager_->get_buffer_address(slot.buffer_id)) - first_buffer);
+    if (!Eiger::SharedTransportPush(shared_transport_, slot)) {
+      break;
+    }
+    empty_buffer_queue_.pop();
+    lent_buffers_.insert(slot.buffer_id);
+  }
+}
+
+/**
+ * Take the payload part of a message received while using the shared transport
+ *
+ * The payload has either been written to a lent buffer by the fan, in which
+ * case the part is a descriptor and that buffer becomes the current frame
+ * buffer, or it was sent over TCP into the raw buffer and is copied into a
+ * newly allocated frame buffer.
+ *
+ * \param[in,out] bytes_received Bytes received for the part, updated to the payload size
+ */
+void EigerFrameDecoder::receive_shared_payload(size_t& bytes_received)
+{
+  Eiger::SharedFrameDescriptor descriptor;
+  if (Eiger::ParseSharedFrameDescriptor(current_raw_buffer_.data(), bytes_received, descriptor)) {
+    if (lent_buffers_.erase(descriptor.buffer_id) == 1) {
+      current_frame_buffer_id_ = descriptor.buffer_id;
+      current_frame_buffer_ = buffer_manager_->get_buffer_address(current_frame_buffer_id_);
+      dropping_frame_data_ = false;
+      frames_allocated_++;
+      shared_frames_received_++;
+      bytes_received = descriptor.size;
+    } else {
+      LOG4CXX_ERROR(logger_, "Shared transport descriptor for buffer " << descriptor.buffer_id
+          << " which is not lent to the fan. Dropping data for frame " << current_frame_number_);
+      current_frame_buffer_ = dropped_frame_buffer_.data();
+      dropping_frame_data_ = true;
+      frames_dropped_++;
+      bytes_received = 0;
+    }
+    return;
+  }
+
+  allocate_next_frame_buffer();
+  size_t capacity = dropping_frame_data_ ? dropped_frame_buffer_.size() : buffer_size;
+  size_t offset = payload_offset(current_frame_buffer_);
+  bytes_received = std::min(bytes_received, capacity - offset);
+  memcpy(static_cast<char*>(current_frame_buffer_) + offset, current_raw_buffer_.data(), bytes_received);
+}
+
+/**
+ * Connect to the control lane from the EigerFan
+ */
+void EigerFrameDecoder::open_control_lane(void)
+{
+  try {
+    control_lane_context_.reset(new zmq::context_t(1));
+    control_lane_socket_.reset(new zmq::socket_t(*control_lane_context_, ZMQ_PULL));
+    int linger = 0;
+    control_lane_socket_->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    control_lane_socket_->connect(control_lane_endpoint_.c_str());
+    LOG4CXX_INFO(logger_, "Connected to control lane " << control_lane_endpoint_);
+  } catch (zmq::error_t& e) {
+    LOG4CXX_ERROR(logger_, "Unable to connect to control lane " << control_lane_endpoint_ << ": " << e.what());
+    close_control_lane();
+  }
+}
+
+/**
+ * Disconnect from the control lane, discarding any messages received through it
+ */
+void EigerFrameDecoder::close_control_lane(void)
+{
+  control_lane_socket_.reset();
+  control_lane_context_.reset();
+  control_lane_inbox_.clear();
+}
+
+/**
+ * Receive every message waiting on the control lane
+ *
+ * Each message arrives behind the fence the EigerFan sent in its place on the
+ * image stream, and is kept by the sequence number of the fence until the
+ * fence is reached.
+ *
+ * \param[in] timeout_ms Time to wait for a message if none is waiting
+ */
+void EigerFrameDecoder::receive_control_lane(long timeout_ms)
+{
+  if (!control_lane_socket_) {
+    return;
+  }
+  zmq::pollitem_t item = { static_cast<void*>(*control_lane_socket_), 0, ZMQ_POLLIN, 0 };
+  if (zmq::poll(&item, 1, timeout_ms) <= 0) {
+    return;
+  }
+
+  zmq::message_t fence;
+  while (control_lane_socket_->recv(&fence, ZMQ_DONTWAIT)) {
+    Eiger::ControlLaneInbox::Message message;
+    int more = 0;
+    size_t more_size = sizeof(more);
+    control_lane_socket_->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    while (more) {
+      boost::shared_ptr<zmq::message_t> part(new zmq::message_t());
+      control_lane_socket_->recv(part.get());
+      message.push_back(part);
+      control_lane_socket_->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    }
+
+    uint64_t sequence = 0;
+    if (!Eiger::ParseFence(fence.data(), fence.size(), sequence) || message.empty()) {
+      LOG4CXX_ERROR(logger_, "Unexpected message on control lane: "
+          << std::string(static_cast<char*>(fence.data()), fence.size()));
+      continue;
+    }
+    if (!control_lane_inbox_.add(sequence, message)) {
+      LOG4CXX_ERROR(logger_, "Discarding control lane message " << sequence << " as its fence has been passed");
+    }
+  }
+}
+
+/**
+ * Process the message sent through the control lane in place of a fence
+ *
+ * The parts are processed as if they had been received from the image stream
+ * where the fence was, so the message takes effect in order with the images.
+ * The rx thread waits for a message that has not arrived yet, but not at
+ * fences behind one that was missed until the lane delivers again.
+ *
+ * \param[in] sequence The sequence number of the fence
+ * \return The state after processing the message
+ */
+FrameDecoder::FrameReceiveState EigerFrameDecoder::apply_fence(uint64_t sequence)
+{
+  // The message was sent before the fence, so it has normally arrived already
+  receive_control_lane(0);
+  int waited_ms = 0;
+  while (control_lane_inbox_.should_wait(sequence) && waited_ms < CONTROL_LANE_TIMEOUT_MS) {
+    receive_control_lane(CONTROL_LANE_POLL_MS);
+    waited_ms += CONTROL_LANE_POLL_MS;
+  }
+
+  Eiger::ControlLaneInbox::Message message;
+  if (!control_lane_inbox_.take(sequence, message)) {
+    LOG4CXX_ERROR(logger_, "Control lane message " << sequence << " not received after waiting "
+        << waited_ms << "ms - skipping fence");
+    return FrameDecoder::FrameReceiveStateIncomplete;
+  }
+
+  FrameDecoder::FrameReceiveState frame_state = FrameDecoder::FrameReceiveStateIncomplete;
+  for (size_t i = 0; i < message.size(); i++) {
+    if (stream_protocol_ == Eiger::STREAM_PROTOCOL_STREAM2 && currentMessagePart == Eiger::stream2_cbor_part) {
+      // The size is known, so a start is received whatever the size of its flatfield and pixel mask
+      announce_stream2_message(message[i]->size());
+    }
+    void* buffer = get_next_message_buffer();
+    if (message[i]->size() > message_buffer_capacity(buffer)) {
+      LOG4CXX_ERROR(logger_, "Part " << i + 1 << " of control lane message " << sequence << " is " << message[i]->size()
+          << " bytes, which does not fit in the receive buffer - skipping fence");
+      announced_size_ = 0;
+      frame_meta_data(1);
+      fences_failed_++;
+      return FrameDecoder::FrameReceiveStateIncomplete;
+    }
+    memcpy(buffer, message[i]->data(), message[i]->size());
+    frame_state = decode_message(message[i]->size());
+    frame_meta_data(i == message.size() - 1 ? 1 : 0);
+  }
+  return frame_state;
+}
+
+/**
+ * Return the number of bytes that can be received into a buffer from get_next_message_buffer
+ *
+ * \param[in] buffer The buffer
+ */
+size_t EigerFrameDecoder::message_buffer_capacity(const void* buffer) const
+{
+  if (buffer == stream2_buffer_.data()) {
+    return stream2_buffer_.size();
+  }
+  if (buffer == current_raw_buffer_.data()) {
+    return current_raw_buffer_.size();
+  }
+  return buffer_size - payload_offset(current_frame_buffer_);
+}
+
 /**
  * Called by the zmq stream receiver - parses meta data
  *
@@ -468,21 +1208,128 @@ void EigerFrameDecoder::frame_meta_data(int meta)
  */
 void EigerFrameDecoder::monitor_buffers(void)
 {
+  release_overflow_frames();
+  lend_shared_buffers();
+  receive_control_lane(0);
+  update_free_buffer_low_water();
+
+  // Measure the rates over at least RATE_INTERVAL_S
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double interval_s = elapsed_s(rate_start_, now);
+  if (interval_s >= RATE_INTERVAL_S) {
+    frame_rate_ = (total_frames_received_ - rate_frames_received_) / interval_s;
+    data_rate_mb_ = (total_bytes_received_ - rate_bytes_received_) / interval_s / 1e6;
+    rate_frames_received_ = total_frames_received_;
+    rate_bytes_received_ = total_bytes_received_;
+    rate_start_ = now;
+  }
+
   LOG4CXX_DEBUG_LEVEL(2, logger_, get_num_empty_buffers() << " empty buffers available. "
       << "Frames in the last acquisition: "
       << frames_allocated_ << " allocated, "
       << frames_dropped_ << " dropped");
 }
 
+/**
+ * Count a message part against the type of message it belongs to
+ *
+ * \param[in] bytes_received The size of the part
+ */
+void EigerFrameDecoder::count_message_part(size_t bytes_received)
+{
+  if (currentParentMessageType < NUM_PARENT_MESSAGE_TYPES) {
+    message_parts_[currentParentMessageType]++;
+  }
+  bytes_received_ += bytes_received;
+  total_bytes_received_ += bytes_received;
+}
+
+/**
+ * Start the statistics afresh at the start of an acquisition
+ */
+void EigerFrameDecoder::start_acquisition_statistics(void)
+{
+  memset(message_parts_, 0, sizeof(message_parts_));
+  process_time_.reset();
+  fence_parts_ = 0;
+  bytes_received_ = 0;
+  acquisition_start_frames_dropped_ = frames_dropped_;
+  free_buffer_low_water_ = get_num_empty_buffers();
+  overflow_pool_.reset_high_water();
+}
+
+/**
+ * Record the number of free buffers if it is the lowest seen this acquisition
+ */
+void EigerFrameDecoder::update_free_buffer_low_water(void)
+{
+  free_buffer_low_water_ = std::min(free_buffer_low_water_, get_num_empty_buffers());
+}
+
+/**
+ * Map the overflow pool to hold overflow_frames_ frames of the current buffer size
+ *
+ * The pool is kept as it is while it holds frames.
+ */
+void EigerFrameDecoder::allocate_overflow_pool(void)
+{
+  if (overflow_pool_.capacity() == overflow_frames_ && overflow_pool_.frame_size() == buffer_size) {
+    return;
+  }
+  if (overflow_pool_.occupancy() > 0 || current_overflow_slot_ != -1) {
+    LOG4CXX_ERROR(logger_, "Unable to resize the overflow pool while it holds frames");
+    return;
+  }
+  if (!overflow_pool_.allocate(overflow_frames_, buffer_size)) {
+    LOG4CXX_ERROR(logger_, "Unable to allocate overflow pool of " << overflow_frames_ << " frames: " << strerror(errno));
+    overflow_frames_ = 0;
+    return;
+  }
+  if (overflow_frames_ > 0) {
+    LOG4CXX_INFO(logger_, "Overflow pool of " << overflow_frames_ << " frames allocated"
+        << (overflow_pool_.huge_pages() ? " in huge pages" : ""));
+  }
+}
+
+/**
+ * Pass frames held in the overflow pool downstream, oldest first, while frame buffers are free
+ */
+void EigerFrameDecoder::release_overflow_frames(void)
+{
+  while (overflow_pool_.occupancy() > 0 && !empty_buffer_queue_.empty()) {
+    int buffer_id = empty_buffer_queue_.front();
+    empty_buffer_queue_.pop();
+    char* buffer = static_cast<char*>(buffer_manager_->get_buffer_address(buffer_id));
+    int frame_number = overflow_pool_.release_oldest(buffer, payload_offset(buffer));
+    ready_callback_(buffer_id, frame_number);
+    frames_allocated_++;
+    if (overflow_pool_.occupancy() == 0) {
+      LOG4CXX_INFO(logger_, "Overflow pool drained");
+    }
+  }
+  update_free_buffer_low_water();
+}
+
 /**
  * Allocate the next frame buffer
  *
- * If no buffer is free, allocate a temporary buffer and record the fact that frames are being dropped
+ * If no buffer is free, hold the frame in the overflow pool until one is. If the
+ * overflow pool is full too, allocate a temporary buffer and record the fact that
+ * frames are being dropped
  */
 void EigerFrameDecoder::allocate_next_frame_buffer(void) {
-  if (current_frame_buffer_id_ == -1){
-    if (empty_buffer_queue_.empty()){
-      current_frame_buffer_ = dropped_frame_buffer_.get();
+  if (current_frame_buffer_id_ == -1 && current_overflow_slot_ == -1){
+    // Held frames go first so frames are passed on in the order they were received
+    release_overflow_frames();
+    if (empty_buffer_queue_.empty() && overflow_pool_.has_free_slot()){
+      if (overflow_pool_.occupancy() == 0){
+        LOG4CXX_WARN(logger_, "No free buffers available. Holding frames in the overflow pool from frame " << current_frame_number_);
+      }
+      current_frame_buffer_ = overflow_pool_.take_slot(current_overflow_slot_);
+      dropping_frame_data_ = false;
+    } else if (empty_buffer_queue_.empty()){
+      current_frame_buffer_ = dropped_frame_buffer_.data();
       if (!dropping_frame_data_){
         LOG4CXX_ERROR(logger_, "Frame data detected but no free buffers available. Dropping data for frame " << current_frame_number_);
         dropping_frame_data_ = true;
@@ -498,6 +1345,7 @@ void EigerFrameDecoder::allocate_next_frame_buffer(void) {
       current_frame_buffer_ = buffer_manager_->get_buffer_address(current_frame_buffer_id_);
       dropping_frame_data_ = false;
       frames_allocated_++;
+      update_free_buffer_low_water();
     }
   }
 }
@@ -507,12 +1355,27 @@ void EigerFrameDecoder::allocate_next_frame_buffer(void) {
  */
 void EigerFrameDecoder::send_buffer(void) {
 
+  if (currentParentMessageType == Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA) {
+    total_frames_received_++;
+  }
+
   if (!dropping_frame_data_) {
     currentHeader.messageType = currentMessageType;
+    currentHeader.payload_offset = payload_offset(current_frame_buffer_);
     memcpy(current_frame_buffer_, &currentHeader, sizeof(Eiger::FrameHeader));
 
-    // Notify main thread that frame is ready
-    ready_callback_(current_frame_buffer_id_, current_frame_number_);
+    if (current_overflow_slot_ != -1) {
+      // Hold the frame until a frame buffer is free
+      OverflowPool::Frame frame;
+      frame.slot = current_overflow_slot_;
+      frame.frame_number = current_frame_number_;
+      frame.size = std::min<size_t>(currentHeader.data_offset + currentHeader.data_size, buffer_size - currentHeader.payload_offset);
+      overflow_pool_.hold(frame);
+      current_overflow_slot_ = -1;
+    } else {
+      // Notify main thread that frame is ready
+      ready_callback_(current_frame_buffer_id_, current_frame_number_);
+    }
 
     // Reset current frame number ID so that if next frame has same number (e.g. repeated
     // sends of single frame 0), it is detected properly
@@ -529,11 +1392,14 @@ void EigerFrameDecoder::send_buffer(void) {
     currentHeader.stopTime = 0;
     currentHeader.realTime = 0;
     currentHeader.size_in_header = 0;
+    currentHeader.data_offset = 0;
 
     currentHeader.hash[0] = '\0';
     currentHeader.dataType[0] = '\0';
     currentHeader.encoding[0] = '\0';
   }
+
+  lend_shared_buffers();
 }
 
 /**
@@ -543,6 +1409,56 @@ void EigerFrameDecoder::get_status(const std::string param_prefix,
     OdinData::IpcMessage& status_msg)
 {
   status_msg.set_param(param_prefix + "name", std::string("EigerFrameDecoder"));
+  if (shared_transport_) {
+    status_msg.set_param(param_prefix + "shared_frames_received", shared_frames_received_);
+    status_msg.set_param(param_prefix + "shared_buffers_lent", static_cast<uint64_t>(lent_buffers_.size()));
+  }
+  if (control_lane_socket_) {
+    status_msg.set_param(param_prefix + "control_lane_pending", static_cast<uint64_t>(control_lane_inbox_.pending()));
+    status_msg.set_param(param_prefix + "control_lane_discarded", control_lane_inbox_.discarded());
+    status_msg.set_param(param_prefix + "fences_applied", control_lane_inbox_.applied());
+    status_msg.set_param(param_prefix + "fences_missed", control_lane_inbox_.missed());
+    status_msg.set_param(param_prefix + "fences_failed", fences_failed_);
+  }
+
+  // Counts for the current acquisition
+  status_msg.set_param(param_prefix + "acquisition/global_parts", message_parts_[Eiger::PARENT_MESSAGE_TYPE_GLOBAL]);
+  status_msg.set_param(param_prefix + "acquisition/image_parts", message_parts_[Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA]);
+  status_msg.set_param(param_prefix + "acquisition/end_parts", message_parts_[Eiger::PARENT_MESSAGE_TYPE_END]);
+  status_msg.set_param(param_prefix + "acquisition/fence_parts", fence_parts_);
+  status_msg.set_param(param_prefix + "acquisition/bytes_received", bytes_received_);
+  status_msg.set_param(param_prefix + "acquisition/frames_allocated", frames_allocated_);
+  status_msg.set_param(param_prefix + "acquisition/frames_dropped", frames_dropped_ - acquisition_start_frames_dropped_);
+
+  // Buffer occupancy
+  status_msg.set_param(param_prefix + "free_buffers", static_cast<uint64_t>(get_num_empty_buffers()));
+  status_msg.set_param(param_prefix + "free_buffers_low_water", static_cast<uint64_t>(free_buffer_low_water_));
+  if (overflow_frames_ > 0) {
+    status_msg.set_param(param_prefix + "overflow/capacity", static_cast<uint64_t>(overflow_frames_));
+    status_msg.set_param(param_prefix + "overflow/occupancy", static_cast<uint64_t>(overflow_pool_.occupancy()));
+    status_msg.set_param(param_prefix + "overflow/high_water", static_cast<uint64_t>(overflow_pool_.high_water()));
+    status_msg.set_param(param_prefix + "overflow/frames_held", overflow_pool_.frames_held());
+  }
+
+  // Rates over the last interval of at least RATE_INTERVAL_S
+  status_msg.set_param(param_prefix + "frame_rate", frame_rate_);
+  status_msg.set_param(param_prefix + "data_rate_mb", data_rate_mb_);
+
+  // Time spent in process_message, in bins doubling from 1us, the last holding everything longer
+  for (size_t bin = 0; bin < process_time_.num_bins; bin++) {
+    status_msg.set_param(param_prefix + "process_time_us/" + process_time_.label(bin), process_time_.count(bin));
+  }
+  status_msg.set_param(param_prefix + "process_time_max_us", process_time_.max_us());
+}
+
+/**
+ * Reset the statistics, including those of the current acquisition
+ */
+void EigerFrameDecoder::reset_statistics(void)
+{
+  FrameDecoder::reset_statistics();
+  frames_allocated_ = 0;
+  start_acquisition_statistics();
 }
 
 void EigerFrameDecoder::request_configuration(const std::string param_prefix,
@@ -553,6 +1469,12 @@ void EigerFrameDecoder::request_configuration(const std::string param_prefix,
 
   // Add current configuration parameters to reply
   config_reply.set_param(param_prefix + CONFIG_DETECTOR_MODEL, detector_model_);
+  config_reply.set_param(param_prefix + CONFIG_STREAM_PROTOCOL, stream_protocol_);
+  config_reply.set_param(param_prefix + CONFIG_SHARED_TRANSPORT, shared_transport_name_);
+  config_reply.set_param(param_prefix + CONFIG_SHARED_BUFFER_NAME, shared_buffer_name_);
+  config_reply.set_param(param_prefix + CONFIG_CONTROL_LANE, control_lane_endpoint_);
+  config_reply.set_param(param_prefix + CONFIG_OVERFLOW_FRAMES, static_cast<unsigned int>(overflow_frames_));
+  config_reply.set_param(param_prefix + CONFIG_PAYLOAD_ALIGNMENT, static_cast<unsigned int>(payload_alignment_));
 }
 
 int EigerFrameDecoder::get_version_major()
@@ -19,6 +19,8 @@ using namespace log4cxx::helpers;
 
 #include <zmq/zmq.hpp>
 
+#include "EigerDefinitions.h"
+
 namespace FrameSimulator {
 
     /** EigerFrameSimulatorPlugin
@@ -56,6 +58,10 @@ namespace FrameSimulator {
         void sendEndOfSeries(zmq::socket_t& sender);
         void sendImageData(zmq::socket_t& sender, std::string file_pattern, int frames, int hertz);
         void SendFileMessage(zmq::socket_t &socket, std::string filePath, bool more);
+        void SendFileMessages(zmq::socket_t &socket, Eiger::EigerMessageParentType type, bool appendix, int &file_number);
+        void sendStream2Header(zmq::socket_t& sender, std::string acq_id);
+        void sendStream2EndOfSeries(zmq::socket_t& sender);
+        void sendStream2ImageData(zmq::socket_t& sender, std::string file_pattern, int frames, int hertz);
         std::string getSingleLineFromFile(std::string file);
 
         boost::optional<std::string> filepath;
@@ -64,6 +70,7 @@ namespace FrameSimulator {
         int delay_adjustment;
         std::vector<std::string> dest_ports;
         bool stream;
+        std::string protocol;
 
     };
 
@@ -15,6 +15,9 @@
 #include <unistd.h>
 
 #include "version.h"
+#include "EigerDefinitions.h"
+#include "EigerProtocol.h"
+#include "Stream2Cbor.h"
 
 #include <stdlib.h>
 #include <iostream>
@@ -62,6 +65,7 @@ namespace FrameSimulator {
       opt_filepattern.add_option_to(config);
       opt_delay.add_option_to(config);
       opt_stream.add_option_to(config);
+      opt_protocol.add_option_to(config);
 
     }
 
@@ -107,6 +111,12 @@ namespace FrameSimulator {
       filepattern = opt_filepattern.get_val(vm);
       acquisitionID = opt_acqid.get_val(vm);
       delay_adjustment = opt_delay.get_val(vm);
+      protocol = opt_protocol.get_val(vm);
+
+      if (protocol != Eiger::STREAM_PROTOCOL_LEGACY && protocol != Eiger::STREAM_PROTOCOL_STREAM2) {
+        LOG4CXX_ERROR(logger_, "Unknown stream protocol " << protocol);
+        return false;
+      }
 
       set_list_option(opt_ports.get_val(vm), dest_ports);
 
@@ -140,7 +150,22 @@ namespace FrameSimulator {
 
       LOG4CXX_INFO(logger_, "Sending messages...");
 
-      if(!stream) {
+      if (!stream && protocol == Eiger::STREAM_PROTOCOL_STREAM2) {
+
+        std::cout << "Socket bound, press enter to send start message..." << std::endl;
+        getchar();
+        sendStream2Header(socket, acquisitionID);
+
+        std::cout << "Press enter to send data..." << std::endl;
+        getchar();
+        double hertz = 1 / frame_gap_secs_.get();
+        sendStream2ImageData(socket, filepattern, replay_numframes_.get(), hertz);
+
+        sendStream2EndOfSeries(socket);
+
+      }
+
+      else if(!stream) {
 
         std::cout << "Socket bound, press enter to send header..." << std::endl;
         getchar();
@@ -158,33 +183,13 @@ namespace FrameSimulator {
       else {
 
         // Example use for system test data. Replace with the path to actual files.
-        SendFileMessage(socket, "streamfile_1", true);  // Global Header
-        SendFileMessage(socket, "streamfile_2", true);  // Global Header Config.
-        SendFileMessage(socket, "streamfile_3", true);  // Flatfield Header
-        SendFileMessage(socket, "streamfile_4", true);  // Flatfield data blob
-        SendFileMessage(socket, "streamfile_5", true);  // Pixelmask header
-        SendFileMessage(socket, "streamfile_6", true);  // Pixelmask data blob
-        SendFileMessage(socket, "streamfile_7", true);  // Countrate header
-        SendFileMessage(socket, "streamfile_8", true);  // Countrate data blob
-        SendFileMessage(socket, "streamfile_9",
-                        false); // Global Header Appendix. 'more' set to false as is the last message in a multipart message
-
-        SendFileMessage(socket, "streamfile_10", true);  // Image data header
-        SendFileMessage(socket, "streamfile_11", true);  // Image data dimensions
-        SendFileMessage(socket, "streamfile_12", true);  // Image data blob
-        SendFileMessage(socket, "streamfile_13", false); // Image data times.
-
-        SendFileMessage(socket, "streamfile_14", true);  // Image data header
-        SendFileMessage(socket, "streamfile_15", true);  // Image data dimensions
-        SendFileMessage(socket, "streamfile_16", true);  // Image data blob
-        SendFileMessage(socket, "streamfile_17", false); // Image data times.
-
-        SendFileMessage(socket, "streamfile_18", true);  // Image data header
-        SendFileMessage(socket, "streamfile_19", true);  // Image data dimensions
-        SendFileMessage(socket, "streamfile_20", true);  // Image data blob
-        SendFileMessage(socket, "streamfile_21", false); // Image data times.
-
-        SendFileMessage(socket, "streamfile_22", false); // End message
+        // The files hold a global header with 'all' detail and an appendix, three images and an end message
+        int file_number = 1;
+        SendFileMessages(socket, Eiger::PARENT_MESSAGE_TYPE_GLOBAL, true, file_number);
+        for (int image = 0; image < 3; image++) {
+          SendFileMessages(socket, Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA, false, file_number);
+        }
+        SendFileMessages(socket, Eiger::PARENT_MESSAGE_TYPE_END, false, file_number);
 
       }
 
@@ -225,6 +230,23 @@ namespace FrameSimulator {
       }
     }
 
+    /** Send a message read from consecutively numbered files, one per part
+     * @param socket - 0MQ socket
+     * @param type - type of message, which gives its parts
+     * @param appendix - whether the message has an appendix part
+     * @param file_number - number of the file holding the first part, updated to the number after the last part
+     */
+    void EigerFrameSimulatorPlugin::SendFileMessages(zmq::socket_t &socket, Eiger::EigerMessageParentType type,
+                                                     bool appendix, int &file_number) {
+
+      int num_parts = Eiger::NumMessageParts(type) + (appendix ? 1 : 0);
+      for (int part = 1; part <= num_parts; part++) {
+        LOG4CXX_DEBUG(logger_, "Sending " << Eiger::GetPartSpec(type, part).name << " part from streamfile_" << file_number);
+        SendFileMessage(socket, "streamfile_" + boost::lexical_cast<std::string>(file_number), part < num_parts);
+        file_number++;
+      }
+    }
+
     /** Send the header
      * @param sender - 0MQ socket
      * @param acq_id - acquisition id
@@ -427,6 +449,176 @@ namespace FrameSimulator {
       LOG4CXX_DEBUG(logger_, "Sent End Of Series");
     }
 
+    /** Send a stream2 start message
+     * @param sender - 0MQ socket
+     * @param acq_id - acquisition id, sent as the series unique id
+     */
+    void EigerFrameSimulatorPlugin::sendStream2Header(zmq::socket_t &sender, std::string acq_id) {
+
+      LOG4CXX_INFO(logger_, "Sending stream2 start message");
+
+      Eiger::CborWriter cbor;
+      cbor.write_tag(Eiger::CBOR_TAG_SELF_DESCRIBE);
+      cbor.write_map(5);
+      cbor.write_text(Eiger::STREAM2_TYPE_KEY);
+      cbor.write_text(Eiger::STREAM2_START_TYPE);
+      cbor.write_text(Eiger::STREAM2_SERIES_ID_KEY);
+      cbor.write_uint(1);
+      cbor.write_text(Eiger::STREAM2_SERIES_UNIQUE_ID_KEY);
+      cbor.write_text(acq_id);
+      cbor.write_text("auto_summation");
+      cbor.write_head(Eiger::CBOR_SIMPLE, 21);  // true
+      cbor.write_text("incident_energy");
+      cbor.write_uint(12658);
+
+      zmq::message_t message(cbor.str().size());
+      memcpy(message.data(), cbor.str().data(), cbor.str().size());
+      sender.send(message);
+
+      LOG4CXX_INFO(logger_, "Sent stream2 start message");
+    }
+
+    /** Send the image data as stream2 image messages
+     *
+     * The same legacy stream files as sendImageData are used; the dimensions, blob and
+     * times parts are repackaged into a single CBOR message per frame.
+     *
+     * @param sender - 0MQ socket
+     * @param file_pattern - data in files <file_pattern>_2, <file_pattern>_3, <file_pattern>_4
+     * @param frames - the number of times to send the image data
+     * @param hertz - frequency at which the frames are sent
+     */
+    void EigerFrameSimulatorPlugin::sendStream2ImageData(zmq::socket_t &sender, std::string file_pattern, int frames, int hertz) {
+
+      LOG4CXX_INFO(logger_, "Sending stream2 Image Data (" + boost::lexical_cast<std::string>(frames) + " frames at " +
+                            boost::lexical_cast<std::string>(hertz) + " Hertz)");
+
+      std::string mdata_file = file_pattern + "_2";
+      std::string image_file = file_pattern + "_3";
+      std::string times_file = file_pattern + "_4";
+
+      if (filepath) {
+        mdata_file.insert(0, filepath.get() + "/");
+        image_file.insert(0, filepath.get() + "/");
+        times_file.insert(0, filepath.get() + "/");
+      }
+
+      std::ifstream file(image_file.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+      if (!file.is_open()) {
+        LOG4CXX_ERROR(logger_, "Unable to open file " + image_file);
+        return;
+      }
+      std::string blob(file.tellg(), '\0');
+      file.seekg(0, std::ios::beg);
+      file.read(&blob[0], blob.size());
+      file.close();
+
+      LOG4CXX_INFO(logger_, "Size of data: " + boost::lexical_cast<std::string>(blob.size()) + " bytes");
+
+      rapidjson::Document dimensions;
+      dimensions.Parse(getSingleLineFromFile(mdata_file).c_str());
+      rapidjson::Document times;
+      times.Parse(getSingleLineFromFile(times_file).c_str());
+      if (dimensions.HasParseError() || times.HasParseError()) {
+        LOG4CXX_ERROR(logger_, "Unable to parse image dimensions or times");
+        return;
+      }
+
+      uint64_t width = dimensions[Eiger::SHAPE_KEY.c_str()][0].GetUint64();
+      uint64_t height = dimensions[Eiger::SHAPE_KEY.c_str()][1].GetUint64();
+      std::string type = dimensions[Eiger::DATA_TYPE_KEY.c_str()].GetString();
+      std::string encoding = dimensions[Eiger::ENCODING_KEY.c_str()].GetString();
+
+      uint64_t typed_array_tag = Eiger::CBOR_TAG_UINT32_LE;
+      uint64_t element_size = 4;
+      if (type == "uint8") {
+        typed_array_tag = Eiger::CBOR_TAG_UINT8;
+        element_size = 1;
+      } else if (type == "uint16") {
+        typed_array_tag = Eiger::CBOR_TAG_UINT16_LE;
+        element_size = 2;
+      }
+
+      double delay = 1 / (double) hertz;
+      double nanosec = delay * 1000000000;
+      if (nanosec > delay_adjustment) {
+        nanosec -= delay_adjustment;
+      }
+      struct timespec timeOut, remains;
+      timeOut.tv_sec = nanosec / 1000000000;
+      timeOut.tv_nsec = ((int) nanosec) % 1000000000;
+
+      for (int image_id = 0; image_id < frames; image_id++) {
+        // The image blob is the last entry so the message is the encoded fields followed by the blob
+        Eiger::CborWriter cbor;
+        cbor.write_tag(Eiger::CBOR_TAG_SELF_DESCRIBE);
+        cbor.write_map(7);
+        cbor.write_text(Eiger::STREAM2_TYPE_KEY);
+        cbor.write_text(Eiger::STREAM2_IMAGE_TYPE);
+        cbor.write_text(Eiger::STREAM2_SERIES_ID_KEY);
+        cbor.write_uint(1);
+        cbor.write_text(Eiger::STREAM2_IMAGE_ID_KEY);
+        cbor.write_uint(image_id);
+        cbor.write_text(Eiger::START_TIME_KEY);
+        cbor.write_rational(times[Eiger::START_TIME_KEY.c_str()].GetUint64(), 1000000000);
+        cbor.write_text(Eiger::STOP_TIME_KEY);
+        cbor.write_rational(times[Eiger::STOP_TIME_KEY.c_str()].GetUint64(), 1000000000);
+        cbor.write_text(Eiger::REAL_TIME_KEY);
+        cbor.write_rational(times[Eiger::REAL_TIME_KEY.c_str()].GetUint64(), 1000000000);
+        cbor.write_text(Eiger::STREAM2_DATA_KEY);
+        cbor.write_map(1);
+        cbor.write_text("threshold_1");
+        cbor.write_tag(Eiger::CBOR_TAG_MULTI_DIM_ARRAY);
+        cbor.write_array(2);
+        cbor.write_array(2);
+        cbor.write_uint(height);
+        cbor.write_uint(width);
+        cbor.write_tag(typed_array_tag);
+        if (encoding.find("lz4") != std::string::npos) {
+          cbor.write_tag(Eiger::CBOR_TAG_DECTRIS_COMPRESSION);
+          cbor.write_array(3);
+          if (encoding.find("bs") != std::string::npos) {
+            cbor.write_text(Eiger::STREAM2_COMPRESSION_BSLZ4);
+          } else {
+            cbor.write_text(Eiger::STREAM2_COMPRESSION_LZ4);
+          }
+          cbor.write_uint(element_size);
+        }
+        cbor.write_bytes_head(blob.size());
+
+        zmq::message_t message(cbor.str().size() + blob.size());
+        memcpy(message.data(), cbor.str().data(), cbor.str().size());
+        memcpy(static_cast<char*>(message.data()) + cbor.str().size(), blob.data(), blob.size());
+        sender.send(message);
+
+        nanosleep(&timeOut, &remains);
+      }
+
+      LOG4CXX_INFO(logger_, "Sent stream2 Image Data");
+    }
+
+    /** Send a stream2 end message
+     * @param sender - 0MQ socket
+     */
+    void EigerFrameSimulatorPlugin::sendStream2EndOfSeries(zmq::socket_t &sender) {
+
+      LOG4CXX_DEBUG(logger_, "Sending stream2 end message");
+
+      Eiger::CborWriter cbor;
+      cbor.write_tag(Eiger::CBOR_TAG_SELF_DESCRIBE);
+      cbor.write_map(2);
+      cbor.write_text(Eiger::STREAM2_TYPE_KEY);
+      cbor.write_text(Eiger::STREAM2_END_TYPE);
+      cbor.write_text(Eiger::STREAM2_SERIES_ID_KEY);
+      cbor.write_uint(1);
+
+      zmq::message_t message(cbor.str().size());
+      memcpy(message.data(), cbor.str().data(), cbor.str().size());
+      sender.send(message);
+
+      LOG4CXX_DEBUG(logger_, "Sent stream2 end message");
+    }
+
     /**
      * Get the plugin major version number.
      *
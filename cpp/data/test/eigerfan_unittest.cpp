@@ -6,6 +6,8 @@
 #define BOOST_TEST_MAIN
 
 #include <iostream>
+#include <map>
+#include <new>
 #include <string>
 #include <boost/test/unit_test.hpp>
 #include <boost/shared_ptr.hpp>
@@ -16,6 +18,21 @@
 #include <log4cxx/simplelayout.h>
 #include "zmq/zmq.hpp"
 #include "EigerFan.h"
+#include "EigerProtocol.h"
+#include "Stream2Cbor.h"
+#include "ControlLane.h"
+#include "MessageQueue.h"
+#include "MultiPullBroker.h"
+#include "SharedFrameWriter.h"
+#include "FanCoordinator.h"
+#include "FrameCompressor.h"
+#include "OverflowStore.h"
+#include "SendBudget.h"
+#include "ZmtpFrameParser.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <EigerFan.h>
 
@@ -1011,5 +1028,1109 @@ BOOST_AUTO_TEST_CASE( EigerFanTestCheckFanSendsAcquisitionID )
   eigerfanThread.join();
 }
 
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckStream2Parse )
+{
+  // Build a stream2 image message with a bslz4 compressed uint16 image
+  std::string blob("COMPRESSEDBLOB");
+  Eiger::CborWriter cbor;
+  cbor.write_tag(Eiger::CBOR_TAG_SELF_DESCRIBE);
+  cbor.write_map(5);
+  cbor.write_text("type");
+  cbor.write_text("image");
+  cbor.write_text("series_id");
+  cbor.write_uint(3);
+  cbor.write_text("image_id");
+  cbor.write_uint(1234);
+  cbor.write_text("start_time");
+  cbor.write_rational(5, 1000);
+  cbor.write_text("data");
+  cbor.write_map(1);
+  cbor.write_text("threshold_1");
+  cbor.write_tag(Eiger::CBOR_TAG_MULTI_DIM_ARRAY);
+  cbor.write_array(2);
+  cbor.write_array(2);
+  cbor.write_uint(1065);
+  cbor.write_uint(1030);
+  cbor.write_tag(Eiger::CBOR_TAG_UINT16_LE);
+  cbor.write_tag(Eiger::CBOR_TAG_DECTRIS_COMPRESSION);
+  cbor.write_array(3);
+  cbor.write_text("bslz4");
+  cbor.write_uint(2);
+  cbor.write_bytes(blob.c_str(), blob.size());
+  std::string message = cbor.str();
+
+  Eiger::Stream2Message stream2;
+  BOOST_REQUIRE(Eiger::ParseStream2Message(message.data(), message.size(), stream2));
+  BOOST_CHECK_EQUAL(Eiger::STREAM2_IMAGE, stream2.type);
+  BOOST_CHECK_EQUAL(3, stream2.series_id);
+  BOOST_CHECK_EQUAL(1234, stream2.image_id);
+  BOOST_CHECK_EQUAL(5000000, stream2.start_time);
+  BOOST_CHECK_EQUAL(1030, stream2.shape[0]);
+  BOOST_CHECK_EQUAL(1065, stream2.shape[1]);
+  BOOST_CHECK_EQUAL(std::string("uint16"), stream2.data_type);
+  BOOST_CHECK_EQUAL(std::string("bs16-lz4<"), Eiger::Stream2Encoding(stream2));
+  // The payload is located in place at the end of the message
+  BOOST_CHECK_EQUAL(blob.size(), stream2.data_size);
+  BOOST_CHECK_EQUAL(message.size() - blob.size(), stream2.data - reinterpret_cast<const uint8_t*>(message.data()));
+
+  // Truncated messages are rejected
+  BOOST_CHECK(!Eiger::ParseStream2Message(message.data(), message.size() - 1, stream2));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckStream2ParseStart )
+{
+  // Build a stream2 start message with a pixel mask, flatfield and countrate table
+  uint32_t mask[6] = {0, 1, 0, 0, 4, 0};
+  float flatfield[6] = {1.0, 1.5, 1.0, 1.0, 0.5, 1.0};
+  uint32_t countrate[4] = {0, 10, 21, 33};
+  Eiger::CborWriter cbor;
+  cbor.write_tag(Eiger::CBOR_TAG_SELF_DESCRIBE);
+  cbor.write_map(12);
+  cbor.write_text("type");
+  cbor.write_text("start");
+  cbor.write_text("series_id");
+  cbor.write_uint(7);
+  cbor.write_text("beam_center_x");
+  cbor.write_double(2000.5);
+  cbor.write_text("incident_wavelength");
+  cbor.write_double(0.9);
+  cbor.write_text("number_of_images");
+  cbor.write_uint(100);
+  cbor.write_text("detector_description");
+  cbor.write_text("Dectris EIGER2 Si 16M");
+  cbor.write_text("detector_translation");
+  cbor.write_array(3);
+  cbor.write_double(0.0);
+  cbor.write_double(0.0);
+  cbor.write_double(0.25);
+  cbor.write_text("threshold_energy");
+  cbor.write_map(1);
+  cbor.write_text("threshold_1");
+  cbor.write_double(6000.0);
+  cbor.write_text("flatfield_enabled");
+  cbor.write_bool(true);
+  cbor.write_text("pixel_mask");
+  cbor.write_map(1);
+  cbor.write_text("threshold_1");
+  cbor.write_tag(Eiger::CBOR_TAG_MULTI_DIM_ARRAY);
+  cbor.write_array(2);
+  cbor.write_array(2);
+  cbor.write_uint(2);
+  cbor.write_uint(3);
+  cbor.write_tag(Eiger::CBOR_TAG_UINT32_LE);
+  cbor.write_bytes(mask, sizeof(mask));
+  cbor.write_text("flatfield");
+  cbor.write_map(1);
+  cbor.write_text("threshold_1");
+  cbor.write_tag(Eiger::CBOR_TAG_MULTI_DIM_ARRAY);
+  cbor.write_array(2);
+  cbor.write_array(2);
+  cbor.write_uint(2);
+  cbor.write_uint(3);
+  cbor.write_tag(Eiger::CBOR_TAG_FLOAT32_LE);
+  cbor.write_bytes(flatfield, sizeof(flatfield));
+  cbor.write_text("countrate_correction_lookup_table");
+  cbor.write_tag(Eiger::CBOR_TAG_UINT32_LE);
+  cbor.write_bytes(countrate, sizeof(countrate));
+  std::string message = cbor.str();
+
+  Eiger::Stream2Start start;
+  BOOST_REQUIRE(Eiger::ParseStream2Start(message.data(), message.size(), start));
+  BOOST_CHECK_EQUAL(7, start.series_id);
+
+  // Config entries are kept under their legacy names, with the distance from the translation
+  std::map<std::string, Eiger::Stream2ConfigEntry> config;
+  for (size_t i = 0; i < start.config.size(); i++) {
+    config[start.config[i].key] = start.config[i];
+  }
+  BOOST_REQUIRE_EQUAL(8, config.size());
+  BOOST_CHECK_EQUAL(2000.5, config["beam_center_x"].numbers[0]);
+  BOOST_CHECK(!config["beam_center_x"].integer);
+  BOOST_CHECK_EQUAL(0.9, config["wavelength"].numbers[0]);
+  BOOST_CHECK_EQUAL(100, config["nimages"].numbers[0]);
+  BOOST_CHECK(config["nimages"].integer);
+  BOOST_CHECK_EQUAL("Dectris EIGER2 Si 16M", config["description"].text);
+  BOOST_CHECK_EQUAL(Eiger::STREAM2_VALUE_ARRAY, config["detector_translation"].type);
+  BOOST_CHECK_EQUAL(3, config["detector_translation"].numbers.size());
+  BOOST_CHECK_EQUAL(Eiger::STREAM2_VALUE_NUMBER, config["detector_distance"].type);
+  BOOST_CHECK_EQUAL(0.25, config["detector_distance"].numbers[0]);
+  BOOST_CHECK_EQUAL(6000.0, config["threshold_energy"].numbers[0]);
+  BOOST_CHECK(config["flatfield_correction_applied"].flag);
+
+  // The arrays are located in place, the countrate table given a second dimension of 1
+  BOOST_CHECK_EQUAL(3, start.pixel_mask.shape[0]);
+  BOOST_CHECK_EQUAL(2, start.pixel_mask.shape[1]);
+  BOOST_CHECK_EQUAL(std::string("uint32"), start.pixel_mask.data_type);
+  BOOST_CHECK_EQUAL(sizeof(mask), start.pixel_mask.data_size);
+  BOOST_CHECK(memcmp(mask, start.pixel_mask.data, sizeof(mask)) == 0);
+  BOOST_CHECK_EQUAL(std::string("float32"), start.flatfield.data_type);
+  BOOST_CHECK(memcmp(flatfield, start.flatfield.data, sizeof(flatfield)) == 0);
+  BOOST_CHECK_EQUAL(4, start.countrate.shape[0]);
+  BOOST_CHECK_EQUAL(1, start.countrate.shape[1]);
+  BOOST_CHECK(memcmp(countrate, start.countrate.data, sizeof(countrate)) == 0);
+
+  // Image messages and truncated starts are rejected
+  BOOST_CHECK(!Eiger::ParseStream2Start(message.data(), message.size() - 1, start));
+  Eiger::CborWriter image;
+  image.write_map(2);
+  image.write_text("type");
+  image.write_text("image");
+  image.write_text("series_id");
+  image.write_uint(7);
+  BOOST_CHECK(!Eiger::ParseStream2Start(image.str().data(), image.str().size(), start));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckControlLaneInbox )
+{
+  // Fences are recognised by their prefix
+  uint64_t sequence = 0;
+  std::string fence = Eiger::FENCE_MESSAGE_PREFIX + "42}";
+  BOOST_CHECK(Eiger::ParseFence(fence.data(), fence.size(), sequence));
+  BOOST_CHECK_EQUAL(42, sequence);
+  std::string header("{\"htype\":\"dheader-1.0\",\"series\":1}");
+  BOOST_CHECK(!Eiger::ParseFence(header.data(), header.size(), sequence));
+  BOOST_CHECK(!Eiger::ParseFence(Eiger::FENCE_MESSAGE_PREFIX.data(), Eiger::FENCE_MESSAGE_PREFIX.size(), sequence));
+
+  Eiger::ControlLaneInbox inbox;
+  Eiger::ControlLaneInbox::Message message(1, boost::shared_ptr<zmq::message_t>(new zmq::message_t(4)));
+  Eiger::ControlLaneInbox::Message taken;
+
+  // Messages are applied at their own fence, whatever order they arrive in
+  BOOST_CHECK(inbox.add(2, message));
+  BOOST_CHECK(inbox.add(1, message));
+  BOOST_CHECK(!inbox.should_wait(1));
+  BOOST_CHECK(inbox.take(1, taken));
+  BOOST_CHECK_EQUAL(1, taken.size());
+  BOOST_CHECK(inbox.take(2, taken));
+  BOOST_CHECK_EQUAL(2, inbox.applied());
+  BOOST_CHECK_EQUAL(0, inbox.pending());
+
+  // A fence reached before its message is waited for once, then missed
+  BOOST_CHECK(inbox.should_wait(3));
+  BOOST_CHECK(!inbox.take(3, taken));
+  BOOST_CHECK_EQUAL(1, inbox.missed());
+  BOOST_CHECK(inbox.stalled());
+  // Later fences are not waited for while the lane is stalled
+  BOOST_CHECK(!inbox.should_wait(4));
+  BOOST_CHECK(!inbox.take(4, taken));
+  BOOST_CHECK_EQUAL(2, inbox.missed());
+
+  // A message arriving after its fence is discarded, but shows the lane is delivering again
+  BOOST_CHECK(!inbox.add(3, message));
+  BOOST_CHECK_EQUAL(1, inbox.discarded());
+  BOOST_CHECK(!inbox.stalled());
+  BOOST_CHECK(inbox.should_wait(5));
+
+  // A message whose fence never arrives is discarded when a later fence is reached
+  BOOST_CHECK(inbox.add(5, message));
+  BOOST_CHECK(inbox.add(6, message));
+  BOOST_CHECK(inbox.take(6, taken));
+  BOOST_CHECK_EQUAL(2, inbox.discarded());
+  BOOST_CHECK_EQUAL(3, inbox.applied());
+  BOOST_CHECK_EQUAL(0, inbox.pending());
+
+  // A new connection starts the sequence again
+  inbox.clear();
+  BOOST_CHECK(inbox.add(1, message));
+  BOOST_CHECK(inbox.take(1, taken));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckZmtpFrameParser )
+{
+  // A short frame with more to follow, a long frame, a PING command and an empty last frame
+  std::string long_body(300, '\0');
+  for (size_t i = 0; i < long_body.size(); i++) {
+    long_body[i] = static_cast<char>(i);
+  }
+  std::string ping("\x04PING\x00\x0a" "ab", 9);
+  std::string stream;
+  stream += std::string("\x01\x05" "hello", 7);
+  stream += std::string("\x03\x00\x00\x00\x00\x00\x00\x01\x2c", 9) + long_body;
+  stream += std::string("\x04\x09", 2) + ping;
+  stream += std::string("\x00\x00", 2);
+
+  // The frames are the same however the bytes are split up as they are received
+  size_t chunk_sizes[] = {stream.size(), 7, 1};
+  for (size_t c = 0; c < 3; c++) {
+    ZmtpFrameParser parser;
+    std::vector<std::string> frames;
+    std::vector<bool> more;
+    int started = 0;
+    for (size_t offset = 0; offset < stream.size(); offset += chunk_sizes[c]) {
+      const uint8_t* data = reinterpret_cast<const uint8_t*>(stream.data()) + offset;
+      size_t length = std::min(chunk_sizes[c], stream.size() - offset);
+      while (length > 0) {
+        ZmtpFrameParser::Event event = parser.parse(data, length);
+        if (event == ZmtpFrameParser::PARSE_FRAME_STARTED) {
+          started++;
+        } else if (event == ZmtpFrameParser::PARSE_FRAME_COMPLETE) {
+          if (parser.command()) {
+            frames.push_back("command:" + parser.command_body());
+          } else {
+            frames.push_back(std::string(static_cast<char*>(parser.body()->data()), parser.body()->size()));
+          }
+          more.push_back(parser.more());
+          parser.reset();
+        }
+      }
+    }
+    BOOST_CHECK(parser.idle());
+    BOOST_CHECK_EQUAL(3, started);
+    BOOST_REQUIRE_EQUAL(4, frames.size());
+    BOOST_CHECK_EQUAL("hello", frames[0]);
+    BOOST_CHECK(more[0]);
+    BOOST_CHECK(long_body == frames[1]);
+    BOOST_CHECK(more[1]);
+    BOOST_CHECK("command:" + ping == frames[2]);
+    BOOST_CHECK_EQUAL("", frames[3]);
+    BOOST_CHECK(!more[3]);
+  }
+
+  // The rest of a large body can be received directly into the message
+  ZmtpFrameParser parser;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(stream.data()) + 7;
+  size_t length = 9 + 100;
+  BOOST_REQUIRE_EQUAL(ZmtpFrameParser::PARSE_FRAME_STARTED, parser.parse(data, length));
+  BOOST_CHECK_EQUAL(300, parser.size());
+  BOOST_CHECK_EQUAL(ZmtpFrameParser::PARSE_MORE, parser.parse(data, length));
+  BOOST_CHECK_EQUAL(200, parser.remaining());
+  BOOST_CHECK(parser.in_body());
+  memcpy(parser.body_position(), long_body.data() + 100, 150);
+  BOOST_CHECK(!parser.body_received(150));
+  memcpy(parser.body_position(), long_body.data() + 250, 50);
+  BOOST_CHECK(parser.body_received(50));
+  BOOST_CHECK(long_body == std::string(static_cast<char*>(parser.body()->data()), parser.body()->size()));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckFanSendsStream2 )
+{
+  EigerFanConfig config;
+  config.setStreamProtocol(Eiger::STREAM_PROTOCOL_STREAM2);
+  EigerFan eigerFan(config);
+  boost::thread eigerfanThread(startEigerFan, boost::ref(eigerFan));
+
+  zmq::context_t context (1);
+  zmq::socket_t socket (context, ZMQ_DEALER);
+  socket.connect ("tcp://localhost:5559");
+
+  // Set the acquisition ID
+  std::string acqIDCommand("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"configure\", \"params\": {\"acqid\":\"test_acq_id\"}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  zmq::message_t request (acqIDCommand.size());
+  memcpy (request.data (), acqIDCommand.c_str(), acqIDCommand.size());
+  socket.send (request);
+  zmq::message_t reply;
+  socket.recv (&reply);
+
+  // Now connect a consumer
+  zmq::socket_t receiver(context, ZMQ_PULL);
+  receiver.connect("tcp://localhost:31600");
+
+  // Sleep to give time for 0MQ message to get through and be processed
+  sleep(1);
+
+  // Start up an Emulated Eiger stream
+  zmq::socket_t  eigerStream(context, ZMQ_PUSH);
+  eigerStream.bind("tcp://*:9999");
+
+  Eiger::CborWriter start;
+  start.write_map(2);
+  start.write_text("type");
+  start.write_text("start");
+  start.write_text("series_id");
+  start.write_uint(1);
+
+  Eiger::CborWriter image;
+  image.write_map(3);
+  image.write_text("type");
+  image.write_text("image");
+  image.write_text("series_id");
+  image.write_uint(1);
+  image.write_text("image_id");
+  image.write_uint(324);
+
+  Eiger::CborWriter end;
+  end.write_map(2);
+  end.write_text("type");
+  end.write_text("end");
+  end.write_text("series_id");
+  end.write_uint(1);
+
+  std::vector<std::string> messages;
+  messages.push_back(start.str());
+  messages.push_back(image.str());
+  messages.push_back(end.str());
+
+  int more;
+  size_t more_size = sizeof (more);
+  for (size_t i = 0; i < messages.size(); i++) {
+    zmq::message_t streamMessage(messages[i].size());
+    memcpy (streamMessage.data (), messages[i].data(), messages[i].size());
+    eigerStream.send(streamMessage);
+
+    // The start is announced so the consumer can receive it whatever its size
+    zmq::message_t consumerMessage;
+    if (i == 0) {
+      receiver.recv (&consumerMessage);
+      std::string notice(static_cast<char*>(consumerMessage.data()), consumerMessage.size());
+      BOOST_CHECK_EQUAL(Eiger::SIZE_NOTICE_PREFIX + std::to_string(messages[i].size()) + "}", notice);
+      receiver.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+      BOOST_CHECK_EQUAL(0, more);
+    }
+
+    // Each message is forwarded unmodified behind the acquisition ID
+    receiver.recv (&consumerMessage);
+    std::string acqID(static_cast<char*>(consumerMessage.data()), consumerMessage.size());
+    BOOST_CHECK_EQUAL("test_acq_id", acqID);
+    receiver.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    BOOST_CHECK_EQUAL(1, more);
+
+    receiver.recv (&consumerMessage);
+    std::string cbor(static_cast<char*>(consumerMessage.data()), consumerMessage.size());
+    BOOST_CHECK(messages[i] == cbor);
+    receiver.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    BOOST_CHECK_EQUAL(0, more);
+  }
+
+  // Check the image was counted against the frame number from the CBOR
+  std::string command("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"status\", \"params\": {}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  request.rebuild(command.size());
+  memcpy (request.data (), command.c_str(), command.size());
+  socket.send (request);
+  reply.rebuild();
+  socket.recv (&reply);
+  std::string replyMessage(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"frame\":324") != std::string::npos, replyMessage);
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"frames_sent\":1") != std::string::npos, replyMessage);
+
+  shutdownEigerFan();
+  eigerfanThread.join();
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckAcquisitionIDQueue )
+{
+  EigerFanConfig config;
+  config.setStreamProtocol(Eiger::STREAM_PROTOCOL_STREAM2);
+  EigerFan eigerFan(config);
+  boost::thread eigerfanThread(startEigerFan, boost::ref(eigerFan));
+
+  zmq::context_t context (1);
+  zmq::socket_t socket (context, ZMQ_DEALER);
+  socket.connect ("tcp://localhost:5559");
+
+  // Queue two acquisition IDs, the second with its own offset and block size
+  std::string queueCommand("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"configure\", \"params\": {\"acqid\":\"configured\", \"acqid_queue\":[\"first\", {\"acqid\":\"second\", \"offset\":1, \"block_size\":4}]}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  zmq::message_t request (queueCommand.size());
+  memcpy (request.data (), queueCommand.c_str(), queueCommand.size());
+  socket.send (request);
+  zmq::message_t reply;
+  socket.recv (&reply);
+  std::string replyMessage(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"ack\"") != std::string::npos, replyMessage);
+
+  std::string statusCommand("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"status\", \"params\": {}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  request.rebuild(statusCommand.size());
+  memcpy (request.data (), statusCommand.c_str(), statusCommand.size());
+  socket.send (request);
+  reply.rebuild();
+  socket.recv (&reply);
+  replyMessage.assign(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"acqid_queue\":[{\"acqid\":\"first\"},{\"acqid\":\"second\",\"offset\":1,\"block_size\":4}]") != std::string::npos, replyMessage);
+
+  zmq::socket_t receiver(context, ZMQ_PULL);
+  receiver.connect("tcp://localhost:31600");
+  sleep(1);
+
+  zmq::socket_t  eigerStream(context, ZMQ_PUSH);
+  eigerStream.bind("tcp://*:9999");
+
+  // Each series takes the next acquisition ID, then the configured one once the queue is empty
+  std::vector<std::string> expected;
+  expected.push_back("first");
+  expected.push_back("second");
+  expected.push_back("configured");
+  for (size_t series = 0; series < expected.size(); series++) {
+    Eiger::CborWriter start;
+    start.write_map(2);
+    start.write_text("type");
+    start.write_text("start");
+    start.write_text("series_id");
+    start.write_uint(series + 1);
+
+    Eiger::CborWriter end;
+    end.write_map(2);
+    end.write_text("type");
+    end.write_text("end");
+    end.write_text("series_id");
+    end.write_uint(series + 1);
+
+    std::vector<std::string> messages;
+    messages.push_back(start.str());
+    messages.push_back(end.str());
+    for (size_t i = 0; i < messages.size(); i++) {
+      zmq::message_t streamMessage(messages[i].size());
+      memcpy (streamMessage.data (), messages[i].data(), messages[i].size());
+      eigerStream.send(streamMessage);
+
+      zmq::message_t consumerMessage;
+      if (i == 0) {
+        // Size notice ahead of the start
+        receiver.recv (&consumerMessage);
+      }
+      receiver.recv (&consumerMessage);
+      std::string acqID(static_cast<char*>(consumerMessage.data()), consumerMessage.size());
+      BOOST_CHECK_EQUAL(expected[series], acqID);
+      receiver.recv (&consumerMessage);
+    }
+  }
+
+  request.rebuild(statusCommand.size());
+  memcpy (request.data (), statusCommand.c_str(), statusCommand.size());
+  socket.send (request);
+  reply.rebuild();
+  socket.recv (&reply);
+  replyMessage.assign(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"acqid_queue\":[]") != std::string::npos, replyMessage);
+
+  // The block size of a queued series applied to that series only
+  std::string configCommand("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"request_configuration\", \"params\": {}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  request.rebuild(configCommand.size());
+  memcpy (request.data (), configCommand.c_str(), configCommand.size());
+  socket.send (request);
+  reply.rebuild();
+  socket.recv (&reply);
+  replyMessage.assign(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"block_size\":1,") != std::string::npos, replyMessage);
+
+  shutdownEigerFan();
+  eigerfanThread.join();
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckStallWatchdog )
+{
+  EigerFanConfig config;
+  config.setStreamProtocol(Eiger::STREAM_PROTOCOL_STREAM2);
+  config.setStallTimeout(500);
+  EigerFan eigerFan(config);
+  boost::thread eigerfanThread(startEigerFan, boost::ref(eigerFan));
+
+  zmq::context_t context (1);
+  zmq::socket_t socket (context, ZMQ_DEALER);
+  socket.connect ("tcp://localhost:5559");
+
+  zmq::socket_t receiver(context, ZMQ_PULL);
+  receiver.connect("tcp://localhost:31600");
+  sleep(1);
+
+  zmq::socket_t  eigerStream(context, ZMQ_PUSH);
+  eigerStream.bind("tcp://*:9999");
+
+  Eiger::CborWriter start;
+  start.write_map(2);
+  start.write_text("type");
+  start.write_text("start");
+  start.write_text("series_id");
+  start.write_uint(1);
+
+  Eiger::CborWriter image;
+  image.write_map(3);
+  image.write_text("type");
+  image.write_text("image");
+  image.write_text("series_id");
+  image.write_uint(1);
+  image.write_text("image_id");
+  image.write_uint(0);
+
+  Eiger::CborWriter end;
+  end.write_map(2);
+  end.write_text("type");
+  end.write_text("end");
+  end.write_text("series_id");
+  end.write_uint(1);
+
+  // The stream stops after the first image, so the fan ends the series itself
+  std::vector<std::string> messages;
+  messages.push_back(start.str());
+  messages.push_back(image.str());
+  for (size_t i = 0; i < messages.size(); i++) {
+    zmq::message_t streamMessage(messages[i].size());
+    memcpy (streamMessage.data (), messages[i].data(), messages[i].size());
+    eigerStream.send(streamMessage);
+  }
+  std::vector<Eiger::Stream2MessageType> expectedTypes;
+  expectedTypes.push_back(Eiger::STREAM2_START);
+  expectedTypes.push_back(Eiger::STREAM2_IMAGE);
+  expectedTypes.push_back(Eiger::STREAM2_END);
+  for (size_t i = 0; i < expectedTypes.size(); i++) {
+    zmq::message_t consumerMessage;
+    if (expectedTypes[i] == Eiger::STREAM2_START) {
+      // Size notice ahead of the start
+      receiver.recv (&consumerMessage);
+    }
+    receiver.recv (&consumerMessage);
+    receiver.recv (&consumerMessage);
+    Eiger::Stream2Message parsed;
+    BOOST_REQUIRE(Eiger::ParseStream2Message(consumerMessage.data(), consumerMessage.size(), parsed));
+    BOOST_CHECK(expectedTypes[i] == parsed.type);
+  }
+
+  // The rest of the stalled series is discarded
+  zmq::message_t lateEnd(end.str().size());
+  memcpy (lateEnd.data (), end.str().data(), end.str().size());
+  eigerStream.send(lateEnd);
+  sleep(1);
+
+  std::string statusCommand("{\"msg_type\": \"cmd\", \"id\": 1, \"msg_val\": \"status\", \"params\": {}, \"timestamp\": \"2017-07-03T14:17:58.440432\"}");
+  zmq::message_t request (statusCommand.size());
+  memcpy (request.data (), statusCommand.c_str(), statusCommand.size());
+  socket.send (request);
+  zmq::message_t reply;
+  socket.recv (&reply);
+  std::string replyMessage(static_cast<char*>(reply.data()), reply.size());
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"stalls_detected\":1") != std::string::npos, replyMessage);
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"last_stall_frame\":0") != std::string::npos, replyMessage);
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"late_messages_discarded\":1") != std::string::npos, replyMessage);
+  BOOST_CHECK_MESSAGE(replyMessage.find("\"state\":\"WAITING_STREAM\"") != std::string::npos, replyMessage);
+
+  zmq::message_t noMessage;
+  BOOST_CHECK(!receiver.recv(&noMessage, ZMQ_DONTWAIT));
+
+  shutdownEigerFan();
+  eigerfanThread.join();
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckConsumerIndexForFrame )
+{
+  // A single fan sends blocks of 2 frames to 3 consumers
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForFrame(1, 0, 2, 3));
+  BOOST_CHECK_EQUAL(1, GetConsumerIndexForFrame(2, 0, 2, 3));
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForFrame(6, 0, 2, 3));
+  BOOST_CHECK_EQUAL(1, GetConsumerIndexForFrame(6, 2, 2, 3));
+
+  // Two second tier fans with 3 consumers each behind an upstream fan with 2
+  // consumers and the same block size are equivalent to one fan with 6 consumers
+  for (uint64_t frame = 0; frame < 100; frame++) {
+    int flatRank = GetConsumerIndexForFrame(frame, 1, 2, 6);
+    int upstreamRank = GetConsumerIndexForFrame(frame, 1, 2, 2);
+    int secondTierRank = GetConsumerIndexForFrame(frame, 1, 2, 3, 2, 2);
+    BOOST_CHECK_EQUAL(flatRank, upstreamRank + 2 * secondTierRank);
+  }
+
+  // Upstream blocks are split into sub-blocks across the second tier consumers
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForFrame(0, 0, 5, 4, 20, 2));
+  BOOST_CHECK_EQUAL(3, GetConsumerIndexForFrame(15, 0, 5, 4, 20, 2));
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForFrame(40, 0, 5, 4, 20, 2));
+  BOOST_CHECK_EQUAL(1, GetConsumerIndexForFrame(45, 0, 5, 4, 20, 2));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckConsumerIndexForPhase )
+{
+  // Pumped and unpumped frames alternate, going to ranks 0-1 and 2-3 in blocks of 2
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForPhase(0, 0, 2, 4, 2));
+  BOOST_CHECK_EQUAL(2, GetConsumerIndexForPhase(1, 0, 2, 4, 2));
+  BOOST_CHECK_EQUAL(0, GetConsumerIndexForPhase(2, 0, 2, 4, 2));
+  BOOST_CHECK_EQUAL(1, GetConsumerIndexForPhase(4, 0, 2, 4, 2));
+  BOOST_CHECK_EQUAL(3, GetConsumerIndexForPhase(7, 0, 2, 4, 2));
+  BOOST_CHECK_EQUAL(2, GetConsumerIndexForPhase(9, 0, 2, 4, 2));
+
+  // Within a group, frames of a phase are distributed as by a fan of their own
+  for (uint64_t frame = 0; frame < 100; frame++) {
+    int phase = frame % 3;
+    int groupRank = GetConsumerIndexForFrame(frame / 3, 1, 2, 2);
+    BOOST_CHECK_EQUAL(phase * 2 + groupRank, GetConsumerIndexForPhase(frame, 1, 2, 6, 3));
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckMessageQueue )
+{
+  // Capacity is rounded up to a power of 2
+  MessageQueue queue(3);
+  BOOST_CHECK_EQUAL(4, queue.capacity());
+  BOOST_CHECK(queue.pop(10) == NULL);
+
+  // Fill the queue from several producers
+  std::vector<boost::shared_ptr<boost::thread> > producers;
+  for (int i = 0; i < 4; i++) {
+    producers.push_back(boost::shared_ptr<boost::thread>(
+      new boost::thread(boost::bind(&MessageQueue::try_push, &queue, new MultipartMessage()))
+    ));
+  }
+  for (int i = 0; i < 4; i++) {
+    producers[i]->join();
+  }
+  BOOST_CHECK_EQUAL(4, queue.depth());
+  BOOST_CHECK_EQUAL(4, queue.max_depth());
+  MultipartMessage extra;
+  BOOST_CHECK(!queue.try_push(&extra));
+
+  // Parts come back out in order
+  MultipartMessage* message = queue.pop(10);
+  BOOST_REQUIRE(message != NULL);
+  delete message;
+  BOOST_CHECK_EQUAL(3, queue.depth());
+  message = new MultipartMessage();
+  std::string part1("part1"), part2("part2");
+  boost::shared_ptr<zmq::message_t> zpart1(new zmq::message_t(part1.size()));
+  memcpy(zpart1->data(), part1.c_str(), part1.size());
+  boost::shared_ptr<zmq::message_t> zpart2(new zmq::message_t(part2.size()));
+  memcpy(zpart2->data(), part2.c_str(), part2.size());
+  message->add(zpart1);
+  message->add(zpart2);
+  BOOST_CHECK(queue.try_push(message));
+  for (int i = 0; i < 3; i++) {
+    delete queue.pop(10);
+  }
+  message = queue.pop(10);
+  BOOST_REQUIRE(message != NULL);
+  BOOST_CHECK_EQUAL(10, message->bytes());
+  zmq::message_t part;
+  BOOST_CHECK_EQUAL(1, message->more());
+  BOOST_CHECK(message->recv(&part));
+  BOOST_CHECK_EQUAL(part1, std::string(static_cast<char*>(part.data()), part.size()));
+  BOOST_CHECK(message->recv(&part));
+  BOOST_CHECK_EQUAL(part2, std::string(static_cast<char*>(part.data()), part.size()));
+  BOOST_CHECK_EQUAL(0, message->more());
+  BOOST_CHECK(!message->recv(&part));
+  delete message;
+
+  BOOST_CHECK_EQUAL(0, queue.depth());
+  queue.reset_max_depth();
+  BOOST_CHECK_EQUAL(0, queue.max_depth());
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckMultiPullBrokerBounds )
+{
+  MessageQueue queue(16);
+  MultiPullBroker broker(1);
+  std::string endpoint("tcp://127.0.0.1:31602");
+  broker.connect(endpoint, &queue);
+  BOOST_CHECK_EQUAL(1, broker.worker_count());
+
+  // Invalid bounds are rejected and leave the pool alone
+  BOOST_CHECK(!broker.set_thread_bounds(0, 2));
+  BOOST_CHECK(!broker.set_thread_bounds(3, 2));
+
+  // With no data arriving the pool sits at the minimum, so raising it grows the pool
+  BOOST_CHECK(broker.set_thread_bounds(3, 4));
+  for (int i = 0; i < 40 && broker.worker_count() != 3; i++) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+  BOOST_CHECK_EQUAL(3, broker.worker_count());
+
+  // Lowering the maximum below the pool size retires workers straight away
+  BOOST_CHECK(broker.set_thread_bounds(1, 2));
+  for (int i = 0; i < 40 && broker.worker_count() != 2; i++) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+  BOOST_CHECK_EQUAL(2, broker.worker_count());
+
+  broker.shutdown();
+}
+
+static void PushAfterDelay(MessageQueue* queue)
+{
+  // Late enough that the consumer is already spinning or blocked in pop
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  queue->try_push(new MultipartMessage());
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckSpinFallback )
+{
+  // The io_uring engine has neither a worker pool to resize nor workers to spin or pin
+  UringZmtpIngest uring(1);
+  BOOST_CHECK(!uring.set_spin(100));
+  BOOST_CHECK(!uring.set_cpus(std::vector<int>(1, 0)));
+  BOOST_CHECK(!uring.set_thread_bounds(1, 2));
+  BOOST_CHECK_EQUAL(0, uring.spin_hits());
+
+  MultiPullBroker broker(1);
+  BOOST_CHECK(broker.set_spin(100));
+  BOOST_CHECK(broker.set_cpus(std::vector<int>()));
+
+  // The fan sets the spin count on construction whichever engine it ends up with
+  EigerFanConfig config;
+  config.setIngestEngine(Eiger::INGEST_ENGINE_IO_URING);
+  config.setSpinCount(100);
+  EigerFan eigerFan(config);
+
+  // Which leaves the rx queue spinning for messages before it blocks
+  MessageQueue queue(4);
+  queue.set_spin(1000000);
+  boost::thread producer(boost::bind(&PushAfterDelay, &queue));
+  MultipartMessage* message = queue.pop(1000);
+  producer.join();
+  BOOST_REQUIRE(message != NULL);
+  delete message;
+  BOOST_CHECK_EQUAL(1, queue.spin_hits() + queue.wakeups());
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckSharedFrameWriter )
+{
+  // Stand in for the decoder: a frame pool and a control segment lending two of its buffers
+  const std::string transport_name = "/eigerfan_test_transport";
+  const std::string pool_name = "/eigerfan_test_pool";
+  const size_t buffer_size = 4096;
+  const size_t pool_header = 64;
+  shm_unlink(transport_name.c_str());
+  shm_unlink(pool_name.c_str());
+
+  SharedFrameWriter writer(transport_name);
+  BOOST_CHECK(!writer.attach());
+
+  int pool_fd = shm_open(pool_name.c_str(), O_CREAT | O_RDWR, 0600);
+  BOOST_REQUIRE(pool_fd >= 0);
+  BOOST_REQUIRE(ftruncate(pool_fd, pool_header + 4 * buffer_size) == 0);
+  char* pool = static_cast<char*>(mmap(NULL, pool_header + 4 * buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0));
+  close(pool_fd);
+  int transport_fd = shm_open(transport_name.c_str(), O_CREAT | O_RDWR, 0600);
+  BOOST_REQUIRE(transport_fd >= 0);
+  BOOST_REQUIRE(ftruncate(transport_fd, sizeof(Eiger::SharedTransportControl)) == 0);
+  void* transport = mmap(NULL, sizeof(Eiger::SharedTransportControl), PROT_READ | PROT_WRITE, MAP_SHARED, transport_fd, 0);
+  close(transport_fd);
+  BOOST_REQUIRE(transport != MAP_FAILED);
+  Eiger::SharedTransportControl* control = new (transport) Eiger::SharedTransportControl();
+  control->magic = Eiger::SHARED_TRANSPORT_MAGIC;
+  control->version = Eiger::SHARED_TRANSPORT_VERSION;
+  strncpy(control->buffer_name, pool_name.c_str(), sizeof(control->buffer_name) - 1);
+  control->buffer_size = buffer_size;
+  control->payload_offset = sizeof(Eiger::FrameHeader);
+
+  // Not attached until the decoder marks the transport ready
+  BOOST_CHECK(!writer.attach());
+  control->state.store(Eiger::SHARED_TRANSPORT_READY);
+  BOOST_REQUIRE(writer.attach());
+
+  Eiger::SharedFrameSlot slot = {2, pool_header + 2 * buffer_size};
+  BOOST_CHECK(Eiger::SharedTransportPush(control, slot));
+  slot.buffer_id = 3;
+  slot.offset = pool_header + 3 * buffer_size;
+  BOOST_CHECK(Eiger::SharedTransportPush(control, slot));
+  BOOST_CHECK_EQUAL(2, Eiger::SharedTransportAvailable(control));
+
+  // Payloads go to the lent buffers in order, after the frame header
+  std::string payload("image data");
+  Eiger::SharedFrameDescriptor descriptor;
+  BOOST_REQUIRE(writer.write(payload.c_str(), payload.size(), descriptor));
+  BOOST_CHECK_EQUAL(2, descriptor.buffer_id);
+  BOOST_CHECK_EQUAL(payload.size(), descriptor.size);
+  BOOST_CHECK_EQUAL(payload, std::string(pool + slot.offset - buffer_size + sizeof(Eiger::FrameHeader), payload.size()));
+
+  // The descriptor is recognised as one when it is received
+  Eiger::SharedFrameDescriptor received;
+  BOOST_CHECK(Eiger::ParseSharedFrameDescriptor(&descriptor, sizeof(descriptor), received));
+  BOOST_CHECK_EQUAL(descriptor.buffer_id, received.buffer_id);
+  BOOST_CHECK(!Eiger::ParseSharedFrameDescriptor(payload.c_str(), payload.size(), received));
+
+  // Payloads that do not fit a buffer are left for TCP without taking a buffer
+  std::vector<char> large(buffer_size, 0);
+  BOOST_CHECK(!writer.write(&large[0], large.size(), descriptor));
+  BOOST_CHECK_EQUAL(1, Eiger::SharedTransportAvailable(control));
+  BOOST_CHECK(writer.write(payload.c_str(), payload.size(), descriptor));
+  BOOST_CHECK_EQUAL(3, descriptor.buffer_id);
+
+  // Nothing lent
+  BOOST_CHECK(!writer.write(payload.c_str(), payload.size(), descriptor));
+  BOOST_CHECK_EQUAL(2, writer.frames_written());
+  BOOST_CHECK_EQUAL(1, writer.frames_unavailable());
+
+  // A buffer outside the pool is counted and stays lent, and the pool is mapped again on attach
+  Eiger::SharedFrameSlot outside = {9, pool_header + 4 * buffer_size};
+  BOOST_CHECK(Eiger::SharedTransportPush(control, outside));
+  BOOST_CHECK(!writer.write(payload.c_str(), payload.size(), descriptor));
+  BOOST_CHECK_EQUAL(1, writer.buffers_rejected());
+  BOOST_CHECK_EQUAL(1, Eiger::SharedTransportAvailable(control));
+  BOOST_CHECK(!writer.attached());
+  BOOST_REQUIRE(writer.attach());
+  Eiger::SharedFrameSlot left;
+  BOOST_CHECK(Eiger::SharedTransportPop(control, left));
+  BOOST_CHECK_EQUAL(outside.buffer_id, left.buffer_id);
+
+  // The ring wraps
+  for (size_t i = 0; i < Eiger::SHARED_TRANSPORT_RING_SIZE; i++) {
+    BOOST_CHECK(Eiger::SharedTransportPush(control, slot));
+  }
+  BOOST_CHECK(!Eiger::SharedTransportPush(control, slot));
+  Eiger::SharedFrameSlot taken;
+  BOOST_CHECK(Eiger::SharedTransportPop(control, taken));
+  BOOST_CHECK_EQUAL(slot.offset, taken.offset);
+  BOOST_CHECK(Eiger::SharedTransportPush(control, slot));
+
+  writer.detach();
+  munmap(control, sizeof(Eiger::SharedTransportControl));
+  munmap(pool, pool_header + 4 * buffer_size);
+  shm_unlink(transport_name.c_str());
+  shm_unlink(pool_name.c_str());
+}
+
+static bool ReceiveCoordinatorMessage(FanCoordinatorClient& client, rapidjson::Document& document, const std::string& type)
+{
+  // Wait up to a second for the coordinator to reply
+  for (int i = 0; i < 100; i++) {
+    if (client.receive(document)) {
+      return type == document[Eiger::COORDINATOR_MSG_TYPE_KEY.c_str()].GetString();
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  return false;
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckFanCoordinator )
+{
+  FanCoordinator coordinator("tcp://127.0.0.1:5571");
+  coordinator.start();
+
+  zmq::context_t ctx;
+  FanCoordinatorClient clientA(ctx, "tcp://127.0.0.1:5571", "A");
+  FanCoordinatorClient clientB(ctx, "tcp://127.0.0.1:5571", "B");
+  rapidjson::Document document;
+
+  // The first instance to register sets the routing table
+  clientA.register_instance(2, 1);
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientA, document, Eiger::COORDINATOR_REGISTERED));
+  clientB.register_instance(2, 5);
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientB, document, Eiger::COORDINATOR_REGISTERED));
+  BOOST_CHECK_EQUAL(1, document[Eiger::COORDINATOR_BLOCK_SIZE_KEY.c_str()].GetInt());
+  BOOST_CHECK(!document.HasMember(Eiger::COORDINATOR_SERIES_KEY.c_str()));
+
+  // A start is passed on to the other instances
+  clientA.send_start(7, "acq", 3, 1);
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientB, document, Eiger::COORDINATOR_START));
+  BOOST_CHECK_EQUAL(7, document[Eiger::COORDINATOR_SERIES_KEY.c_str()].GetInt());
+  BOOST_CHECK_EQUAL("acq", std::string(document[Eiger::COORDINATOR_ACQ_ID_KEY.c_str()].GetString()));
+  BOOST_CHECK_EQUAL(3, document[Eiger::COORDINATOR_OFFSET_KEY.c_str()].GetInt());
+  BOOST_CHECK(!clientA.receive(document));
+
+  // An end goes to every instance and is released to its holder once all have drained
+  clientB.send_end(7);
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientA, document, Eiger::COORDINATOR_END));
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientB, document, Eiger::COORDINATOR_END));
+  clientA.send_drained(7, 3);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  BOOST_CHECK(!clientB.receive(document));
+  clientB.send_drained(7, 4);
+  BOOST_REQUIRE(ReceiveCoordinatorMessage(clientB, document, Eiger::COORDINATOR_RELEASE_END));
+  BOOST_CHECK_EQUAL(7, document[Eiger::COORDINATOR_SERIES_KEY.c_str()].GetInt());
+  BOOST_CHECK_EQUAL(7, document[Eiger::COORDINATOR_FRAMES_KEY.c_str()].GetUint64());
+  BOOST_CHECK(!clientA.receive(document));
+
+  coordinator.stop();
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckSendBudget )
+{
+  // Two destinations sharing 8 kB, so each may hold 4 kB
+  SendBudget budget(8192, 2);
+  BOOST_CHECK_EQUAL(4096, budget.share());
+
+  // Over inproc the receiver holds the sent data until it closes the message
+  zmq::context_t context(1);
+  zmq::socket_t push(context, ZMQ_PUSH);
+  zmq::socket_t pull(context, ZMQ_PULL);
+  push.bind("inproc://send_budget");
+  pull.connect("inproc://send_budget");
+
+  zmq::message_t message(3000);
+  memset(message.data(), 1, message.size());
+  budget.track(message, 0);
+  BOOST_REQUIRE(push.send(message));
+  BOOST_CHECK_EQUAL(3000, budget.queued_bytes(0));
+  BOOST_CHECK(!budget.has_space(0, 3000));
+  BOOST_CHECK(budget.has_space(0, 1000));
+  BOOST_CHECK(budget.has_space(1, 3000));
+  BOOST_CHECK(!budget.wait_for_space(0, 3000, 10));
+
+  // Small messages are not counted
+  zmq::message_t small(10);
+  budget.track(small, 0);
+  BOOST_REQUIRE(push.send(small));
+  BOOST_CHECK_EQUAL(3000, budget.queued_bytes(0));
+
+  // The bytes are given back when the receiver is done with the data
+  {
+    zmq::message_t received;
+    BOOST_REQUIRE(pull.recv(&received));
+    BOOST_CHECK_EQUAL(3000, received.size());
+    BOOST_CHECK_EQUAL(1, static_cast<char*>(received.data())[2999]);
+  }
+  BOOST_CHECK(budget.wait_for_space(0, 3000, 1000));
+  BOOST_CHECK_EQUAL(0, budget.queued_bytes(0));
+  BOOST_CHECK_EQUAL(3000, budget.peak_queued_bytes(0));
+
+  // A message larger than the share is admitted once nothing is queued
+  BOOST_CHECK(budget.has_space(0, 10000));
+  budget.record_drop(1, 5000);
+  BOOST_CHECK_EQUAL(1, budget.dropped_frames(1));
+  BOOST_CHECK_EQUAL(5000, budget.dropped_bytes(1));
+
+  // A message refused by a send without blocking is given back uncounted
+  zmq::socket_t unconnected(context, ZMQ_PUSH);
+  unconnected.bind("inproc://send_budget_refused");
+  zmq::message_t refused(2000);
+  memset(refused.data(), 2, refused.size());
+  BOOST_CHECK(!budget.send(unconnected, refused, 1, ZMQ_DONTWAIT));
+  BOOST_CHECK_EQUAL(0, budget.queued_bytes(1));
+  BOOST_REQUIRE_EQUAL(2000, refused.size());
+  BOOST_CHECK_EQUAL(2, static_cast<char*>(refused.data())[1999]);
+
+  // and is counted once when it is sent
+  BOOST_REQUIRE(budget.send(push, refused, 1));
+  BOOST_CHECK_EQUAL(2000, budget.queued_bytes(1));
+  {
+    // After the small message sent above
+    zmq::message_t received;
+    BOOST_REQUIRE(pull.recv(&received));
+    BOOST_REQUIRE_EQUAL(10, received.size());
+    BOOST_REQUIRE(pull.recv(&received));
+    BOOST_REQUIRE_EQUAL(2000, received.size());
+    BOOST_CHECK_EQUAL(2, static_cast<char*>(received.data())[1999]);
+  }
+  BOOST_CHECK(budget.wait_for_space(1, 4096, 1000));
+  BOOST_CHECK_EQUAL(0, budget.queued_bytes(1));
+
+  // No limit
+  SendBudget unlimited(0, 2);
+  zmq::message_t large(3000);
+  unlimited.track(large, 0);
+  BOOST_CHECK(unlimited.has_space(0, 1000000));
+}
+
+static void AppendOverflowMessage(OverflowStore& store, char fill)
+{
+  // A two part message of 40 bytes
+  zmq::message_t header(8);
+  memset(header.data(), fill, header.size());
+  store.append(header, true);
+  zmq::message_t data(32);
+  memset(data.data(), fill, data.size());
+  store.append(data, false);
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckOverflowStore )
+{
+  const std::string spill_path = "/tmp/eigerfan_test_overflow.spill";
+  {
+    // Room in memory for two messages
+    OverflowStore store(spill_path, 80);
+    BOOST_CHECK(store.empty());
+
+    // A message is only stored once its last part is appended
+    zmq::message_t part(8);
+    store.append(part, true);
+    BOOST_CHECK(store.empty());
+    zmq::message_t last(32);
+    store.append(last, false);
+    BOOST_CHECK_EQUAL(1, store.depth());
+    store.pop_front();
+
+    AppendOverflowMessage(store, 'a');
+    AppendOverflowMessage(store, 'b');
+    AppendOverflowMessage(store, 'c');
+    AppendOverflowMessage(store, 'd');
+    BOOST_CHECK_EQUAL(4, store.depth());
+    BOOST_CHECK_EQUAL(80, store.ram_bytes());
+    BOOST_CHECK_EQUAL(2, store.spill_depth());
+    BOOST_CHECK_EQUAL(2, store.spilled_messages());
+
+    // Messages come back out in order, from memory then from the spill file
+    BOOST_CHECK_EQUAL('a', static_cast<char*>(store.front()[1]->data())[0]);
+    store.pop_front();
+    BOOST_CHECK_EQUAL('b', static_cast<char*>(store.front()[0]->data())[0]);
+    store.pop_front();
+
+    // Memory is free again but later messages follow the spilled ones
+    AppendOverflowMessage(store, 'e');
+    BOOST_CHECK_EQUAL(0, store.ram_bytes());
+    BOOST_CHECK_EQUAL(3, store.spill_depth());
+
+    const char expected[] = {'c', 'd', 'e'};
+    for (int i = 0; i < 3; i++) {
+      BOOST_REQUIRE(!store.empty());
+      OverflowMessage& message = store.front();
+      BOOST_REQUIRE_EQUAL(2, message.size());
+      BOOST_CHECK_EQUAL(8, message[0]->size());
+      BOOST_CHECK_EQUAL(32, message[1]->size());
+      BOOST_CHECK_EQUAL(expected[i], static_cast<char*>(message[1]->data())[31]);
+      store.pop_front();
+    }
+    BOOST_CHECK(store.empty());
+
+    // Once drained, messages are held in memory again
+    AppendOverflowMessage(store, 'f');
+    BOOST_CHECK_EQUAL(40, store.ram_bytes());
+    BOOST_CHECK_EQUAL(0, store.spill_depth());
+    BOOST_CHECK_EQUAL(0, access(spill_path.c_str(), F_OK));
+  }
+  // The spill file is removed with the store
+  BOOST_CHECK(access(spill_path.c_str(), F_OK) != 0);
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckFrameCompressor )
+{
+  // Bit b of byte n of element i ends up in bit row 8n+b, at bit i of the row
+  uint8_t elements[16] = {0};
+  elements[2] = 0x01;  // Bit 0 of element 1
+  elements[13] = 0x80;  // Bit 7 of byte 1 of element 6
+  uint8_t shuffled[16];
+  FrameCompressor::bitshuffle(elements, shuffled, 8, 2);
+  for (int row = 0; row < 16; row++) {
+    uint8_t expected = row == 0 ? 0x02 : (row == 15 ? 0x40 : 0x00);
+    BOOST_CHECK_EQUAL(expected, shuffled[row]);
+  }
+
+  BOOST_CHECK_EQUAL(2048, FrameCompressor::block_size(4));
+  BOOST_CHECK_EQUAL(4096, FrameCompressor::block_size(2));
+
+#ifdef EIGERFAN_HAS_LZ4
+  // A frame of 5003 uint32 elements has two full blocks, a partial block and 3 elements left over
+  FrameCompressor compressor(2);
+  zmq::message_t frame(5003 * sizeof(uint32_t));
+  uint32_t* pixels = static_cast<uint32_t*>(frame.data());
+  for (int i = 0; i < 5003; i++) {
+    pixels[i] = i % 7;
+  }
+  zmq::message_t compressed;
+  BOOST_REQUIRE(compressor.compress(frame, sizeof(uint32_t), compressed));
+  BOOST_CHECK(compressed.size() < frame.size());
+  const uint8_t* header = static_cast<const uint8_t*>(compressed.data());
+  uint64_t totalBytes = 0;
+  for (int i = 0; i < 8; i++) {
+    totalBytes = (totalBytes << 8) | header[i];
+  }
+  uint32_t blockBytes = 0;
+  for (int i = 8; i < 12; i++) {
+    blockBytes = (blockBytes << 8) | header[i];
+  }
+  BOOST_CHECK_EQUAL(frame.size(), totalBytes);
+  BOOST_CHECK_EQUAL(8192, blockBytes);
+  // The leftover elements are copied to the end
+  BOOST_CHECK_EQUAL(0, memcmp(static_cast<char*>(compressed.data()) + compressed.size() - 12, &pixels[5000], 12));
+  BOOST_CHECK_EQUAL(1, compressor.frames_compressed());
+#endif
+}
+
+BOOST_AUTO_TEST_CASE( EigerFanTestCheckProtocolTable )
+{
+  Eiger::EigerMessageParentType type = Eiger::PARENT_MESSAGE_TYPE_GLOBAL;
+  BOOST_CHECK(Eiger::ClassifyMessageType(Eiger::IMAGE_HEADER_TYPE.c_str(), Eiger::IMAGE_HEADER_TYPE.size(), type));
+  BOOST_CHECK_EQUAL(Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA, type);
+  BOOST_CHECK(Eiger::ClassifyMessageType(Eiger::END_HEADER_TYPE.c_str(), Eiger::END_HEADER_TYPE.size(), type));
+  BOOST_CHECK_EQUAL(Eiger::PARENT_MESSAGE_TYPE_END, type);
+  // A fence has the same length as an image htype
+  BOOST_CHECK(!Eiger::ClassifyMessageType(Eiger::FENCE_HEADER_TYPE.c_str(), Eiger::FENCE_HEADER_TYPE.size(), type));
+
+  BOOST_CHECK_EQUAL(Eiger::global_detector_none_part, Eiger::FindHeaderDetail("none")->last_part);
+  BOOST_CHECK_EQUAL(Eiger::global_detector_config_part, Eiger::FindHeaderDetail("basic")->last_part);
+  BOOST_CHECK_EQUAL(Eiger::global_countrate_data_part, Eiger::FindHeaderDetail("all")->last_part);
+  BOOST_CHECK(Eiger::FindHeaderDetail("some") == NULL);
+
+  const Eiger::PartSpec& mask = Eiger::GetPartSpec(Eiger::PARENT_MESSAGE_TYPE_GLOBAL, Eiger::global_mask_data_part);
+  BOOST_CHECK_EQUAL(Eiger::PART_CONTENT_DATA, mask.content);
+  BOOST_CHECK_EQUAL(Eiger::GLOBAL_HEADER_MASK, mask.message_type);
+  BOOST_CHECK(mask.frame_buffer);
+  BOOST_CHECK(!Eiger::GetPartSpec(Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA, Eiger::image_data_time_part).frame_buffer);
+  BOOST_CHECK_EQUAL(Eiger::PART_CONTENT_NONE, Eiger::GetPartSpec(Eiger::PARENT_MESSAGE_TYPE_END, 2).content);
+  BOOST_CHECK_EQUAL(Eiger::PART_CONTENT_NONE, Eiger::GetPartSpec(Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA, 42).content);
+  BOOST_CHECK_EQUAL(Eiger::image_data_time_part, Eiger::NumMessageParts(Eiger::PARENT_MESSAGE_TYPE_IMAGE_DATA));
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
@@ -0,0 +1,843 @@
+/*
+ * frame_processor_unittest.cpp
+ *
+ */
+#define BOOST_TEST_MODULE "EigerFrameProcessorUnitTest"
+#define BOOST_TEST_MAIN
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "zmq/zmq.hpp"
+#include "AzimuthalIntegrator.h"
+#include "DataBlockFrame.h"
+#include "EigerBitDepthPlugin.h"
+#include "EigerHitFinderPlugin.h"
+#include "FrameCompressor.h"
+#include "FrameDecompressor.h"
+#include "HitScorer.h"
+#include "PixelKernels.h"
+#include "SparseEncoder.h"
+#include "WorkerPool.h"
+
+using namespace FrameProcessor;
+
+// Pixel counts either side of the 8, 16 and 32 pixels a vector kernel takes at a time
+static const size_t PIXEL_COUNTS[] = {0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 1000, 4103};
+
+/**
+ * Make an image of small counts, with some empty, some invalid and some just
+ * below the invalid value
+ */
+template <typename T>
+static std::vector<T> make_pixels(size_t count, std::mt19937& rng)
+{
+  const T invalid = std::numeric_limits<T>::max();
+  std::vector<T> pixels(count);
+  for (size_t i = 0; i < count; i++) {
+    switch (rng() % 8) {
+      case 0:
+        pixels[i] = invalid;
+        break;
+      case 1:
+        pixels[i] = invalid - 1 - rng() % 4;
+        break;
+      case 2:
+      case 3:
+        pixels[i] = 0;
+        break;
+      default:
+        pixels[i] = rng() % 1000;
+    }
+  }
+  return pixels;
+}
+
+/**
+ * Make a mask of pixels to leave out
+ */
+static std::vector<uint8_t> make_exclude(size_t count, std::mt19937& rng)
+{
+  std::vector<uint8_t> exclude(count);
+  for (size_t i = 0; i < count; i++) {
+    exclude[i] = rng() % 5 == 0 ? 1 : 0;
+  }
+  return exclude;
+}
+
+/**
+ * Reduce pixels with the kernels chosen at run time or the portable kernels
+ */
+template <typename T>
+static PixelStatistics statistics(const std::vector<T>& pixels, const uint8_t* exclude, T threshold, bool scalar)
+{
+  PixelStatistics stats = EMPTY_PIXEL_STATISTICS;
+  set_scalar_pixel_kernels(scalar);
+  pixel_statistics(pixels.data(), exclude, pixels.size(), threshold, stats);
+  set_scalar_pixel_kernels(false);
+  return stats;
+}
+
+static void check_statistics_equal(const PixelStatistics& expected, const PixelStatistics& stats)
+{
+  BOOST_CHECK_EQUAL(expected.sum, stats.sum);
+  BOOST_CHECK_EQUAL(expected.max, stats.max);
+  BOOST_CHECK_EQUAL(expected.over_threshold, stats.over_threshold);
+  BOOST_CHECK_EQUAL(expected.excluded, stats.excluded);
+}
+
+/**
+ * Compress an image as the EigerFan does and decompress it as the plugins do
+ */
+template <typename T>
+static bool roundtrip(FrameCompressor& compressor, FrameDecompressor& decompressor, const std::vector<T>& pixels,
+                      std::vector<T>& output)
+{
+  zmq::message_t raw(pixels.size() * sizeof(T));
+  memcpy(raw.data(), pixels.data(), raw.size());
+  zmq::message_t compressed;
+  if (!compressor.compress(raw, sizeof(T), compressed)) {
+    return false;
+  }
+  output.assign(pixels.size(), 0);
+  return decompressor.decompress(compressed.data(), compressed.size(), bslz4, sizeof(T), pixels.size(),
+                                 reinterpret_cast<uint8_t*>(output.data()));
+}
+
+/**
+ * Make a detector mask with a few pixels set
+ */
+static std::vector<uint32_t> make_mask(size_t count, std::mt19937& rng)
+{
+  std::vector<uint32_t> mask(count);
+  for (size_t i = 0; i < count; i++) {
+    mask[i] = rng() % 11 == 0 ? 1 : 0;
+  }
+  return mask;
+}
+
+/**
+ * Count the pixels of the scoring region at or above the threshold, one at a time
+ */
+template <typename T>
+static uint64_t expected_score(const std::vector<T>& pixels, size_t width, const DetectorGeometry* geometry,
+                               const std::vector<uint32_t>& mask, double low_resolution, double high_resolution,
+                               T threshold)
+{
+  uint64_t score = 0;
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (mask[i] || pixels[i] == std::numeric_limits<T>::max() || pixels[i] < threshold) {
+      continue;
+    }
+    double d = geometry ? geometry->resolution(i % width, i / width) : 0;
+    if (geometry && (d > low_resolution || d < high_resolution)) {
+      continue;
+    }
+    score++;
+  }
+  return score;
+}
+
+/**
+ * Find the pixels that are not empty with the kernels chosen at run time or the portable kernels
+ */
+template <typename T>
+static std::vector<uint32_t> changed(const std::vector<T>& pixels, const uint8_t* masked, uint32_t first_index,
+                                     bool scalar)
+{
+  set_scalar_pixel_kernels(scalar);
+  size_t found = changed_pixels(pixels.data(), masked, pixels.size(), first_index, NULL);
+  std::vector<uint32_t> indices(found);
+  BOOST_CHECK_EQUAL(found, changed_pixels(pixels.data(), masked, pixels.size(), first_index, indices.data()));
+  set_scalar_pixel_kernels(false);
+  return indices;
+}
+
+/**
+ * Make a low occupancy image, with the pixels the detector masks set invalid
+ * except for a few that are not
+ */
+template <typename T>
+static std::vector<T> make_sparse_pixels(const std::vector<uint32_t>& mask, std::mt19937& rng)
+{
+  std::vector<T> pixels(mask.size(), 0);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    if (mask[i]) {
+      pixels[i] = rng() % 50 == 0 ? 0 : std::numeric_limits<T>::max();
+    } else if (rng() % 200 == 0) {
+      pixels[i] = 1 + rng() % 3;
+    }
+  }
+  return pixels;
+}
+
+/**
+ * Rebuild an image from the detector mask and a sparse record, as a reader does
+ */
+template <typename T>
+static std::vector<T> decode_record(const uint32_t* record, const std::vector<uint32_t>& mask)
+{
+  std::vector<T> pixels(mask.size());
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = mask[i] ? std::numeric_limits<T>::max() : 0;
+  }
+  uint32_t entries = record[1];
+  const uint32_t* indices = record + SPARSE_RECORD_HEADER;
+  const uint32_t* counts = indices + entries;
+  for (uint32_t i = 0; i < entries; i++) {
+    pixels[indices[i]] = static_cast<T>(counts[i]);
+  }
+  return pixels;
+}
+
+/**
+ * Narrow pixels to 16 bits with the kernels chosen at run time or the portable kernels
+ */
+static size_t narrow(const std::vector<uint32_t>& pixels, std::vector<uint16_t>& narrowed, bool scalar)
+{
+  narrowed.assign(pixels.size(), 7);
+  set_scalar_pixel_kernels(scalar);
+  size_t too_large = narrow_pixels(pixels.data(), narrowed.data(), pixels.size());
+  set_scalar_pixel_kernels(false);
+  return too_large;
+}
+
+/**
+ * Widen a narrowed image back to 32 bits, as a reader of the 16 bit dataset does
+ */
+static std::vector<uint32_t> widen(const std::vector<uint16_t>& narrowed)
+{
+  std::vector<uint32_t> pixels(narrowed.size());
+  for (size_t i = 0; i < narrowed.size(); i++) {
+    pixels[i] = narrowed[i] == UINT16_MAX ? UINT32_MAX : narrowed[i];
+  }
+  return pixels;
+}
+
+/**
+ * Add up pixels by index with the kernels chosen at run time or the portable kernels
+ */
+template <typename T>
+static std::pair<uint64_t, uint64_t> indexed_sum(const std::vector<T>& pixels, const std::vector<uint32_t>& indices,
+                                                 bool scalar)
+{
+  uint64_t sum = 0;
+  uint64_t counted = 0;
+  set_scalar_pixel_kernels(scalar);
+  indexed_pixel_sum(pixels.data(), indices.data(), indices.size(), sum, counted);
+  set_scalar_pixel_kernels(false);
+  return std::make_pair(sum, counted);
+}
+
+/**
+ * Integrate an image with the kernels chosen at run time or the portable kernels
+ */
+static std::vector<double> integrate(AzimuthalIntegrator& integrator, const void* pixels, DataType data_type,
+                                     bool scalar)
+{
+  std::vector<double> profile;
+  set_scalar_pixel_kernels(scalar);
+  integrator.integrate(pixels, data_type, profile);
+  set_scalar_pixel_kernels(false);
+  return profile;
+}
+
+/**
+ * Frames a plugin passes on, in the order it passes them
+ */
+class FrameCollector : public IFrameCallback
+{
+public:
+  void callback(boost::shared_ptr<Frame> frame)
+  {
+    frames.push_back(frame);
+  }
+
+  std::vector<boost::shared_ptr<Frame> > frames;
+};
+
+/**
+ * Make an uncompressed image frame in the "data" dataset, as the EigerProcessPlugin passes on
+ */
+template <typename T>
+static boost::shared_ptr<Frame> make_frame(long long frame_number, const std::vector<T>& pixels, size_t width)
+{
+  dimensions_t dimensions(2);
+  dimensions[0] = pixels.size() / width;
+  dimensions[1] = width;
+  FrameMetaData meta_data(frame_number, "data", sizeof(T) == sizeof(uint16_t) ? raw_16bit : raw_32bit, "test",
+                          dimensions, no_compression);
+  boost::shared_ptr<Frame> frame(new DataBlockFrame(meta_data, pixels.data(), pixels.size() * sizeof(T)));
+  frame->set_frame_number(frame_number);
+  return frame;
+}
+
+/**
+ * Pass a frame to a plugin, as the plugin before it in the chain does
+ */
+static void process(IFrameCallback& plugin, boost::shared_ptr<Frame> frame)
+{
+  plugin.callback(frame);
+}
+
+/**
+ * Set one configuration parameter of a plugin
+ *
+ * \return false if the plugin rejected the configuration
+ */
+static bool configure(FrameProcessorPlugin& plugin, const std::string& name, const std::string& value)
+{
+  OdinData::IpcMessage config;
+  OdinData::IpcMessage reply;
+  config.set_param(name, value);
+  plugin.configure(config, reply);
+  return reply.get_msg_type() != OdinData::IpcMessage::MsgTypeNack;
+}
+
+BOOST_AUTO_TEST_SUITE(EigerFrameProcessorUnitTest);
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckStatisticsKernels )
+{
+  BOOST_TEST_MESSAGE("Pixel kernels: " << pixel_kernel_name());
+  set_scalar_pixel_kernels(true);
+  BOOST_CHECK_EQUAL(std::string("scalar"), pixel_kernel_name());
+  set_scalar_pixel_kernels(false);
+
+  // Invalid pixels are excluded and never counted as the maximum
+  std::vector<uint16_t> small = {3, 65535, 10, 0, 65534};
+  PixelStatistics stats = statistics(small, NULL, static_cast<uint16_t>(10), false);
+  BOOST_CHECK_EQUAL(65547, stats.sum);
+  BOOST_CHECK_EQUAL(65534, stats.max);
+  BOOST_CHECK_EQUAL(2, stats.over_threshold);
+  BOOST_CHECK_EQUAL(1, stats.excluded);
+
+  // The vector kernels match the portable kernels for every length, with and without a mask
+  std::mt19937 rng(46);
+  for (size_t count : PIXEL_COUNTS) {
+    std::vector<uint8_t> exclude = make_exclude(count, rng);
+    std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(count, rng);
+    std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(count, rng);
+    const uint8_t* masks[] = {NULL, exclude.data()};
+    for (const uint8_t* mask : masks) {
+      check_statistics_equal(statistics(pixels16, mask, static_cast<uint16_t>(500), true),
+                             statistics(pixels16, mask, static_cast<uint16_t>(500), false));
+      check_statistics_equal(statistics(pixels32, mask, static_cast<uint32_t>(500), true),
+                             statistics(pixels32, mask, static_cast<uint32_t>(500), false));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckWorkerPoolResize )
+{
+  WorkerPool pool;
+  pool.resize(1);
+  BOOST_CHECK_EQUAL(2, pool.num_threads());
+  BOOST_CHECK(!pool.apply_requested_size());
+
+  // A requested size waits until the thread running tasks applies it
+  pool.request_resize(2);
+  pool.request_resize(3);
+  BOOST_CHECK_EQUAL(2, pool.num_threads());
+  BOOST_CHECK(pool.apply_requested_size());
+  BOOST_CHECK_EQUAL(4, pool.num_threads());
+  BOOST_CHECK(!pool.apply_requested_size());
+
+  std::vector<int> done(16, 0);
+  pool.run(done.size(), [&done](size_t task) { done[task]++; });
+  BOOST_CHECK(std::all_of(done.begin(), done.end(), [](int count) { return count == 1; }));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckDecompressRoundtrip )
+{
+  if (!FrameCompressor::supported() || !FrameDecompressor::supported()) {
+    BOOST_TEST_MESSAGE("Built without LZ4, roundtrip not tested");
+    return;
+  }
+  WorkerPool pool;
+  pool.resize(2);
+  FrameDecompressor decompressor(pool);
+  FrameCompressor compressor(2);
+
+  // Lengths include partial bitshuffle blocks and elements after the last multiple of 8
+  std::mt19937 rng(460);
+  for (size_t count : {1, 9, 4103, 100003}) {
+    std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(count, rng);
+    std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(count, rng);
+    std::vector<uint16_t> output16;
+    std::vector<uint32_t> output32;
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels16, output16));
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels32, output32));
+    BOOST_CHECK(output16 == pixels16);
+    BOOST_CHECK(output32 == pixels32);
+
+    // The statistics of the decompressed image are those of the image sent
+    check_statistics_equal(statistics(pixels16, NULL, static_cast<uint16_t>(500), true),
+                           statistics(output16, NULL, static_cast<uint16_t>(500), false));
+    check_statistics_equal(statistics(pixels32, NULL, static_cast<uint32_t>(500), true),
+                           statistics(output32, NULL, static_cast<uint32_t>(500), false));
+  }
+
+  // A truncated image or one of the wrong size is refused
+  std::vector<uint32_t> pixels = make_pixels<uint32_t>(4103, rng);
+  zmq::message_t raw(pixels.size() * sizeof(uint32_t));
+  memcpy(raw.data(), pixels.data(), raw.size());
+  zmq::message_t compressed;
+  BOOST_REQUIRE(compressor.compress(raw, sizeof(uint32_t), compressed));
+  std::vector<uint32_t> output(pixels.size() + 1);
+  uint8_t* out = reinterpret_cast<uint8_t*>(output.data());
+  BOOST_CHECK(!decompressor.decompress(compressed.data(), compressed.size() / 2, bslz4, sizeof(uint32_t),
+                                       pixels.size(), out));
+  BOOST_CHECK(!decompressor.decompress(compressed.data(), compressed.size(), bslz4, sizeof(uint32_t),
+                                       pixels.size() + 1, out));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckHitScorer )
+{
+  const size_t width = 101;
+  const size_t height = 67;
+  const size_t count = width * height;
+  // The ring from 30A to 80A is a band across the image, missing the centre and corners
+  const DetectorGeometry geometry = {50.3, 30.7, 0.1, 75e-6, 75e-6, 1.0};
+  const double low_resolution = 80.0;
+  const double high_resolution = 30.0;
+  std::mt19937 rng(47);
+  std::vector<uint32_t> mask = make_mask(count, rng);
+  std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(count, rng);
+  std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(count, rng);
+
+  WorkerPool pool;
+  pool.resize(2);
+  HitScorer scorer(pool);
+
+  // Without a geometry the region is every pixel not masked
+  scorer.set_region(width, height, NULL, mask.data(), low_resolution, high_resolution);
+  size_t unmasked = count - std::count(mask.begin(), mask.end(), 1);
+  BOOST_CHECK_EQUAL(unmasked, scorer.region_pixels());
+  BOOST_CHECK_EQUAL(expected_score(pixels16, width, NULL, mask, 0, 0, static_cast<uint16_t>(500)),
+                    scorer.score(pixels16.data(), raw_16bit, 500));
+  DetectorGeometry no_distance = geometry;
+  no_distance.distance = 0;
+  scorer.set_region(width, height, &no_distance, mask.data(), low_resolution, high_resolution);
+  BOOST_CHECK_EQUAL(unmasked, scorer.region_pixels());
+
+  scorer.set_region(width, height, &geometry, mask.data(), low_resolution, high_resolution);
+  BOOST_CHECK_GT(scorer.region_pixels(), 0);
+  BOOST_CHECK_LT(scorer.region_pixels(), unmasked);
+
+  std::vector<uint16_t> output16;
+  std::vector<uint32_t> output32;
+  bool compressed = FrameCompressor::supported() && FrameDecompressor::supported();
+  FrameDecompressor decompressor(pool);
+  FrameCompressor compressor(2);
+  if (compressed) {
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels16, output16));
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels32, output32));
+  }
+  for (uint32_t threshold : {0u, 1u, 500u, 65534u, 65535u, 70000u}) {
+    uint16_t threshold16 = static_cast<uint16_t>(std::min<uint32_t>(threshold, UINT16_MAX));
+    uint64_t score16 = expected_score(pixels16, width, &geometry, mask, low_resolution, high_resolution, threshold16);
+    uint64_t score32 = expected_score(pixels32, width, &geometry, mask, low_resolution, high_resolution, threshold);
+    // The portable and vector kernels give the same score, as does the image after compression
+    for (bool scalar : {true, false}) {
+      set_scalar_pixel_kernels(scalar);
+      BOOST_CHECK_EQUAL(score16, scorer.score(pixels16.data(), raw_16bit, threshold));
+      BOOST_CHECK_EQUAL(score32, scorer.score(pixels32.data(), raw_32bit, threshold));
+      if (compressed) {
+        BOOST_CHECK_EQUAL(score16, scorer.score(output16.data(), raw_16bit, threshold));
+        BOOST_CHECK_EQUAL(score32, scorer.score(output32.data(), raw_32bit, threshold));
+      }
+    }
+    set_scalar_pixel_kernels(false);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckChangedPixelsKernels )
+{
+  // A pixel is empty if it is zero, or the invalid value where masked
+  std::vector<uint16_t> small = {0, 65535, 65535, 0, 4};
+  std::vector<uint8_t> small_mask = {0, 1, 0, 1, 0};
+  std::vector<uint32_t> indices = changed(small, small_mask.data(), 10, false);
+  BOOST_REQUIRE_EQUAL(3, indices.size());
+  BOOST_CHECK_EQUAL(12, indices[0]);
+  BOOST_CHECK_EQUAL(13, indices[1]);
+  BOOST_CHECK_EQUAL(14, indices[2]);
+
+  // The vector kernels find the same pixels in the same order as the portable kernels
+  std::mt19937 rng(48);
+  for (size_t count : PIXEL_COUNTS) {
+    std::vector<uint8_t> masked = make_exclude(count, rng);
+    std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(count, rng);
+    std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(count, rng);
+    const uint8_t* masks[] = {NULL, masked.data()};
+    for (const uint8_t* mask : masks) {
+      std::vector<uint32_t> expected16 = changed(pixels16, mask, 1000, true);
+      std::vector<uint32_t> expected32 = changed(pixels32, mask, 1000, true);
+      BOOST_CHECK(expected16 == changed(pixels16, mask, 1000, false));
+      BOOST_CHECK(expected32 == changed(pixels32, mask, 1000, false));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckSparseEncoderRoundtrip )
+{
+  if (!FrameCompressor::supported() || !FrameDecompressor::supported()) {
+    BOOST_TEST_MESSAGE("Built without LZ4, roundtrip not tested");
+    return;
+  }
+  // More pixels than one block the encoder searches at a time, and not a multiple of it
+  const size_t count = 70001;
+  std::mt19937 rng(480);
+  std::vector<uint32_t> mask = make_mask(count, rng);
+  std::vector<uint16_t> pixels16 = make_sparse_pixels<uint16_t>(mask, rng);
+  std::vector<uint32_t> pixels32 = make_sparse_pixels<uint32_t>(mask, rng);
+  std::vector<uint8_t> masked(mask.begin(), mask.end());
+
+  WorkerPool pool;
+  pool.resize(2);
+  FrameDecompressor decompressor(pool);
+  FrameCompressor compressor(2);
+  SparseEncoder encoder(pool);
+  encoder.set_mask(count, mask.data());
+  const size_t capacity = count / 50;
+  const size_t length = SparseEncoder::record_length(capacity);
+
+  // Images sent compressed are encoded, and the record compressed as the plugin writes it
+  std::vector<uint16_t> output16;
+  std::vector<uint32_t> output32;
+  BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels16, output16));
+  BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels32, output32));
+  for (bool scalar : {true, false}) {
+    set_scalar_pixel_kernels(scalar);
+    std::vector<uint32_t> record16(length, 7);
+    std::vector<uint32_t> record32(length, 7);
+    BOOST_REQUIRE(encoder.encode(output16.data(), raw_16bit, capacity, record16.data()));
+    size_t entries16 = encoder.entries();
+    BOOST_REQUIRE(encoder.encode(output32.data(), raw_32bit, capacity, record32.data()));
+    set_scalar_pixel_kernels(false);
+    BOOST_CHECK_EQUAL(changed(pixels16, masked.data(), 0, scalar).size(), entries16);
+    BOOST_CHECK_EQUAL(SPARSE_RECORD_PRESENT, record16[0]);
+    BOOST_CHECK_EQUAL(entries16, record16[1]);
+    BOOST_CHECK_EQUAL(0, record16[length - 1]);
+
+    std::vector<uint32_t> written16;
+    std::vector<uint32_t> written32;
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, record16, written16));
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, record32, written32));
+    BOOST_CHECK(decode_record<uint16_t>(written16.data(), mask) == pixels16);
+    BOOST_CHECK(decode_record<uint32_t>(written32.data(), mask) == pixels32);
+  }
+
+  // An image with more pixels than the record holds is left to the dense dataset
+  std::vector<uint32_t> record(SparseEncoder::record_length(10));
+  BOOST_CHECK(!encoder.encode(pixels32.data(), raw_32bit, 10, record.data()));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckNarrowKernels )
+{
+  // Lengths that are not a multiple of the 16 pixels the vector kernel takes
+  // at a time, with the pixel under test in the vector part and in the tail
+  std::mt19937 rng(49);
+  for (size_t count : {17, 33, 1000, 4103}) {
+    for (size_t position : {static_cast<size_t>(0), count / 2, count - 1}) {
+      std::vector<uint32_t> pixels(count);
+      for (size_t i = 0; i < count; i++) {
+        pixels[i] = rng() % 65535;
+      }
+      std::vector<uint16_t> narrowed;
+      for (bool scalar : {true, false}) {
+        // Every valid pixel below 65535 and the invalid value narrow without loss
+        pixels[position] = 0xffffffff;
+        BOOST_CHECK_EQUAL(0, narrow(pixels, narrowed, scalar));
+        BOOST_CHECK_EQUAL(0xffff, narrowed[position]);
+        BOOST_CHECK(widen(narrowed) == pixels);
+
+        // A valid 65535 would read back as invalid, so the image must stay 32 bit
+        pixels[position] = 65535;
+        BOOST_CHECK_EQUAL(1, narrow(pixels, narrowed, scalar));
+        pixels[position] = 65536;
+        BOOST_CHECK_EQUAL(1, narrow(pixels, narrowed, scalar));
+        BOOST_CHECK_EQUAL(0xffff, narrowed[position]);
+        pixels[position] = 0xfffffffe;
+        BOOST_CHECK_EQUAL(1, narrow(pixels, narrowed, scalar));
+        pixels[position] = 65534;
+        BOOST_CHECK_EQUAL(0, narrow(pixels, narrowed, scalar));
+        BOOST_CHECK_EQUAL(65534, narrowed[position]);
+      }
+    }
+  }
+
+  // The vector kernel matches the portable kernel on mixed images, tail included
+  for (size_t count : PIXEL_COUNTS) {
+    std::vector<uint32_t> pixels(count);
+    for (size_t i = 0; i < count; i++) {
+      uint32_t choice = rng() % 10;
+      pixels[i] = choice == 0 ? 0xffffffff : choice == 1 ? 65535 + rng() % 3 : choice == 2 ? rng() : rng() % 65535;
+    }
+    std::vector<uint16_t> expected;
+    std::vector<uint16_t> narrowed;
+    size_t too_large = narrow(pixels, expected, true);
+    BOOST_CHECK_EQUAL(too_large, narrow(pixels, narrowed, false));
+    BOOST_CHECK(expected == narrowed);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckNarrowRoundtrip )
+{
+  if (!FrameCompressor::supported() || !FrameDecompressor::supported()) {
+    BOOST_TEST_MESSAGE("Built without LZ4, roundtrip not tested");
+    return;
+  }
+  WorkerPool pool;
+  pool.resize(2);
+  FrameDecompressor decompressor(pool);
+  FrameCompressor compressor(2);
+
+  // A 32 bit image sent compressed is narrowed and compressed again, and
+  // reads back as the image sent
+  std::mt19937 rng(490);
+  for (size_t count : {9, 4103, 100003}) {
+    std::vector<uint32_t> pixels(count);
+    for (size_t i = 0; i < count; i++) {
+      pixels[i] = rng() % 7 == 0 ? 0xffffffff : rng() % 65535;
+    }
+    std::vector<uint32_t> received;
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels, received));
+    for (bool scalar : {true, false}) {
+      std::vector<uint16_t> narrowed;
+      BOOST_CHECK_EQUAL(0, narrow(received, narrowed, scalar));
+      std::vector<uint16_t> written;
+      BOOST_REQUIRE(roundtrip(compressor, decompressor, narrowed, written));
+      BOOST_CHECK(widen(written) == pixels);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckIndexedSumKernels )
+{
+  // The vector kernels add the same valid pixels as the portable kernels for every length
+  std::mt19937 rng(50);
+  std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(10000, rng);
+  std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(10000, rng);
+  for (size_t count : PIXEL_COUNTS) {
+    std::vector<uint32_t> indices(count);
+    for (size_t i = 0; i < count; i++) {
+      indices[i] = rng() % pixels16.size();
+    }
+    std::sort(indices.begin(), indices.end());
+    std::pair<uint64_t, uint64_t> expected16(0, 0);
+    std::pair<uint64_t, uint64_t> expected32(0, 0);
+    for (size_t i = 0; i < count; i++) {
+      if (pixels16[indices[i]] != UINT16_MAX) {
+        expected16.first += pixels16[indices[i]];
+        expected16.second++;
+      }
+      if (pixels32[indices[i]] != UINT32_MAX) {
+        expected32.first += pixels32[indices[i]];
+        expected32.second++;
+      }
+    }
+    for (bool scalar : {true, false}) {
+      std::pair<uint64_t, uint64_t> sum16 = indexed_sum(pixels16, indices, scalar);
+      std::pair<uint64_t, uint64_t> sum32 = indexed_sum(pixels32, indices, scalar);
+      BOOST_CHECK_EQUAL(expected16.first, sum16.first);
+      BOOST_CHECK_EQUAL(expected16.second, sum16.second);
+      BOOST_CHECK_EQUAL(expected32.first, sum32.first);
+      BOOST_CHECK_EQUAL(expected32.second, sum32.second);
+    }
+  }
+
+  // A 16 bit gather reads the pixel after the one it picks out, so the last
+  // pixel of the image is added by the portable loop
+  std::vector<uint16_t> image(17);
+  std::vector<uint32_t> every(17);
+  for (size_t i = 0; i < image.size(); i++) {
+    image[i] = i + 1;
+    every[i] = i;
+  }
+  BOOST_CHECK_EQUAL(153, indexed_sum(image, every, false).first);
+  BOOST_CHECK_EQUAL(17, indexed_sum(image, every, false).second);
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckAzimuthalIntegrator )
+{
+  const size_t width = 101;
+  const size_t height = 67;
+  const size_t count = width * height;
+  const DetectorGeometry geometry = {50.3, 30.7, 0.1, 75e-6, 75e-6, 1.0};
+  std::mt19937 rng(500);
+  std::vector<uint32_t> mask = make_mask(count, rng);
+  std::vector<uint16_t> pixels16 = make_pixels<uint16_t>(count, rng);
+  std::vector<uint32_t> pixels32 = make_pixels<uint32_t>(count, rng);
+  size_t unmasked = count - std::count(mask.begin(), mask.end(), 1);
+
+  WorkerPool pool;
+  pool.resize(2);
+  AzimuthalIntegrator integrator(pool);
+
+  // With one bin covering every pixel, the profile is the mean of the valid pixels not masked
+  integrator.set_geometry(width, height, geometry, mask.data(), RADIAL_Q, 1, 0, 0);
+  BOOST_CHECK_EQUAL(1, integrator.bins());
+  BOOST_CHECK_EQUAL(unmasked, integrator.entries());
+  uint64_t sum = 0;
+  uint64_t counted = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!mask[i] && pixels32[i] != UINT32_MAX) {
+      sum += pixels32[i];
+      counted++;
+    }
+  }
+  std::vector<double> profile = integrate(integrator, pixels32.data(), raw_32bit, false);
+  BOOST_REQUIRE_EQUAL(1, profile.size());
+  BOOST_CHECK_EQUAL(static_cast<double>(sum) / counted, profile[0]);
+
+  // Each bin of an image of one count holds that count, or 0 if it has no pixels
+  integrator.set_geometry(width, height, geometry, mask.data(), RADIAL_Q, 100, 0, 0);
+  BOOST_CHECK_EQUAL(100, integrator.bins());
+  BOOST_CHECK_EQUAL(unmasked, integrator.entries());
+  std::vector<uint16_t> flat(count, 7);
+  profile = integrate(integrator, flat.data(), raw_16bit, false);
+  BOOST_REQUIRE_EQUAL(100, profile.size());
+  BOOST_CHECK_EQUAL(7, profile.front());
+  BOOST_CHECK_EQUAL(7, profile.back());
+  for (double mean : profile) {
+    BOOST_CHECK(mean == 7 || mean == 0);
+  }
+
+  // The portable and vector kernels give the same profile, as does the image after compression
+  bool compressed = FrameCompressor::supported() && FrameDecompressor::supported();
+  std::vector<uint16_t> output16;
+  std::vector<uint32_t> output32;
+  FrameDecompressor decompressor(pool);
+  FrameCompressor compressor(2);
+  if (compressed) {
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels16, output16));
+    BOOST_REQUIRE(roundtrip(compressor, decompressor, pixels32, output32));
+  }
+  for (RadialUnit unit : {RADIAL_Q, RADIAL_TWO_THETA}) {
+    integrator.set_geometry(width, height, geometry, mask.data(), unit, 64, 0, 0);
+    std::vector<double> expected16 = integrate(integrator, pixels16.data(), raw_16bit, true);
+    std::vector<double> expected32 = integrate(integrator, pixels32.data(), raw_32bit, true);
+    BOOST_CHECK(expected16 == integrate(integrator, pixels16.data(), raw_16bit, false));
+    BOOST_CHECK(expected32 == integrate(integrator, pixels32.data(), raw_32bit, false));
+    if (compressed) {
+      BOOST_CHECK(expected16 == integrate(integrator, output16.data(), raw_16bit, false));
+      BOOST_CHECK(expected32 == integrate(integrator, output32.data(), raw_32bit, false));
+    }
+  }
+
+  // Pixels outside a given radial range are left out
+  integrator.set_geometry(width, height, geometry, NULL, RADIAL_TWO_THETA, 10, 0.5, 1.5);
+  BOOST_CHECK_EQUAL(0.5, integrator.radial_min());
+  BOOST_CHECK_EQUAL(1.5, integrator.radial_max());
+  BOOST_CHECK_GT(integrator.entries(), 0);
+  BOOST_CHECK_LT(integrator.entries(), count);
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckHitFinderVeto )
+{
+  // With the default thresholds, a hit has 20 pixels of 5 counts or more
+  const size_t width = 32;
+  std::vector<uint16_t> miss(width * 16, 1);
+  std::vector<uint16_t> hit(miss);
+  for (size_t i = 0; i < 40; i++) {
+    hit[i * 7] = 100;
+  }
+
+  EigerHitFinderPlugin plugin;
+  plugin.set_name("hit_finder");
+  boost::shared_ptr<FrameCollector> next(new FrameCollector());
+  plugin.register_callback("next", next, true);
+  BOOST_CHECK(!configure(plugin, "veto_mode", "sometimes"));
+
+  // Dropped images are not passed on, and hits keep their dataset
+  BOOST_REQUIRE(configure(plugin, "veto_mode", "drop"));
+  process(plugin, make_frame(0, miss, width));
+  process(plugin, make_frame(1, hit, width));
+  BOOST_REQUIRE_EQUAL(1, next->frames.size());
+  BOOST_CHECK_EQUAL(1, next->frames[0]->get_frame_number());
+  BOOST_CHECK_EQUAL("data", next->frames[0]->get_meta_data().get_dataset_name());
+
+  // Diverted images are passed on in the veto dataset
+  BOOST_REQUIRE(configure(plugin, "veto_mode", "divert"));
+  BOOST_REQUIRE(configure(plugin, "veto_dataset", "low_priority"));
+  process(plugin, make_frame(2, miss, width));
+  process(plugin, make_frame(3, hit, width));
+  BOOST_REQUIRE_EQUAL(3, next->frames.size());
+  BOOST_CHECK_EQUAL(2, next->frames[1]->get_frame_number());
+  BOOST_CHECK_EQUAL("low_priority", next->frames[1]->get_meta_data().get_dataset_name());
+  BOOST_CHECK_EQUAL(3, next->frames[2]->get_frame_number());
+  BOOST_CHECK_EQUAL("data", next->frames[2]->get_meta_data().get_dataset_name());
+
+  // With the veto off every image is kept in its dataset
+  BOOST_REQUIRE(configure(plugin, "veto_mode", "off"));
+  process(plugin, make_frame(4, miss, width));
+  BOOST_REQUIRE_EQUAL(4, next->frames.size());
+  BOOST_CHECK_EQUAL("data", next->frames[3]->get_meta_data().get_dataset_name());
+
+  OdinData::IpcMessage status;
+  plugin.status(status);
+  BOOST_CHECK_EQUAL(3, status.get_param<uint64_t>("hit_finder/frames_kept"));
+  BOOST_CHECK_EQUAL(2, status.get_param<uint64_t>("hit_finder/frames_vetoed"));
+  BOOST_CHECK_EQUAL(0, status.get_param<uint64_t>("hit_finder/frames_failed"));
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameProcessorTestCheckBitDepthDatasets )
+{
+  const size_t width = 32;
+  std::mt19937 rng(49);
+  std::vector<uint32_t> fits(width * 16);
+  for (size_t i = 0; i < fits.size(); i++) {
+    fits[i] = rng() % 8 == 0 ? UINT32_MAX : rng() % 65535;
+  }
+  // A count of 65535 would read back as the 16 bit invalid value
+  std::vector<uint32_t> wide(fits);
+  wide[100] = 65535;
+
+  EigerBitDepthPlugin plugin;
+  plugin.set_name("bit_depth");
+  boost::shared_ptr<FrameCollector> next(new FrameCollector());
+  plugin.register_callback("next", next, true);
+  BOOST_REQUIRE(configure(plugin, "wide_dataset", "data_wide"));
+
+  // An image that fits is passed on as 16 bits in the same dataset
+  process(plugin, make_frame(0, fits, width));
+  BOOST_REQUIRE_EQUAL(1, next->frames.size());
+  boost::shared_ptr<Frame> narrowed = next->frames[0];
+  BOOST_CHECK_EQUAL(0, narrowed->get_frame_number());
+  BOOST_CHECK_EQUAL("data", narrowed->get_meta_data().get_dataset_name());
+  BOOST_CHECK_EQUAL(raw_16bit, narrowed->get_meta_data().get_data_type());
+  BOOST_REQUIRE_EQUAL(fits.size() * sizeof(uint16_t), narrowed->get_image_size());
+  const uint16_t* pixels = static_cast<const uint16_t*>(narrowed->get_image_ptr());
+  BOOST_CHECK(widen(std::vector<uint16_t>(pixels, pixels + fits.size())) == fits);
+
+  // An image that does not is passed on unchanged in the wide dataset
+  process(plugin, make_frame(1, wide, width));
+  BOOST_REQUIRE_EQUAL(2, next->frames.size());
+  boost::shared_ptr<Frame> unchanged = next->frames[1];
+  BOOST_CHECK_EQUAL(1, unchanged->get_frame_number());
+  BOOST_CHECK_EQUAL("data_wide", unchanged->get_meta_data().get_dataset_name());
+  BOOST_CHECK_EQUAL(raw_32bit, unchanged->get_meta_data().get_data_type());
+  BOOST_REQUIRE_EQUAL(wide.size() * sizeof(uint32_t), unchanged->get_image_size());
+  BOOST_CHECK_EQUAL(0, memcmp(wide.data(), unchanged->get_image_ptr(), unchanged->get_image_size()));
+
+  // 16 bit images are passed on as they are
+  std::vector<uint16_t> small(width * 16, 3);
+  process(plugin, make_frame(2, small, width));
+  BOOST_REQUIRE_EQUAL(3, next->frames.size());
+  BOOST_CHECK_EQUAL("data", next->frames[2]->get_meta_data().get_dataset_name());
+
+  OdinData::IpcMessage status;
+  plugin.status(status);
+  BOOST_CHECK_EQUAL(1, status.get_param<uint64_t>("bit_depth/frames_narrowed"));
+  BOOST_CHECK_EQUAL(1, status.get_param<uint64_t>("bit_depth/frames_wide"));
+  BOOST_CHECK_EQUAL(0, status.get_param<uint64_t>("bit_depth/frames_failed"));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
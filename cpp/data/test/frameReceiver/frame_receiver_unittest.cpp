@@ -0,0 +1,214 @@
+/*
+ * frame_receiver_unittest.cpp
+ *
+ */
+#define BOOST_TEST_MODULE "EigerFrameReceiverUnitTest"
+#define BOOST_TEST_MAIN
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "EigerDefinitions.h"
+#include "HugePageBuffer.h"
+#include "OverflowPool.h"
+#include "TimeHistogram.h"
+
+using namespace FrameReceiver;
+
+BOOST_AUTO_TEST_SUITE(EigerFrameReceiverUnitTest);
+
+BOOST_AUTO_TEST_CASE( EigerFrameReceiverTestCheckTimeHistogram )
+{
+  typedef TimeHistogram<12> Histogram;
+
+  // Bins double in width from 1us, with times under 1us in the first
+  BOOST_CHECK_EQUAL(0, Histogram::bin(0));
+  BOOST_CHECK_EQUAL(1, Histogram::bin(1));
+  BOOST_CHECK_EQUAL(2, Histogram::bin(2));
+  BOOST_CHECK_EQUAL(2, Histogram::bin(3));
+  BOOST_CHECK_EQUAL(3, Histogram::bin(4));
+  BOOST_CHECK_EQUAL(10, Histogram::bin(1023));
+  // The last bin holds everything from 1024us up
+  BOOST_CHECK_EQUAL(11, Histogram::bin(1024));
+  BOOST_CHECK_EQUAL(11, Histogram::bin(UINT64_MAX));
+
+  // Labels give the lower bound of each bin
+  BOOST_CHECK_EQUAL(std::string("lt_1"), Histogram::label(0));
+  BOOST_CHECK_EQUAL(std::string("ge_1"), Histogram::label(1));
+  BOOST_CHECK_EQUAL(std::string("ge_4"), Histogram::label(3));
+  BOOST_CHECK_EQUAL(std::string("ge_1024"), Histogram::label(11));
+
+  // Every bound falls in the bin it labels
+  for (size_t bin = 1; bin < Histogram::num_bins; bin++) {
+    BOOST_CHECK_EQUAL(bin, Histogram::bin(static_cast<uint64_t>(1) << (bin - 1)));
+  }
+
+  Histogram histogram;
+  histogram.add(0);
+  histogram.add(5);
+  histogram.add(7);
+  histogram.add(5000);
+  BOOST_CHECK_EQUAL(1, histogram.count(0));
+  BOOST_CHECK_EQUAL(2, histogram.count(3));
+  BOOST_CHECK_EQUAL(1, histogram.count(11));
+  BOOST_CHECK_EQUAL(5000, histogram.max_us());
+
+  histogram.reset();
+  for (size_t bin = 0; bin < Histogram::num_bins; bin++) {
+    BOOST_CHECK_EQUAL(0, histogram.count(bin));
+  }
+  BOOST_CHECK_EQUAL(0, histogram.max_us());
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameReceiverTestCheckOverflowPool )
+{
+  const size_t frame_size = 4096;
+  const size_t part_size = 100;
+  OverflowPool pool;
+  BOOST_REQUIRE(pool.allocate(3, frame_size));
+  BOOST_CHECK_EQUAL(3, pool.capacity());
+
+  // Hold frames 10-12 as the decoder does, the header then the message part after it
+  for (int frame_number = 10; frame_number < 13; frame_number++) {
+    int slot = -1;
+    char* buffer = pool.take_slot(slot);
+    BOOST_REQUIRE(buffer != NULL);
+    Eiger::FrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frame_number = frame_number;
+    header.payload_offset = sizeof(Eiger::FrameHeader);
+    memcpy(buffer, &header, sizeof(header));
+    memset(buffer + header.payload_offset, frame_number, part_size);
+    OverflowPool::Frame frame = {slot, frame_number, part_size};
+    pool.hold(frame);
+  }
+  int slot = -1;
+  BOOST_CHECK(!pool.has_free_slot());
+  BOOST_CHECK(pool.take_slot(slot) == NULL);
+  BOOST_CHECK_EQUAL(3, pool.occupancy());
+  BOOST_CHECK_EQUAL(3, pool.high_water());
+
+  // Frames come out oldest first, wherever the part is in the frame buffer
+  std::vector<char> buffer(frame_size);
+  BOOST_CHECK_EQUAL(10, pool.release_oldest(buffer.data(), 512));
+  Eiger::FrameHeader* header = reinterpret_cast<Eiger::FrameHeader*>(buffer.data());
+  BOOST_CHECK_EQUAL(10, header->frame_number);
+  BOOST_CHECK_EQUAL(512, header->payload_offset);
+  BOOST_CHECK_EQUAL(10, buffer[512]);
+  BOOST_CHECK_EQUAL(10, buffer[512 + part_size - 1]);
+
+  // A frame held after a release still comes out behind the older frames
+  BOOST_REQUIRE(pool.take_slot(slot) != NULL);
+  memcpy(pool.slot_data(slot), header, sizeof(Eiger::FrameHeader));
+  OverflowPool::Frame frame = {slot, 13, 0};
+  pool.hold(frame);
+  BOOST_CHECK_EQUAL(11, pool.release_oldest(buffer.data(), sizeof(Eiger::FrameHeader)));
+  BOOST_CHECK_EQUAL(11, buffer[sizeof(Eiger::FrameHeader)]);
+  BOOST_CHECK_EQUAL(12, pool.release_oldest(buffer.data(), sizeof(Eiger::FrameHeader)));
+  BOOST_CHECK_EQUAL(13, pool.release_oldest(buffer.data(), sizeof(Eiger::FrameHeader)));
+  BOOST_CHECK_EQUAL(0, pool.occupancy());
+  BOOST_CHECK_EQUAL(4, pool.frames_held());
+
+  // The high water mark starts again from the frames still held
+  BOOST_CHECK_EQUAL(3, pool.high_water());
+  pool.reset_high_water();
+  BOOST_CHECK_EQUAL(0, pool.high_water());
+  BOOST_CHECK(pool.has_free_slot());
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameReceiverTestCheckPayloadOffset )
+{
+  // Without an alignment the part follows straight after the header
+  char unaligned[64];
+  BOOST_CHECK_EQUAL(sizeof(Eiger::FrameHeader), Eiger::AlignedPayloadOffset(unaligned + 1, 0));
+  BOOST_CHECK_EQUAL(1000, Eiger::AlignedFrameBufferSize(1000, 0));
+
+  const size_t alignments[] = {64, 512, 4096};
+  for (size_t a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+    size_t alignment = alignments[a];
+    size_t frame_size = sizeof(Eiger::FrameHeader) + 10000;
+    size_t buffer_size = Eiger::AlignedFrameBufferSize(frame_size, alignment);
+    BOOST_CHECK_EQUAL(0, buffer_size % alignment);
+
+    // A pool of buffers starting at an address that is not aligned
+    const size_t num_buffers = 3;
+    std::vector<char> pool(num_buffers * buffer_size + alignment);
+    char* first = pool.data() + (alignment - reinterpret_cast<uintptr_t>(pool.data()) % alignment) + 24;
+    size_t first_offset = Eiger::AlignedPayloadOffset(first, alignment);
+    for (size_t i = 0; i < num_buffers; i++) {
+      char* buffer = first + i * buffer_size;
+      size_t offset = Eiger::AlignedPayloadOffset(buffer, alignment);
+      // The part is aligned, after the header, at the same offset in every buffer and fits
+      BOOST_CHECK_EQUAL(0, reinterpret_cast<uintptr_t>(buffer + offset) % alignment);
+      BOOST_CHECK_GE(offset, sizeof(Eiger::FrameHeader));
+      BOOST_CHECK_LT(offset, sizeof(Eiger::FrameHeader) + alignment);
+      BOOST_CHECK_EQUAL(first_offset, offset);
+      BOOST_CHECK_LE(offset + frame_size - sizeof(Eiger::FrameHeader), buffer_size);
+
+      // The decoder records the offset where EigerProcessPlugin finds the part
+      Eiger::FrameHeader header;
+      memset(&header, 0, sizeof(header));
+      header.payload_offset = offset;
+      header.data_offset = 16;
+      memcpy(buffer, &header, sizeof(header));
+      const Eiger::FrameHeader* hdrPtr = reinterpret_cast<const Eiger::FrameHeader*>(buffer);
+      const char* payload = static_cast<const char*>(buffer) + hdrPtr->payload_offset;
+      BOOST_CHECK(payload == buffer + offset);
+      BOOST_CHECK_EQUAL(offset + 16, hdrPtr->payload_offset + hdrPtr->data_offset);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameReceiverTestCheckHugePageBuffer )
+{
+  HugePageBuffer buffer;
+  BOOST_CHECK(buffer.data() == NULL);
+  BOOST_CHECK_EQUAL(0, buffer.size());
+
+  // The size asked for is usable whether or not huge pages back it
+  const size_t size = HUGE_PAGE_SIZE + 1000;
+  BOOST_REQUIRE(buffer.allocate(size));
+  BOOST_REQUIRE(buffer.data() != NULL);
+  BOOST_CHECK_EQUAL(size, buffer.size());
+  buffer.prefault();
+  char* data = static_cast<char*>(buffer.data());
+  BOOST_CHECK_EQUAL(0, data[0]);
+  BOOST_CHECK_EQUAL(0, data[size - 1]);
+  memset(data, 0x5a, size);
+  BOOST_CHECK_EQUAL(0x5a, data[size - 1]);
+
+  // Allocating again replaces the mapping
+  BOOST_REQUIRE(buffer.allocate(1000));
+  BOOST_CHECK_EQUAL(1000, buffer.size());
+  BOOST_CHECK_EQUAL(0, static_cast<char*>(buffer.data())[999]);
+
+  buffer.release();
+  BOOST_CHECK(buffer.data() == NULL);
+  BOOST_CHECK_EQUAL(0, buffer.size());
+  BOOST_CHECK(!buffer.huge_pages());
+  buffer.prefault();
+  BOOST_REQUIRE(buffer.allocate(0));
+  BOOST_CHECK(buffer.data() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE( EigerFrameReceiverTestCheckScratchBufferSize )
+{
+  // The scratch buffers take the biggest frame whatever the detector, so they are kept across a re-init
+  BOOST_CHECK_EQUAL(Eiger::frame_size_16M + Eiger::stream2_message_overhead, Eiger::ScratchBufferSize(Eiger::frame_size_500K));
+  BOOST_CHECK_EQUAL(Eiger::ScratchBufferSize(Eiger::frame_size_500K), Eiger::ScratchBufferSize(Eiger::frame_size_16M));
+
+  // unless an alignment makes the frame buffers bigger still
+  size_t aligned = Eiger::AlignedFrameBufferSize(Eiger::frame_size_16M + Eiger::stream2_message_overhead, 1 << 20);
+  BOOST_CHECK_EQUAL(aligned, Eiger::ScratchBufferSize(aligned));
+
+  // A scratch buffer of that size can be allocated and faulted in at init
+  HugePageBuffer scratch;
+  BOOST_REQUIRE(scratch.allocate(Eiger::ScratchBufferSize(aligned)));
+  scratch.prefault();
+  BOOST_CHECK_EQUAL(aligned, scratch.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -29,6 +29,9 @@ HASH = "hash"
 ENCODING = "encoding"
 DATATYPE = "type"
 
+# FrameProcessor plugin message parameters
+BIT_DEPTH = "bit_depth"
+
 # Dectris header parameters
 AUTO_SUMMATION = "auto_summation"
 BEAM_CENTER_Y = "beam_center_y"
@@ -177,6 +180,8 @@ class EigerMetaWriter(MetaWriter):
             StringHDF5Dataset(HASH, encoding="ascii", length=32),
             StringHDF5Dataset(ENCODING, encoding="ascii", length=10),
             StringHDF5Dataset(DATATYPE, encoding="ascii", length=6),
+            # Datasets with one value per frame from FrameProcessor plugins
+            Int64HDF5Dataset(BIT_DEPTH),
             # Datasets received on arm
             Int64HDF5Dataset(SERIES, cache=False),
             Float32HDF5Dataset(COUNTRATE, rank=2, cache=False),
@@ -257,6 +262,11 @@ class EigerMetaWriter(MetaWriter):
             "eiger-headerappendix": self.handle_header_appendix,
             "eiger-imagedata": self.handle_image_data,
             "eiger-imageappendix": self.handle_image_appendix,
+            "eiger-framestatistics": self.handle_monitoring,
+            "eiger-hitfinding": self.handle_monitoring,
+            "eiger-sparse": self.handle_monitoring,
+            "eiger-azimuthalintegration": self.handle_monitoring,
+            "eiger-bitdepth": self.handle_bit_depth,
             "eiger-end": self.handle_end,
         }
 
@@ -295,7 +305,8 @@ class EigerMetaWriter(MetaWriter):
         self._logger.debug("%s | Handling flatfield header message", self._name)
 
         shape = tuple(reversed(header["shape"]))  # (x, y) -> (y, x)
-        flatfield_array = np.frombuffer(flatfield_blob, dtype=np.float32).reshape(shape)
+        dtype = header.get("type", "float32")
+        flatfield_array = np.frombuffer(flatfield_blob, dtype=dtype).reshape(shape)
         self._write_dataset(FLATFIELD, flatfield_array)
 
     def handle_mask_header(self, header, mask_blob):
@@ -303,7 +314,8 @@ class EigerMetaWriter(MetaWriter):
         self._logger.debug("%s | Handling mask header message", self._name)
 
         shape = tuple(reversed(header["shape"]))  # (x, y) -> (y, x)
-        mask_array = np.frombuffer(mask_blob, dtype=np.uint32).reshape(shape)
+        dtype = header.get("type", "uint32")
+        mask_array = np.frombuffer(mask_blob, dtype=dtype).reshape(shape)
         self._write_dataset(MASK, mask_array)
 
     def handle_countrate_header(self, header, countrate_blob):
@@ -311,7 +323,8 @@ class EigerMetaWriter(MetaWriter):
         self._logger.debug("%s | Handling countrate header message", self._name)
 
         shape = tuple(reversed(header["shape"]))  # (x, y) -> (y, x)
-        countrate_table = np.frombuffer(countrate_blob, dtype=np.float32).reshape(shape)
+        dtype = header.get("type", "float32")
+        countrate_table = np.frombuffer(countrate_blob, dtype=dtype).reshape(shape)
         self._write_dataset(COUNTRATE, countrate_table)
 
         # This is the last message of the global header with header_detail all
@@ -348,6 +361,21 @@ class EigerMetaWriter(MetaWriter):
         self._logger.debug("%s | Handling image appendix message", self._name)
         # Do nothing as can't write variable length dataset in swmr
 
+    def handle_monitoring(self, _header, _data):
+        """Handle per frame results of the FrameProcessor analysis plugins"""
+        self._logger.debug("%s | Handling monitoring message", self._name)
+        # Do nothing as these are for live monitoring by other subscribers
+
+    def handle_bit_depth(self, _header, data):
+        """Handle bit depth message of the EigerBitDepthPlugin
+
+        Images narrowed to 16 bits and those kept at 32 bits are written to separate
+        datasets, so record which holds each frame.
+        """
+        self._logger.debug("%s | Handling bit depth message", self._name)
+
+        self._add_values([BIT_DEPTH], data, data[FRAME])
+
     def handle_end(self, header, _data):
         """Handle end message - register to stop when writers finished"""
         self._logger.debug("%s | Handling end message", self._name)
@@ -0,0 +1,86 @@
+"""Reconstruction of images written sparse by the EigerSparsePlugin
+
+Each frame is written either to the image dataset or, if few enough of its
+pixels count, as a record in the sparse dataset alongside it::
+
+    [1, n, index 0 .. index n-1, count 0 .. count n-1, 0 ...]
+
+A frame with no record reads back as zeros, so a first value of 0 says the
+frame is in the image dataset instead. Pixels left out of a record are zero,
+or the invalid value of the image type where the detector mask is set.
+"""
+
+import numpy as np
+
+SPARSE_RECORD_PRESENT = 1
+SPARSE_RECORD_HEADER = 2
+
+
+def is_sparse(record):
+    """Whether a record holds a frame, rather than the frame being written dense"""
+    return int(record[0]) == SPARSE_RECORD_PRESENT
+
+
+def empty_image(shape, dtype, mask=None):
+    """Make an image with no counts, with the invalid value where the mask is set
+
+    Args:
+        shape: Shape of the images as (height, width)
+        dtype: Type of the image pixels, uint16 or uint32
+        mask: Detector mask of the given shape, non-zero for masked pixels
+
+    """
+    image = np.zeros(shape, dtype=dtype)
+    if mask is not None:
+        image[np.asarray(mask) != 0] = np.iinfo(dtype).max
+    return image
+
+
+def reconstruct(record, shape, dtype, mask=None, empty=None):
+    """Rebuild an image from its sparse record
+
+    Args:
+        record: The sparse record of the frame
+        shape: Shape of the images as (height, width)
+        dtype: Type of the image pixels, uint16 or uint32
+        mask: Detector mask of the given shape, non-zero for masked pixels
+        empty: Image from empty_image to start from, to avoid remaking it for
+            every frame. Ignored if mask is given
+
+    Returns:
+        The image, or None if the frame was written dense
+
+    """
+    record = np.asarray(record)
+    if not is_sparse(record):
+        return None
+    if mask is not None or empty is None:
+        image = empty_image(shape, dtype, mask)
+    else:
+        image = empty.copy()
+    entries = int(record[1])
+    indices = record[SPARSE_RECORD_HEADER : SPARSE_RECORD_HEADER + entries]
+    counts = record[SPARSE_RECORD_HEADER + entries : SPARSE_RECORD_HEADER + 2 * entries]
+    image.reshape(-1)[indices] = counts.astype(dtype)
+    return image
+
+
+def read_frame(images, records, frame, mask=None, empty=None):
+    """Read a frame from whichever of the image and sparse datasets it was written to
+
+    Args:
+        images: The image dataset, of shape (frames, height, width)
+        records: The sparse dataset, of shape (frames, record length)
+        frame: Index of the frame to read
+        mask: Detector mask, non-zero for masked pixels
+        empty: Image from empty_image to start from, see reconstruct
+
+    Returns:
+        The image
+
+    """
+    if frame < len(records):
+        image = reconstruct(records[frame], images.shape[1:], images.dtype, mask, empty)
+        if image is not None:
+            return image
+    return images[frame]
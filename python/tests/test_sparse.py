@@ -0,0 +1,55 @@
+import numpy as np
+from eiger_detector.data.sparse import empty_image, read_frame, reconstruct
+
+SHAPE = (6, 8)
+
+
+def make_record(image, mask, capacity):
+    invalid = np.iinfo(image.dtype).max
+    expected = np.where(mask != 0, invalid, 0).astype(image.dtype)
+    indices = np.flatnonzero(image != expected)
+    record = np.zeros(2 + 2 * capacity, dtype=np.uint32)
+    record[0] = 1
+    record[1] = len(indices)
+    record[2 : 2 + len(indices)] = indices
+    record[2 + len(indices) : 2 + 2 * len(indices)] = image.reshape(-1)[indices]
+    return record
+
+
+def test_reconstruct_with_mask():
+    mask = np.zeros(SHAPE, dtype=np.uint32)
+    mask[:, 3] = 1
+    for dtype in (np.uint16, np.uint32):
+        image = empty_image(SHAPE, dtype, mask)
+        image[0, 0] = 2
+        image[5, 7] = np.iinfo(dtype).max
+        image[2, 3] = 7
+
+        record = make_record(image, mask, capacity=4)
+
+        np.testing.assert_array_equal(reconstruct(record, SHAPE, dtype, mask), image)
+
+
+def test_reconstruct_reuses_empty_image():
+    empty = empty_image(SHAPE, np.uint32)
+    image = empty.copy()
+    image[1, 1] = 3
+
+    record = make_record(image, np.zeros(SHAPE), capacity=2)
+    result = reconstruct(record, SHAPE, np.uint32, empty=empty)
+
+    np.testing.assert_array_equal(result, image)
+    assert not empty.any()
+
+
+def test_read_frame_falls_back_to_dense():
+    images = np.zeros((3,) + SHAPE, dtype=np.uint16)
+    images[1] = 9
+    records = np.zeros((3, 10), dtype=np.uint32)
+    sparse = np.zeros(SHAPE, dtype=np.uint16)
+    sparse[4, 4] = 1
+    records[0] = make_record(sparse, np.zeros(SHAPE), capacity=4)
+
+    np.testing.assert_array_equal(read_frame(images, records, 0), sparse)
+    np.testing.assert_array_equal(read_frame(images, records, 1), images[1])
+    assert reconstruct(records[1], SHAPE, np.uint16) is None